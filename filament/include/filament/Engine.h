@@ -337,6 +337,31 @@ public:
 
     DebugRegistry& getDebugRegistry() noexcept;
 
+    /**
+     * Statistics about the command buffer, which holds the commands waiting to be executed
+     * by the driver. It grows temporarily when a frame needs more space than usual
+     * (e.g. when uploading a lot of data), instead of stalling.
+     */
+    struct CommandBufferStats {
+        size_t size;            //!< current size of the command buffer in bytes
+        size_t highWatermark;   //!< largest amount of memory used at once, in bytes
+        size_t growCount;       //!< number of times the command buffer had to grow
+    };
+
+    /**
+     * @return statistics about the command buffer.
+     */
+    CommandBufferStats getCommandBufferStats() const noexcept;
+
+    /**
+     * Sets how much time can be spent each frame removing the components of destroyed entities.
+     * Components that couldn't be removed in time are removed during the next frames. A few
+     * hundred entities are always processed per frame, regardless of the budget.
+     *
+     * @param microseconds  Time budget per frame, 500 microseconds by default.
+     */
+    void setGarbageCollectionTimeBudget(uint32_t microseconds) noexcept;
+
 protected:
     //! \privatesection
     Engine() noexcept = default;
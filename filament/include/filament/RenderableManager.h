@@ -53,6 +53,9 @@ public:
 
     Instance getInstance(utils::Entity e) const noexcept;
 
+    // maximum number of levels of detail of a renderable, see Builder::levelOfDetail()
+    static constexpr size_t MAX_LOD_COUNT = 4;
+
     struct Bone {
         math::quatf unitQuaternion = { 1, 0, 0, 0 };
         math::float3 translation = { 0, 0, 0 };
@@ -86,9 +89,40 @@ public:
         Builder& skinning(size_t boneCount, Bone const* transforms) noexcept;
         Builder& skinning(size_t boneCount, math::mat4f const* transforms) noexcept;
 
+        /**
+         * Draws the renderable's primitives 'instanceCount' times with a single draw call each,
+         * each instance being transformed by its own matrix, in the renderable's local space.
+         * The bounding box must contain all the instances. Materials must be compiled with the
+         * instancing variant (see matc).
+         */
+        Builder& instances(size_t instanceCount) noexcept; // 0 (not instanced) by default, 128 max
+        Builder& instances(size_t instanceCount, math::mat4f const* transforms) noexcept;
+
         // Sets an ordering index for blended primitives that all live at the same Z value.
         Builder& blendOrder(size_t index, uint16_t order) noexcept; // 0 by default
 
+        // Sets a simplified triangle mesh, in the renderable's local space, used to hide other
+        // renderables when occlusion culling is enabled on a View. The mesh must be entirely
+        // contained in the renderable's geometry. The data is copied by build(), which fails if
+        // an index isn't smaller than vertexCount.
+        Builder& occluder(math::float3 const* vertices, size_t vertexCount,
+                uint16_t const* indices, size_t indexCount) noexcept; // none by default
+
+        /**
+         * Splits the primitives in levels of detail. Level 0 is the most detailed and starts at
+         * primitive 0, level 'level' (in [1, MAX_LOD_COUNT)) starts at primitive 'first' and
+         * ends where the next level starts.
+         *
+         * A level is rendered while the renderable's bounding sphere covers less than its
+         * 'screenSize' (a fraction of the viewport's height, e.g. 0.1 for 10%) and at least the
+         * next level's. Levels must be given in order, with decreasing screen sizes.
+         */
+        Builder& levelOfDetail(uint8_t level, size_t first, float screenSize) noexcept;
+
+        // Fraction by which the screen size must cross a threshold before the level changes,
+        // which avoids switching back and forth between two levels. 0 by default.
+        Builder& levelOfDetailHysteresis(float hysteresis) noexcept;
+
         /**
          * Adds the Renderable component to an entity.
          *
@@ -140,17 +174,32 @@ public:
     void setBones(Instance instance, Bone const* transforms, size_t boneCount = 1, size_t offset = 0) noexcept;
     void setBones(Instance instance, math::mat4f const* transforms, size_t boneCount = 1, size_t offset = 0) noexcept;
 
+    // sets the transforms of instances [offset, offset + instanceCount) of an instanced renderable
+    void setInstances(Instance instance, math::mat4f const* transforms, size_t instanceCount = 1, size_t offset = 0) noexcept;
+
 
     // getters...
     const Box& getAxisAlignedBoundingBox(Instance instance) const noexcept;
 
-    // number of render primitives in this renderable
+    // number of instances drawn, 0 if the renderable isn't instanced
+    size_t getInstanceCount(Instance instance) const noexcept;
+
+    // number of levels of detail in this renderable, 1 if it has none
+    size_t getLevelCount(Instance instance) const noexcept;
+
+    // number of render primitives in this renderable, or in the given level of detail.
+    // Unless specified, the methods below work on the primitives of level 0.
     size_t getPrimitiveCount(Instance instance) const noexcept;
+    size_t getPrimitiveCount(Instance instance, uint8_t level) const noexcept;
 
     // set/change the material of a given render primitive
     void setMaterialInstanceAt(Instance instance,
             size_t primitiveIndex, MaterialInstance const* materialInstance) noexcept;
+    void setMaterialInstanceAt(Instance instance, uint8_t level,
+            size_t primitiveIndex, MaterialInstance const* materialInstance) noexcept;
     MaterialInstance* getMaterialInstanceAt(Instance instance, size_t primitiveIndex) const noexcept;
+    MaterialInstance* getMaterialInstanceAt(Instance instance,
+            uint8_t level, size_t primitiveIndex) const noexcept;
 
     // set/change the geometry (vertex/index buffers) of a given primitive
     void setGeometryAt(Instance instance, size_t primitiveIndex,
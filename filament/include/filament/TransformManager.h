@@ -24,6 +24,10 @@
 #include <utils/EntityInstance.h>
 
 #include <math/mat4.h>
+#include <math/quat.h>
+#include <math/vec3.h>
+
+#include <stddef.h>
 
 namespace filament {
 
@@ -120,10 +124,48 @@ public:
      * @see getTransform()
      * @attention This operation can be slow if the hierarchy of transform is too deep, and this
      *            will be particularly bad when updating a lot of transforms. In that case,
-     *            consider using openLocalTransformTransaction() / commitLocalTransformTransaction().
+     *            consider using openLocalTransformTransaction() / commitLocalTransformTransaction(),
+     *            or setTransforms().
      */
     void setTransform(Instance ci, const math::mat4f& localTransform) noexcept;
 
+    /**
+     * Sets the local transform of several transform components at once.
+     * @param instances         Array of count instances of the transform components to update.
+     * @param localTransforms   Array of count local transforms (i.e. relative to the parent).
+     * @param count             Number of transform components to update.
+     *
+     * All the local transforms are written first, then the world transforms of the updated
+     * components and of their descendants are computed in a single pass over the part of the
+     * hierarchy that holds them.
+     * Inside a local transform transaction, world transforms are only computed when the
+     * transaction is committed.
+     *
+     * @note The single pass requires that the hierarchy didn't change since the last
+     *       commitLocalTransformTransaction(), otherwise each component is updated as if by
+     *       setTransform().
+     *
+     * @see setTransform(), openLocalTransformTransaction()
+     */
+    void setTransforms(Instance const* instances,
+            const math::mat4f* localTransforms, size_t count) noexcept;
+
+    /**
+     * Sets the local transform of several transform components at once, from their translation,
+     * rotation and scale, which is less than half the size of a matrix. Each local transform is
+     * the translation, times the rotation, times the scale.
+     * @param instances     Array of count instances of the transform components to update.
+     * @param translations  Array of count translations.
+     * @param rotations     Array of count rotations.
+     * @param scales        Array of count scale factors, or nullptr for no scaling.
+     * @param count         Number of transform components to update.
+     *
+     * @see setTransforms(Instance const*, const math::mat4f*, size_t)
+     */
+    void setTransforms(Instance const* instances,
+            const math::float3* translations, const math::quatf* rotations,
+            const math::float3* scales, size_t count) noexcept;
+
     /**
      * Returns the local transform of a transform component.
      * @param ci The instance of the transform component to query the local transform from.
@@ -290,6 +290,40 @@ public:
      */
     void setShadowsEnabled(bool enabled) noexcept;
 
+    /**
+     * Enable or disable occlusion culling. Disabled by default.
+     *
+     * When enabled, the occluder meshes of the visible renderables are rasterized on the CPU
+     * and renderables entirely hidden behind them are not drawn. This only helps when
+     * the scene has large occluders.
+     *
+     * @param enabled true enables occlusion culling, false disables it.
+     *
+     * @see Renderable::Builder::occluder()
+     */
+    void setOcclusionCullingEnabled(bool enabled) noexcept;
+
+    /**
+     * Returns whether occlusion culling is enabled.
+     */
+    bool isOcclusionCullingEnabled() const noexcept;
+
+    /**
+     * Enable or disable the caching of rendering commands. Disabled by default.
+     *
+     * When enabled, the sorted rendering commands are kept from one frame to the next and only
+     * the commands of the renderables that changed are generated again. This helps scenes
+     * that are mostly static from frame to frame, at the cost of some memory.
+     *
+     * @param enabled true enables command caching, false disables it.
+     */
+    void setCommandCachingEnabled(bool enabled) noexcept;
+
+    /**
+     * Returns whether command caching is enabled.
+     */
+    bool isCommandCachingEnabled() const noexcept;
+
     /**
      * Specifies which buffers can be discarded before rendering.
      *
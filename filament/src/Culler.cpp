@@ -18,73 +18,481 @@
 
 #include <math/fast.h>
 
+#include <algorithm>
+
+#include <assert.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#   define CULLER_HAS_NEON 1
+#   include <arm_neon.h>
+#elif (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || defined(__GNUC__))
+#   define CULLER_HAS_AVX 1
+#   include <immintrin.h>
+#   define CULLER_TARGET_AVX2   __attribute__((target("avx2")))
+#   define CULLER_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
 using namespace math;
 
 namespace filament {
 namespace details {
 
-void Culler::intersects(
-        result_type* UTILS_RESTRICT results,
-        Frustum const& UTILS_RESTRICT frustum,
-        math::float4 const* UTILS_RESTRICT b,
-        size_t count) noexcept {
+/*
+ * The culling kernels below all work on structures of arrays (i.e.: x[], y[], z[]) so that
+ * each plane test can use full-width vector loads.
+ *
+ * They must all compute the plane distances with the same operations, in the same order, so
+ * that they return the same results regardless of the instruction set.
+ *
+ * 'count' is always a multiple of Culler::MODULO (8).
+ */
+
+using BoxKernel = void (*)(Culler::result_type* results, float4 const* planes,
+        float const* cx, float const* cy, float const* cz,
+        float const* ex, float const* ey, float const* ez,
+        size_t count, size_t bit);
+
+using SphereKernel = void (*)(Culler::result_type* results, float4 const* planes,
+        float const* x, float const* y, float const* z, float const* r,
+        size_t count);
+
+struct Kernels {
+    BoxKernel boxes;
+    SphereKernel spheres;
+};
 
-    math::float4 const * const UTILS_RESTRICT planes = frustum.mPlanes;
+// ------------------------------------------------------------------------------------------------
+// Generic kernels
+// ------------------------------------------------------------------------------------------------
 
-    // we use a vectorize width of 8 because, on ARMv8 it allow the compiler to write 8
+static void intersectsBoxesGeneric(
+        Culler::result_type* UTILS_RESTRICT results, float4 const* UTILS_RESTRICT planes,
+        float const* UTILS_RESTRICT cx, float const* UTILS_RESTRICT cy,
+        float const* UTILS_RESTRICT cz, float const* UTILS_RESTRICT ex,
+        float const* UTILS_RESTRICT ey, float const* UTILS_RESTRICT ez,
+        size_t count, size_t bit) {
+
+    // we use a vectorize width of 8 because, on ARMv8 it allows the compiler to write eight
     // 8-bits results in one go. Without this it has to do 4 separate byte writes, which
     // ends-up being slower.
-    count = round(count); // capacity guaranteed to be multiple of 8
     #pragma clang loop vectorize_width(8)
     for (size_t i = 0; i < count; i++) {
         int visible = ~0;
-        math::float4 const sphere(b[i]);
 
         #pragma clang loop unroll(full)
         for (size_t j = 0; j < 6; j++) {
             // clang doesn't seem to generate vector * scalar instructions, which leads
             // to increased register pressure and stack spills
-            const float dot = planes[j].x * sphere.x +
-                              planes[j].y * sphere.y +
-                              planes[j].z * sphere.z +
-                              planes[j].w - sphere.w;
+            const float dot =
+                    planes[j].x * cx[i] - std::abs(planes[j].x) * ex[i] +
+                    planes[j].y * cy[i] - std::abs(planes[j].y) * ey[i] +
+                    planes[j].z * cz[i] - std::abs(planes[j].z) * ez[i] +
+                    planes[j].w;
+
+            visible &= fast::signbit(dot) << bit;
+        }
+
+        results[i] |= Culler::result_type(visible);
+    }
+}
+
+static void intersectsSpheresGeneric(
+        Culler::result_type* UTILS_RESTRICT results, float4 const* UTILS_RESTRICT planes,
+        float const* UTILS_RESTRICT x, float const* UTILS_RESTRICT y,
+        float const* UTILS_RESTRICT z, float const* UTILS_RESTRICT r,
+        size_t count) {
+
+    #pragma clang loop vectorize_width(8)
+    for (size_t i = 0; i < count; i++) {
+        int visible = ~0;
+
+        #pragma clang loop unroll(full)
+        for (size_t j = 0; j < 6; j++) {
+            const float dot = planes[j].x * x[i] +
+                              planes[j].y * y[i] +
+                              planes[j].z * z[i] +
+                              planes[j].w - r[i];
             visible &= fast::signbit(dot);
         }
-        results[i] = result_type(visible);
+        results[i] = Culler::result_type(visible);
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+// NEON kernels, 4 lanes, 8 results at a time
+// ------------------------------------------------------------------------------------------------
+
+#if defined(CULLER_HAS_NEON)
+
+static inline uint32x4_t boxPlanesNeon(float4 const* UTILS_RESTRICT planes,
+        float32x4_t cx, float32x4_t cy, float32x4_t cz,
+        float32x4_t ex, float32x4_t ey, float32x4_t ez) {
+    uint32x4_t visible = vdupq_n_u32(~0u);
+    for (size_t j = 0; j < 6; j++) {
+        float32x4_t d = vmulq_n_f32(cx, planes[j].x);
+        d = vsubq_f32(d, vmulq_n_f32(ex, std::abs(planes[j].x)));
+        d = vaddq_f32(d, vmulq_n_f32(cy, planes[j].y));
+        d = vsubq_f32(d, vmulq_n_f32(ey, std::abs(planes[j].y)));
+        d = vaddq_f32(d, vmulq_n_f32(cz, planes[j].z));
+        d = vsubq_f32(d, vmulq_n_f32(ez, std::abs(planes[j].z)));
+        d = vaddq_f32(d, vdupq_n_f32(planes[j].w));
+        visible = vandq_u32(visible, vreinterpretq_u32_f32(d));
+    }
+    return visible;
+}
+
+static inline uint32x4_t spherePlanesNeon(float4 const* UTILS_RESTRICT planes,
+        float32x4_t x, float32x4_t y, float32x4_t z, float32x4_t r) {
+    uint32x4_t visible = vdupq_n_u32(~0u);
+    for (size_t j = 0; j < 6; j++) {
+        float32x4_t d = vmulq_n_f32(x, planes[j].x);
+        d = vaddq_f32(d, vmulq_n_f32(y, planes[j].y));
+        d = vaddq_f32(d, vmulq_n_f32(z, planes[j].z));
+        d = vaddq_f32(d, vdupq_n_f32(planes[j].w));
+        d = vsubq_f32(d, r);
+        visible = vandq_u32(visible, vreinterpretq_u32_f32(d));
+    }
+    return visible;
+}
+
+// narrows the sign bits of two vectors of 4 lanes into 8 bytes of 0xFF or 0x00
+static inline uint8x8_t signMaskNeon(uint32x4_t lo, uint32x4_t hi) {
+    const int32x4_t l = vshrq_n_s32(vreinterpretq_s32_u32(lo), 31);
+    const int32x4_t h = vshrq_n_s32(vreinterpretq_s32_u32(hi), 31);
+    return vreinterpret_u8_s8(vmovn_s16(vcombine_s16(vmovn_s32(l), vmovn_s32(h))));
+}
+
+static void intersectsBoxesNeon(
+        Culler::result_type* UTILS_RESTRICT results, float4 const* UTILS_RESTRICT planes,
+        float const* UTILS_RESTRICT cx, float const* UTILS_RESTRICT cy,
+        float const* UTILS_RESTRICT cz, float const* UTILS_RESTRICT ex,
+        float const* UTILS_RESTRICT ey, float const* UTILS_RESTRICT ez,
+        size_t count, size_t bit) {
+    const uint8x8_t mask = vdup_n_u8(uint8_t(1u << bit));
+    for (size_t i = 0; i < count; i += 8) {
+        const uint32x4_t lo = boxPlanesNeon(planes,
+                vld1q_f32(cx + i), vld1q_f32(cy + i), vld1q_f32(cz + i),
+                vld1q_f32(ex + i), vld1q_f32(ey + i), vld1q_f32(ez + i));
+        const uint32x4_t hi = boxPlanesNeon(planes,
+                vld1q_f32(cx + i + 4), vld1q_f32(cy + i + 4), vld1q_f32(cz + i + 4),
+                vld1q_f32(ex + i + 4), vld1q_f32(ey + i + 4), vld1q_f32(ez + i + 4));
+        const uint8x8_t visible = vand_u8(signMaskNeon(lo, hi), mask);
+        vst1_u8(results + i, vorr_u8(vld1_u8(results + i), visible));
+    }
+}
+
+static void intersectsSpheresNeon(
+        Culler::result_type* UTILS_RESTRICT results, float4 const* UTILS_RESTRICT planes,
+        float const* UTILS_RESTRICT x, float const* UTILS_RESTRICT y,
+        float const* UTILS_RESTRICT z, float const* UTILS_RESTRICT r,
+        size_t count) {
+    const uint8x8_t mask = vdup_n_u8(1);
+    for (size_t i = 0; i < count; i += 8) {
+        const uint32x4_t lo = spherePlanesNeon(planes,
+                vld1q_f32(x + i), vld1q_f32(y + i), vld1q_f32(z + i), vld1q_f32(r + i));
+        const uint32x4_t hi = spherePlanesNeon(planes,
+                vld1q_f32(x + i + 4), vld1q_f32(y + i + 4), vld1q_f32(z + i + 4),
+                vld1q_f32(r + i + 4));
+        vst1_u8(results + i, vand_u8(signMaskNeon(lo, hi), mask));
+    }
+}
+
+#endif // CULLER_HAS_NEON
+
+// ------------------------------------------------------------------------------------------------
+// AVX2 kernels, 8 lanes
+// ------------------------------------------------------------------------------------------------
+
+#if defined(CULLER_HAS_AVX)
+
+CULLER_TARGET_AVX2
+static inline __m256 boxPlanesAvx2(float4 const* UTILS_RESTRICT planes,
+        __m256 cx, __m256 cy, __m256 cz, __m256 ex, __m256 ey, __m256 ez) {
+    __m256 visible = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    for (size_t j = 0; j < 6; j++) {
+        __m256 d = _mm256_mul_ps(cx, _mm256_set1_ps(planes[j].x));
+        d = _mm256_sub_ps(d, _mm256_mul_ps(ex, _mm256_set1_ps(std::abs(planes[j].x))));
+        d = _mm256_add_ps(d, _mm256_mul_ps(cy, _mm256_set1_ps(planes[j].y)));
+        d = _mm256_sub_ps(d, _mm256_mul_ps(ey, _mm256_set1_ps(std::abs(planes[j].y))));
+        d = _mm256_add_ps(d, _mm256_mul_ps(cz, _mm256_set1_ps(planes[j].z)));
+        d = _mm256_sub_ps(d, _mm256_mul_ps(ez, _mm256_set1_ps(std::abs(planes[j].z))));
+        d = _mm256_add_ps(d, _mm256_set1_ps(planes[j].w));
+        visible = _mm256_and_ps(visible, d);
+    }
+    return visible;
+}
+
+CULLER_TARGET_AVX2
+static inline __m256 spherePlanesAvx2(float4 const* UTILS_RESTRICT planes,
+        __m256 x, __m256 y, __m256 z, __m256 r) {
+    __m256 visible = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    for (size_t j = 0; j < 6; j++) {
+        __m256 d = _mm256_mul_ps(x, _mm256_set1_ps(planes[j].x));
+        d = _mm256_add_ps(d, _mm256_mul_ps(y, _mm256_set1_ps(planes[j].y)));
+        d = _mm256_add_ps(d, _mm256_mul_ps(z, _mm256_set1_ps(planes[j].z)));
+        d = _mm256_add_ps(d, _mm256_set1_ps(planes[j].w));
+        d = _mm256_sub_ps(d, r);
+        visible = _mm256_and_ps(visible, d);
+    }
+    return visible;
+}
+
+// narrows the sign bits of 8 lanes into 8 bytes of 0xFF or 0x00
+CULLER_TARGET_AVX2
+static inline uint64_t signMaskAvx2(__m256 v) {
+    const __m256i m = _mm256_srai_epi32(_mm256_castps_si256(v), 31);
+    const __m128i w = _mm_packs_epi32(_mm256_castsi256_si128(m), _mm256_extracti128_si256(m, 1));
+    uint64_t bytes;
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(&bytes), _mm_packs_epi16(w, w));
+    return bytes;
+}
+
+CULLER_TARGET_AVX2
+static void intersectsBoxesAvx2(
+        Culler::result_type* UTILS_RESTRICT results, float4 const* UTILS_RESTRICT planes,
+        float const* UTILS_RESTRICT cx, float const* UTILS_RESTRICT cy,
+        float const* UTILS_RESTRICT cz, float const* UTILS_RESTRICT ex,
+        float const* UTILS_RESTRICT ey, float const* UTILS_RESTRICT ez,
+        size_t count, size_t bit) {
+    const uint64_t mask = 0x0101010101010101ull << bit;
+    for (size_t i = 0; i < count; i += 8) {
+        const __m256 visible = boxPlanesAvx2(planes,
+                _mm256_loadu_ps(cx + i), _mm256_loadu_ps(cy + i), _mm256_loadu_ps(cz + i),
+                _mm256_loadu_ps(ex + i), _mm256_loadu_ps(ey + i), _mm256_loadu_ps(ez + i));
+        uint64_t r;
+        memcpy(&r, results + i, sizeof(r));
+        r |= signMaskAvx2(visible) & mask;
+        memcpy(results + i, &r, sizeof(r));
+    }
+}
+
+CULLER_TARGET_AVX2
+static void intersectsSpheresAvx2(
+        Culler::result_type* UTILS_RESTRICT results, float4 const* UTILS_RESTRICT planes,
+        float const* UTILS_RESTRICT x, float const* UTILS_RESTRICT y,
+        float const* UTILS_RESTRICT z, float const* UTILS_RESTRICT r,
+        size_t count) {
+    for (size_t i = 0; i < count; i += 8) {
+        const __m256 visible = spherePlanesAvx2(planes,
+                _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), _mm256_loadu_ps(z + i),
+                _mm256_loadu_ps(r + i));
+        const uint64_t bytes = signMaskAvx2(visible) & 0x0101010101010101ull;
+        memcpy(results + i, &bytes, sizeof(bytes));
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+// AVX-512 kernels, 16 lanes, the last 8 items (if any) use the AVX2 kernels
+// ------------------------------------------------------------------------------------------------
+
+CULLER_TARGET_AVX512
+static void intersectsBoxesAvx512(
+        Culler::result_type* UTILS_RESTRICT results, float4 const* UTILS_RESTRICT planes,
+        float const* UTILS_RESTRICT cx, float const* UTILS_RESTRICT cy,
+        float const* UTILS_RESTRICT cz, float const* UTILS_RESTRICT ex,
+        float const* UTILS_RESTRICT ey, float const* UTILS_RESTRICT ez,
+        size_t count, size_t bit) {
+    const __m128i mask = _mm_set1_epi8(char(1u << bit));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const __m512 x = _mm512_loadu_ps(cx + i);
+        const __m512 y = _mm512_loadu_ps(cy + i);
+        const __m512 z = _mm512_loadu_ps(cz + i);
+        const __m512 hx = _mm512_loadu_ps(ex + i);
+        const __m512 hy = _mm512_loadu_ps(ey + i);
+        const __m512 hz = _mm512_loadu_ps(ez + i);
+        __m512i visible = _mm512_set1_epi32(-1);
+        for (size_t j = 0; j < 6; j++) {
+            __m512 d = _mm512_mul_ps(x, _mm512_set1_ps(planes[j].x));
+            d = _mm512_sub_ps(d, _mm512_mul_ps(hx, _mm512_set1_ps(std::abs(planes[j].x))));
+            d = _mm512_add_ps(d, _mm512_mul_ps(y, _mm512_set1_ps(planes[j].y)));
+            d = _mm512_sub_ps(d, _mm512_mul_ps(hy, _mm512_set1_ps(std::abs(planes[j].y))));
+            d = _mm512_add_ps(d, _mm512_mul_ps(z, _mm512_set1_ps(planes[j].z)));
+            d = _mm512_sub_ps(d, _mm512_mul_ps(hz, _mm512_set1_ps(std::abs(planes[j].z))));
+            d = _mm512_add_ps(d, _mm512_set1_ps(planes[j].w));
+            visible = _mm512_and_si512(visible, _mm512_castps_si512(d));
+        }
+        const __m128i bytes = _mm512_cvtepi32_epi8(_mm512_srai_epi32(visible, 31));
+        __m128i* const p = reinterpret_cast<__m128i*>(results + i);
+        _mm_storeu_si128(p, _mm_or_si128(_mm_loadu_si128(p), _mm_and_si128(bytes, mask)));
+    }
+    if (i < count) {
+        intersectsBoxesAvx2(results + i, planes,
+                cx + i, cy + i, cz + i, ex + i, ey + i, ez + i, count - i, bit);
+    }
+}
+
+CULLER_TARGET_AVX512
+static void intersectsSpheresAvx512(
+        Culler::result_type* UTILS_RESTRICT results, float4 const* UTILS_RESTRICT planes,
+        float const* UTILS_RESTRICT x, float const* UTILS_RESTRICT y,
+        float const* UTILS_RESTRICT z, float const* UTILS_RESTRICT r,
+        size_t count) {
+    const __m128i mask = _mm_set1_epi8(1);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const __m512 sx = _mm512_loadu_ps(x + i);
+        const __m512 sy = _mm512_loadu_ps(y + i);
+        const __m512 sz = _mm512_loadu_ps(z + i);
+        const __m512 sr = _mm512_loadu_ps(r + i);
+        __m512i visible = _mm512_set1_epi32(-1);
+        for (size_t j = 0; j < 6; j++) {
+            __m512 d = _mm512_mul_ps(sx, _mm512_set1_ps(planes[j].x));
+            d = _mm512_add_ps(d, _mm512_mul_ps(sy, _mm512_set1_ps(planes[j].y)));
+            d = _mm512_add_ps(d, _mm512_mul_ps(sz, _mm512_set1_ps(planes[j].z)));
+            d = _mm512_add_ps(d, _mm512_set1_ps(planes[j].w));
+            d = _mm512_sub_ps(d, sr);
+            visible = _mm512_and_si512(visible, _mm512_castps_si512(d));
+        }
+        const __m128i bytes = _mm512_cvtepi32_epi8(_mm512_srai_epi32(visible, 31));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(results + i), _mm_and_si128(bytes, mask));
+    }
+    if (i < count) {
+        intersectsSpheresAvx2(results + i, planes, x + i, y + i, z + i, r + i, count - i);
+    }
+}
+
+#endif // CULLER_HAS_AVX
+
+// ------------------------------------------------------------------------------------------------
+// Runtime dispatch
+// ------------------------------------------------------------------------------------------------
+
+static Kernels getKernels(Culler::Isa isa) noexcept {
+    switch (isa) {
+#if defined(CULLER_HAS_NEON)
+        case Culler::Isa::NEON:
+            return { intersectsBoxesNeon, intersectsSpheresNeon };
+#endif
+#if defined(CULLER_HAS_AVX)
+        case Culler::Isa::AVX2:
+            return { intersectsBoxesAvx2, intersectsSpheresAvx2 };
+        case Culler::Isa::AVX512:
+            return { intersectsBoxesAvx512, intersectsSpheresAvx512 };
+#endif
+        default:
+            return { intersectsBoxesGeneric, intersectsSpheresGeneric };
+    }
+}
+
+static Kernels const& getKernels() noexcept {
+    static const Kernels kernels = getKernels(Culler::getIsa());
+    return kernels;
+}
+
+Culler::Isa Culler::getIsa() noexcept {
+    static const Isa isa = []() {
+        if (isSupported(Isa::AVX512)) return Isa::AVX512;
+        if (isSupported(Isa::AVX2))   return Isa::AVX2;
+        if (isSupported(Isa::NEON))   return Isa::NEON;
+        return Isa::GENERIC;
+    }();
+    return isa;
+}
+
+bool Culler::isSupported(Isa isa) noexcept {
+    switch (isa) {
+        case Isa::GENERIC:
+            return true;
+#if defined(CULLER_HAS_NEON)
+        case Isa::NEON:
+            return true;
+#endif
+#if defined(CULLER_HAS_AVX)
+        case Isa::AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+        case Isa::AVX512:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return false;
     }
 }
 
+// ------------------------------------------------------------------------------------------------
+
 void Culler::intersects(
         result_type* UTILS_RESTRICT results,
         Frustum const& UTILS_RESTRICT frustum,
-        math::float3 const* UTILS_RESTRICT center,
-        math::float3 const* UTILS_RESTRICT extent,
+        float const* UTILS_RESTRICT cx, float const* UTILS_RESTRICT cy,
+        float const* UTILS_RESTRICT cz, float const* UTILS_RESTRICT ex,
+        float const* UTILS_RESTRICT ey, float const* UTILS_RESTRICT ez,
         size_t count, size_t bit) noexcept {
+    count = round(count); // capacity guaranteed to be multiple of 8
+    getKernels().boxes(results, frustum.mPlanes, cx, cy, cz, ex, ey, ez, count, bit);
+}
 
-    math::float4 const * UTILS_RESTRICT const planes = frustum.mPlanes;
-
-    // we use a vectorize width of 8 because, on ARMv8 it allows the compiler to write eight
-    // 8-bits results in one go. Without this it has to do 4 separate byte writes, which
-    // ends-up being slower.
+void Culler::intersects(
+        result_type* UTILS_RESTRICT results,
+        Frustum const& UTILS_RESTRICT frustum,
+        float const* UTILS_RESTRICT x, float const* UTILS_RESTRICT y,
+        float const* UTILS_RESTRICT z, float const* UTILS_RESTRICT r,
+        size_t count) noexcept {
     count = round(count); // capacity guaranteed to be multiple of 8
-    #pragma clang loop vectorize_width(8)
-    for (size_t i = 0; i < count; i++) {
-        int visible = ~0;
+    getKernels().spheres(results, frustum.mPlanes, x, y, z, r, count);
+}
 
-        #pragma clang loop unroll(full)
-        for (size_t j = 0; j < 6; j++) {
-            // clang doesn't seem to generate vector * scalar instructions, which leads
-            // to increased register pressure and stack spills
-            const float dot =
-                    planes[j].x * center[i].x - std::abs(planes[j].x) * extent[i].x +
-                    planes[j].y * center[i].y - std::abs(planes[j].y) * extent[i].y +
-                    planes[j].z * center[i].z - std::abs(planes[j].z) * extent[i].z +
-                    planes[j].w;
+// The AoS versions below transpose the data, one block at a time, into a structure of arrays
+// on the stack. This is cheaper than it looks, because it allows the kernels to use full-width
+// vector loads, which the float3 stride prevents.
+static constexpr size_t TRANSPOSE_BLOCK_SIZE = 128;
 
-            visible &= fast::signbit(dot) << bit;
+void Culler::intersects(
+        result_type* UTILS_RESTRICT results,
+        Frustum const& UTILS_RESTRICT frustum,
+        math::float4 const* UTILS_RESTRICT b,
+        size_t count) noexcept {
+    SphereKernel const kernel = getKernels().spheres;
+    alignas(64) float x[TRANSPOSE_BLOCK_SIZE];
+    alignas(64) float y[TRANSPOSE_BLOCK_SIZE];
+    alignas(64) float z[TRANSPOSE_BLOCK_SIZE];
+    alignas(64) float r[TRANSPOSE_BLOCK_SIZE];
+
+    count = round(count); // capacity guaranteed to be multiple of 8
+    for (size_t first = 0; first < count; first += TRANSPOSE_BLOCK_SIZE) {
+        const size_t c = std::min(TRANSPOSE_BLOCK_SIZE, count - first);
+        math::float4 const* const UTILS_RESTRICT spheres = b + first;
+        for (size_t i = 0; i < c; i++) {
+            x[i] = spheres[i].x;
+            y[i] = spheres[i].y;
+            z[i] = spheres[i].z;
+            r[i] = spheres[i].w;
         }
+        kernel(results + first, frustum.mPlanes, x, y, z, r, c);
+    }
+}
+
+void Culler::intersects(
+        result_type* UTILS_RESTRICT results,
+        Frustum const& UTILS_RESTRICT frustum,
+        math::float3 const* UTILS_RESTRICT center,
+        math::float3 const* UTILS_RESTRICT extent,
+        size_t count, size_t bit) noexcept {
+    BoxKernel const kernel = getKernels().boxes;
+    alignas(64) float cx[TRANSPOSE_BLOCK_SIZE];
+    alignas(64) float cy[TRANSPOSE_BLOCK_SIZE];
+    alignas(64) float cz[TRANSPOSE_BLOCK_SIZE];
+    alignas(64) float ex[TRANSPOSE_BLOCK_SIZE];
+    alignas(64) float ey[TRANSPOSE_BLOCK_SIZE];
+    alignas(64) float ez[TRANSPOSE_BLOCK_SIZE];
 
-        results[i] |= result_type(visible);
+    count = round(count); // capacity guaranteed to be multiple of 8
+    for (size_t first = 0; first < count; first += TRANSPOSE_BLOCK_SIZE) {
+        const size_t c = std::min(TRANSPOSE_BLOCK_SIZE, count - first);
+        math::float3 const* const UTILS_RESTRICT centers = center + first;
+        math::float3 const* const UTILS_RESTRICT extents = extent + first;
+        for (size_t i = 0; i < c; i++) {
+            cx[i] = centers[i].x;
+            cy[i] = centers[i].y;
+            cz[i] = centers[i].z;
+            ex[i] = extents[i].x;
+            ey[i] = extents[i].y;
+            ez[i] = extents[i].z;
+        }
+        kernel(results + first, frustum.mPlanes, cx, cy, cz, ex, ey, ez, c, bit);
     }
 }
 
@@ -135,5 +543,30 @@ void Culler::Test::intersects(
     Culler::intersects(results, frustum, b, count);
 }
 
+bool Culler::Test::isSupported(Isa isa) noexcept {
+    return Culler::isSupported(isa);
+}
+
+void Culler::Test::intersects(Isa isa,
+        result_type* UTILS_RESTRICT results,
+        Frustum const& UTILS_RESTRICT frustum,
+        float const* UTILS_RESTRICT cx, float const* UTILS_RESTRICT cy,
+        float const* UTILS_RESTRICT cz, float const* UTILS_RESTRICT ex,
+        float const* UTILS_RESTRICT ey, float const* UTILS_RESTRICT ez,
+        size_t count) noexcept {
+    assert(isSupported(isa));
+    getKernels(isa).boxes(results, frustum.mPlanes, cx, cy, cz, ex, ey, ez, round(count), 0);
+}
+
+void Culler::Test::intersects(Isa isa,
+        result_type* UTILS_RESTRICT results,
+        Frustum const& UTILS_RESTRICT frustum,
+        float const* UTILS_RESTRICT x, float const* UTILS_RESTRICT y,
+        float const* UTILS_RESTRICT z, float const* UTILS_RESTRICT r,
+        size_t count) noexcept {
+    assert(isSupported(isa));
+    getKernels(isa).spheres(results, frustum.mPlanes, x, y, z, r, round(count));
+}
+
 } // namespace details
 } // namespace filament
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "details/CullingBvh.h"
+
+#include <utils/JobSystem.h>
+
+#include <math/vec4.h>
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+using namespace math;
+using namespace utils;
+
+namespace filament {
+namespace details {
+
+// subtrees at this depth (or above) are culled in parallel
+static constexpr size_t PARALLEL_DEPTH = 4;
+
+// enough for ~2^32 boxes with a median split
+static constexpr size_t MAX_DEPTH = 64;
+
+void CullingBvh::clear() noexcept {
+    mNodes.clear();
+    mIndices.clear();
+    mPositions.clear();
+    mLeaves.clear();
+    mBoxes.clear();
+    mDirty.clear();
+    mRefitCount = 0;
+}
+
+void CullingBvh::build(float3 const* center, float3 const* extent, size_t count) {
+    clear();
+    if (!count) {
+        return;
+    }
+
+    mIndices.resize(count);
+    std::iota(mIndices.begin(), mIndices.end(), 0u);
+    mNodes.reserve(2 * (count / (LEAF_SIZE / 2) + 1));
+    buildNode(center, 0, uint32_t(count), 0);
+
+    // keep a copy of the boxes in hierarchy order, so the leaves can use the flat Culler.
+    // The Culler processes Culler::MODULO boxes at a time, so we need some padding.
+    mBoxes.resize(count + Culler::MODULO);
+    mPositions.resize(count);
+    for (size_t p = 0; p < count; p++) {
+        const uint32_t i = mIndices[p];
+        setBox(p, center[i], extent[i]);
+        mPositions[i] = uint32_t(p);
+    }
+
+    mLeaves.resize(count);
+    for (uint32_t n = 0, c = uint32_t(mNodes.size()); n < c; n++) {
+        Node const& node = mNodes[n];
+        if (!node.right) {
+            std::fill_n(mLeaves.begin() + node.first, node.count, n);
+        }
+    }
+
+    // children are always stored after their parent
+    for (size_t n = mNodes.size(); n-- > 0;) {
+        updateBounds(uint32_t(n));
+    }
+
+    mDirty.assign(mNodes.size(), 0);
+}
+
+void CullingBvh::setBox(size_t p, float3 const& center, float3 const& extent) noexcept {
+    mBoxes.elementAt<CENTER_X>(p) = center.x;
+    mBoxes.elementAt<CENTER_Y>(p) = center.y;
+    mBoxes.elementAt<CENTER_Z>(p) = center.z;
+    mBoxes.elementAt<EXTENT_X>(p) = extent.x;
+    mBoxes.elementAt<EXTENT_Y>(p) = extent.y;
+    mBoxes.elementAt<EXTENT_Z>(p) = extent.z;
+}
+
+uint32_t CullingBvh::buildNode(float3 const* center,
+        uint32_t first, uint32_t count, uint32_t parent) {
+    const uint32_t index = uint32_t(mNodes.size());
+    mNodes.push_back({ {}, first, count, 0, parent });
+
+    if (count > LEAF_SIZE) {
+        uint32_t* const indices = mIndices.data() + first;
+
+        // split in two halves along the longest axis of the centers' bounds
+        float3 lo = std::numeric_limits<float>::max();
+        float3 hi = std::numeric_limits<float>::lowest();
+        for (size_t i = 0; i < count; i++) {
+            lo = min(lo, center[indices[i]]);
+            hi = max(hi, center[indices[i]]);
+        }
+        const float3 d = hi - lo;
+        const size_t axis = (d.x > d.y) ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+        const uint32_t half = count / 2;
+        std::nth_element(indices, indices + half, indices + count,
+                [center, axis](uint32_t lhs, uint32_t rhs) {
+                    return center[lhs][axis] < center[rhs][axis];
+                });
+
+        // the left child is always stored right after its parent
+        buildNode(center, first, half, index);
+        const uint32_t right = buildNode(center, first + half, count - half, index);
+        mNodes[index].right = right;
+    }
+    return index;
+}
+
+void CullingBvh::updateBounds(uint32_t n) noexcept {
+    Node& node = mNodes[n];
+    if (node.right) {
+        node.bounds = merge(mNodes[n + 1].bounds, mNodes[node.right].bounds);
+    } else {
+        float const* const UTILS_RESTRICT cx = mBoxes.data<CENTER_X>() + node.first;
+        float const* const UTILS_RESTRICT cy = mBoxes.data<CENTER_Y>() + node.first;
+        float const* const UTILS_RESTRICT cz = mBoxes.data<CENTER_Z>() + node.first;
+        float const* const UTILS_RESTRICT ex = mBoxes.data<EXTENT_X>() + node.first;
+        float const* const UTILS_RESTRICT ey = mBoxes.data<EXTENT_Y>() + node.first;
+        float const* const UTILS_RESTRICT ez = mBoxes.data<EXTENT_Z>() + node.first;
+        float3 lo = std::numeric_limits<float>::max();
+        float3 hi = std::numeric_limits<float>::lowest();
+        for (size_t i = 0, c = node.count; i < c; i++) {
+            const float3 center{ cx[i], cy[i], cz[i] };
+            const float3 extent{ ex[i], ey[i], ez[i] };
+            lo = min(lo, center - extent);
+            hi = max(hi, center + extent);
+        }
+        node.bounds = { (hi + lo) * 0.5f, (hi - lo) * 0.5f };
+    }
+}
+
+void CullingBvh::refit(float3 const* center, float3 const* extent,
+        uint32_t const* changed, size_t count) noexcept {
+    if (mNodes.empty() || !count) {
+        return;
+    }
+
+    // update our copy of the boxes and mark their leaf and its ancestors
+    uint8_t* const UTILS_RESTRICT dirty = mDirty.data();
+    for (size_t k = 0; k < count; k++) {
+        const uint32_t i = changed[k];
+        const uint32_t p = mPositions[i];
+        setBox(p, center[i], extent[i]);
+        for (uint32_t n = mLeaves[p]; !dirty[n]; n = mNodes[n].parent) {
+            dirty[n] = 1;
+            if (n == 0) {
+                break;
+            }
+        }
+    }
+
+    // children are always stored after their parent
+    for (size_t n = mNodes.size(); n-- > 0;) {
+        if (dirty[n]) {
+            dirty[n] = 0;
+            updateBounds(uint32_t(n));
+        }
+    }
+
+    mRefitCount++;
+}
+
+void CullingBvh::cull(JobSystem& js, Culler::result_type* results,
+        Frustum const& frustum, size_t bit) const noexcept {
+    if (mNodes.empty()) {
+        return;
+    }
+
+    float4 planes[6];
+    frustum.getNormalizedPlanes(planes);
+
+    // find the subtrees at the top of the hierarchy that need to be processed
+    struct Subtree {
+        uint32_t node;
+        bool inside;
+    };
+    Subtree subtrees[1u << PARALLEL_DEPTH];
+    size_t subtreeCount = 0;
+
+    struct Entry {
+        uint32_t node;
+        uint32_t depth;
+    };
+    Entry stack[PARALLEL_DEPTH + 2];
+    size_t top = 0;
+    stack[top++] = { 0, 0 };
+    while (top) {
+        const Entry entry = stack[--top];
+        Node const& node = mNodes[entry.node];
+        const Classification c = classify(planes, node.bounds);
+        if (c == Classification::OUTSIDE) {
+            continue;
+        }
+        if (c == Classification::INSIDE || !node.right || entry.depth == PARALLEL_DEPTH) {
+            subtrees[subtreeCount++] = { entry.node, c == Classification::INSIDE };
+            continue;
+        }
+        stack[top++] = { node.right, entry.depth + 1 };
+        stack[top++] = { entry.node + 1, entry.depth + 1 };
+    }
+
+    // culling job (this runs on multiple threads)
+    auto functor = [this, results, &frustum, planes, bit, subtrees](uint32_t index, uint32_t c) {
+        for (uint32_t i = index, e = index + c; i < e; i++) {
+            cullSubtree(results, frustum, planes, bit, subtrees[i].node, subtrees[i].inside);
+        }
+    };
+
+    auto job = jobs::parallel_for(js, nullptr, 0, uint32_t(subtreeCount),
+            std::ref(functor), jobs::CountSplitter<1, 8>());
+    js.runAndWait(job);
+}
+
+void CullingBvh::cullSubtree(Culler::result_type* UTILS_RESTRICT results,
+        Frustum const& frustum, float4 const* planes, size_t bit,
+        uint32_t root, bool inside) const noexcept {
+    uint32_t const* const UTILS_RESTRICT indices = mIndices.data();
+    const Culler::result_type visible = Culler::result_type(1u << bit);
+
+    uint32_t stack[MAX_DEPTH];
+    size_t top = 0;
+    stack[top++] = root;
+    while (top) {
+        Node const& node = mNodes[stack[--top]];
+        const Classification c = inside ? Classification::INSIDE : classify(planes, node.bounds);
+        if (c == Classification::OUTSIDE) {
+            continue;
+        }
+        if (c == Classification::INSIDE) {
+            // the whole subtree is visible
+            for (size_t i = node.first, e = node.first + node.count; i < e; i++) {
+                results[indices[i]] |= visible;
+            }
+            continue;
+        }
+        if (node.right) {
+            stack[top++] = node.right;
+            stack[top++] = uint32_t(&node - mNodes.data()) + 1;
+            continue;
+        }
+        // this is a leaf that intersects the frustum, test each of its boxes
+        Culler::result_type leafResults[LEAF_SIZE] = {};
+        const size_t first = node.first;
+        Culler::intersects(leafResults, frustum,
+                mBoxes.data<CENTER_X>() + first,
+                mBoxes.data<CENTER_Y>() + first,
+                mBoxes.data<CENTER_Z>() + first,
+                mBoxes.data<EXTENT_X>() + first,
+                mBoxes.data<EXTENT_Y>() + first,
+                mBoxes.data<EXTENT_Z>() + first, node.count, bit);
+        for (size_t i = 0, e = node.count; i < e; i++) {
+            results[indices[node.first + i]] |= leafResults[i];
+        }
+    }
+}
+
+CullingBvh::Classification CullingBvh::classify(float4 const* planes, Box const& box) noexcept {
+    // this must match the test used by Culler::intersects()
+    bool inside = true;
+    for (size_t j = 0; j < 6; j++) {
+        const float d = dot(planes[j].xyz, box.center) + planes[j].w;
+        const float r = dot(abs(planes[j].xyz), box.halfExtent);
+        if (!std::signbit(d - r)) {
+            return Classification::OUTSIDE;
+        }
+        inside = inside && std::signbit(d + r);
+    }
+    return inside ? Classification::INSIDE : Classification::INTERSECTS;
+}
+
+Box CullingBvh::merge(Box const& lhs, Box const& rhs) noexcept {
+    const float3 lo = min(lhs.getMin(), rhs.getMin());
+    const float3 hi = max(lhs.getMax(), rhs.getMax());
+    return { (hi + lo) * 0.5f, (hi - lo) * 0.5f };
+}
+
+} // namespace details
+} // namespace filament
@@ -132,8 +132,9 @@ FEngine::FEngine(Backend backend, ExternalContext* externalContext, void* shared
         mExternalContext(externalContext),
         mSharedGLContext(sharedGLContext),
         mEntityManager(EntityManager::get()),
+        mDestroyedEntities(mEntityManager),
         mRenderableManager(*this),
-        mTransformManager(),
+        mTransformManager(&mJobSystem),
         mLightManager(*this),
         mCameraManager(*this),
         mPerViewUib(PerViewUib::getUib()),
@@ -143,6 +144,7 @@ FEngine::FEngine(Backend backend, ExternalContext* externalContext, void* shared
         mPostProcessSib(PostProcessSib::getSib()),
         mCommandBufferQueue(CONFIG_MIN_COMMAND_BUFFERS_SIZE, CONFIG_COMMAND_BUFFERS_SIZE),
         mPerRenderPassAllocator("per-renderpass allocator", CONFIG_PER_RENDER_PASS_ARENA_SIZE),
+        mPerThreadAllocators("per-thread allocator", mJobSystem, CONFIG_PER_THREAD_ARENA_SIZE),
         mEpoch(std::chrono::steady_clock::now()),
         mDriverBarrier(1)
 {
@@ -234,10 +236,15 @@ FEngine::~FEngine() noexcept {
 void FEngine::shutdown() {
 #ifndef NDEBUG
     // print out some statistics about this run
-    size_t wm = mCommandBufferQueue.getHigWatermark();
+    size_t wm = mCommandBufferQueue.getHighWatermark();
     size_t wmpct = wm / (CONFIG_COMMAND_BUFFERS_SIZE / 100);
     slog.d << "CircularBuffer: High watermark "
-           << wm / 1024 << " KiB (" << wmpct << "%)" << io::endl;
+           << wm / 1024 << " KiB (" << wmpct << "%), grown "
+           << mCommandBufferQueue.getGrowCount() << " times" << io::endl;
+    slog.d << "CommandBufferQueue: blocked "
+           << mCommandBufferQueue.getProducerBlockedTime().count() / 1000000 << " ms (main), "
+           << mCommandBufferQueue.getConsumerBlockedTime().count() / 1000000 << " ms (driver)"
+           << io::endl;
 #endif
 
     DriverApi& driver = getDriverApi();
@@ -315,23 +322,98 @@ void FEngine::prepare() {
             item->commit(*this);
         }
     }
+
+    drainDestroyedEntities();
+
+    // drop the component changes all scenes have caught-up with
+    ChangeLog* const changeLogs[FScene::CHANGE_LOG_COUNT] = {
+            &mTransformManager.getChangeLog(),
+            &mRenderableManager.getChangeLog(),
+            &mLightManager.getChangeLog()
+    };
+    for (size_t i = 0; i < FScene::CHANGE_LOG_COUNT; i++) {
+        ChangeLog& changeLog = *changeLogs[i];
+        size_t oldest = changeLog.end().position;
+        for (void* item : mScenes) {
+            // scenes that missed changes will re-gather everything anyways, and so would
+            // scenes that are more changes behind than they have entities (e.g. not rendered
+            // for a while), so we don't hold onto those changes.
+            FScene const* const scene = static_cast<FScene const*>(item);
+            ChangeLog::Cursor cursor = scene->getChangeCursor(i);
+            const size_t behind = changeLog.end().position - cursor.position;
+            if (changeLog.isValid(cursor) &&
+                    behind <= std::max(ChangeLog::MAX_ENTRIES, scene->getEntityCount())) {
+                oldest = std::min(oldest, cursor.position);
+            }
+        }
+        changeLog.trim(oldest);
+    }
+}
+
+void FEngine::drainDestroyedEntities() {
+    std::vector<Entity>& garbage = mGarbage;
+    const size_t first = garbage.size();
+    if (UTILS_UNLIKELY(!mDestroyedEntities.drain(garbage))) {
+        // all entities were destroyed, scenes must re-gather and gc() must sweep all components
+        garbage.clear();
+        mSweepComponents = true;
+        for (void* item : mScenes) {
+            static_cast<FScene*>(item)->invalidate();
+        }
+        return;
+    }
+    if (garbage.size() > first) {
+        // this must happen before gc() removes the components
+        for (void* item : mScenes) {
+            static_cast<FScene*>(item)->removeDestroyedEntities(
+                    garbage.data() + first, garbage.size() - first);
+        }
+    }
 }
 
 void FEngine::gc() {
     JobSystem& js = mJobSystem;
-    auto parent = js.createJob();
-    auto em = std::ref(mEntityManager);
-
-    js.run(jobs::createJob(js, parent, &FRenderableManager::gc, &mRenderableManager, em),
-            JobSystem::DONT_SIGNAL);
-    js.run(jobs::createJob(js, parent, &FLightManager::gc, &mLightManager, em),
-            JobSystem::DONT_SIGNAL);
-    js.run(jobs::createJob(js, parent, &FTransformManager::gc, &mTransformManager, em),
-            JobSystem::DONT_SIGNAL);
-    js.run(jobs::createJob(js, parent, &FCameraManager::gc, &mCameraManager, em),
-            JobSystem::DONT_SIGNAL);
+    std::vector<Entity>& garbage = mGarbage;
+
+    if (UTILS_UNLIKELY(mSweepComponents)) {
+        // all entities were destroyed, we need to look at every component
+        mSweepComponents = false;
+        auto parent = js.createJob();
+        js.run(jobs::createJob(js, parent, [this]() { mRenderableManager.gc(mEntityManager); }),
+                JobSystem::DONT_SIGNAL);
+        js.run(jobs::createJob(js, parent, [this]() { mLightManager.gc(mEntityManager); }),
+                JobSystem::DONT_SIGNAL);
+        js.run(jobs::createJob(js, parent, [this]() { mTransformManager.gc(mEntityManager); }),
+                JobSystem::DONT_SIGNAL);
+        js.run(jobs::createJob(js, parent, [this]() { mCameraManager.gc(mEntityManager); }),
+                JobSystem::DONT_SIGNAL);
+        js.runAndWait(parent);
+        return;
+    }
 
-    js.runAndWait(parent);
+    // Remove the components of the destroyed entities, one batch at a time, until we run out
+    // of time. We always process at least one batch, so that we eventually catch up.
+    const auto deadline = clock::now() + mGarbageCollectionTimeBudget;
+    while (!garbage.empty()) {
+        const size_t count = std::min(garbage.size(), size_t(GC_BATCH_SIZE));
+        Entity const* const entities = garbage.data() + garbage.size() - count;
+
+        auto parent = js.createJob();
+        js.run(jobs::createJob(js, parent, [this, entities, count]() {
+                    mRenderableManager.gc(entities, count); }), JobSystem::DONT_SIGNAL);
+        js.run(jobs::createJob(js, parent, [this, entities, count]() {
+                    mLightManager.gc(entities, count); }), JobSystem::DONT_SIGNAL);
+        js.run(jobs::createJob(js, parent, [this, entities, count]() {
+                    mTransformManager.gc(entities, count); }), JobSystem::DONT_SIGNAL);
+        js.run(jobs::createJob(js, parent, [this, entities, count]() {
+                    mCameraManager.gc(entities, count); }), JobSystem::DONT_SIGNAL);
+        js.runAndWait(parent);
+
+        garbage.resize(garbage.size() - count);
+        if (clock::now() >= deadline) {
+            break;
+        }
+    }
 }
 
 void FEngine::flush() {
@@ -367,9 +449,9 @@ int FEngine::loop() {
 
     auto& commandBufferQueue = mCommandBufferQueue;
     while (true) {
-        // wait until we get command buffers to be executed (or thread exit requested)
-        auto buffers = commandBufferQueue.waitForCommands();
-        if (UTILS_UNLIKELY(!buffers.size())) {
+        // wait until we get a command buffer to be executed (or thread exit requested)
+        auto buffer = commandBufferQueue.waitForCommands();
+        if (UTILS_UNLIKELY(!buffer.begin)) {
             break;
         }
 
@@ -378,13 +460,9 @@ int FEngine::loop() {
             JobSystem::setThreadAffinity(affinityMask);
         }
 
-        // execute all command buffers
-        for (auto& item : buffers) {
-            if (UTILS_LIKELY(item.begin)) {
-                mCommandStream.execute(item.begin);
-                mCommandBufferQueue.releaseBuffer(item);
-            }
-        }
+        // execute the command buffer
+        mCommandStream.execute(buffer.begin);
+        commandBufferQueue.releaseBuffer(buffer);
     }
 
     // terminate() is a synchronous API
@@ -395,6 +473,8 @@ int FEngine::loop() {
 void FEngine::flushCommandBuffer(CommandBufferQueue& commandQueue) {
     getDriver().purge();
     commandQueue.flush();
+    // the queue may have switched to another CircularBuffer
+    mCommandStream.setCircularBuffer(commandQueue.getCircularBuffer());
 }
 
 const FMaterial* FEngine::getSkyboxMaterial(driver::TextureFormat format) const noexcept {
@@ -875,5 +955,13 @@ DebugRegistry& Engine::getDebugRegistry() noexcept {
     return upcast(this)->getDebugRegistry();
 }
 
+Engine::CommandBufferStats Engine::getCommandBufferStats() const noexcept {
+    return upcast(this)->getCommandBufferStats();
+}
+
+void Engine::setGarbageCollectionTimeBudget(uint32_t microseconds) noexcept {
+    upcast(this)->setGarbageCollectionTimeBudget(std::chrono::microseconds(microseconds));
+}
+
 
 } // namespace filament
@@ -23,6 +23,7 @@
 
 #include <filament/Viewport.h>
 
+#include <utils/algorithm.h>
 #include <utils/Allocator.h>
 #include <utils/Systrace.h>
 
@@ -34,6 +35,16 @@
 
 #include <stddef.h>
 
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#   define FROXEL_HAS_NEON 1
+#   include <arm_neon.h>
+#elif (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || defined(__GNUC__))
+#   define FROXEL_HAS_AVX 1
+#   include <immintrin.h>
+#   define FROXEL_TARGET_AVX2   __attribute__((target("avx2")))
+#   define FROXEL_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
 using namespace math;
 using namespace utils;
 
@@ -68,12 +79,15 @@ constexpr size_t FROXEL_BUFFER_WIDTH        = 1u << FROXEL_BUFFER_WIDTH_SHIFT;
 constexpr size_t FROXEL_BUFFER_WIDTH_MASK   = FROXEL_BUFFER_WIDTH - 1u;
 constexpr size_t FROXEL_BUFFER_HEIGHT       = (FROXEL_BUFFER_ENTRY_COUNT_MAX + FROXEL_BUFFER_WIDTH_MASK) / FROXEL_BUFFER_WIDTH;
 
-constexpr size_t RECORD_BUFFER_WIDTH_SHIFT  = 5u;
+constexpr size_t RECORD_BUFFER_WIDTH_SHIFT  = 8u;
 constexpr size_t RECORD_BUFFER_WIDTH        = 1u << RECORD_BUFFER_WIDTH_SHIFT;
 constexpr size_t RECORD_BUFFER_WIDTH_MASK   = RECORD_BUFFER_WIDTH - 1u;
 
-constexpr size_t RECORD_BUFFER_HEIGHT       = 2048;
-constexpr size_t RECORD_BUFFER_ENTRY_COUNT  = RECORD_BUFFER_WIDTH * RECORD_BUFFER_HEIGHT; // 64K
+// The record buffer starts small and doubles in height each time it runs out of space, up to
+// RECORD_BUFFER_MAX_HEIGHT. It's copied in the command stream each time the records change, so
+// we don't want it larger than needed.
+constexpr size_t RECORD_BUFFER_MIN_HEIGHT   = 256;  // 64K entries
+constexpr size_t RECORD_BUFFER_MAX_HEIGHT   = 1024; // 256K entries
 
 // Buffer needed for Froxelizer internal data structures (~256 KiB)
 constexpr size_t PER_FROXELDATA_ARENA_SIZE = sizeof(float4) *
@@ -82,29 +96,43 @@ constexpr size_t PER_FROXELDATA_ARENA_SIZE = sizeof(float4) *
                                                   FEngine::CONFIG_FROXEL_SLICE_COUNT / 4 + 1);
 
 
+// The intersection kernels test up to this many planes or froxels at once. They may read (but
+// not use) that many floats past the end of the planes and bounding spheres arrays.
+static constexpr size_t KERNEL_WIDTH = 16;
+
 // number of lights processed by one group (e.g. 32)
 static constexpr size_t LIGHT_PER_GROUP = sizeof(Froxelizer::LightGroupType) * 8;
 
-// number of groups (i.e. jobs) to use for froxelization (e.g. 8)
-static constexpr size_t GROUP_COUNT =
+// number of light groups stored in a light record word (e.g. 2)
+static constexpr size_t GROUP_PER_RECORD_WORD =
+        sizeof(Froxelizer::LightRecordWord) / sizeof(Froxelizer::LightGroupType);
+
+// maximum number of groups (i.e. jobs) to use for froxelization (e.g. 128)
+static constexpr size_t MAX_GROUP_COUNT =
         (CONFIG_MAX_LIGHT_COUNT + LIGHT_PER_GROUP - 1) / LIGHT_PER_GROUP;
 
+// maximum number of light record words per froxel (e.g. 64)
+static constexpr size_t MAX_LIGHT_RECORD_WORD_COUNT =
+        (MAX_GROUP_COUNT + GROUP_PER_RECORD_WORD - 1) / GROUP_PER_RECORD_WORD;
 
-// record buffer cannot be larger than 65K entries because we're using uint16_t to store indices
-// so its maximum size is 128 KiB
-static_assert(RECORD_BUFFER_ENTRY_COUNT <= 65536,
-        "RecordBuffer cannot be larger than 65536 entries");
+// textures are guaranteed to be at least 2048 texels high in all versions of GLES
+static_assert(RECORD_BUFFER_MAX_HEIGHT <= 2048,
+        "RecordBuffer cannot be higher than 2048 rows");
+
+static GPUBuffer createRecordBuffer(DriverApi& driverApi, size_t height) {
+    GPUBuffer::ElementType type = std::is_same<Froxelizer::RecordBufferType, uint8_t>::value
+                                  ? GPUBuffer::ElementType::UINT8 : GPUBuffer::ElementType::UINT16;
+    return GPUBuffer(driverApi, { type, 1 }, RECORD_BUFFER_WIDTH, height);
+}
 
 Froxelizer::Froxelizer(FEngine& engine)
         : mArena("froxel", PER_FROXELDATA_ARENA_SIZE) {
 
     DriverApi& driverApi = engine.getDriverApi();
 
-    // RecordBuffer cannot be larger than 65536 entries, because indices are uint16_t
-    GPUBuffer::ElementType type = std::is_same<RecordBufferType, uint8_t>::value
-                                  ? GPUBuffer::ElementType::UINT8 : GPUBuffer::ElementType::UINT16;
-    mRecordsBuffer = GPUBuffer(driverApi, { type, 1 }, RECORD_BUFFER_WIDTH, RECORD_BUFFER_HEIGHT);
-    mFroxelBuffer  = GPUBuffer(driverApi, { GPUBuffer::ElementType::UINT16, 2 },
+    mRecordBufferHeight = uint16_t(RECORD_BUFFER_MIN_HEIGHT);
+    mRecordsBuffer = createRecordBuffer(driverApi, mRecordBufferHeight);
+    mFroxelBuffer  = GPUBuffer(driverApi, { GPUBuffer::ElementType::UINT32, 2 },
             FROXEL_BUFFER_WIDTH, FROXEL_BUFFER_HEIGHT);
 }
 
@@ -116,7 +144,8 @@ void Froxelizer::terminate(DriverApi& driverApi) noexcept {
     // call reset() on our LinearAllocator arenas
     mArena.reset();
 
-    mBoundingSpheres = nullptr;
+    mBoundingSpheresX = mBoundingSpheresY = mBoundingSpheresZ = mBoundingSpheresR = nullptr;
+    mPlanesXx = mPlanesXz = nullptr;
     mPlanesY = nullptr;
     mPlanesX = nullptr;
     mDistancesZ = nullptr;
@@ -134,6 +163,14 @@ void Froxelizer::setOptions(float zLightNear, float zLightFar) noexcept {
 }
 
 
+void Froxelizer::setIsa(Culler::Isa isa) noexcept {
+    assert(Culler::isSupported(isa));
+    if (mIsa != isa) {
+        mIsa = isa;
+        mFroxelThreadDataInvalid = true;
+    }
+}
+
 void Froxelizer::setViewport(Viewport const& viewport) noexcept {
     if (UTILS_UNLIKELY(mViewport != viewport)) {
         mViewport = viewport;
@@ -150,56 +187,46 @@ void Froxelizer::setProjection(const mat4f& projection, float near, float far) n
 }
 
 bool Froxelizer::prepare(
-        FEngine::DriverApi& driverApi, ArenaScope& arena, Viewport const& viewport,
-        const math::mat4f& projection, float projectionNear, float projectionFar) noexcept {
+        FEngine::DriverApi& driverApi, Viewport const& viewport,
+        const math::mat4f& projection, float projectionNear, float projectionFar,
+        size_t lightCount) noexcept {
     setViewport(viewport);
     setProjection(projection, projectionNear, projectionFar);
 
     bool uniformsNeedUpdating = false;
     if (UTILS_UNLIKELY(mDirtyFlags)) {
         uniformsNeedUpdating = update();
+        // the froxels changed, all lights must be froxelized again
+        mFroxelThreadDataInvalid = true;
     }
 
-    /*
-     * Allocations that need to persists until the driver consumes them are done from
-     * the command stream.
-     */
-
-    // froxel buffer (~32 KiB)
-    mFroxelBufferUser = {
-            driverApi.allocatePod<FroxelEntry>(FROXEL_BUFFER_ENTRY_COUNT_MAX, CACHELINE_SIZE),
-            FROXEL_BUFFER_ENTRY_COUNT_MAX };
-
-    // record buffer (~64 KiB)
-    mRecordBufferUser = {
-            driverApi.allocatePod<RecordBufferType>(RECORD_BUFFER_ENTRY_COUNT, CACHELINE_SIZE),
-            RECORD_BUFFER_ENTRY_COUNT };
-
-    /*
-     * Temporary allocations for processing all froxel data
-     */
-
-    // light records per froxel (~256 KiB)
-    mLightRecords = {
-            arena.allocate<LightRecord>(FROXEL_BUFFER_ENTRY_COUNT_MAX, CACHELINE_SIZE),
-            FROXEL_BUFFER_ENTRY_COUNT_MAX };
-
-    // froxel thread data (~256 KiB)
-    mFroxelShardedData = {
-            arena.allocate<FroxelThreadData>(GROUP_COUNT, CACHELINE_SIZE),
-            uint32_t(GROUP_COUNT)
-    };
+    // froxels were dropped last time, grow the record buffer if we can
+    if (UTILS_UNLIKELY(mRecordBufferFull)) {
+        mRecordBufferFull = false;
+        if (mRecordBufferHeight < RECORD_BUFFER_MAX_HEIGHT) {
+            mRecordBufferHeight *= 2;
+            mRecordsBuffer.terminate(driverApi);
+            mRecordsBuffer = createRecordBuffer(driverApi, mRecordBufferHeight);
+            mFroxelThreadDataInvalid = true;
+        }
+    }
 
-    assert(mFroxelBufferUser.begin());
-    assert(mRecordBufferUser.begin());
-    assert(mLightRecords.begin());
-    assert(mFroxelShardedData.begin());
+    // lights are split in groups of LIGHT_PER_GROUP, each processed by its own job. We use an
+    // even number of groups, so that light record words are always made of whole groups.
+    assert(lightCount <= CONFIG_MAX_LIGHT_COUNT);
+    const size_t wordCount = std::max(size_t(1),
+            (lightCount + LIGHT_PER_GROUP * GROUP_PER_RECORD_WORD - 1) /
+                    (LIGHT_PER_GROUP * GROUP_PER_RECORD_WORD));
+    mLightRecordWordCount = wordCount;
+    if (UTILS_UNLIKELY(mGroupCount != wordCount * GROUP_PER_RECORD_WORD)) {
+        // lights are assigned to different groups, all lights must be froxelized again
+        mGroupCount = wordCount * GROUP_PER_RECORD_WORD;
+        mFroxelThreadData.resize(mGroupCount);
+        mFroxelThreadDataInvalid = true;
+    }
 
-#ifndef NDEBUG
-    memset(mFroxelBufferUser.data(),    0x55, mFroxelBufferUser.sizeInBytes());
-    memset(mRecordBufferUser.data(),    0xEB, mRecordBufferUser.sizeInBytes());
-    memset(mFroxelShardedData.data(),   0xFD, mFroxelShardedData.sizeInBytes());
-#endif
+    // the froxel and record buffers are only (re)allocated when the records are rebuilt,
+    // see froxelizeAssignRecordsCompress().
 
     return uniformsNeedUpdating;
 }
@@ -284,21 +311,35 @@ bool Froxelizer::update() noexcept {
             // this is a LinearAllocator arena, use rewind() instead of free (which is a no op).
             mArena.rewind(mDistancesZ);
 
-            mBoundingSpheres = nullptr;
+            mBoundingSpheresX = mBoundingSpheresY = mBoundingSpheresZ = mBoundingSpheresR = nullptr;
+            mPlanesXx = mPlanesXz = nullptr;
             mPlanesY = nullptr;
             mPlanesX = nullptr;
             mDistancesZ = nullptr;
         }
 
+        // the structures of arrays are padded with zeros for the intersection kernels
+        const size_t planesXStride = froxelCountX + 1 + KERNEL_WIDTH;
+        const size_t spheresStride = froxelCount + KERNEL_WIDTH;
+
         mDistancesZ      = mArena.alloc<float>(froxelCountZ + 1);
         mPlanesX         = mArena.alloc<float4>(froxelCountX + 1);
         mPlanesY         = mArena.alloc<float4>(froxelCountY + 1);
-        mBoundingSpheres = mArena.alloc<float4>(froxelCount);
+        mPlanesXx        = mArena.alloc<float>(planesXStride * 2);
+        mPlanesXz        = mPlanesXx + planesXStride;
+        mBoundingSpheresX = mArena.alloc<float>(spheresStride * 4);
+        mBoundingSpheresY = mBoundingSpheresX + spheresStride;
+        mBoundingSpheresZ = mBoundingSpheresY + spheresStride;
+        mBoundingSpheresR = mBoundingSpheresZ + spheresStride;
 
         assert(mDistancesZ);
         assert(mPlanesX);
         assert(mPlanesY);
-        assert(mBoundingSpheres);
+        assert(mPlanesXx);
+        assert(mBoundingSpheresX);
+
+        std::fill_n(mPlanesXx, planesXStride * 2, 0.0f);
+        std::fill_n(mBoundingSpheresX, spheresStride * 4, 0.0f);
 
         mDistancesZ[0] = 0.0f;
         const float zLightNear = mZLightNear;
@@ -335,7 +376,8 @@ bool Froxelizer::update() noexcept {
         assert(mDistancesZ);
         assert(mPlanesX);
         assert(mPlanesY);
-        assert(mBoundingSpheres);
+        assert(mPlanesXx);
+        assert(mBoundingSpheresX);
 
         // clip-space dimensions
         const float froxelWidthInClipSpace  = (2.0f * mFroxelDimension.x) / mViewport.width;
@@ -351,6 +393,8 @@ bool Froxelizer::update() noexcept {
             p0 = mat4f::project(invProjection, p0);
             p1 = mat4f::project(invProjection, p1);
             mPlanesX[i] = float4(normalize(cross(p1.xyz, p0.xyz)), 0);
+            mPlanesXx[i] = mPlanesX[i].x;
+            mPlanesXz[i] = mPlanesX[i].z;
         }
 
         for (size_t i = 0, n = mFroxelCountY; i <= n; ++i) {
@@ -374,7 +418,10 @@ bool Froxelizer::update() noexcept {
         typename std::aligned_storage<sizeof(float2), alignof(float2)>::type stack[2048];
         float2* const UTILS_RESTRICT minMaxX = reinterpret_cast<float2*>(stack);
 
-        float4* const        UTILS_RESTRICT boundingSpheres = mBoundingSpheres;
+        float* const         UTILS_RESTRICT boundingSpheresX = mBoundingSpheresX;
+        float* const         UTILS_RESTRICT boundingSpheresY = mBoundingSpheresY;
+        float* const         UTILS_RESTRICT boundingSpheresZ = mBoundingSpheresZ;
+        float* const         UTILS_RESTRICT boundingSpheresR = mBoundingSpheresR;
         float4  const* const UTILS_RESTRICT planesX = mPlanesX;
         float4  const* const UTILS_RESTRICT planesY = mPlanesY;
         float   const* const UTILS_RESTRICT planesZ = mDistancesZ;
@@ -437,7 +484,12 @@ bool Froxelizer::update() noexcept {
                     assert(getFroxelIndex(ix, iy, iz) == fi);
                     minp.x = minMaxX[ix][0];
                     maxp.x = minMaxX[ix][1];
-                    boundingSpheres[fi++] = { (maxp + minp) * 0.5f, length((maxp - minp) * 0.5f) };
+                    const float3 center = (maxp + minp) * 0.5f;
+                    boundingSpheresX[fi] = center.x;
+                    boundingSpheresY[fi] = center.y;
+                    boundingSpheresZ[fi] = center.z;
+                    boundingSpheresR[fi] = length((maxp - minp) * 0.5f);
+                    fi++;
                 }
             }
         }
@@ -523,35 +575,56 @@ std::pair<size_t, size_t> Froxelizer::clipToIndices(float2 const& clip) const no
 
 
 void Froxelizer::commit(driver::DriverApi& driverApi) {
-    // send data to GPU
-    mFroxelBuffer.commit(driverApi, mFroxelBufferUser);
-    mRecordsBuffer.commit(driverApi, mRecordBufferUser);
-#ifndef NDEBUG
-    mFroxelBufferUser.clear();
-    mRecordBufferUser.clear();
-    mFroxelShardedData.clear();
-#endif
+    // Send data to GPU. The buffers are only dirty if the records were rebuilt, otherwise the
+    // GPU still has the right data and we don't need to copy anything in the command stream.
+    if (mFroxelBuffer.isDirty()) {
+        const size_t count = mFroxelBufferUser.size();
+        FroxelEntry* const froxels = driverApi.allocatePod<FroxelEntry>(count, CACHELINE_SIZE);
+        std::copy(mFroxelBufferUser.begin(), mFroxelBufferUser.end(), froxels);
+        mFroxelBuffer.commit(driverApi, froxels, froxels + count);
+    }
+    if (mRecordsBuffer.isDirty()) {
+        // only the rows that are used are uploaded
+        const size_t count = mUsedRecordCount;
+        RecordBufferType* const records =
+                driverApi.allocatePod<RecordBufferType>(count, CACHELINE_SIZE);
+        std::copy_n(mRecordBufferUser.begin(), count, records);
+        mRecordsBuffer.commit(driverApi, records, records + count);
+    }
 }
 
 void Froxelizer::froxelizeLights(FEngine& engine,
         math::mat4f const& UTILS_RESTRICT viewMatrix,
         const FScene::LightSoa& UTILS_RESTRICT lightData) noexcept {
     // note: this is called asynchronously
-    froxelizeLoop(engine, viewMatrix, lightData);
-    froxelizeAssignRecordsCompress();
+    const FEngine::clock::time_point start = FEngine::clock::now();
+
+    const bool invalid = mFroxelThreadDataInvalid;
+    const size_t froxelizedLightCount = froxelizeLoop(engine, viewMatrix, lightData);
+
+    // the froxel and record buffers we sent to the GPU last time are still valid if no light
+    // changed, in that case they're not updated (see commit()).
+    const bool recordsUpdated = invalid || froxelizedLightCount;
+    if (recordsUpdated) {
+        froxelizeAssignRecordsCompress();
+    }
+
+    mStats.lightCount = lightData.size() - FScene::DIRECTIONAL_LIGHTS_COUNT;
+    mStats.froxelizedLightCount = froxelizedLightCount;
+    mStats.recordsUpdated = recordsUpdated;
+    mStats.duration = FEngine::clock::now() - start;
 
 #ifndef NDEBUG
-    if (lightData.size()) {
+    if (recordsUpdated && lightData.size()) {
         // go through every froxel
         auto const& recordBufferUser(mRecordBufferUser);
-        auto gpuFroxelEntries(mFroxelBufferUser);
-        gpuFroxelEntries.set(gpuFroxelEntries.begin(),
-                mFroxelCountX * mFroxelCountY * mFroxelCountZ);
+        Slice<const FroxelEntry> gpuFroxelEntries(mFroxelBufferUser.data(),
+                mFroxelBufferUser.data() + mFroxelCountX * mFroxelCountY * mFroxelCountZ);
         for (auto const& entry : gpuFroxelEntries) {
             // go through every lights for that froxel
             for (size_t i = 0; i < entry.pointLightCount + entry.spotLightCount; i++) {
                 // get the light index
-                assert(entry.offset + i < RECORD_BUFFER_ENTRY_COUNT);
+                assert(entry.offset + i < recordBufferUser.size());
 
                 size_t lightIndex = recordBufferUser[entry.offset + i];
                 assert(lightIndex <= CONFIG_MAX_LIGHT_INDEX);
@@ -564,103 +637,174 @@ void Froxelizer::froxelizeLights(FEngine& engine,
 #endif
 }
 
-void Froxelizer::froxelizeLoop(FEngine& engine,
+size_t Froxelizer::froxelizeLoop(FEngine& engine,
         mat4f const& UTILS_RESTRICT viewMatrix,
         const FScene::LightSoa& UTILS_RESTRICT lightData) noexcept {
     SYSTRACE_CALL();
 
-    Slice<FroxelThreadData> froxelThreadData = mFroxelShardedData;
-    memset(froxelThreadData.data(), 0, froxelThreadData.sizeInBytes());
+    // when the camera moves, all the lights move in view-space
+    if (mat4f::fuzzyEqual(mViewMatrix, viewMatrix)) {
+        mViewMatrix = viewMatrix;
+        mFroxelThreadDataInvalid = true;
+    }
+
+    FroxelThreadData* const froxelThreadData = mFroxelThreadData.data();
+    const size_t groupCount = mGroupCount;
+    const size_t lightCount = lightData.size() - FScene::DIRECTIONAL_LIGHTS_COUNT;
+    assert(mFroxelThreadData.size() == groupCount);
+    assert(lightCount <= groupCount * LIGHT_PER_GROUP);
+
+    // start from scratch, all lights are new
+    const bool invalid = mFroxelThreadDataInvalid;
+    if (invalid) {
+        memset(froxelThreadData, 0, groupCount * sizeof(FroxelThreadData));
+        mLightParams.clear();
+        mFroxelThreadDataInvalid = false;
+    }
+
+    // lights in [lightCount, previousLightCount[ have been removed
+    const size_t previousLightCount = mLightParams.size();
+    mLightParams.resize(std::max(lightCount, previousLightCount));
+    LightParams* const UTILS_RESTRICT lights = mLightParams.data();
 
     auto& lcm = engine.getLightManager();
     auto const* UTILS_RESTRICT spheres      = lightData.data<FScene::POSITION_RADIUS>();
     auto const* UTILS_RESTRICT directions   = lightData.data<FScene::DIRECTION>();
     auto const* UTILS_RESTRICT instances    = lightData.data<FScene::LIGHT_INSTANCE>();
 
-    auto process = [ this, &froxelThreadData,
+    // number of lights added, moved or removed in each group
+    size_t changedCounts[MAX_GROUP_COUNT];
+
+    auto process = [ this, froxelThreadData, lights, &changedCounts, groupCount,
+                     lightCount, previousLightCount, invalid,
                      spheres, directions, instances, &viewMatrix, &lcm ]
-            (size_t count, size_t offset, size_t stride) {
+            (size_t group) {
 
         const mat4f& projection = mProjection;
         const mat3f& vn = viewMatrix.upperLeft();
 
-        for (size_t i = offset; i < count; i += stride) {
-            const size_t j = i + FScene::DIRECTIONAL_LIGHTS_COUNT;
-            FLightManager::Instance li = instances[j];
-            LightParams light = {
-                    .position = (viewMatrix * float4{ spheres[j].xyz, 1 }).xyz, // to view-space
-                    .cosSqr = lcm.getCosOuterSquared(li),   // spot only
-                    .axis = vn * directions[j],             // spot only
-                    .invSin = lcm.getSinInverse(li),        // spot only
-                    .radius = spheres[j].w,
-            };
-
-            const size_t group = i % GROUP_COUNT;
-            const size_t bit   = i / GROUP_COUNT;
+        // find the lights of this group that changed since last time
+        LightGroupType changed = 0;
+        for (size_t i = group, c = std::max(lightCount, previousLightCount); i < c; i += groupCount) {
+            const size_t bit = i / groupCount;
             assert(bit < LIGHT_PER_GROUP);
+            if (i < lightCount) {
+                const size_t j = i + FScene::DIRECTIONAL_LIGHTS_COUNT;
+                FLightManager::Instance li = instances[j];
+                LightParams light = {
+                        .position = (viewMatrix * float4{ spheres[j].xyz, 1 }).xyz, // to view-space
+                        .cosSqr = lcm.getCosOuterSquared(li),   // spot only
+                        .axis = vn * directions[j],             // spot only
+                        .invSin = lcm.getSinInverse(li),        // spot only
+                        .radius = spheres[j].w,
+                };
+                // LightParams has no padding, so we can compare its bits
+                if (i < previousLightCount && !memcmp(&lights[i], &light, sizeof(LightParams))) {
+                    continue;
+                }
+                lights[i] = light;
+            }
+            changed |= LightGroupType(1) << bit;
+        }
+
+        changedCounts[group] = utils::popcount(changed);
+        if (!changed) {
+            return;
+        }
+
+        FroxelThreadData& threadData = froxelThreadData[group];
+
+        // remove the lights that changed from all the froxels (the first entry is the light type)
+        if (!invalid) {
+            const LightGroupType keep = ~changed;
+            for (size_t j = 0, c = getFroxelCount() + 1; j < c; j++) {
+                threadData[j] &= keep;
+            }
+        }
 
-            FroxelThreadData& threadData = froxelThreadData[group];
-            const bool isSpot = light.invSin != std::numeric_limits<float>::infinity();
-            threadData[0] |= isSpot << bit;
-            froxelizePointAndSpotLight(threadData, bit, projection, light);
+        // and add them back where they are now
+        for (LightGroupType w = changed; w; w &= w - 1) {
+            const size_t bit = utils::ctz(w);
+            const size_t i = bit * groupCount + group;
+            if (i < lightCount) {
+                LightParams const& light = lights[i];
+                const bool isSpot = light.invSin != std::numeric_limits<float>::infinity();
+                threadData[0] |= LightGroupType(isSpot) << bit;
+                froxelizePointAndSpotLight(threadData, bit, projection, light);
+            }
         }
     };
 
-    // we do 64 lights per job
+    // we do LIGHT_PER_GROUP lights per job
     JobSystem& js = engine.getJobSystem();
 
     constexpr bool SINGLE_THREADED = false;
     if (!SINGLE_THREADED) {
         auto parent = js.createJob();
-        for (size_t i = 0; i < GROUP_COUNT; i++) {
-            js.run(jobs::createJob(js, parent, std::cref(process),
-                    lightData.size() - FScene::DIRECTIONAL_LIGHTS_COUNT, i, GROUP_COUNT));
+        for (size_t i = 0; i < groupCount; i++) {
+            js.run(jobs::createJob(js, parent, std::cref(process), i));
         }
         js.runAndWait(parent);
     } else {
-        js.runAndWait(jobs::createJob(js, nullptr, std::cref(process),
-                lightData.size() - FScene::DIRECTIONAL_LIGHTS_COUNT, 0, 1)
-        );
+        for (size_t i = 0; i < groupCount; i++) {
+            process(i);
+        }
+    }
+
+    mLightParams.resize(lightCount);
+
+    size_t changedCount = 0;
+    for (size_t i = 0; i < groupCount; i++) {
+        changedCount += changedCounts[i];
     }
+    return changedCount;
 }
 
 void Froxelizer::froxelizeAssignRecordsCompress() noexcept {
 
     SYSTRACE_CALL();
 
-    Slice<FroxelThreadData> froxelThreadData = mFroxelShardedData;
+    FroxelThreadData const* const froxelThreadData = mFroxelThreadData.data();
+    const size_t groupCount = mGroupCount;
+    const size_t wordCount = mLightRecordWordCount;
+    assert(wordCount <= MAX_LIGHT_RECORD_WORD_COUNT);
 
-    // convert froxel data from N groups of M bits to LightRecord::bitset, so we can
+    // convert froxel data from N groups of M bits to light record words, so we can
     // easily compare adjacent froxels, for compaction. The conversion loops below get
     // inlined and vectorized in release builds.
 
     // keep these two loops separate, it helps the compiler a lot
-    LightRecord::bitset spotLights;
-    for (size_t i = 0; i < LightRecord::bitset::WORLD_COUNT; i++) {
-        using container_type = LightRecord::bitset::container_type;
-        constexpr size_t r = sizeof(container_type) / sizeof(LightGroupType);
-        container_type b = froxelThreadData[i * r][0];
+    LightRecordWord spotLights[MAX_LIGHT_RECORD_WORD_COUNT];
+    for (size_t i = 0; i < wordCount; i++) {
+        constexpr size_t r = GROUP_PER_RECORD_WORD;
+        LightRecordWord b = froxelThreadData[i * r][0];
         for (size_t k = 0; k < r; k++) {
-            b |= (container_type(froxelThreadData[i * r + k][0]) << (LIGHT_PER_GROUP * k));
+            b |= (LightRecordWord(froxelThreadData[i * r + k][0]) << (LIGHT_PER_GROUP * k));
         }
-        spotLights.getBitsAt(i) = b;
+        spotLights[i] = b;
     }
 
+    // This is only called when the records are rebuilt, which is the only time we need these.
+    // The froxel and record buffers are kept until the next rebuild, so commit() can
+    // upload them, and they're only reallocated when they grow.
+    mLightRecords.resize(getFroxelCount() * wordCount);
+    mFroxelBufferUser.resize(FROXEL_BUFFER_ENTRY_COUNT_MAX);
+    mRecordBufferUser.resize(RECORD_BUFFER_WIDTH * mRecordBufferHeight);
+
     // this gets very well vectorized...
-    utils::Slice<LightRecord> records(mLightRecords);
-    for (size_t j = 1, jc = FROXEL_BUFFER_ENTRY_COUNT_MAX; j < jc; j++) {
-        for (size_t i = 0; i < LightRecord::bitset::WORLD_COUNT; i++) {
-            using container_type = LightRecord::bitset::container_type;
-            constexpr size_t r = sizeof(container_type) / sizeof(LightGroupType);
-            container_type b = froxelThreadData[i * r][j];
+    LightRecordWord* const UTILS_RESTRICT records = mLightRecords.data();
+    for (size_t j = 1, jc = getFroxelCount() + 1; j < jc; j++) {
+        for (size_t i = 0; i < wordCount; i++) {
+            constexpr size_t r = GROUP_PER_RECORD_WORD;
+            LightRecordWord b = froxelThreadData[i * r][j];
             for (size_t k = 0; k < r; k++) {
-                b |= (container_type(froxelThreadData[i * r + k][j]) << (LIGHT_PER_GROUP * k));
+                b |= (LightRecordWord(froxelThreadData[i * r + k][j]) << (LIGHT_PER_GROUP * k));
             }
-            records[j - 1].lights.getBitsAt(i) = b;
+            records[(j - 1) * wordCount + i] = b;
         }
     }
 
-    uint16_t offset = 0;
+    uint32_t offset = 0;
     FroxelEntry* const UTILS_RESTRICT froxels = mFroxelBufferUser.data();
 
     auto remap = [stride = size_t(mFroxelCountX * mFroxelCountY)](size_t i) {
@@ -672,6 +816,7 @@ void Froxelizer::froxelizeAssignRecordsCompress() noexcept {
     };
 
     RecordBufferType* const UTILS_RESTRICT froxelRecords = mRecordBufferUser.data();
+    const size_t recordCount = mRecordBufferUser.size();
 
     // how many froxel record entries were reused (for debugging)
     UTILS_UNUSED size_t reused = FROXEL_BUFFER_ENTRY_COUNT_MAX;
@@ -680,55 +825,67 @@ void Froxelizer::froxelizeAssignRecordsCompress() noexcept {
 #ifndef NDEBUG
         reused--;
 #endif
-        auto const& b = records[i];
-        // We have a limitation of 255 spot + 255 point lights per froxel.
+        LightRecordWord const* const b = records + i * wordCount;
+        size_t pointLightCount = 0;
+        size_t spotLightCount = 0;
+        for (size_t k = 0; k < wordCount; k++) {
+            pointLightCount += utils::popcount(b[k] & ~spotLights[k]);
+            spotLightCount  += utils::popcount(b[k] &  spotLights[k]);
+        }
+
+        // We have a limitation of 65535 spot + 65535 point lights per froxel.
         const FroxelEntry entry = {
                 .offset = offset,
-                .pointLightCount = (uint8_t)std::min(size_t(255), (b.lights & ~spotLights).count()),
-                .spotLightCount  = (uint8_t)std::min(size_t(255), (b.lights &  spotLights).count())
+                .pointLightCount = (uint16_t)std::min(size_t(0xFFFF), pointLightCount),
+                .spotLightCount  = (uint16_t)std::min(size_t(0xFFFF), spotLightCount)
         };
         const size_t lightCount = entry.count[0] + entry.count[1];
 
-        if (UTILS_UNLIKELY(offset + lightCount >= RECORD_BUFFER_ENTRY_COUNT)) {
+        if (UTILS_UNLIKELY(offset + lightCount >= recordCount)) {
 #ifndef NDEBUG
             slog.d << "out of space: " << i << ", at " << offset << io::endl;
 #endif
+            // the record buffer will grow for the next frame, if it can.
             // note: instead of dropping froxels we could look for similar records we've already
             // filed up.
+            mRecordBufferFull = true;
             do { // this compiles to memset() when remap() is identity
-                froxels[remap(i++)].u32 = 0;
+                froxels[remap(i++)].u64 = 0;
             } while(i < c);
             goto out_of_memory;
         }
 
         // iterate the bitfield
-        auto beginPoint = froxelRecords + offset;
-        auto beginSpot  = froxelRecords + offset + entry.count[0];
-        b.lights.forEachSetBit([&spotLights,
-                point = beginPoint, spot = beginSpot, beginPoint, beginSpot]
-                (size_t l) mutable {
-
-            // make sure to keep this code branch-less
-            const bool isSpot = spotLights[l];
-            auto& p = isSpot ? spot      : point;
-            auto  s = isSpot ? beginSpot : beginPoint;
-
-            const size_t word = l / LIGHT_PER_GROUP;
-            const size_t bit  = l % LIGHT_PER_GROUP;
-            l = (bit * GROUP_COUNT) | (word % GROUP_COUNT);
-
-            *p = (RecordBufferType)l;
-            // we need to "cancel" the write if we have more than 255 spot or point lights
-            // (this is a limitation of the data type used to store the light counts per froxel)
-            p += (p - s < 255) ? 1 : 0;
-        });
+        RecordBufferType* point = froxelRecords + offset;
+        RecordBufferType* spot  = froxelRecords + offset + entry.count[0];
+        RecordBufferType* const beginPoint = point;
+        RecordBufferType* const beginSpot  = spot;
+        for (size_t k = 0; k < wordCount; k++) {
+            for (LightRecordWord w = b[k]; w; w &= w - 1) {
+                const size_t bit = utils::ctz(w);
+
+                // make sure to keep this code branch-less
+                const bool isSpot = (spotLights[k] >> bit) & 1u;
+                auto& p = isSpot ? spot      : point;
+                auto  s = isSpot ? beginSpot : beginPoint;
+
+                const size_t l = k * sizeof(LightRecordWord) * 8 + bit;
+                const size_t group = l / LIGHT_PER_GROUP;
+                const size_t index = (l % LIGHT_PER_GROUP) * groupCount + group;
+
+                *p = (RecordBufferType)index;
+                // we need to "cancel" the write if we have more than 65535 spot or point lights
+                // (this is a limitation of the data type used to store the light counts per froxel)
+                p += (p - s < 0xFFFF) ? 1 : 0;
+            }
+        }
 
         offset += lightCount;
 
         // note: we can't use partition_point() here because we're not sorted
         do {
-            froxels[remap(i++)].u32 = entry.u32;
-        } while(i < c && records[i].lights == b.lights);
+            froxels[remap(i++)].u64 = entry.u64;
+        } while(i < c && std::equal(b, b + wordCount, records + i * wordCount));
     }
 out_of_memory:
 
@@ -736,7 +893,302 @@ out_of_memory:
     mFroxelBuffer.invalidate();
 
     // needed record buffer size may change at each frame
-    mRecordsBuffer.invalidate(0, (offset + RECORD_BUFFER_WIDTH_MASK) >> RECORD_BUFFER_WIDTH_SHIFT);
+    const size_t rowCount = (offset + RECORD_BUFFER_WIDTH_MASK) >> RECORD_BUFFER_WIDTH_SHIFT;
+    mUsedRecordCount = rowCount * RECORD_BUFFER_WIDTH;
+    mRecordsBuffer.invalidate(0, rowCount);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Light vs. froxel intersection kernels
+// ------------------------------------------------------------------------------------------------
+
+/*
+ * The planes kernels return a bitmask of which of KERNEL_WIDTH planes {x,0,z,0} intersect a
+ * sphere (radius squared), i.e.: spherePlaneDistanceSquared() > 0 for each plane.
+ *
+ * The cone kernels set 'mask' in each of 'count' froxels whose bounding sphere intersects a spot
+ * light's cone, i.e.: sphereConeIntersectionFast() for each froxel.
+ *
+ * They must all compute with the same operations, in the same order, so that they return the
+ * same results regardless of the instruction set.
+ */
+
+using LightGroupType = Froxelizer::LightGroupType;
+
+struct Cone {
+    float3 position;
+    float3 axis;
+    float invSin;
+    float cosSqr;
+};
+
+using PlanesKernel = uint32_t (*)(float const* px, float const* pz, float4 const& s);
+
+using ConeKernel = void (*)(LightGroupType* froxels,
+        float const* x, float const* y, float const* z, float const* r,
+        size_t count, LightGroupType mask, Cone const& cone);
+
+struct FroxelKernels {
+    PlanesKernel planes;
+    ConeKernel cone;
+};
+
+// ------------------------------------------------------------------------------------------------
+// Generic kernels
+// ------------------------------------------------------------------------------------------------
+
+static uint32_t intersectsPlanesGeneric(
+        float const* UTILS_RESTRICT px, float const* UTILS_RESTRICT pz, float4 const& s) {
+    uint32_t hits = 0;
+    for (size_t i = 0; i < KERNEL_WIDTH; i++) {
+        const float d = s.x * px[i] + s.z * pz[i];
+        hits |= uint32_t(s.w - d * d > 0) << i;
+    }
+    return hits;
+}
+
+static void intersectsConeGeneric(LightGroupType* UTILS_RESTRICT froxels,
+        float const* UTILS_RESTRICT x, float const* UTILS_RESTRICT y,
+        float const* UTILS_RESTRICT z, float const* UTILS_RESTRICT r,
+        size_t count, LightGroupType mask, Cone const& cone) {
+    for (size_t i = 0; i < count; i++) {
+        // the cone's apex is moved back by the sphere's radius
+        const float t = r[i] * cone.invSin;
+        const float dx = x[i] - (cone.position.x - t * cone.axis.x);
+        const float dy = y[i] - (cone.position.y - t * cone.axis.y);
+        const float dz = z[i] - (cone.position.z - t * cone.axis.z);
+        const float e = cone.axis.x * dx + cone.axis.y * dy + cone.axis.z * dz;
+        const float dd = dx * dx + dy * dy + dz * dz;
+        // make sure to keep this code branch-less
+        const bool intersect = (e * e >= dd * cone.cosSqr) & (e > 0);
+        froxels[i] |= intersect ? mask : 0;
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+// NEON kernels, 4 lanes, the last froxels (if any) use the generic kernel
+// ------------------------------------------------------------------------------------------------
+
+#if defined(FROXEL_HAS_NEON)
+
+// converts 4 lanes of 0xFFFFFFFF or 0 to 4 bits
+static inline uint32_t bitMaskNeon(uint32x4_t v) {
+    static const uint32_t weights[4] = { 1, 2, 4, 8 };
+    const uint32x4_t b = vandq_u32(v, vld1q_u32(weights));
+    const uint32x2_t h = vpadd_u32(vget_low_u32(b), vget_high_u32(b));
+    return vget_lane_u32(vpadd_u32(h, h), 0);
+}
+
+static uint32_t intersectsPlanesNeon(
+        float const* UTILS_RESTRICT px, float const* UTILS_RESTRICT pz, float4 const& s) {
+    uint32_t hits = 0;
+    for (size_t i = 0; i < KERNEL_WIDTH; i += 4) {
+        const float32x4_t d = vaddq_f32(
+                vmulq_n_f32(vld1q_f32(px + i), s.x), vmulq_n_f32(vld1q_f32(pz + i), s.z));
+        const float32x4_t rr = vsubq_f32(vdupq_n_f32(s.w), vmulq_f32(d, d));
+        hits |= bitMaskNeon(vcgtq_f32(rr, vdupq_n_f32(0))) << i;
+    }
+    return hits;
+}
+
+static void intersectsConeNeon(LightGroupType* UTILS_RESTRICT froxels,
+        float const* UTILS_RESTRICT x, float const* UTILS_RESTRICT y,
+        float const* UTILS_RESTRICT z, float const* UTILS_RESTRICT r,
+        size_t count, LightGroupType mask, Cone const& cone) {
+    const uint32x4_t m = vdupq_n_u32(mask);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const float32x4_t t = vmulq_n_f32(vld1q_f32(r + i), cone.invSin);
+        const float32x4_t dx = vsubq_f32(vld1q_f32(x + i),
+                vsubq_f32(vdupq_n_f32(cone.position.x), vmulq_n_f32(t, cone.axis.x)));
+        const float32x4_t dy = vsubq_f32(vld1q_f32(y + i),
+                vsubq_f32(vdupq_n_f32(cone.position.y), vmulq_n_f32(t, cone.axis.y)));
+        const float32x4_t dz = vsubq_f32(vld1q_f32(z + i),
+                vsubq_f32(vdupq_n_f32(cone.position.z), vmulq_n_f32(t, cone.axis.z)));
+        float32x4_t e = vmulq_n_f32(dx, cone.axis.x);
+        e = vaddq_f32(e, vmulq_n_f32(dy, cone.axis.y));
+        e = vaddq_f32(e, vmulq_n_f32(dz, cone.axis.z));
+        float32x4_t dd = vmulq_f32(dx, dx);
+        dd = vaddq_f32(dd, vmulq_f32(dy, dy));
+        dd = vaddq_f32(dd, vmulq_f32(dz, dz));
+        const uint32x4_t intersect = vandq_u32(
+                vcgeq_f32(vmulq_f32(e, e), vmulq_n_f32(dd, cone.cosSqr)),
+                vcgtq_f32(e, vdupq_n_f32(0)));
+        vst1q_u32(froxels + i, vorrq_u32(vld1q_u32(froxels + i), vandq_u32(intersect, m)));
+    }
+    if (i < count) {
+        intersectsConeGeneric(froxels + i, x + i, y + i, z + i, r + i, count - i, mask, cone);
+    }
+}
+
+#endif // FROXEL_HAS_NEON
+
+// ------------------------------------------------------------------------------------------------
+// AVX2 kernels, 8 lanes, the last froxels (if any) use masked loads and stores
+// ------------------------------------------------------------------------------------------------
+
+#if defined(FROXEL_HAS_AVX)
+
+FROXEL_TARGET_AVX2
+static uint32_t intersectsPlanesAvx2(
+        float const* UTILS_RESTRICT px, float const* UTILS_RESTRICT pz, float4 const& s) {
+    const __m256 sx = _mm256_set1_ps(s.x);
+    const __m256 sz = _mm256_set1_ps(s.z);
+    const __m256 sw = _mm256_set1_ps(s.w);
+    uint32_t hits = 0;
+    for (size_t i = 0; i < KERNEL_WIDTH; i += 8) {
+        const __m256 d = _mm256_add_ps(
+                _mm256_mul_ps(sx, _mm256_loadu_ps(px + i)),
+                _mm256_mul_ps(sz, _mm256_loadu_ps(pz + i)));
+        const __m256 rr = _mm256_sub_ps(sw, _mm256_mul_ps(d, d));
+        hits |= uint32_t(_mm256_movemask_ps(
+                _mm256_cmp_ps(rr, _mm256_setzero_ps(), _CMP_GT_OQ))) << i;
+    }
+    return hits;
+}
+
+FROXEL_TARGET_AVX2
+static void intersectsConeAvx2(LightGroupType* UTILS_RESTRICT froxels,
+        float const* UTILS_RESTRICT x, float const* UTILS_RESTRICT y,
+        float const* UTILS_RESTRICT z, float const* UTILS_RESTRICT r,
+        size_t count, LightGroupType mask, Cone const& cone) {
+    const __m256 px = _mm256_set1_ps(cone.position.x);
+    const __m256 py = _mm256_set1_ps(cone.position.y);
+    const __m256 pz = _mm256_set1_ps(cone.position.z);
+    const __m256 ax = _mm256_set1_ps(cone.axis.x);
+    const __m256 ay = _mm256_set1_ps(cone.axis.y);
+    const __m256 az = _mm256_set1_ps(cone.axis.z);
+    const __m256 invSin = _mm256_set1_ps(cone.invSin);
+    const __m256 cosSqr = _mm256_set1_ps(cone.cosSqr);
+    const __m256i m = _mm256_set1_epi32(int(mask));
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for (size_t i = 0; i < count; i += 8) {
+        const __m256 t = _mm256_mul_ps(_mm256_loadu_ps(r + i), invSin);
+        const __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_sub_ps(px, _mm256_mul_ps(t, ax)));
+        const __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), _mm256_sub_ps(py, _mm256_mul_ps(t, ay)));
+        const __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + i), _mm256_sub_ps(pz, _mm256_mul_ps(t, az)));
+        __m256 e = _mm256_mul_ps(ax, dx);
+        e = _mm256_add_ps(e, _mm256_mul_ps(ay, dy));
+        e = _mm256_add_ps(e, _mm256_mul_ps(az, dz));
+        __m256 dd = _mm256_mul_ps(dx, dx);
+        dd = _mm256_add_ps(dd, _mm256_mul_ps(dy, dy));
+        dd = _mm256_add_ps(dd, _mm256_mul_ps(dz, dz));
+        const __m256 intersect = _mm256_and_ps(
+                _mm256_cmp_ps(_mm256_mul_ps(e, e), _mm256_mul_ps(dd, cosSqr), _CMP_GE_OQ),
+                _mm256_cmp_ps(e, _mm256_setzero_ps(), _CMP_GT_OQ));
+        // froxels past 'count' belong to the next row, leave them alone
+        const __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(int(count - i)), lanes);
+        int* const p = reinterpret_cast<int*>(froxels + i);
+        const __m256i f = _mm256_maskload_epi32(p, valid);
+        _mm256_maskstore_epi32(p, valid,
+                _mm256_or_si256(f, _mm256_and_si256(_mm256_castps_si256(intersect), m)));
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+// AVX-512 kernels, 16 lanes
+// ------------------------------------------------------------------------------------------------
+
+FROXEL_TARGET_AVX512
+static uint32_t intersectsPlanesAvx512(
+        float const* UTILS_RESTRICT px, float const* UTILS_RESTRICT pz, float4 const& s) {
+    static_assert(KERNEL_WIDTH == 16, "the AVX-512 kernels process 16 planes at a time");
+    const __m512 d = _mm512_add_ps(
+            _mm512_mul_ps(_mm512_set1_ps(s.x), _mm512_loadu_ps(px)),
+            _mm512_mul_ps(_mm512_set1_ps(s.z), _mm512_loadu_ps(pz)));
+    const __m512 rr = _mm512_sub_ps(_mm512_set1_ps(s.w), _mm512_mul_ps(d, d));
+    return _mm512_cmp_ps_mask(rr, _mm512_setzero_ps(), _CMP_GT_OQ);
+}
+
+FROXEL_TARGET_AVX512
+static void intersectsConeAvx512(LightGroupType* UTILS_RESTRICT froxels,
+        float const* UTILS_RESTRICT x, float const* UTILS_RESTRICT y,
+        float const* UTILS_RESTRICT z, float const* UTILS_RESTRICT r,
+        size_t count, LightGroupType mask, Cone const& cone) {
+    const __m512 px = _mm512_set1_ps(cone.position.x);
+    const __m512 py = _mm512_set1_ps(cone.position.y);
+    const __m512 pz = _mm512_set1_ps(cone.position.z);
+    const __m512 ax = _mm512_set1_ps(cone.axis.x);
+    const __m512 ay = _mm512_set1_ps(cone.axis.y);
+    const __m512 az = _mm512_set1_ps(cone.axis.z);
+    const __m512 invSin = _mm512_set1_ps(cone.invSin);
+    const __m512 cosSqr = _mm512_set1_ps(cone.cosSqr);
+    const __m512i m = _mm512_set1_epi32(int(mask));
+    for (size_t i = 0; i < count; i += 16) {
+        const __m512 t = _mm512_mul_ps(_mm512_loadu_ps(r + i), invSin);
+        const __m512 dx = _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_sub_ps(px, _mm512_mul_ps(t, ax)));
+        const __m512 dy = _mm512_sub_ps(_mm512_loadu_ps(y + i), _mm512_sub_ps(py, _mm512_mul_ps(t, ay)));
+        const __m512 dz = _mm512_sub_ps(_mm512_loadu_ps(z + i), _mm512_sub_ps(pz, _mm512_mul_ps(t, az)));
+        __m512 e = _mm512_mul_ps(ax, dx);
+        e = _mm512_add_ps(e, _mm512_mul_ps(ay, dy));
+        e = _mm512_add_ps(e, _mm512_mul_ps(az, dz));
+        __m512 dd = _mm512_mul_ps(dx, dx);
+        dd = _mm512_add_ps(dd, _mm512_mul_ps(dy, dy));
+        dd = _mm512_add_ps(dd, _mm512_mul_ps(dz, dz));
+        const __mmask16 intersect = _mm512_mask_cmp_ps_mask(
+                _mm512_cmp_ps_mask(e, _mm512_setzero_ps(), _CMP_GT_OQ),
+                _mm512_mul_ps(e, e), _mm512_mul_ps(dd, cosSqr), _CMP_GE_OQ);
+        // froxels past 'count' belong to the next row, leave them alone
+        const size_t n = count - i;
+        const __mmask16 valid = __mmask16(n >= 16 ? 0xFFFFu : (1u << n) - 1u);
+        const __mmask16 k = valid & intersect;
+        const __m512i f = _mm512_maskz_loadu_epi32(k, froxels + i);
+        _mm512_mask_storeu_epi32(froxels + i, k, _mm512_or_si512(f, m));
+    }
+}
+
+#endif // FROXEL_HAS_AVX
+
+// ------------------------------------------------------------------------------------------------
+// Runtime dispatch
+// ------------------------------------------------------------------------------------------------
+
+static FroxelKernels getFroxelKernels(Culler::Isa isa) noexcept {
+    switch (isa) {
+#if defined(FROXEL_HAS_NEON)
+        case Culler::Isa::NEON:
+            return { intersectsPlanesNeon, intersectsConeNeon };
+#endif
+#if defined(FROXEL_HAS_AVX)
+        case Culler::Isa::AVX2:
+            return { intersectsPlanesAvx2, intersectsConeAvx2 };
+        case Culler::Isa::AVX512:
+            return { intersectsPlanesAvx512, intersectsConeAvx512 };
+#endif
+        default:
+            return { intersectsPlanesGeneric, intersectsConeGeneric };
+    }
+}
+
+// bitmask of the n first planes of a kernel
+static inline uint32_t firstPlanes(size_t n) noexcept {
+    return n >= 32 ? ~0u : (1u << n) - 1u;
+}
+
+// returns the first of the planes [begin, end[ that intersects the sphere, or end
+static inline size_t findFirstPlane(PlanesKernel intersects,
+        float const* px, float const* pz, float4 const& s, size_t begin, size_t end) noexcept {
+    for (size_t i = begin; i < end; i += KERNEL_WIDTH) {
+        const uint32_t hits = intersects(px + i, pz + i, s) & firstPlanes(end - i);
+        if (hits) {
+            return i + utils::ctz(hits);
+        }
+    }
+    return end;
+}
+
+// returns 1 past the last of the planes [begin, end[ that intersects the sphere, or begin
+static inline size_t findLastPlane(PlanesKernel intersects,
+        float const* px, float const* pz, float4 const& s, size_t begin, size_t end) noexcept {
+    for (size_t i = end; i > begin;) {
+        const size_t first = i - std::min(i - begin, KERNEL_WIDTH);
+        const uint32_t hits = intersects(px + first, pz + first, s) & firstPlanes(i - first);
+        if (hits) {
+            return first + 32 - utils::clz(hits);
+        }
+        i = first;
+    }
+    return begin;
 }
 
 static inline float2 project(mat4f const& p, float3 const& v) noexcept {
@@ -816,11 +1268,16 @@ void Froxelizer::froxelizePointAndSpotLight(
     assert(z0 <= z1);
 #endif
 
+    const FroxelKernels kernels = getFroxelKernels(mIsa);
+    const Cone cone = { light.position, light.axis, light.invSin, light.cosSqr };
+    const bool isSpot = light.invSin != std::numeric_limits<float>::infinity();
+    const LightGroupType mask = LightGroupType(1) << bit;
+
     const size_t zcenter = findSliceZ(s.z);
-    float4 const * const UTILS_RESTRICT planesX = mPlanesX;
     float4 const * const UTILS_RESTRICT planesY = mPlanesY;
     float const * const UTILS_RESTRICT planesZ = mDistancesZ;
-    float4 const * const UTILS_RESTRICT boundingSpheres = mBoundingSpheres;
+    float const * const UTILS_RESTRICT planesXx = mPlanesXx;
+    float const * const UTILS_RESTRICT planesXz = mPlanesXz;
     for (size_t iz = z0 ; iz <= z1; ++iz) {
         float4 cz(s);
         if (UTILS_LIKELY(iz != zcenter)) {
@@ -842,23 +1299,14 @@ void Froxelizer::froxelizePointAndSpotLight(
                     cy = spherePlaneIntersection(cz, plane.y, plane.z);
                 }
                 if (cy.w > 0) { // intersection of light with this horizontal plane
-                    size_t bx, ex; // horizontal begin/end indices
-                    // find the begin index (left side)
-                    for (bx = x0; bx <= xcenter; ++bx) {
-                        if (spherePlaneDistanceSquared(cy, planesX[bx].x, planesX[bx].z) > 0) {
-                            // intersection
-                            break;
-                        }
-                    }
+                    // find the begin index (left side), the planes are tested KERNEL_WIDTH
+                    // at a time
+                    const size_t bx = findFirstPlane(kernels.planes, planesXx, planesXz, cy,
+                            x0, std::max(x0, xcenter + 1));
 
                     // find the end index (right side), x1 is past the end
-                    for (ex = x1; --ex > xcenter;) {
-                        if (spherePlaneDistanceSquared(cy, planesX[ex].x, planesX[ex].z) > 0) {
-                            // intersection
-                            break;
-                        }
-                    }
-                    ++ex;
+                    const size_t ex = findLastPlane(kernels.planes, planesXx, planesXz, cy,
+                            std::min(xcenter + 1, x1), x1);
 
                     if (UTILS_UNLIKELY(bx >= ex)) {
                         continue;
@@ -867,20 +1315,19 @@ void Froxelizer::froxelizePointAndSpotLight(
                     assert(bx < mFroxelCountX && ex <= mFroxelCountX);
 
                     // The first entry reserved for type of light, i.e. point/spot
-                    size_t fi = getFroxelIndex(bx, iy, iz) + 1;
-                    if (light.invSin != std::numeric_limits<float>::infinity()) {
+                    const size_t fi = getFroxelIndex(bx, iy, iz);
+                    LightGroupType* const UTILS_RESTRICT froxels = froxelThread.data() + fi + 1;
+                    if (isSpot) {
                         // This is a spotlight (common case)
-                        // this loops gets vectorized (on arm64) w/ clang
-                        while (bx++ != ex) {
-                            // see if this froxel intersects the cone
-                            bool intersect = sphereConeIntersectionFast(boundingSpheres[fi - 1],
-                                    light.position, light.axis, light.invSin, light.cosSqr);
-                            froxelThread[fi++] |= LightGroupType(intersect) << bit;
-                        }
+                        // see which froxels intersect the cone
+                        kernels.cone(froxels,
+                                mBoundingSpheresX + fi, mBoundingSpheresY + fi,
+                                mBoundingSpheresZ + fi, mBoundingSpheresR + fi,
+                                ex - bx, mask, cone);
                     } else {
                         // this loops gets vectorized (on arm64) w/ clang
-                        while (bx++ != ex) {
-                            froxelThread[fi++] |= LightGroupType(1) << bit;
+                        for (size_t i = 0, c = ex - bx; i < c; i++) {
+                            froxels[i] |= mask;
                         }
                     }
                 }
@@ -20,39 +20,41 @@
 
 #include <filament/EngineEnums.h>
 
-#include <private/filament/UibGenerator.h>
-
 namespace filament {
 
 using namespace driver;
 
 namespace details {
 
-GpuLightBuffer::GpuLightBuffer(FEngine& engine) noexcept
-        : mLightsUb(UibGenerator::getLightsUib()) {
-    DriverApi& driverApi = engine.getDriverApi();
-    mLightUbh = driverApi.createUniformBuffer(mLightsUb.getSize());
-    driverApi.bindUniforms(BindingPoints::LIGHTS, mLightUbh);
+static constexpr size_t LIGHT_BUFFER_HEIGHT =
+        (CONFIG_MAX_LIGHT_COUNT + GpuLightBuffer::LIGHTS_PER_ROW_MASK) / GpuLightBuffer::LIGHTS_PER_ROW;
+
+// ES3.0 only guarantees 2048 texels textures
+static_assert(LIGHT_BUFFER_HEIGHT <= 2048, "too many lights for the lights buffer");
+
+GpuLightBuffer::GpuLightBuffer(FEngine& engine) noexcept {
+    // each light is stored as 4 float4 (i.e. a mat4)
+    static_assert(sizeof(LightParameters) == 4 * sizeof(math::float4), "LightParameters must be 64 bytes");
+    mLightsBuffer = GPUBuffer(engine.getDriverApi(), { GPUBuffer::ElementType::FLOAT, 4 },
+            LIGHTS_PER_ROW * 4, LIGHT_BUFFER_HEIGHT);
 }
 
 GpuLightBuffer::~GpuLightBuffer() noexcept = default;
 
 void GpuLightBuffer::terminate(FEngine& engine) {
     DriverApi& driverApi = engine.getDriverApi();
-    driverApi.destroyUniformBuffer(mLightUbh);
+    mLightsBuffer.terminate(driverApi);
 }
 
-void GpuLightBuffer::commit(FEngine& engine) noexcept {
-    if (UTILS_UNLIKELY(mLightsUb.isDirty())) {
-        commitSlow(engine);
-    }
-    engine.getDriverApi().bindUniforms(BindingPoints::LIGHTS, mLightUbh);
+void GpuLightBuffer::prepare(DriverApi& driverApi, size_t count) noexcept {
+    assert(count <= CONFIG_MAX_LIGHT_COUNT);
+    // the buffer is uploaded by whole rows
+    count = (count + LIGHTS_PER_ROW_MASK) & ~LIGHTS_PER_ROW_MASK;
+    mLights = { driverApi.allocatePod<LightParameters>(count, utils::CACHELINE_SIZE), count };
 }
 
-void GpuLightBuffer::commitSlow(FEngine& engine) noexcept {
-    DriverApi& driverApi = engine.getDriverApi();
-    driverApi.updateUniformBuffer(mLightUbh, UniformBuffer(mLightsUb));
-    mLightsUb.clean();
+void GpuLightBuffer::commit(DriverApi& driverApi) noexcept {
+    mLightsBuffer.commit(driverApi, mLights);
 }
 
 } // namespace details
@@ -79,6 +79,16 @@ Material* Material::Builder::build(Engine& engine) {
 
     assert(upcast(engine).getBackend() != Backend::DEFAULT && "Default backend has not been resolved.");
 
+    // the binding points and sampler bindings of other versions don't match the engine's
+    uint32_t version = 0;
+    materialParser->getMaterialVersion(&version);
+    if (!ASSERT_POSTCONDITION_NON_FATAL(version == MATERIAL_VERSION,
+            "the material version is %u, but this engine needs version %u",
+            version, MATERIAL_VERSION)) {
+        delete materialParser;
+        return nullptr;
+    }
+
     uint32_t v;
     materialParser->getShaderModels(&v);
     utils::bitset32 shaderModels;
@@ -299,7 +309,6 @@ Handle<HwProgram> FMaterial::getProgramSlow(uint8_t variantKey) const noexcept {
             .withFragmentShader(fs)
             .withSamplerBindings(&mSamplerBindings)
             .addUniformBlock(BindingPoints::PER_VIEW, &UibGenerator::getPerViewUib())
-            .addUniformBlock(BindingPoints::LIGHTS, &UibGenerator::getLightsUib())
             .addUniformBlock(BindingPoints::PER_RENDERABLE, &UibGenerator::getPerRenderableUib())
             .addUniformBlock(BindingPoints::PER_MATERIAL_INSTANCE, &mUniformInterfaceBlock)
             .addSamplerBlock(BindingPoints::PER_VIEW, &SibGenerator::getPerViewSib())
@@ -309,6 +318,10 @@ Handle<HwProgram> FMaterial::getProgramSlow(uint8_t variantKey) const noexcept {
         pb.addUniformBlock(BindingPoints::PER_RENDERABLE_BONES, &UibGenerator::getPerRenderableBonesUib());
     }
 
+    if (Variant(variantKey).hasInstancing()) {
+        pb.addUniformBlock(BindingPoints::PER_RENDERABLE_INSTANCES, &UibGenerator::getPerRenderableInstancesUib());
+    }
+
     auto program = mEngine.getDriverApi().createProgram(std::move(pb));
     assert(program);
 
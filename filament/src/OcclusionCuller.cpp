@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "details/OcclusionCuller.h"
+
+#include <utils/JobSystem.h>
+
+#include <math/vec4.h>
+
+#include <algorithm>
+#include <limits>
+
+#include <math.h>
+
+using namespace math;
+using namespace utils;
+
+namespace filament {
+namespace details {
+
+static_assert(OcclusionCuller::WIDTH % 8 == 0, "WIDTH must be a multiple of 8");
+static_assert(OcclusionCuller::HEIGHT % OcclusionCuller::BAND_HEIGHT == 0,
+        "HEIGHT must be a multiple of BAND_HEIGHT");
+
+// depth of the cleared buffer, farther than anything
+static constexpr float FAR_DEPTH = std::numeric_limits<float>::max();
+
+OcclusionCuller::OcclusionCuller() = default;
+
+void OcclusionCuller::rasterize(JobSystem& js, mat4f const& viewProjection,
+        Mesh const* meshes, size_t count) noexcept {
+    mViewProjection = viewProjection;
+    // the depth buffer is only allocated the first time it's used
+    mDepth.resize(WIDTH * HEIGHT);
+    std::fill(mDepth.begin(), mDepth.end(), FAR_DEPTH);
+
+    // each mesh gets its own range of triangles, so they can be set-up in parallel
+    mMeshOffsets.resize(count + 1);
+    size_t triangleCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        mMeshOffsets[i] = triangleCount;
+        triangleCount += meshes[i].indexCount / 3;
+    }
+    mMeshOffsets[count] = triangleCount;
+    mTriangles.resize(triangleCount);
+
+    // transform and set-up the triangles (this runs on multiple threads)
+    auto setupJob = [this, meshes, &viewProjection](uint32_t index, uint32_t c) {
+        for (size_t i = index, e = index + c; i < e; i++) {
+            Mesh const& mesh = meshes[i];
+            const mat4f mvp = viewProjection * mesh.transform;
+            Triangle* const UTILS_RESTRICT triangles = mTriangles.data() + mMeshOffsets[i];
+            for (size_t t = 0, n = mesh.indexCount / 3; t < n; t++) {
+                float4 clip[3];
+                for (size_t k = 0; k < 3; k++) {
+                    clip[k] = mvp * float4{ mesh.vertices[mesh.indices[t * 3 + k]], 1 };
+                }
+                if (!setup(triangles[t], clip)) {
+                    // this triangle doesn't cover any pixel
+                    triangles[t].minY = 1;
+                    triangles[t].maxY = 0;
+                }
+            }
+        }
+    };
+    auto job = jobs::parallel_for(js, nullptr, 0, uint32_t(count),
+            std::ref(setupJob), jobs::CountSplitter<1, 8>());
+    js.runAndWait(job);
+
+    auto last = std::remove_if(mTriangles.begin(), mTriangles.end(),
+            [](Triangle const& triangle) { return triangle.minY > triangle.maxY; });
+    mTriangleCount = size_t(last - mTriangles.begin());
+    if (!mTriangleCount) {
+        return;
+    }
+
+    // rasterize the bands (this runs on multiple threads)
+    auto rasterizeJob = [this](uint32_t index, uint32_t c) {
+        for (size_t band = index, e = index + c; band < e; band++) {
+            rasterizeBand(band * BAND_HEIGHT, (band + 1) * BAND_HEIGHT);
+        }
+    };
+    job = jobs::parallel_for(js, nullptr, 0, uint32_t(HEIGHT / BAND_HEIGHT),
+            std::ref(rasterizeJob), jobs::CountSplitter<1, 8>());
+    js.runAndWait(job);
+}
+
+bool OcclusionCuller::setup(Triangle& triangle, float4 const* clip) noexcept {
+    float2 p[3];
+    float depth = std::numeric_limits<float>::lowest();
+    for (size_t k = 0; k < 3; k++) {
+        float4 const& c = clip[k];
+        // triangles crossing the near plane are dropped, which is conservative
+        if (!(c.w > 0) || c.z < -c.w) {
+            return false;
+        }
+        const float3 ndc = c.xyz / c.w;
+        p[k] = float2{ (ndc.x * 0.5f + 0.5f) * WIDTH, (ndc.y * 0.5f + 0.5f) * HEIGHT };
+        depth = std::max(depth, ndc.z);
+    }
+
+    // occluders can have any winding, make it counter-clockwise
+    const float2 e1 = p[1] - p[0];
+    const float2 e2 = p[2] - p[0];
+    const float area = e1.x * e2.y - e1.y * e2.x;
+    if (!(area != 0)) {
+        return false;
+    }
+    if (area < 0) {
+        std::swap(p[1], p[2]);
+    }
+
+    // pixels whose center may be inside the triangle
+    const float2 lo = min(p[0], min(p[1], p[2]));
+    const float2 hi = max(p[0], max(p[1], p[2]));
+    const float minX = std::max(0.0f, std::ceil(lo.x - 0.5f));
+    const float minY = std::max(0.0f, std::ceil(lo.y - 0.5f));
+    const float maxX = std::min(float(WIDTH - 1), std::floor(hi.x - 0.5f));
+    const float maxY = std::min(float(HEIGHT - 1), std::floor(hi.y - 0.5f));
+    if (minX > maxX || minY > maxY) {
+        return false;
+    }
+
+    triangle.v[0] = p[0];
+    triangle.v[1] = p[1];
+    triangle.v[2] = p[2];
+    triangle.depth = depth;
+    triangle.minX = int16_t(minX);
+    triangle.minY = int16_t(minY);
+    triangle.maxX = int16_t(maxX);
+    triangle.maxY = int16_t(maxY);
+    return true;
+}
+
+void OcclusionCuller::rasterizeBand(size_t firstRow, size_t lastRow) noexcept {
+    float* const UTILS_RESTRICT buffer = mDepth.data();
+    Triangle const* const UTILS_RESTRICT triangles = mTriangles.data();
+    for (size_t t = 0, n = mTriangleCount; t < n; t++) {
+        Triangle const& triangle = triangles[t];
+        const size_t y0 = std::max(size_t(triangle.minY), firstRow);
+        const size_t y1 = std::min(size_t(triangle.maxY) + 1, lastRow);
+        if (y0 >= y1) {
+            continue;
+        }
+
+        // edge functions a.x + b.y + c, positive inside the triangle
+        float a[3], b[3], c[3];
+        for (size_t k = 0; k < 3; k++) {
+            const float2 p = triangle.v[k];
+            const float2 q = triangle.v[(k + 1) % 3];
+            a[k] = p.y - q.y;
+            b[k] = q.x - p.x;
+            c[k] = -(a[k] * p.x + b[k] * p.y);
+        }
+
+        const float z = triangle.depth;
+        const size_t x0 = size_t(triangle.minX);
+        const size_t x1 = size_t(triangle.maxX) + 1;
+        for (size_t y = y0; y < y1; y++) {
+            const float py = y + 0.5f;
+            const float r0 = b[0] * py + c[0];
+            const float r1 = b[1] * py + c[1];
+            const float r2 = b[2] * py + c[2];
+            float* const UTILS_RESTRICT row = buffer + y * WIDTH;
+            // this is vectorized
+            for (size_t x = x0; x < x1; x++) {
+                const float px = x + 0.5f;
+                const bool inside = (a[0] * px + r0 >= 0) &
+                                    (a[1] * px + r1 >= 0) &
+                                    (a[2] * px + r2 >= 0);
+                row[x] = inside ? std::min(row[x], z) : row[x];
+            }
+        }
+    }
+}
+
+void OcclusionCuller::cull(JobSystem& js, Culler::result_type* results,
+        float3 const* center, float3 const* extent, size_t count, size_t bit) const noexcept {
+    if (!mTriangleCount) {
+        return;
+    }
+
+    const Culler::result_type mask = Culler::result_type(1u << bit);
+
+    // occlusion job (this runs on multiple threads)
+    auto functor = [this, results, center, extent, mask](uint32_t index, uint32_t c) {
+        for (size_t i = index, e = index + c; i < e; i++) {
+            if ((results[i] & mask) && isOccluded({ center[i], extent[i] })) {
+                results[i] &= ~mask;
+            }
+        }
+    };
+
+    auto job = jobs::parallel_for(js, nullptr, 0, uint32_t(count),
+            std::ref(functor), jobs::CountSplitter<Culler::MODULO * Culler::MIN_LOOP_COUNT_HINT, 8>());
+    js.runAndWait(job);
+}
+
+bool OcclusionCuller::isOccluded(Box const& box) const noexcept {
+    if (!mTriangleCount) {
+        return false;
+    }
+
+    float3 lo = std::numeric_limits<float>::max();
+    float3 hi = std::numeric_limits<float>::lowest();
+    for (size_t k = 0; k < 8; k++) {
+        const float3 corner = box.center + box.halfExtent * float3{
+                (k & 1) ? 1 : -1, (k & 2) ? 1 : -1, (k & 4) ? 1 : -1 };
+        const float4 c = mViewProjection * float4{ corner, 1 };
+        // boxes crossing the near plane are always visible
+        if (!(c.w > 0) || c.z < -c.w) {
+            return false;
+        }
+        const float3 ndc = c.xyz / c.w;
+        lo = min(lo, ndc);
+        hi = max(hi, ndc);
+    }
+
+    if (hi.x < -1 || lo.x > 1 || hi.y < -1 || lo.y > 1) {
+        // not on screen, this is the frustum culling's business
+        return false;
+    }
+
+    // All the pixels touched by the box's screen-space bounds must be closer than the box.
+    // Occluders only cover the pixels whose center they contain, so a pixel can be written
+    // even though the occluder doesn't cover all of it. Testing one more pixel on each side
+    // guarantees that a part of the box that sticks out of an occluder edge reaches a pixel
+    // whose center isn't covered.
+    const float fx0 = std::floor((lo.x * 0.5f + 0.5f) * WIDTH) - 1;
+    const float fy0 = std::floor((lo.y * 0.5f + 0.5f) * HEIGHT) - 1;
+    const float fx1 = std::floor((hi.x * 0.5f + 0.5f) * WIDTH) + 1;
+    const float fy1 = std::floor((hi.y * 0.5f + 0.5f) * HEIGHT) + 1;
+    const size_t x0 = size_t(std::max(0.0f, fx0));
+    const size_t y0 = size_t(std::max(0.0f, fy0));
+    const size_t x1 = size_t(std::min(float(WIDTH - 1), fx1));
+    const size_t y1 = size_t(std::min(float(HEIGHT - 1), fy1));
+    const float z = lo.z;
+    float const* const UTILS_RESTRICT buffer = mDepth.data();
+    for (size_t y = y0; y <= y1; y++) {
+        float const* const UTILS_RESTRICT row = buffer + y * WIDTH;
+        // this is vectorized
+        bool visible = false;
+        for (size_t x = x0; x <= x1; x++) {
+            visible |= row[x] >= z;
+        }
+        if (visible) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace details
+} // namespace filament
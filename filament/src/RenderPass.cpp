@@ -27,8 +27,12 @@
 #include "details/Renderer.h"
 
 #include <utils/JobSystem.h>
+#include <utils/Panic.h>
+#include <utils/RadixSort.h>
 #include <utils/Systrace.h>
 
+#include <algorithm>
+
 using namespace utils;
 using namespace math;
 
@@ -43,11 +47,12 @@ RenderPass::~RenderPass() noexcept = default;
 UTILS_ALWAYS_INLINE // this allows the compiler to devirtualize some calls
 inline              // this removes the code from the compilation unit
 void RenderPass::render(
-        FEngine& engine, JobSystem& js,
+        FEngine& engine, JobSystem& js, ArenaScope& arena,
         FScene::RenderableSoa const& soa, Range<uint32_t> vr,
         uint32_t commandTypeFlags, RenderFlags renderFlags,
         const CameraInfo& camera, Viewport const& viewport,
-        GrowingSlice<Command>& commands) noexcept {
+        jobs::AdaptiveSplitter& splitter,
+        GrowingSlice<Command>& commands, CommandCache* cache) noexcept {
 
     SYSTRACE_CONTEXT();
 
@@ -57,40 +62,46 @@ void RenderPass::render(
     // up-to-date summed primitive counts needed for generateCommands()
     updateSummedPrimitiveCounts(const_cast<FScene::RenderableSoa&>(soa), vr);
 
+    // we extract camera position/forward outside of the loop, because these are not cheap.
+    const float3 cameraPosition(camera.getPosition());
+    const float3 cameraForwardVector(camera.getForwardVector());
+
     // compute how much maximum storage we need for this pass
     uint32_t growBy = FScene::getPrimitiveCount(soa, vr.last);
     // double the color pass for transparents that need to render twice
     const bool colorPass  = bool(commandTypeFlags & CommandTypeFlags::COLOR);
     const bool depthPass  = bool(commandTypeFlags & (CommandTypeFlags::DEPTH | CommandTypeFlags::SHADOW));
     growBy *= uint32_t(colorPass * 2 + depthPass);
-    Command* const curr = commands.grow(growBy);
 
-    // we extract camera position/forward outside of the loop, because these are not cheap.
-    const float3 cameraPosition(camera.getPosition());
-    const float3 cameraForwardVector(camera.getForwardVector());
-    auto work = [commandTypeFlags, curr, &soa, renderFlags, cameraPosition, cameraForwardVector]
-            (uint32_t startIndex, uint32_t indexCount) {
-        RenderPass::generateCommands(commandTypeFlags, curr,
-                soa, { startIndex, startIndex + indexCount }, renderFlags,
-                cameraPosition, cameraForwardVector);
-    };
+    // this must happen before any nested ArenaScope is created, plus one for the "eof" command
+    reserveCommands(arena, commands, growBy + 1);
 
-    auto jobCommandsParallel = jobs::parallel_for(js, nullptr, vr.first, (uint32_t)vr.size(),
-            std::cref(work), jobs::CountSplitter<JOBS_PARALLEL_FOR_COMMANDS_COUNT, 8>());
+    if (!cache || !generateCachedCommands(js, arena, *cache, commandTypeFlags,
+            soa, vr, renderFlags, cameraPosition, cameraForwardVector, commands)) {
+        Command* const curr = commands.grow(growBy);
 
-    { // scope for systrace
-        SYSTRACE_NAME("jobCommandsParallel");
-        js.runAndWait(jobCommandsParallel);
-    }
+        auto work = [commandTypeFlags, curr, &soa, renderFlags, cameraPosition, cameraForwardVector]
+                (uint32_t startIndex, uint32_t indexCount) {
+            RenderPass::generateCommands(commandTypeFlags, curr,
+                    soa, { startIndex, startIndex + indexCount }, renderFlags,
+                    cameraPosition, cameraForwardVector);
+        };
 
-    // always add an "eof" command
-    // "eof" command. these commands are guaranteed to be sorted last in the
-    // command buffer.
-    commands.grow(1)->key = uint64_t(Pass::SENTINEL);
+        auto jobCommandsParallel = jobs::parallel_for(js, nullptr, vr.first, (uint32_t)vr.size(),
+                std::cref(work), splitter);
 
-    { // sort all commands
-        SYSTRACE_NAME("sort commands");
-        std::sort(commands.begin(), commands.end());
+        { // scope for systrace
+            SYSTRACE_NAME("jobCommandsParallel");
+            js.runAndWait(jobCommandsParallel);
+        }
+
+        // always add an "eof" command
+        // "eof" command. these commands are guaranteed to be sorted last in the
+        // command buffer.
+        commands.grow(1)->key = uint64_t(Pass::SENTINEL);
+
+        // sort all commands
+        RenderPass::sortCommands(js, arena, commands);
     }
 
     // Take care not to upload data within the render pass (synchronize can commit froxel data)
@@ -98,7 +109,7 @@ void RenderPass::render(
     beginRenderPass(driver, viewport, camera);
 
     // Now, execute all commands
-    RenderPass::recordDriverCommands(driver, commands);
+    RenderPass::recordDriverCommands(engine, js, arena, driver, commands);
 
     endRenderPass(driver, viewport);
 
@@ -108,17 +119,422 @@ void RenderPass::render(
     engine.flush();
 }
 
+UTILS_NOINLINE // no need to be inlined
+void RenderPass::reserveCommands(ArenaScope& arena, GrowingSlice<Command>& commands,
+        size_t count) noexcept {
+    if (UTILS_LIKELY(commands.remain() >= count)) {
+        return;
+    }
+    // the old buffer is only reclaimed at the end of the frame, so at least double the size
+    const size_t size = commands.size();
+    const size_t capacity = std::max(size + count, size_t(commands.capacity()) * 2);
+    Command* const data = arena.allocate<Command>(capacity, CACHELINE_SIZE);
+    ASSERT_POSTCONDITION(data, "Out of memory for %u commands", unsigned(capacity));
+    std::copy_n(commands.cbegin(), size, data);
+    commands.set(data, uint32_t(capacity));
+    commands.resize(uint32_t(size));
+}
+
+UTILS_NOINLINE // no need to be inlined
+bool RenderPass::generateCachedCommands(JobSystem& js, ArenaScope& arena,
+        CommandCache& cache, uint32_t commandTypeFlags,
+        FScene::RenderableSoa const& soa, Range<uint32_t> vr, RenderFlags renderFlags,
+        float3 cameraPosition, float3 cameraForward,
+        GrowingSlice<Command>& commands) noexcept {
+    SYSTRACE_CALL();
+
+    const bool colorPass  = bool(commandTypeFlags & CommandTypeFlags::COLOR);
+    const bool depthPass  = bool(commandTypeFlags & (CommandTypeFlags::DEPTH | CommandTypeFlags::SHADOW));
+    const uint32_t commandsPerPrimitive = uint32_t(colorPass * 2 + depthPass);
+
+    // all this scratch memory is only needed until the end of this function
+    ArenaScope scope(arena.getAllocator());
+    const size_t visibleCount = vr.size();
+    uint32_t* const changed = scope.allocate<uint32_t>(visibleCount + 1);
+    uint32_t* const offsets = scope.allocate<uint32_t>(visibleCount + 1);
+    if (UTILS_UNLIKELY(!changed || !offsets)) {
+        cache.mValid = false;
+        return false;
+    }
+
+    // find the renderables whose commands changed since the last frame
+    auto const* const UTILS_RESTRICT soaInstance = soa.data<FScene::RENDERABLE_INSTANCE>();
+    auto const* const UTILS_RESTRICT soaPrimitives = soa.data<FScene::PRIMITIVES>();
+    const uint32_t frame = ++cache.mFrame;
+    size_t changedCount = 0;
+    for (uint32_t i : vr) {
+        const uint32_t instance = soaInstance[i];
+        if (instance >= cache.mStates.size()) {
+            cache.mStates.resize(instance + 1);
+        }
+        CommandCache::State& state = cache.mStates[instance];
+        const uint64_t hash = getCommandsHash(soa, i, cameraPosition, cameraForward);
+        state.unchanged = state.frame == frame - 1 && state.hash == hash;
+        state.hash = hash;
+        state.frame = frame;
+        if (!state.unchanged) {
+            changed[changedCount++] = i;
+        }
+    }
+
+    const bool rebuild = !cache.mValid ||
+            cache.mCommandTypeFlags != commandTypeFlags || cache.mRenderFlags != renderFlags ||
+            changedCount > visibleCount * CommandCache::REBUILD_RATIO;
+    if (rebuild) {
+        // the cached commands are not used at all
+        changedCount = 0;
+        for (uint32_t i : vr) {
+            changed[changedCount++] = i;
+        }
+    }
+
+    // where the commands of each changed renderable go
+    uint32_t count = 0;
+    for (size_t k = 0; k < changedCount; k++) {
+        offsets[k] = count;
+        count += uint32_t(soaPrimitives[changed[k]].size()) * commandsPerPrimitive;
+    }
+    offsets[changedCount] = count;
+
+    Command* const generated = scope.allocate<Command>(count + 1, CACHELINE_SIZE);
+    uint32_t* const owners = scope.allocate<uint32_t>(count + 1);
+    RadixSort::Item* const items = scope.allocate<RadixSort::Item>(count * 2 + 1, CACHELINE_SIZE);
+    if (UTILS_UNLIKELY(!generated || !owners || !items)) {
+        cache.mValid = false;
+        return false;
+    }
+
+    // generate the commands of the changed renderables (this runs on multiple threads)
+    auto work = [commandTypeFlags, generated, owners, changed, offsets, soaInstance,
+            &soa, renderFlags, cameraPosition, cameraForward](uint32_t index, uint32_t c) {
+        for (uint32_t k = index, e = index + c; k < e;) {
+            // consecutive renderables are generated together
+            uint32_t n = k + 1;
+            while (n < e && changed[n] == changed[n - 1] + 1) {
+                n++;
+            }
+            RenderPass::generateRangeCommands(commandTypeFlags, generated + offsets[k],
+                    soa, { changed[k], changed[n - 1] + 1 }, renderFlags,
+                    cameraPosition, cameraForward);
+            for (; k < n; k++) {
+                std::fill(owners + offsets[k], owners + offsets[k + 1],
+                        uint32_t(soaInstance[changed[k]]));
+            }
+        }
+    };
+
+    auto job = jobs::parallel_for(js, nullptr, 0, uint32_t(changedCount), std::cref(work),
+            cache.mSplitter);
+    js.runAndWait(job);
+
+    // sort the new commands
+    for (uint32_t i = 0; i < count; i++) {
+        items[i] = { generated[i].key, i };
+    }
+    RadixSort::Item const* sorted = items;
+    if (count < RADIX_SORT_MIN_COMMANDS) {
+        std::sort(items, items + count,
+                [](RadixSort::Item const& lhs, RadixSort::Item const& rhs) {
+                    return lhs.key < rhs.key;
+                });
+    } else {
+        sorted = RadixSort::sort(js, items, items + count, count);
+    }
+
+    // cancelled commands are sorted last, we don't keep them
+    const size_t newCount = size_t(std::partition_point(sorted, sorted + count,
+            [](RadixSort::Item const& item) { return item.key != uint64_t(Pass::SENTINEL); })
+                    - sorted);
+
+    // merge them with the cached commands of the renderables that didn't change
+    std::vector<Command>& next = cache.mNextCommands;
+    std::vector<uint32_t>& nextOwners = cache.mNextOwners;
+    Command const* const UTILS_RESTRICT cached = cache.mCommands.data();
+    uint32_t const* const UTILS_RESTRICT cachedOwners = cache.mOwners.data();
+    CommandCache::State const* const UTILS_RESTRICT states = cache.mStates.data();
+    const size_t cachedCount = rebuild ? 0 : cache.mCommands.size();
+    next.clear();
+    nextOwners.clear();
+    next.reserve(cachedCount + newCount);
+    nextOwners.reserve(cachedCount + newCount);
+    size_t a = 0, b = 0;
+    while (a < cachedCount || b < newCount) {
+        if (a < cachedCount) {
+            // skip the renderables that changed or are not visible anymore
+            CommandCache::State const& state = states[cachedOwners[a]];
+            if (!(state.frame == frame && state.unchanged)) {
+                a++;
+                continue;
+            }
+        }
+        if (b == newCount || (a < cachedCount && cached[a].key <= sorted[b].key)) {
+            next.push_back(cached[a]);
+            nextOwners.push_back(cachedOwners[a]);
+            a++;
+        } else {
+            next.push_back(generated[sorted[b].value]);
+            nextOwners.push_back(owners[sorted[b].value]);
+            b++;
+        }
+    }
+    std::swap(cache.mCommands, next);
+    std::swap(cache.mOwners, nextOwners);
+
+    cache.mValid = true;
+    cache.mCommandTypeFlags = commandTypeFlags;
+    cache.mRenderFlags = renderFlags;
+    if (rebuild) {
+        cache.mRebuildCount++;
+    } else {
+        cache.mPatchCount++;
+    }
+
+    // copy the commands, followed by the "eof" command
+    const size_t n = cache.mCommands.size();
+    Command* const curr = commands.grow(uint32_t(n + 1));
+    std::copy_n(cache.mCommands.data(), n, curr);
+    curr[n].key = uint64_t(Pass::SENTINEL);
+    return true;
+}
+
+uint64_t RenderPass::getCommandsHash(FScene::RenderableSoa const& soa, uint32_t i,
+        float3 cameraPosition, float3 cameraForward) noexcept {
+    auto mix = [](uint64_t h, uint64_t v) {
+        h = (h ^ v) * 0x9E3779B97F4A7C15llu;
+        return h ^ (h >> 32);
+    };
+
+    // this must match the distance computed in generateCommandsImpl()
+    float distance = dot(soa.elementAt<FScene::WORLD_AABB_CENTER>(i), cameraForward) -
+            dot(cameraPosition, cameraForward);
+    distance = -distance;
+    const uint32_t distanceBits = reinterpret_cast<uint32_t&>(distance);
+
+    FRenderableManager::Visibility const& visibility = soa.elementAt<FScene::VISIBILITY_STATE>(i);
+    uint64_t h = mix(0, soa.elementAt<FScene::UBH>(i).getId() |
+            uint64_t(soa.elementAt<FScene::BONES_UBH>(i).getId()) << 32);
+    h = mix(h, soa.elementAt<FScene::INSTANCES_UBH>(i).getId() |
+            uint64_t(soa.elementAt<FScene::INSTANCE_COUNT>(i)) << 32);
+    h = mix(h, uint64_t(visibility.priority) |
+            uint64_t(visibility.castShadows) << 3 |
+            uint64_t(visibility.receiveShadows) << 4 |
+            uint64_t(visibility.skinning) << 5);
+    // the depth bucket, see Z_BUCKET_MASK
+    h = mix(h, distanceBits >> 22);
+
+    bool hasBlending = false;
+    Slice<FRenderPrimitive> const& primitives = soa.elementAt<FScene::PRIMITIVES>(i);
+    h = mix(h, primitives.size());
+    for (auto const& primitive : primitives) {
+        FMaterialInstance const* const mi = primitive.getMaterialInstance();
+        h = mix(h, uintptr_t(mi));
+        h = mix(h, primitive.getHwHandle().getId() |
+                uint64_t(primitive.getBlendOrder()) << 32 |
+                uint64_t(primitive.getPrimitiveType()) << 48);
+        hasBlending |= mi->getMaterial()->getRasterState().hasBlending();
+    }
+
+    // blended commands are sorted by their exact distance
+    if (hasBlending) {
+        h = mix(h, distanceBits);
+    }
+    return h;
+}
+
+void RenderPass::CommandCache::clear() noexcept {
+    mCommands.clear();
+    mOwners.clear();
+    mNextCommands.clear();
+    mNextOwners.clear();
+    mStates.clear();
+    mFrame = 0;
+    mValid = false;
+}
+
+UTILS_NOINLINE // no need to be inlined
+void RenderPass::sortCommands(JobSystem& js, ArenaScope& arena,
+        Slice<Command>& commands) noexcept {
+    SYSTRACE_CALL();
+
+    const size_t count = commands.size();
+    if (count < RADIX_SORT_MIN_COMMANDS) {
+        std::sort(commands.begin(), commands.end());
+        return;
+    }
+
+    // we sort (key, index) pairs instead of moving the commands around on each pass,
+    // this scratch memory is only needed until the end of this function.
+    ArenaScope scope(arena.getAllocator());
+    RadixSort::Item* const items = scope.allocate<RadixSort::Item>(count * 2, CACHELINE_SIZE);
+    if (UTILS_UNLIKELY(!items)) {
+        std::sort(commands.begin(), commands.end());
+        return;
+    }
+
+    Command* const UTILS_RESTRICT data = commands.begin();
+    for (size_t i = 0; i < count; i++) {
+        items[i] = { data[i].key, uint32_t(i) };
+    }
+
+    RadixSort::Item* const UTILS_RESTRICT sorted = RadixSort::sort(js, items, items + count, count);
+
+    // Apply the permutation in place, one cycle at a time: data[i] must receive the command
+    // that was at sorted[i].value. Positions that are done are marked by pointing to themselves.
+    for (size_t i = 0; i < count; i++) {
+        if (sorted[i].value == i) {
+            continue;
+        }
+        const Command temp = data[i];
+        size_t j = i;
+        for (;;) {
+            const size_t k = sorted[j].value;
+            sorted[j].value = uint32_t(j);
+            if (k == i) {
+                break;
+            }
+            data[j] = data[k];
+            j = k;
+        }
+        data[j] = temp;
+    }
+}
+
+// the most driver commands' space a Command can take, see recordDriverCommands() below
+static constexpr size_t MAX_DRIVER_COMMANDS_SIZE =
+        4 * CommandStream::getCommandSize<decltype(&Driver::bindUniforms), &Driver::bindUniforms>() +
+        CommandStream::getCommandSize<decltype(&Driver::bindSamplers), &Driver::bindSamplers>() +
+        CommandStream::getCommandSize<decltype(&Driver::setViewportScissor), &Driver::setViewportScissor>() +
+        std::max(CommandStream::getCommandSize<decltype(&Driver::draw), &Driver::draw>(),
+                CommandStream::getCommandSize<decltype(&Driver::drawInstanced), &Driver::drawInstanced>());
+
+// the material instance in use when the command 'c' is recorded, so that each slice of commands
+// continues where the previous one left off, exactly like a serial recording
+static inline FMaterialInstance const* getPreviousMaterialInstance(
+        RenderPass::Command const* first, RenderPass::Command const* c) noexcept {
+    return c != first ? c[-1].primitive.mi : nullptr;
+}
+
+// A slice of commands is recorded in the scratch arena of the thread that runs it. It can use at
+// most half of the arena, so that a thread can record a second slice if it steals one. The
+// last command's worth of memory is left for the CircularBuffer and the alignment.
+static constexpr size_t MAX_RECORDING_SLICE_SIZE =
+        CONFIG_PER_THREAD_ARENA_SIZE / (2 * MAX_DRIVER_COMMANDS_SIZE) - 1;
+
+UTILS_NOINLINE // no need to be inlined
+void RenderPass::recordDriverCommands(FEngine& engine, JobSystem& js, ArenaScope& arena,
+        FEngine::DriverApi& driver, Slice<Command> const& commands) noexcept {
+    SYSTRACE_CALL();
+    static_assert(MAX_RECORDING_SLICE_SIZE >= PARALLEL_RECORDING_MIN_COMMANDS,
+            "the per-thread arenas are too small to record commands in parallel");
+
+    // cancelled commands are sorted last, there is no need to give them to a thread
+    Command const* const first = commands.cbegin();
+    const size_t count = size_t(std::partition_point(first, commands.cend(),
+            [](Command const& c) { return c.key != uint64_t(Pass::SENTINEL); }) - first);
+
+    const size_t threads = size_t(1) << js.getParallelSplitCount();
+    const size_t sliceCount = std::min(threads, count / PARALLEL_RECORDING_MIN_COMMANDS);
+    if (sliceCount <= 1) {
+        recordDriverCommands(driver, commands);
+        return;
+    }
+
+    // Commands are recorded in rounds of 'sliceCount' slices, as many as needed for the slices
+    // to fit in the scratch arenas. After each round, the slices are stitched in order and the
+    // arenas are rewound. If a thread runs out of memory anyway, its slice is recorded directly
+    // when stitching.
+    PerThreadArenas& scratch = engine.getPerThreadAllocators();
+    ArenaScope scope(arena.getAllocator());
+    const size_t sliceSize = std::min(MAX_RECORDING_SLICE_SIZE,
+            (count + sliceCount - 1) / sliceCount);
+    const size_t roundSize = sliceSize * sliceCount;
+    CircularBuffer** const buffers = scope.allocate<CircularBuffer*>(sliceCount);
+    void** const marks = scope.allocate<void*>(scratch.getArenaCount());
+    if (UTILS_UNLIKELY(!buffers || !marks)) {
+        recordDriverCommands(driver, commands);
+        return;
+    }
+
+    // programs are created lazily on the engine's stream, so they must all exist before
+    // recording on other threads
+    FMaterialInstance const* previousMi = nullptr;
+    uint8_t previousVariant = 0;
+    for (size_t i = 0; i < count; i++) {
+        PrimitiveInfo const& info = first[i].primitive;
+        if (info.mi != previousMi || info.materialVariant.key != previousVariant) {
+            previousMi = info.mi;
+            previousVariant = info.materialVariant.key;
+            info.mi->getMaterial()->getProgram(previousVariant);
+        }
+    }
+
+    // no job uses the scratch arenas while we're waiting for ours
+    for (size_t i = 0, c = scratch.getArenaCount(); i < c; i++) {
+        marks[i] = scratch.get(i).getCurrent();
+    }
+
+    // the slices are recorded for the same driver as the stream they're appended to
+    Driver& concreteDriver = driver.getDriver();
+    for (size_t roundBegin = 0; roundBegin < count; roundBegin += roundSize) {
+        Command const* const roundFirst = first + roundBegin;
+        const size_t roundCount = std::min(roundSize, count - roundBegin);
+        const size_t roundSliceCount = (roundCount + sliceSize - 1) / sliceSize;
+
+        // recording job (this runs on multiple threads)
+        auto work = [&concreteDriver, &scratch, buffers, first, roundFirst, roundCount, sliceSize]
+                (uint32_t index, uint32_t c) {
+            LinearAllocatorArena& allocator = scratch.get();
+            for (size_t s = index, e = index + c; s < e; s++) {
+                // the CircularBuffer doesn't own its memory, so it doesn't need to be destroyed
+                const size_t size = sliceSize * MAX_DRIVER_COMMANDS_SIZE;
+                void* const data = allocator.alloc(size, CACHELINE_SIZE);
+                buffers[s] = data ? allocator.make<CircularBuffer>(data, size) : nullptr;
+                if (UTILS_UNLIKELY(!buffers[s])) {
+                    continue;
+                }
+                CommandStream stream(concreteDriver, *buffers[s]);
+                const size_t begin = s * sliceSize;
+                const size_t end = std::min(roundCount, begin + sliceSize);
+                RenderPass::recordDriverCommands(stream, { roundFirst + begin, roundFirst + end },
+                        getPreviousMaterialInstance(first, roundFirst + begin));
+                assert(buffers[s]->getUsed() <= buffers[s]->size());
+            }
+        };
+
+        auto job = jobs::parallel_for(js, nullptr, 0, uint32_t(roundSliceCount),
+                std::cref(work), jobs::CountSplitter<1, 8>());
+        js.runAndWait(job);
+
+        // stitch all the slices in order
+        for (size_t s = 0; s < roundSliceCount; s++) {
+            if (UTILS_LIKELY(buffers[s])) {
+                driver.append(*buffers[s]);
+            } else {
+                const size_t begin = s * sliceSize;
+                const size_t end = std::min(roundCount, begin + sliceSize);
+                recordDriverCommands(driver, { roundFirst + begin, roundFirst + end },
+                        getPreviousMaterialInstance(first, roundFirst + begin));
+            }
+        }
+
+        for (size_t i = 0, c = scratch.getArenaCount(); i < c; i++) {
+            scratch.get(i).rewind(marks[i]);
+        }
+    }
+}
+
 UTILS_NOINLINE // no need to be inlined
 void RenderPass::recordDriverCommands(
         FEngine::DriverApi& UTILS_RESTRICT driver,  // using restrict here is very important
-        Slice<Command> const& commands) noexcept {
+        Slice<Command> const& commands, FMaterialInstance const* currentMi) noexcept {
     SYSTRACE_CALL();
 
     if (!commands.empty()) {
-        FMaterialInstance const* UTILS_RESTRICT previousMi = nullptr;
-        FMaterial const* UTILS_RESTRICT ma = nullptr;
+        FMaterialInstance const* UTILS_RESTRICT previousMi = currentMi;
+        FMaterial const* UTILS_RESTRICT ma = currentMi ? currentMi->getMaterial() : nullptr;
         Command const* UTILS_RESTRICT c;
-        for (c = commands.cbegin(); c->key != -1LLU; ++c) {
+        Command const* const UTILS_RESTRICT last = commands.cend();
+        for (c = commands.cbegin(); c != last && c->key != -1LLU; ++c) {
             /*
              * Be careful when changing code below, this is the hot inner-loop
              */
@@ -139,7 +555,15 @@ void RenderPass::recordDriverCommands(
             }
 
             Handle<HwProgram> const ph = ma->getProgram(info.materialVariant.key);
-            driver.draw(ph, info.rasterState, info.primitiveHandle);
+            if (UTILS_LIKELY(!info.perRenderableInstances)) {
+                driver.draw(ph, info.rasterState, info.primitiveHandle);
+            } else {
+                // all the instances of the renderable are drawn at once
+                driver.bindUniforms(BindingPoints::PER_RENDERABLE_INSTANCES,
+                        info.perRenderableInstances);
+                driver.drawInstanced(ph, info.rasterState, info.primitiveHandle,
+                        info.instanceCount);
+            }
         }
 
         SYSTRACE_VALUE32("commandCount", c - commands.cbegin());
@@ -213,6 +637,16 @@ void RenderPass::generateCommands(uint32_t commandTypeFlags, Command* const comm
     offset *= uint32_t(colorPass * 2 + depthPass);
     Command* const curr = commands + offset;
 
+    generateRangeCommands(commandTypeFlags, curr,
+            soa, range, renderFlags, cameraPosition, cameraForward);
+}
+
+/* static */
+UTILS_NOINLINE
+void RenderPass::generateRangeCommands(uint32_t commandTypeFlags, Command* curr,
+        FScene::RenderableSoa const& soa, utils::Range<uint32_t> range, RenderFlags renderFlags,
+        math::float3 cameraPosition, math::float3 cameraForward) noexcept {
+
     /*
      *
      * The if {} below is to coerce the compiler into generating different versions of
@@ -269,6 +703,8 @@ void RenderPass::generateCommandsImpl(uint32_t,
     auto const* const UTILS_RESTRICT soaPrimitives      = soa.data<FScene::PRIMITIVES>();
     auto const* const UTILS_RESTRICT soaUbh             = soa.data<FScene::UBH>();
     auto const* const UTILS_RESTRICT soaBonesUbh        = soa.data<FScene::BONES_UBH>();
+    auto const* const UTILS_RESTRICT soaInstancesUbh    = soa.data<FScene::INSTANCES_UBH>();
+    auto const* const UTILS_RESTRICT soaInstanceCount   = soa.data<FScene::INSTANCE_COUNT>();
 
     const bool hasShadowing = renderFlags & HAS_SHADOWING;
     Variant materialVariant;
@@ -320,8 +756,11 @@ void RenderPass::generateCommandsImpl(uint32_t,
         cmdColor.key = makeField(soaVisibility[i].priority, PRIORITY_MASK, PRIORITY_SHIFT);
         cmdColor.primitive.perRenderableUniforms = soaUbh[i];
         cmdColor.primitive.perRenderableBones = soaBonesUbh[i];
+        cmdColor.primitive.perRenderableInstances = soaInstancesUbh[i];
+        cmdColor.primitive.instanceCount = soaInstanceCount[i];
         materialVariant.setShadowReceiver(soaVisibility[i].receiveShadows & hasShadowing);
         materialVariant.setSkinning(soaVisibility[i].skinning);
+        materialVariant.setInstancing(bool(soaInstancesUbh[i]));
 
         // we're assuming we're always doing the depth (either way, it's correct)
         // this will generate front to back rendering
@@ -330,7 +769,10 @@ void RenderPass::generateCommandsImpl(uint32_t,
         cmdDepth.key |= makeField(distanceBits, DISTANCE_BITS_MASK, DISTANCE_BITS_SHIFT);
         cmdDepth.primitive.perRenderableUniforms = soaUbh[i];
         cmdDepth.primitive.perRenderableBones = soaBonesUbh[i];
+        cmdDepth.primitive.perRenderableInstances = soaInstancesUbh[i];
+        cmdDepth.primitive.instanceCount = soaInstanceCount[i];
         cmdDepth.primitive.materialVariant.setSkinning(soaVisibility[i].skinning);
+        cmdDepth.primitive.materialVariant.setInstancing(bool(soaInstancesUbh[i]));
 
         const bool shadowCaster = soaVisibility[i].castShadows & hasShadowing;
         const bool writeDepthForShadows = shadowPass & shadowCaster;
@@ -467,6 +909,41 @@ void RenderPass::updateSummedPrimitiveCounts(
     summedPrimitiveCount[vr.last] = count;
 }
 
+// ------------------------------------------------------------------------------------------------
+
+void RenderPass::Test::generateCommands(JobSystem& js, ArenaScope& arena,
+        uint32_t commandTypeFlags, FScene::RenderableSoa& soa, Range<uint32_t> vr,
+        RenderFlags renderFlags, float3 cameraPosition, float3 cameraForward,
+        GrowingSlice<Command>& commands) noexcept {
+    const bool colorPass  = bool(commandTypeFlags & CommandTypeFlags::COLOR);
+    const bool depthPass  = bool(commandTypeFlags & (CommandTypeFlags::DEPTH | CommandTypeFlags::SHADOW));
+    updateSummedPrimitiveCounts(soa, vr);
+    const uint32_t count = FScene::getPrimitiveCount(soa, vr.last) * (colorPass * 2 + depthPass);
+    RenderPass::generateCommands(commandTypeFlags, commands.grow(count),
+            soa, vr, renderFlags, cameraPosition, cameraForward);
+    commands.grow(1)->key = uint64_t(Pass::SENTINEL);
+    RenderPass::sortCommands(js, arena, commands);
+}
+
+bool RenderPass::Test::generateCachedCommands(JobSystem& js, ArenaScope& arena,
+        CommandCache& cache, uint32_t commandTypeFlags,
+        FScene::RenderableSoa const& soa, Range<uint32_t> vr,
+        RenderFlags renderFlags, float3 cameraPosition, float3 cameraForward,
+        GrowingSlice<Command>& commands) noexcept {
+    return RenderPass::generateCachedCommands(js, arena, cache, commandTypeFlags,
+            soa, vr, renderFlags, cameraPosition, cameraForward, commands);
+}
+
+void RenderPass::Test::recordDriverCommands(FEngine& engine, JobSystem& js,
+        ArenaScope& arena, FEngine::DriverApi& driver, Slice<Command> const& commands) noexcept {
+    RenderPass::recordDriverCommands(engine, js, arena, driver, commands);
+}
+
+void RenderPass::Test::recordDriverCommands(FEngine::DriverApi& driver,
+        Slice<Command> const& commands) noexcept {
+    RenderPass::recordDriverCommands(driver, commands);
+}
+
 // ------------------------------------------------------------------------------------------------
 // FRenderer concrete implementations are defined here so that we can benefit from
 // inlining and devirtualization.
@@ -536,7 +1013,7 @@ void FRenderer::ColorPass::endRenderPass(DriverApi& driver, Viewport const& view
     }
 }
 
-void FRenderer::ColorPass::renderColorPass(FEngine& engine, JobSystem& js,
+void FRenderer::ColorPass::renderColorPass(FEngine& engine, JobSystem& js, ArenaScope& arena,
         Handle<HwRenderTarget> const rth, FView* view, Viewport const& scaledViewport,
         GrowingSlice<Command>& commands) noexcept {
 
@@ -581,7 +1058,8 @@ void FRenderer::ColorPass::renderColorPass(FEngine& engine, JobSystem& js,
 
     ColorPass colorPass("ColorPass", js, jobFroxelize, view, rth);
     driver.pushGroupMarker("Color Pass");
-    colorPass.render(engine, js, soa, vr, commandType, flags, cameraInfo, scaledViewport, commands);
+    colorPass.render(engine, js, arena, soa, vr, commandType, flags, cameraInfo, scaledViewport,
+            view->getColorPassSplitter(), commands, view->getColorCommandCache());
     driver.popGroupMarker();
 }
 
@@ -596,7 +1074,7 @@ void FRenderer::ShadowPass::beginRenderPass(driver::DriverApi& driver, Viewport
     shadowMap.beginRenderPass(driver);
 }
 
-void FRenderer::ShadowPass::renderShadowMap(FEngine& engine, JobSystem& js,
+void FRenderer::ShadowPass::renderShadowMap(FEngine& engine, JobSystem& js, ArenaScope& arena,
         FView* view, GrowingSlice<Command>& commands) noexcept {
 
     auto& soa = view->getScene()->getRenderableData();
@@ -614,8 +1092,9 @@ void FRenderer::ShadowPass::renderShadowMap(FEngine& engine, JobSystem& js,
             .zf                 = camera.getCullingFar(),
     };
 
-    // populate the RenderPrimitive array with the proper LOD
-    view->updatePrimitivesLod(engine, cameraInfo, soa, vr);
+    // populate the RenderPrimitive array with the proper LOD, as seen by the viewer so
+    // the shadows match the rendered geometry
+    view->updatePrimitivesLod(engine, view->getCameraInfo(), soa, vr);
 
     driver::DriverApi& driver = engine.getDriverApi();
     view->prepareCamera(cameraInfo, viewport);
@@ -628,7 +1107,8 @@ void FRenderer::ShadowPass::renderShadowMap(FEngine& engine, JobSystem& js,
 
     ShadowPass shadowPass("ShadowPass", shadowMap);
     driver.pushGroupMarker("Shadow map Pass");
-    shadowPass.render(engine, js, soa, vr, CommandTypeFlags::SHADOW, flags, cameraInfo, viewport, commands);
+    shadowPass.render(engine, js, arena, soa, vr, CommandTypeFlags::SHADOW, flags, cameraInfo, viewport,
+            view->getShadowPassSplitter(), commands, view->getShadowCommandCache());
     driver.popGroupMarker();
 }
 
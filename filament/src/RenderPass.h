@@ -19,6 +19,7 @@
 
 #include <filament/Viewport.h>
 
+#include "details/Allocators.h"
 #include "details/Camera.h"
 #include "details/Material.h"
 #include "details/Scene.h"
@@ -28,8 +29,11 @@
 #include <private/filament/Variant.h>
 
 #include <utils/compiler.h>
+#include <utils/JobSystem.h>
 #include <utils/Slice.h>
 
+#include <vector>
+
 namespace utils {
 class JobSystem;
 }
@@ -172,14 +176,16 @@ public:
         return boolish ? -1llu : 0llu;
     }
 
-    struct PrimitiveInfo { // 28 bytes
+    struct PrimitiveInfo { // 32 bytes
         FMaterialInstance const* mi = nullptr;              // 8 bytes (4)
         Handle<HwRenderPrimitive> primitiveHandle;          // 4 bytes
         Handle<HwUniformBuffer> perRenderableUniforms;      // 4 bytes
         Handle<HwUniformBuffer> perRenderableBones;         // 4 bytes
+        Handle<HwUniformBuffer> perRenderableInstances;     // 4 bytes
         Driver::RasterState rasterState;                    // 4 bytes
         Variant materialVariant;                            // 1 byte
-        uint8_t reserved[3] = { };                          // 3 bytes (that helps the compiler)
+        uint8_t instanceCount = 0;                          // 1 byte (0 when not instanced)
+        uint8_t reserved[2] = { };                          // 2 bytes (that helps the compiler)
     };
 
     struct alignas(8) Command {     // 32 bytes
@@ -202,17 +208,89 @@ public:
     static constexpr RenderFlags HAS_DYNAMIC_LIGHTING   = 0x04;
 
 
+    /*
+     * Keeps the sorted commands of a pass from one frame to the next, so that only the commands
+     * of the renderables that changed (visibility, primitives, material instances or depth
+     * bucket) are generated and sorted again, then merged with the ones that didn't change.
+     *
+     * Depth commands of unchanged renderables keep their previous distance to the camera,
+     * this only affects the front-to-back order within a depth bucket. Blended commands are
+     * always up-to-date since they need to be sorted exactly.
+     */
+    class CommandCache {
+    public:
+        // above this ratio of changed renderables, all the commands are generated again
+        static constexpr float REBUILD_RATIO = 0.25f;
+
+        void clear() noexcept;
+
+        // number of frames that generated all the commands / only the changed ones
+        size_t getRebuildCount() const noexcept { return mRebuildCount; }
+        size_t getPatchCount() const noexcept { return mPatchCount; }
+
+    private:
+        friend class RenderPass;
+
+        struct State {
+            uint64_t hash = 0;          // hash of everything the renderable's commands depend on
+            uint32_t frame = 0;         // last frame this renderable was visible
+            bool unchanged = false;     // whether its cached commands are still valid
+        };
+
+        std::vector<Command> mCommands;         // sorted, without the sentinel
+        std::vector<uint32_t> mOwners;          // renderable instance of each command
+        std::vector<Command> mNextCommands;     // the above for the frame being generated
+        std::vector<uint32_t> mNextOwners;
+        std::vector<State> mStates;             // indexed by renderable instance
+        uint32_t mFrame = 0;
+        uint32_t mCommandTypeFlags = 0;
+        RenderFlags mRenderFlags = 0;
+        bool mValid = false;
+        size_t mRebuildCount = 0;
+        size_t mPatchCount = 0;
+        utils::jobs::AdaptiveSplitter mSplitter; // for generating the changed commands
+    };
+
+
     RenderPass(const char* name) noexcept : mName(name) { }
 
     virtual ~RenderPass() noexcept;
 
-    // appends rendering commands for the given view
+    // appends rendering commands for the given view, reusing the cached commands if a cache
+    // is given. 'splitter' sizes the jobs generating the commands, it must be kept from one
+    // frame to the next, and not be shared with other passes.
     void render(
-            FEngine& engine, utils::JobSystem& js,
+            FEngine& engine, utils::JobSystem& js, ArenaScope& arena,
             FScene::RenderableSoa const& soa, utils::Range<uint32_t> visibleRenderables,
             uint32_t commandTypeFlags, RenderFlags renderFlags,
             const CameraInfo& camera, Viewport const& viewport,
-            utils::GrowingSlice<Command>& commands) noexcept;
+            utils::jobs::AdaptiveSplitter& splitter,
+            utils::GrowingSlice<Command>& commands, CommandCache* cache = nullptr) noexcept;
+
+    struct Test {
+        // generates and sorts all the commands of the visible renderables, like render() does
+        // without a cache
+        static void generateCommands(utils::JobSystem& js, ArenaScope& arena,
+                uint32_t commandTypeFlags, FScene::RenderableSoa& soa, utils::Range<uint32_t> vr,
+                RenderFlags renderFlags, math::float3 cameraPosition, math::float3 cameraForward,
+                utils::GrowingSlice<Command>& commands) noexcept;
+
+        // same as above, but only the commands of the renderables that changed are generated
+        static bool generateCachedCommands(utils::JobSystem& js, ArenaScope& arena,
+                CommandCache& cache, uint32_t commandTypeFlags,
+                FScene::RenderableSoa const& soa, utils::Range<uint32_t> vr,
+                RenderFlags renderFlags, math::float3 cameraPosition, math::float3 cameraForward,
+                utils::GrowingSlice<Command>& commands) noexcept;
+
+        // records the driver commands on multiple threads if there are enough of them
+        static void recordDriverCommands(FEngine& engine, utils::JobSystem& js,
+                ArenaScope& arena, FEngine::DriverApi& driver,
+                utils::Slice<Command> const& commands) noexcept;
+
+        // records the driver commands on the calling thread
+        static void recordDriverCommands(FEngine::DriverApi& driver,
+                utils::Slice<Command> const& commands) noexcept;
+    };
 
 private:
     // Called just before rendering, make sure all needed asynchronous tasks are finished.
@@ -228,19 +306,30 @@ private:
 private:
     friend class FRenderer;
 
-    // on 64-bits systems, we process batches of 4 (64 bytes) cache-lines, or 8 (32 bytes) commands
-    // on 32-bits systems, we process batches of 8 (32 bytes) cache-lines, or 8 (32 bytes) commands
-    static constexpr size_t JOBS_PARALLEL_FOR_COMMANDS_COUNT = 16;
-    static constexpr size_t JOBS_PARALLEL_FOR_COMMANDS_SIZE  =
-            sizeof(Command) * JOBS_PARALLEL_FOR_COMMANDS_COUNT;
-
-    static_assert(JOBS_PARALLEL_FOR_COMMANDS_SIZE % utils::CACHELINE_SIZE == 0,
-            "Size of Commands jobs must be multiple of a cache-line size");
-
     static inline void generateCommands(uint32_t commandTypeFlags, Command* const commands,
             FScene::RenderableSoa const& soa, utils::Range<uint32_t> range, RenderFlags renderFlags,
             math::float3 cameraPosition, math::float3 cameraForward) noexcept;
 
+    // same as above, but the commands of 'range' are written at 'curr'
+    static inline void generateRangeCommands(uint32_t commandTypeFlags, Command* curr,
+            FScene::RenderableSoa const& soa, utils::Range<uint32_t> range, RenderFlags renderFlags,
+            math::float3 cameraPosition, math::float3 cameraForward) noexcept;
+
+    // makes room for 'count' more commands, the buffer is reallocated from the arena if needed
+    static void reserveCommands(ArenaScope& arena, utils::GrowingSlice<Command>& commands,
+            size_t count) noexcept;
+
+    // generates the commands of the renderables that changed since the last frame and merges
+    // them with the cached ones. Returns false if the arena is too small.
+    static bool generateCachedCommands(utils::JobSystem& js, ArenaScope& arena,
+            CommandCache& cache, uint32_t commandTypeFlags,
+            FScene::RenderableSoa const& soa, utils::Range<uint32_t> vr, RenderFlags renderFlags,
+            math::float3 cameraPosition, math::float3 cameraForward,
+            utils::GrowingSlice<Command>& commands) noexcept;
+
+    static uint64_t getCommandsHash(FScene::RenderableSoa const& soa, uint32_t i,
+            math::float3 cameraPosition, math::float3 cameraForward) noexcept;
+
     template<uint32_t commandTypeFlags>
     static inline void generateCommandsImpl(uint32_t, Command* commands, FScene::RenderableSoa const& soa,
             utils::Range<uint32_t> range, RenderFlags renderFlags, math::float3 cameraPosition,
@@ -249,8 +338,24 @@ private:
     static void setupColorCommand(Command& cmdDraw, bool hasDepthPass,
             FMaterialInstance const* const mi) noexcept;
 
+    // below this many commands, std::sort() is faster than the radix sort
+    static constexpr size_t RADIX_SORT_MIN_COMMANDS = 1024;
+
+    static void sortCommands(utils::JobSystem& js, ArenaScope& arena,
+            utils::Slice<Command>& commands) noexcept;
+
+    // below this many commands per thread, driver commands are recorded on the calling thread
+    static constexpr size_t PARALLEL_RECORDING_MIN_COMMANDS = 512;
+
+    // records the driver commands into 'driver' (typically the engine's stream), on multiple
+    // threads if there are enough commands. The result is the same as a serial recording.
+    static void recordDriverCommands(FEngine& engine, utils::JobSystem& js, ArenaScope& arena,
+            FEngine::DriverApi& driver, utils::Slice<Command> const& commands) noexcept;
+
+    // 'currentMi' is the material instance already in use, if any
     static void recordDriverCommands(FEngine::DriverApi& driver,
-            utils::Slice<Command> const& commands) noexcept;
+            utils::Slice<Command> const& commands,
+            FMaterialInstance const* currentMi = nullptr) noexcept;
 
     static void updateSummedPrimitiveCounts(
             FScene::RenderableSoa& renderableData, utils::Range<uint32_t> vr) noexcept;
@@ -71,6 +71,10 @@ FRenderer::~FRenderer() noexcept {
     << wm / 1024 << " KiB (" << wmpct << "%), "
     << wm / sizeof(Command) << " commands, " << sizeof(Command) << " bytes/command"
     << io::endl;
+    slog.d << "Renderer: per-renderpass arena High watermark "
+    << mPerRenderPassArenaHighWatermark / 1024 << " KiB, "
+    << mPerRenderPassArena.getAllocator().getBlockCount() << " extra blocks"
+    << io::endl;
 #endif
 }
 
@@ -158,7 +162,7 @@ void FRenderer::renderJob(ArenaScope& arena, FView* view) {
      */
 
     if (view->hasShadowing()) {
-        ShadowPass::renderShadowMap(engine, js, view, commands);
+        ShadowPass::renderShadowMap(engine, js, arena, view, commands);
         recordHighWatermark(commands); // for debugging
         // reset the command buffer
         commands.clear();
@@ -182,7 +186,7 @@ void FRenderer::renderJob(ArenaScope& arena, FView* view) {
 
     // FIXME: viewRenderTarget doesn't have a depth-buffer, so when skipping post-process, don't rely on it
     const Handle<HwRenderTarget> viewRenderTarget = getRenderTarget();
-    ColorPass::renderColorPass(engine, js,
+    ColorPass::renderColorPass(engine, js, arena,
             colorTarget ? colorTarget->target : viewRenderTarget, view, svp, commands);
 
     /*
@@ -301,6 +305,16 @@ void FRenderer::endFrame() {
     // make sure we're done with the gcs
     js.wait(job);
 
+    // all the jobs of this frame are done, their scratch memory can be reused
+    engine.getPerThreadAllocators().reset();
+
+    // report how much per-renderpass memory this frame needed
+    auto& allocator = mPerRenderPassArena.getAllocator();
+    const size_t peak = allocator.getPeak();
+    allocator.resetPeak();
+    allocator.trim(CONFIG_PER_RENDER_PASS_ARENA_UNUSED_FRAMES);  // free the blocks of past spikes
+    mPerRenderPassArenaHighWatermark = std::max(mPerRenderPassArenaHighWatermark, peak);
+    SYSTRACE_VALUE32("perRenderPassArenaPeak", peak);
 
 #if EXTRA_TIMING_INFO
     if (UTILS_UNLIKELY(frameInfoManager.isLapRecordsEnabled())) {
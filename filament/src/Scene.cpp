@@ -20,6 +20,7 @@
 #include "components/RenderableManager.h"
 
 #include "details/Culler.h"
+#include "details/DebugRegistry.h"
 #include "details/Engine.h"
 #include "details/IndirectLight.h"
 #include "details/GpuLightBuffer.h"
@@ -27,6 +28,7 @@
 
 #include <utils/compiler.h>
 #include <utils/EntityManager.h>
+#include <utils/JobSystem.h>
 #include <utils/Range.h>
 #include <utils/Zip2Iterator.h>
 
@@ -38,122 +40,397 @@ using namespace utils;
 namespace filament {
 namespace details {
 
+static constexpr size_t JOBS_PARALLEL_FOR_GATHER_COUNT = 64;
+
+// below this number of renderables, culling the flat arrays is fast enough
+static constexpr size_t CULLING_BVH_MIN_RENDERABLE_COUNT = 1024;
+
+// refitting degrades the hierarchy, so we rebuild it from time to time
+static constexpr size_t CULLING_BVH_MAX_REFIT_COUNT = 64;
+
 // ------------------------------------------------------------------------------------------------
 
 FScene::FScene(FEngine& engine) :
         mEngine(engine),
         mIndirectLight(engine.getDefaultIndirectLight()),
         mGpuLightData(engine) {
+    FDebugRegistry& debugRegistry = engine.getDebugRegistry();
+    debugRegistry.registerProperty("d.scene.culling_bvh", &engine.debug.scene.culling_bvh);
 }
 
 FScene::~FScene() noexcept = default;
 
 
 void FScene::prepare(const math::mat4f& worldOriginTansform) {
-    // TODO: can we skip this in most cases? Since we rely on indices staying the same,
-    //       we could only skip, if nothing changed in the RCM.
-
     FEngine& engine = mEngine;
     EntityManager& em = engine.getEntityManager();
-    FRenderableManager& rcm = engine.getRenderableManager();
     FTransformManager& tcm = engine.getTransformManager();
     FLightManager& lcm = engine.getLightManager();
-    // go through the list of entities, and gather the data of those that are renderables
-    auto& sceneData = mRenderableData;
+    FRenderableManager& rcm = engine.getRenderableManager();
     auto& lightData = mLightData;
     auto const& entities = mEntities;
 
+    /*
+     * Bring our cached renderable and light data up-to-date. Most of the time, only a few
+     * entities changed since last frame, so we only re-gather those and remove the ones that
+     * were destroyed. We fall back to re-gathering everything if we missed some changes, or if
+     * the world origin moved.
+     */
 
-    // NOTE: we can't know in advance how many entities are renderable or lights because the corresponding
-    // component can be added after the entity is added to the scene.
+    ChangeLog const* const changeLogs[CHANGE_LOG_COUNT] = {
+            &tcm.getChangeLog(),
+            &rcm.getChangeLog(),
+            &lcm.getChangeLog()
+    };
 
-    // for the purpose of allocation, we'll assume all our entities are renderables
-    size_t capacity = entities.size();
-    // we need the capacity to be multiple of 16 for SIMD loops
-    capacity = (capacity + 0xF) & ~0xF;
-    // we need 1 extra entry at the end for teh summed primitive count
-    capacity = capacity + 1;
+    // the rows of the entities destroyed since the last call are removed right away
+    engine.drainDestroyedEntities();
 
-    sceneData.clear();
-    if (sceneData.capacity() < capacity) {
-        sceneData.setCapacity(capacity);
+    bool gatherAll = mGatherAll || worldOriginTansform != mWorldOriginTransform;
+    for (size_t i = 0; i < CHANGE_LOG_COUNT; i++) {
+        gatherAll = gatherAll || !changeLogs[i]->isValid(mChangeCursors[i]);
     }
+    mWorldOriginTransform = worldOriginTansform;
+
+    std::vector<Entity>& list = mGatherList;
+    list.clear();
+    if (UTILS_UNLIKELY(gatherAll)) {
+        mRenderableCache.clear();
+        mRenderableEntities.clear();
+        mRenderableRows.clear();
+        mLightCache.clear();
+        mLightEntities.clear();
+        mLightRows.clear();
+        mDirectionalLights.clear();
+        list.assign(entities.begin(), entities.end());
+    } else {
+        for (Entity e : mAddedEntities) {
+            if (entities.find(e) != entities.end()) {
+                list.push_back(e);
+            }
+        }
+        for (size_t i = 0; i < CHANGE_LOG_COUNT; i++) {
+            for (Entity e : changeLogs[i]->since(mChangeCursors[i])) {
+                // the change logs are shared by all scenes
+                if (entities.find(e) != entities.end()) {
+                    list.push_back(e);
+                }
+            }
+        }
+        // an entity can be changed several times, or in several managers
+        std::sort(list.begin(), list.end());
+        list.erase(std::unique(list.begin(), list.end()), list.end());
+    }
+    gatherEntities(engine.getJobSystem(), list);
 
-    lightData.clear();
-    if (lightData.capacity() < capacity) {
-        lightData.setCapacity(capacity);
+    mAddedEntities.clear();
+    mGatherAll = false;
+    for (size_t i = 0; i < CHANGE_LOG_COUNT; i++) {
+        mChangeCursors[i] = changeLogs[i]->end();
     }
-    // the first entries are reserved for the directional lights (currently only one)
-    lightData.resize(DIRECTIONAL_LIGHTS_COUNT);
 
+    ensurePadding(mRenderableCache, mLightCache);
+    updateCullingBvh();
 
-    // find the max intensity directional light index in our local array
-    float maxIntensity = 0;
+    /*
+     * The per-frame arrays only hold the visible renderables and lights, FView fills them
+     * after culling. The first entries of the lights are reserved for the directional lights
+     * (currently only one).
+     */
 
-    for (Entity e : entities) {
-        if (!em.isAlive(e))
-            continue;
+    mRenderableData.clear();
+    lightData.clear();
+    lightData.resize(DIRECTIONAL_LIGHTS_COUNT);
 
-        // getInstance() always returns null if the entity is the Null entity
-        // so we don't need to check for that, but we need to check it's alive
-        auto ri = rcm.getInstance(e);
+    // find the max intensity directional light, there are typically very few of them, so we
+    // always re-evaluate them.
+    float maxIntensity = 0;
+    for (Entity e : mDirectionalLights) {
         auto li = lcm.getInstance(e);
-        if (!ri & !li)
+        if (!li || !em.isAlive(e)) {
             continue;
+        }
+        if (lcm.getIntensity(li) >= maxIntensity) {
+            maxIntensity = lcm.getIntensity(li);
+            auto ti = tcm.getInstance(e);
+            const mat4f worldTransform = worldOriginTansform * tcm.getWorldTransform(ti);
+            float3 d = lcm.getLocalDirection(li);
+            // using the inverse-transpose handles non-uniform scaling
+            d = normalize(transpose(inverse(worldTransform.upperLeft())) * d);
+            // TODO: allow lightData.front() = { ... } syntax
+            lightData.elementAt<FScene::POSITION_RADIUS>(0) = {};
+            lightData.elementAt<FScene::DIRECTION>(0)       = d;
+            lightData.elementAt<FScene::LIGHT_INSTANCE>(0)  = li;
+            lightData.elementAt<FScene::VISIBILITY>(0)      = {};
+        }
+    }
+}
 
-        // get the world transform
-        auto ti = tcm.getInstance(e);
-        const mat4f worldTransform = worldOriginTansform * tcm.getWorldTransform(ti);
-
-        // don't even draw this object if it doesn't have a transform (which shouldn't happen
-        // because one is always created when creating a Renderable component).
-        if (ri && ti) {
-            // compute the world AABB so we can perform culling
-            const Box worldAABB = rigidTransform(rcm.getAABB(ri), worldTransform);
-
-            // we know there is enough space in the array
-            sceneData.push_back_unsafe(
-                    ri,
-                    worldTransform,
-                    rcm.getVisibility(ri),
-                    rcm.getUbh(ri),
-                    rcm.getBonesUbh(ri),
-                    worldAABB.center,
-                    0,
-                    rcm.getLayerMask(ri),
-                    worldAABB.halfExtent,
-                    {}, {});
+void FScene::removeDestroyedEntities(Entity const* entities, size_t count) noexcept {
+    // Entities can be destroyed before their components are garbage collected, we don't
+    // want to draw those.
+    auto const& sceneEntities = mEntities;
+    auto& directionalLights = mDirectionalLights;
+    for (size_t i = 0; i < count; i++) {
+        const Entity e = entities[i];
+        if (sceneEntities.find(e) == sceneEntities.end()) {
+            continue;
         }
+        removeRenderable(e);
+        removeLight(e);
+        auto pos = std::find(directionalLights.begin(), directionalLights.end(), e);
+        if (pos != directionalLights.end()) {
+            directionalLights.erase(pos);
+        }
+    }
+}
 
-        if (li) {
-            // find the dominant directional light
-            if (UTILS_UNLIKELY(lcm.isDirectionalLight(li))) {
-                // we don't store the directional lights, because we only have a single one
-                if (lcm.getIntensity(li) >= maxIntensity) {
-                    float3 d = lcm.getLocalDirection(li);
-                    // using the inverse-transpose handles non-uniform scaling
-                    d = normalize(transpose(inverse(worldTransform.upperLeft())) * d);
-                    // TODO: allow lightData.front() = { ... } syntax
-                    lightData.elementAt<FScene::POSITION_RADIUS>(0) = {};
-                    lightData.elementAt<FScene::DIRECTION>(0)       = d;
-                    lightData.elementAt<FScene::LIGHT_INSTANCE>(0)  = li;
-                    lightData.elementAt<FScene::VISIBILITY>(0)      = {};
-                }
+void FScene::ensurePadding(RenderableSoa& renderables, LightSoa& lights) {
+    // we need the capacity to be multiple of 16 for SIMD loops, and 1 extra entry at the end
+    // for the summed primitive count
+    const size_t renderableCapacity = ((renderables.size() + 0xF) & ~0xF) + 1;
+    if (renderables.capacity() < renderableCapacity) {
+        renderables.setCapacity(renderableCapacity);
+    }
+    const size_t lightCapacity = ((lights.size() + 0xF) & ~0xF) + 1;
+    if (lights.capacity() < lightCapacity) {
+        lights.setCapacity(lightCapacity);
+    }
+}
+
+uint8_t FScene::gatherEntity(Entity e,
+        RenderableSoa& UTILS_RESTRICT renderables, LightSoa& UTILS_RESTRICT lights,
+        size_t index) const noexcept {
+    // this is called concurrently from several jobs, it must only read from the managers
+    FEngine& engine = mEngine;
+    EntityManager& em = engine.getEntityManager();
+    FRenderableManager const& rcm = engine.getRenderableManager();
+    FTransformManager const& tcm = engine.getTransformManager();
+    FLightManager const& lcm = engine.getLightManager();
+
+    // getInstance() always returns null if the entity is the Null entity
+    // so we don't need to check for that, but we need to check it's alive
+    if (!em.isAlive(e)) {
+        return GATHERED_NOTHING;
+    }
+
+    auto ri = rcm.getInstance(e);
+    auto li = lcm.getInstance(e);
+    if (!ri & !li) {
+        return GATHERED_NOTHING;
+    }
+
+    // get the world transform
+    auto ti = tcm.getInstance(e);
+    const mat4f worldTransform = mWorldOriginTransform * tcm.getWorldTransform(ti);
+
+    uint8_t gathered = GATHERED_NOTHING;
+
+    // don't even draw this object if it doesn't have a transform (which shouldn't happen
+    // because one is always created when creating a Renderable component).
+    if (ri && ti) {
+        // compute the world AABB so we can perform culling
+        const Box worldAABB = rigidTransform(rcm.getAABB(ri), worldTransform);
+        renderables.elementAt<RENDERABLE_INSTANCE>(index) = ri;
+        renderables.elementAt<WORLD_TRANSFORM>(index)     = worldTransform;
+        renderables.elementAt<VISIBILITY_STATE>(index)    = rcm.getVisibility(ri);
+        renderables.elementAt<UBH>(index)                 = rcm.getUbh(ri);
+        renderables.elementAt<BONES_UBH>(index)           = rcm.getBonesUbh(ri);
+        renderables.elementAt<INSTANCES_UBH>(index)       = rcm.getInstancesUbh(ri);
+        renderables.elementAt<INSTANCE_COUNT>(index)      = uint8_t(rcm.getInstanceCount(ri));
+        renderables.elementAt<WORLD_AABB_CENTER>(index)   = worldAABB.center;
+        renderables.elementAt<LAYERS>(index)              = rcm.getLayerMask(ri);
+        renderables.elementAt<WORLD_AABB_EXTENT>(index)   = worldAABB.halfExtent;
+        gathered |= GATHERED_RENDERABLE;
+    }
+
+    if (li) {
+        if (UTILS_UNLIKELY(lcm.isDirectionalLight(li))) {
+            // we don't store the directional lights, because we only use a single one
+            gathered |= GATHERED_DIRECTIONAL_LIGHT;
+        } else {
+            const float4 p = worldTransform * float4{ lcm.getLocalPosition(li), 1 };
+            float3 d = 0;
+            if (!lcm.isPointLight(li) || lcm.isIESLight(li)) {
+                d = lcm.getLocalDirection(li);
+                // using the inverse-transpose handles non-uniform scaling
+                d = normalize(transpose(inverse(worldTransform.upperLeft())) * d);
+            }
+            lights.elementAt<POSITION_RADIUS>(index) = float4{ p.xyz, lcm.getRadius(li) };
+            lights.elementAt<DIRECTION>(index)       = d;
+            lights.elementAt<LIGHT_INSTANCE>(index)  = li;
+            gathered |= GATHERED_LIGHT;
+        }
+    }
+    return gathered;
+}
+
+void FScene::gatherEntities(JobSystem& js, std::vector<Entity> const& list) {
+    const size_t count = list.size();
+    if (!count) {
+        return;
+    }
+
+    // Each entity is gathered into its own slot of these temporary arrays, so that
+    // the entities can be processed in parallel.
+    RenderableSoa& renderables = mGatheredRenderables;
+    LightSoa& lights = mGatheredLights;
+    std::vector<uint8_t>& gathered = mGathered;
+    renderables.clear();
+    renderables.resize(count);
+    lights.clear();
+    lights.resize(count);
+    gathered.resize(count);
+
+    // gathering job (this runs on multiple threads)
+    Entity const* const entities = list.data();
+    uint8_t* const kinds = gathered.data();
+    auto functor = [this, entities, kinds, &renderables, &lights](uint32_t index, uint32_t c) {
+        for (size_t i = index, e = index + c; i < e; i++) {
+            kinds[i] = gatherEntity(entities[i], renderables, lights, i);
+        }
+    };
+
+    if (count >= JOBS_PARALLEL_FOR_GATHER_COUNT * 2) {
+        auto job = jobs::parallel_for(js, nullptr, 0, uint32_t(count), std::ref(functor),
+                jobs::CountSplitter<JOBS_PARALLEL_FOR_GATHER_COUNT, 8>());
+        js.runAndWait(job);
+    } else {
+        functor(0, uint32_t(count));
+    }
+
+    // Now compact the gathered data into our cache. When re-gathering everything the cache
+    // is empty and this simply appends the valid entries.
+    RenderableSoa& renderableCache = mRenderableCache;
+    LightSoa& lightCache = mLightCache;
+    auto& directionalLights = mDirectionalLights;
+    for (size_t i = 0; i < count; i++) {
+        const Entity e = entities[i];
+        const uint8_t kind = kinds[i];
+
+        if (kind & GATHERED_RENDERABLE) {
+            auto pos = mRenderableRows.find(e);
+            size_t row;
+            if (pos == mRenderableRows.end()) {
+                row = renderableCache.size();
+                renderableCache.push_back();
+                mRenderableEntities.push_back(e);
+                mRenderableRows[e] = uint32_t(row);
+                mRenderableRowsChanged = true;
             } else {
-                const float4 p = worldTransform * float4{ lcm.getLocalPosition(li), 1 };
-                float3 d = 0;
-                if (!lcm.isPointLight(li) || lcm.isIESLight(li)) {
-                    d = lcm.getLocalDirection(li);
-                    // using the inverse-transpose handles non-uniform scaling
-                    d = normalize(transpose(inverse(worldTransform.upperLeft())) * d);
+                row = pos->second;
+                mUpdatedRenderableRows.push_back(uint32_t(row));
+            }
+            renderableCache.elementAt<RENDERABLE_INSTANCE>(row) = renderables.elementAt<RENDERABLE_INSTANCE>(i);
+            renderableCache.elementAt<WORLD_TRANSFORM>(row)     = renderables.elementAt<WORLD_TRANSFORM>(i);
+            renderableCache.elementAt<VISIBILITY_STATE>(row)    = renderables.elementAt<VISIBILITY_STATE>(i);
+            renderableCache.elementAt<UBH>(row)                 = renderables.elementAt<UBH>(i);
+            renderableCache.elementAt<BONES_UBH>(row)           = renderables.elementAt<BONES_UBH>(i);
+            renderableCache.elementAt<INSTANCES_UBH>(row)       = renderables.elementAt<INSTANCES_UBH>(i);
+            renderableCache.elementAt<INSTANCE_COUNT>(row)      = renderables.elementAt<INSTANCE_COUNT>(i);
+            renderableCache.elementAt<WORLD_AABB_CENTER>(row)   = renderables.elementAt<WORLD_AABB_CENTER>(i);
+            renderableCache.elementAt<LAYERS>(row)              = renderables.elementAt<LAYERS>(i);
+            renderableCache.elementAt<WORLD_AABB_EXTENT>(row)   = renderables.elementAt<WORLD_AABB_EXTENT>(i);
+        } else {
+            removeRenderable(e);
+        }
+
+        auto dir = std::find(directionalLights.begin(), directionalLights.end(), e);
+        if (kind & GATHERED_DIRECTIONAL_LIGHT) {
+            removeLight(e);
+            if (dir == directionalLights.end()) {
+                directionalLights.push_back(e);
+            }
+        } else {
+            if (dir != directionalLights.end()) {
+                directionalLights.erase(dir);
+            }
+            if (kind & GATHERED_LIGHT) {
+                auto pos = mLightRows.find(e);
+                size_t row;
+                if (pos == mLightRows.end()) {
+                    row = lightCache.size();
+                    lightCache.push_back();
+                    mLightEntities.push_back(e);
+                    mLightRows[e] = uint32_t(row);
+                } else {
+                    row = pos->second;
                 }
-                lightData.push_back_unsafe(
-                        float4{ p.xyz, lcm.getRadius(li) }, d, li, {});
+                lightCache.elementAt<POSITION_RADIUS>(row) = lights.elementAt<POSITION_RADIUS>(i);
+                lightCache.elementAt<DIRECTION>(row)       = lights.elementAt<DIRECTION>(i);
+                lightCache.elementAt<LIGHT_INSTANCE>(row)  = lights.elementAt<LIGHT_INSTANCE>(i);
+            } else {
+                removeLight(e);
             }
         }
     }
 }
 
+uint8_t FScene::Test::gatherEntity(FScene const& scene, Entity e,
+        RenderableSoa& renderables, LightSoa& lights, size_t index) noexcept {
+    static_assert(RENDERABLE == GATHERED_RENDERABLE && LIGHT == GATHERED_LIGHT,
+            "FScene::Test must match gatherEntity()");
+    return scene.gatherEntity(e, renderables, lights, index);
+}
+
+void FScene::Test::gatherEntities(FScene& scene, JobSystem& js, std::vector<Entity> const& list) {
+    scene.gatherEntities(js, list);
+}
+
+void FScene::removeRenderable(Entity e) noexcept {
+    auto pos = mRenderableRows.find(e);
+    if (pos != mRenderableRows.end()) {
+        // move the last row in place of the one we're removing
+        const uint32_t row = pos->second;
+        const uint32_t last = uint32_t(mRenderableCache.size() - 1);
+        mRenderableRows.erase(pos);
+        if (row != last) {
+            Entity moved = mRenderableEntities[last];
+            mRenderableCache.swap(row, last);
+            mRenderableEntities[row] = moved;
+            mRenderableRows[moved] = row;
+        }
+        mRenderableCache.pop_back();
+        mRenderableEntities.pop_back();
+        mRenderableRowsChanged = true;
+    }
+}
+
+void FScene::updateCullingBvh() {
+    RenderableSoa const& cache = mRenderableCache;
+    const size_t count = cache.size();
+    CullingBvh& bvh = mCullingBvh;
+    if (!mEngine.debug.scene.culling_bvh || count < CULLING_BVH_MIN_RENDERABLE_COUNT) {
+        bvh.clear();
+    } else if (mRenderableRowsChanged || bvh.size() != count ||
+               bvh.getRefitCount() >= CULLING_BVH_MAX_REFIT_COUNT) {
+        bvh.build(cache.data<WORLD_AABB_CENTER>(), cache.data<WORLD_AABB_EXTENT>(), count);
+    } else if (!mUpdatedRenderableRows.empty()) {
+        bvh.refit(cache.data<WORLD_AABB_CENTER>(), cache.data<WORLD_AABB_EXTENT>(),
+                mUpdatedRenderableRows.data(), mUpdatedRenderableRows.size());
+    }
+    mRenderableRowsChanged = false;
+    mUpdatedRenderableRows.clear();
+}
+
+void FScene::removeLight(Entity e) noexcept {
+    auto pos = mLightRows.find(e);
+    if (pos != mLightRows.end()) {
+        // move the last row in place of the one we're removing
+        const uint32_t row = pos->second;
+        const uint32_t last = uint32_t(mLightCache.size() - 1);
+        mLightRows.erase(pos);
+        if (row != last) {
+            Entity moved = mLightEntities[last];
+            mLightCache.swap(row, last);
+            mLightEntities[row] = moved;
+            mLightRows[moved] = row;
+        }
+        mLightCache.pop_back();
+        mLightEntities.pop_back();
+    }
+}
+
 void FScene::updateUBOs(utils::Range<uint32_t> visibleRenderables) const noexcept {
     FRenderableManager& rcm = mEngine.getRenderableManager();
     auto& sceneData = mRenderableData;
@@ -175,43 +452,51 @@ void FScene::prepareLights(const CameraInfo& camera, ArenaScope& rootArena) noex
 
     /*
      * Here we copy our lights data into the GPU buffer, some lights might be left out if there
-     * are more than the GPU buffer allows (i.e. 255).
+     * are more than the GPU buffer allows (i.e. CONFIG_MAX_LIGHT_COUNT).
      *
-     * Sorting light by distance to the camera for dropping the ones in excess doesn't
-     * work well because a light far from the camera could light an object close to it
-     * (e.g. a search light).
+     * This is a last resort, it should only happen with very large numbers of visible lights.
+     * In that case we keep the lights that contribute the most at the camera, sorting by
+     * distance only doesn't work well because a light far from the camera could light an
+     * object close to it (e.g. a search light).
      *
-     * When we have too many lights, there is nothing better we can do though.
-     * However, when the froxelization "record buffer" runs out of space, it's better to drop
+     * When the froxelization "record buffer" runs out of space, it's better to drop
      * froxels far from the camera instead. This would happen during froxelization.
      */
 
     // don't count the directional light
     if (UTILS_UNLIKELY(lightData.size() > CONFIG_MAX_LIGHT_COUNT + DIRECTIONAL_LIGHTS_COUNT)) {
         ArenaScope arena(rootArena.getAllocator());
-        float* const UTILS_RESTRICT distances = arena.allocate<float>(lightData.size(), CACHELINE_SIZE);
+        float* const UTILS_RESTRICT importance = arena.allocate<float>(lightData.size(), CACHELINE_SIZE);
 
-        // pre-compute the lights' distance to the camera, for sorting below.
+        // pre-compute the lights' importance, for partitioning below.
         float3 const position = camera.getPosition();
 
         // skip directional light
+        auto const* UTILS_RESTRICT spheres   = lightData.data<FScene::POSITION_RADIUS>();
+        auto const* UTILS_RESTRICT instances = lightData.data<FScene::LIGHT_INSTANCE>();
         for (size_t i = DIRECTIONAL_LIGHTS_COUNT, c = lightData.size(); i < c; ++i) {
+            // intensity of the light at the camera, assuming it's 1m away when the camera is
+            // within its radius of influence.
             // TODO: this should take spot-light direction into account
-            // TODO: maybe we could also take the intensity into account
-            float4 s = lightData.elementAt<FScene::POSITION_RADIUS>(i);
-            distances[i] = std::max(0.0f, length(position - s.xyz) - s.w);
+            float4 s = spheres[i];
+            float d = std::max(1.0f, length(position - s.xyz) - s.w);
+            importance[i] = lcm.getIntensity(instances[i]) / (d * d);
         }
 
-        // skip directional light
-        Zip2Iterator<FScene::LightSoa::iterator, float*> b = { lightData.begin(), distances };
-        std::sort(b + DIRECTIONAL_LIGHTS_COUNT, b + lightData.size(),
-                [](auto const& lhs, auto const& rhs) { return lhs.second < rhs.second; });
+        // skip directional light, we don't need the kept lights to be sorted
+        Zip2Iterator<FScene::LightSoa::iterator, float*> b = { lightData.begin(), importance };
+        std::nth_element(b + DIRECTIONAL_LIGHTS_COUNT,
+                b + CONFIG_MAX_LIGHT_COUNT + DIRECTIONAL_LIGHTS_COUNT, b + lightData.size(),
+                [](auto const& lhs, auto const& rhs) { return lhs.second > rhs.second; });
 
-        lightData.resize(std::min(lightData.size(), CONFIG_MAX_LIGHT_COUNT + DIRECTIONAL_LIGHTS_COUNT));
+        lightData.resize(CONFIG_MAX_LIGHT_COUNT + DIRECTIONAL_LIGHTS_COUNT);
     }
 
     assert(lightData.size() <= CONFIG_MAX_LIGHT_COUNT + DIRECTIONAL_LIGHTS_COUNT);
 
+    const size_t lightCount = lightData.size() - DIRECTIONAL_LIGHTS_COUNT;
+    gpuLightData.prepare(mEngine.getDriverApi(), lightCount);
+
     auto const* UTILS_RESTRICT positions    = lightData.data<FScene::POSITION_RADIUS>();
     auto const* UTILS_RESTRICT directions   = lightData.data<FScene::DIRECTION>();
     auto const* UTILS_RESTRICT instances    = lightData.data<FScene::LIGHT_INSTANCE>();
@@ -225,16 +510,29 @@ void FScene::prepareLights(const CameraInfo& camera, ArenaScope& rootArena) noex
         lp.spotScaleOffset.xy   = { lcm.getSpotParams(li).scaleOffset };
     }
 
-    gpuLightData.invalidate(0, lightData.size() - DIRECTIONAL_LIGHTS_COUNT);
-    gpuLightData.commit(mEngine);
+    if (lightCount) {
+        gpuLightData.invalidate(0, lightCount);
+        gpuLightData.commit(mEngine.getDriverApi());
+    }
 }
 
 void FScene::addEntity(Entity entity) {
-    mEntities.insert(entity);
+    if (mEntities.insert(entity).second) {
+        // the entity is gathered during the next prepare()
+        mAddedEntities.push_back(entity);
+    }
 }
 
 void FScene::remove(Entity entity) {
-    mEntities.erase(entity);
+    if (mEntities.erase(entity)) {
+        removeRenderable(entity);
+        removeLight(entity);
+        auto& directionalLights = mDirectionalLights;
+        auto pos = std::find(directionalLights.begin(), directionalLights.end(), entity);
+        if (pos != directionalLights.end()) {
+            directionalLights.erase(pos);
+        }
+    }
 }
 
 size_t FScene::getRenderableCount() const noexcept {
@@ -278,7 +576,7 @@ void FScene::computeBounds(
     using State = FRenderableManager::Visibility;
 
     // Compute the scene bounding volume
-    RenderableSoa const& UTILS_RESTRICT soa = mRenderableData;
+    RenderableSoa const& UTILS_RESTRICT soa = mRenderableCache;
     float3 const* const UTILS_RESTRICT worldAABBCenter = soa.data<WORLD_AABB_CENTER>();
     float3 const* const UTILS_RESTRICT worldAABBExtent = soa.data<WORLD_AABB_EXTENT>();
     uint8_t const* const UTILS_RESTRICT layers = soa.data<LAYERS>();
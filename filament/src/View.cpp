@@ -36,6 +36,8 @@
 #include <math/scalar.h>
 #include <math/fast.h>
 
+#include <limits>
+
 using namespace math;
 using namespace utils;
 
@@ -247,6 +249,15 @@ void FView::setClearTargets(bool color, bool depth, bool stencil) noexcept {
     mClearTargetStencil = stencil;
 }
 
+void FView::setCommandCachingEnabled(bool enabled) noexcept {
+    mCommandCaching = enabled;
+    if (!enabled) {
+        // free the cached commands
+        mColorCommandCache.clear();
+        mShadowCommandCache.clear();
+    }
+}
+
 void FView::setVisibleLayers(uint8_t select, uint8_t values) noexcept {
     mVisibleLayers = (mVisibleLayers & ~select) | (values & select);
 }
@@ -372,9 +383,13 @@ void FView::prepareLighting(FEngine& engine, FEngine::DriverApi& driver, ArenaSc
     // Dynamic lighting
     if (mHasDynamicLighting) {
         Froxelizer& froxelizer = mFroxelizer;
-        if (froxelizer.prepare(driver, arena, viewport, camera.projection, camera.zn, camera.zf)) {
+        if (froxelizer.prepare(driver, viewport, camera.projection, camera.zn, camera.zf,
+                lightData.size() - FScene::DIRECTIONAL_LIGHTS_COUNT)) {
             froxelizer.updateUniforms(u); // update our uniform buffer if needed
         }
+        // the record buffer can be re-allocated by prepare(), and the lights buffer is per-scene
+        mPerViewSb.setBuffer(FEngine::PerViewSib::RECORDS, froxelizer.getRecordBuffer());
+        mPerViewSb.setBuffer(FEngine::PerViewSib::LIGHTS, scene->getGpuLightBuffer().getLightsBuffer());
     }
 }
 
@@ -382,6 +397,10 @@ void FView::prepare(FEngine& engine, driver::DriverApi& driver, ArenaScope& aren
         Viewport const& viewport) noexcept {
     JobSystem& js = engine.getJobSystem();
 
+    // the levels of detail picked last frame are the previous ones for this frame
+    std::swap(mLodLevels, mNextLodLevels);
+    mNextLodLevels.clear();
+
     /*
      * Prepare the scene -- this is where we gather all the objects added to the scene,
      * and in particular their world-space AABB.
@@ -433,9 +452,10 @@ void FView::prepare(FEngine& engine, driver::DriverApi& driver, ArenaScope& aren
             // world origin transform, use only for debugging
             .worldOrigin        = worldOriginCamera
     };
+    const mat4f cullingView =
+            FCamera::getViewMatrix(worldOriginScene * mCullingCamera->getModelMatrix());
     mCullingFrustum = FCamera::getFrustum(
-            mCullingCamera->getCullingProjectionMatrix(),
-            FCamera::getViewMatrix(worldOriginScene * mCullingCamera->getModelMatrix()));
+            mCullingCamera->getCullingProjectionMatrix(), cullingView);
 
     /*
      * Gather all information needed to render this scene. Apply the world origin to all
@@ -448,43 +468,47 @@ void FView::prepare(FEngine& engine, driver::DriverApi& driver, ArenaScope& aren
      * (this will set the VISIBLE_RENDERABLE bit)
      */
 
-    FScene::RenderableSoa& renderableData = scene->getRenderableData();
-    Slice<Culler::result_type> cullingMask = renderableData.slice<FScene::VISIBLE_MASK>();
+    // we cull the scene's cached renderables in place, only the visible ones are copied
+    FScene::RenderableSoa& renderableCache = scene->getRenderableCache();
+    Slice<Culler::result_type> cullingMask = renderableCache.slice<FScene::VISIBLE_MASK>();
     std::fill(cullingMask.begin(), cullingMask.end(), 0); // TODO: can we avoid this fill?
-    prepareVisibleRenderables(js, renderableData);
+    prepareVisibleRenderables(js, renderableCache);
+
+    /*
+     * Occlusion culling: hide the renderables that are behind the visible occluders
+     * (this will clear the VISIBLE_RENDERABLE bit)
+     */
+
+    if (isCullingEnabled() && isOcclusionCullingEnabled()) {
+        prepareOcclusion(js, engine.getRenderableManager(), renderableCache,
+                mat4f{ mCullingCamera->getCullingProjectionMatrix() * cullingView });
+    }
 
     /*
      * Shadowing: compute the shadow camera and cull shadow casters
      * (this will set the VISIBLE_SHADOW_CASTER bit)
      */
 
-    prepareShadowing(engine, driver, renderableData, scene->getLightData());
+    prepareShadowing(engine, driver, renderableCache, scene->getLightData());
 
     /*
-     * partition the array of renderable w.r.t their visibility:
+     * Copy the visible renderables w.r.t their visibility:
      *
-     * Sort the SoA so that invisible objects are first, then renderables,
-     * then both renderable and casters, then casters only -- this operation is somewhat heavy
-     * as it sorts the whole SoA. We use std::partition instead of sort(), which gives us
-     * O(3.N) instead of O(N.log(N)) application of swap().
+     * Renderables first, then both renderable and casters, then casters only. Invisible
+     * objects are not copied at all, so this only costs a pass over the visibility masks
+     * in addition to copying the visible renderables.
      */
 
     // calculate the sorting key for all elements, based on their visibility
-    uint8_t const* layers = renderableData.data<FScene::LAYERS>();
-    auto const* visibility = renderableData.data<FScene::VISIBILITY_STATE>();
+    uint8_t const* layers = renderableCache.data<FScene::LAYERS>();
+    auto const* visibility = renderableCache.data<FScene::VISIBILITY_STATE>();
     computeVisibilityMasks(getVisibleLayers(), layers, visibility, cullingMask.begin(),
-            renderableData.size());
+            renderableCache.size());
 
-    auto const beginRenderables = renderableData.begin();
-    auto beginCasters = partition(beginRenderables, renderableData.end(), VISIBLE_RENDERABLE);
-    auto beginCastersOnly = partition(beginCasters, renderableData.end(), VISIBLE_ALL);
-    auto endCastersOnly = partition(beginCastersOnly, renderableData.end(), VISIBLE_SHADOW_CASTER);
-
-    // convert to indices
-    uint32_t iEnd = uint32_t(endCastersOnly - beginRenderables);
-    mVisibleRenderables = Range{ 0, uint32_t(beginCastersOnly - beginRenderables) };
-    mVisibleShadowCasters = Range{ uint32_t(beginCasters - beginRenderables), iEnd };
-    Range merged = { 0, iEnd };
+    FScene::RenderableSoa& renderableData = scene->getRenderableData();
+    copyVisibleRenderables(renderableCache, renderableData,
+            mVisibleRenderables, mVisibleShadowCasters);
+    Range merged = { 0, uint32_t(renderableData.size()) };
 
     // update those UBOs
     scene->updateUBOs(merged);
@@ -495,7 +519,8 @@ void FView::prepare(FEngine& engine, driver::DriverApi& driver, ArenaScope& aren
      * TODO: this could be done in parallel with culling above
      */
 
-    prepareVisibleLights(engine.getLightManager(), js, scene->getLightData());
+    prepareVisibleLights(engine.getLightManager(), js,
+            scene->getLightCache(), scene->getLightData());
 
     /*
      * Prepare lighting -- this is where we update the lights UBOs, set-up the IBL,
@@ -541,13 +566,54 @@ void FView::computeVisibilityMasks(
 }
 
 UTILS_NOINLINE
-/* static */ FScene::RenderableSoa::iterator FView::partition(
-        FScene::RenderableSoa::iterator begin,
-        FScene::RenderableSoa::iterator end,
-        uint8_t mask) noexcept {
-    return std::partition(begin, end, [mask](auto it) {
-        return it.template get<FScene::VISIBLE_MASK>() == mask;
-    });
+/* static */ void FView::copyVisibleRenderables(
+        FScene::RenderableSoa const& UTILS_RESTRICT renderableCache,
+        FScene::RenderableSoa& UTILS_RESTRICT renderableData,
+        Range& visibleRenderables, Range& visibleShadowCasters) noexcept {
+    Culler::result_type const* const visibleMask = renderableCache.data<FScene::VISIBLE_MASK>();
+    const size_t count = renderableCache.size();
+
+    // count the renderables of each visibility to find where each of them goes
+    uint32_t offsets[VISIBLE_ALL + 1] = {};
+    for (size_t i = 0; i < count; i++) {
+        offsets[visibleMask[i]]++;
+    }
+    const uint32_t renderables = offsets[VISIBLE_RENDERABLE];
+    const uint32_t both = offsets[VISIBLE_ALL];
+    const uint32_t castersOnly = offsets[VISIBLE_SHADOW_CASTER];
+    offsets[VISIBLE_RENDERABLE] = 0;
+    offsets[VISIBLE_ALL] = renderables;
+    offsets[VISIBLE_SHADOW_CASTER] = renderables + both;
+    const uint32_t visibleCount = renderables + both + castersOnly;
+    visibleRenderables = Range{ 0, renderables + both };
+    visibleShadowCasters = Range{ renderables, visibleCount };
+
+    // we need the capacity to be multiple of 16 for SIMD loops, and 1 extra entry at the end
+    // for the summed primitive count
+    const size_t capacity = ((visibleCount + 0xF) & ~0xF) + 1;
+    renderableData.clear();
+    if (renderableData.capacity() < capacity) {
+        renderableData.setCapacity(capacity);
+    }
+    renderableData.resize(visibleCount);
+
+    for (size_t i = 0; i < count; i++) {
+        const Culler::result_type mask = visibleMask[i];
+        if (mask) {
+            const uint32_t j = offsets[mask]++;
+            renderableData.elementAt<FScene::RENDERABLE_INSTANCE>(j) = renderableCache.elementAt<FScene::RENDERABLE_INSTANCE>(i);
+            renderableData.elementAt<FScene::WORLD_TRANSFORM>(j)     = renderableCache.elementAt<FScene::WORLD_TRANSFORM>(i);
+            renderableData.elementAt<FScene::VISIBILITY_STATE>(j)    = renderableCache.elementAt<FScene::VISIBILITY_STATE>(i);
+            renderableData.elementAt<FScene::UBH>(j)                 = renderableCache.elementAt<FScene::UBH>(i);
+            renderableData.elementAt<FScene::BONES_UBH>(j)           = renderableCache.elementAt<FScene::BONES_UBH>(i);
+            renderableData.elementAt<FScene::INSTANCES_UBH>(j)       = renderableCache.elementAt<FScene::INSTANCES_UBH>(i);
+            renderableData.elementAt<FScene::INSTANCE_COUNT>(j)      = renderableCache.elementAt<FScene::INSTANCE_COUNT>(i);
+            renderableData.elementAt<FScene::WORLD_AABB_CENTER>(j)   = renderableCache.elementAt<FScene::WORLD_AABB_CENTER>(i);
+            renderableData.elementAt<FScene::VISIBLE_MASK>(j)        = mask;
+            renderableData.elementAt<FScene::LAYERS>(j)              = renderableCache.elementAt<FScene::LAYERS>(i);
+            renderableData.elementAt<FScene::WORLD_AABB_EXTENT>(j)   = renderableCache.elementAt<FScene::WORLD_AABB_EXTENT>(i);
+        }
+    }
 }
 
 void FView::prepareCamera(const CameraInfo& camera, const Viewport& viewport) const noexcept {
@@ -609,6 +675,12 @@ void FView::commitUniforms(driver::DriverApi& driverApi) const noexcept {
 void FView::commitFroxels(driver::DriverApi& driverApi) const noexcept {
     if (mHasDynamicLighting) {
         mFroxelizer.commit(driverApi);
+
+        // trace how much of the froxelization could be skipped
+        Froxelizer::Stats const& stats = mFroxelizer.getStats();
+        SYSTRACE_VALUE32("froxelizedLights", stats.froxelizedLightCount);
+        SYSTRACE_VALUE32("froxelizationTime (us)",
+                std::chrono::duration_cast<std::chrono::microseconds>(stats.duration).count());
     }
 }
 
@@ -617,22 +689,62 @@ void FView::prepareVisibleRenderables(JobSystem& js,
         FScene::RenderableSoa& renderableData) const noexcept {
     SYSTRACE_CALL();
     if (UTILS_LIKELY(isCullingEnabled())) {
-        cullRenderables(js, renderableData, mCullingFrustum, VISIBLE_RENDERABLE_BIT);
+        cullRenderables(js, renderableData, getScene()->getCullingBvh(),
+                mCullingFrustum, VISIBLE_RENDERABLE_BIT, mCullingSplitter);
     } else {
         std::fill(renderableData.begin<FScene::VISIBLE_MASK>(),
                   renderableData.end<FScene::VISIBLE_MASK>(), VISIBLE_RENDERABLE);
     }
 }
 
+UTILS_NOINLINE
+void FView::prepareOcclusion(JobSystem& js, FRenderableManager const& rcm,
+        FScene::RenderableSoa& renderableData, mat4f const& viewProjection) noexcept {
+    SYSTRACE_CALL();
+
+    // only the occluders that passed frustum culling can hide something
+    auto const* UTILS_RESTRICT instances  = renderableData.data<FScene::RENDERABLE_INSTANCE>();
+    auto const* UTILS_RESTRICT transforms = renderableData.data<FScene::WORLD_TRANSFORM>();
+    auto const* UTILS_RESTRICT visibility = renderableData.data<FScene::VISIBILITY_STATE>();
+    auto const* UTILS_RESTRICT visibles   = renderableData.data<FScene::VISIBLE_MASK>();
+    std::vector<OcclusionCuller::Mesh>& meshes = mOccluderMeshes;
+    meshes.clear();
+    for (size_t i = 0, c = renderableData.size(); i < c; i++) {
+        if (visibility[i].occluder && (visibles[i] & VISIBLE_RENDERABLE)) {
+            FRenderableManager::Occluder const* occluder = rcm.getOccluder(instances[i]);
+            meshes.push_back({ transforms[i],
+                    occluder->vertices.data(), occluder->indices.data(), occluder->indices.size() });
+        }
+    }
+    if (meshes.empty()) {
+        return;
+    }
+
+    mOcclusionCuller.rasterize(js, viewProjection, meshes.data(), meshes.size());
+    mOcclusionCuller.cull(js, renderableData.data<FScene::VISIBLE_MASK>(),
+            renderableData.data<FScene::WORLD_AABB_CENTER>(),
+            renderableData.data<FScene::WORLD_AABB_EXTENT>(),
+            renderableData.size(), VISIBLE_RENDERABLE_BIT);
+}
+
 UTILS_NOINLINE
 void FView::prepareVisibleShadowCasters(JobSystem& js,
         FScene::RenderableSoa& renderableData, Frustum const& lightFrustum) const noexcept {
     SYSTRACE_CALL();
-    cullRenderables(js, renderableData, lightFrustum, VISIBLE_SHADOW_CASTER_BIT);
+    cullRenderables(js, renderableData, getScene()->getCullingBvh(),
+            lightFrustum, VISIBLE_SHADOW_CASTER_BIT, mShadowCullingSplitter);
 }
 
 void FView::cullRenderables(JobSystem& js,
-        FScene::RenderableSoa& renderableData, Frustum const& frustum, size_t bit) noexcept {
+        FScene::RenderableSoa& renderableData, CullingBvh const* bvh,
+        Frustum const& frustum, size_t bit, jobs::AdaptiveSplitter& splitter) noexcept {
+
+    if (bvh) {
+        // reject whole groups of renderables, the bvh uses the same culling routine
+        assert(bvh->size() == renderableData.size());
+        bvh->cull(js, renderableData.data<FScene::VISIBLE_MASK>(), frustum, bit);
+        return;
+    }
 
     float3 const* worldAABBCenter = renderableData.data<FScene::WORLD_AABB_CENTER>();
     float3 const* worldAABBExtent = renderableData.data<FScene::WORLD_AABB_EXTENT>();
@@ -650,25 +762,26 @@ void FView::cullRenderables(JobSystem& js,
 
     // launch the computation on multiple threads
     auto job = jobs::parallel_for(js, nullptr, 0, (uint32_t)renderableData.size(),
-            std::ref(functor), jobs::CountSplitter<Culler::MODULO * Culler::MIN_LOOP_COUNT_HINT, 8>());
+            std::ref(functor), splitter);
     js.runAndWait(job);
 }
 
-void FView::prepareVisibleLights(FLightManager& lcm, utils::JobSystem&, FScene::LightSoa& lightData) const {
+void FView::prepareVisibleLights(FLightManager& lcm, utils::JobSystem&,
+        FScene::LightSoa& lightCache, FScene::LightSoa& lightData) const {
 
-    auto const* UTILS_RESTRICT sphereArray     = lightData.data<FScene::POSITION_RADIUS>();
-    auto const* UTILS_RESTRICT directions      = lightData.data<FScene::DIRECTION>();
-    auto const* UTILS_RESTRICT instanceArray   = lightData.data<FScene::LIGHT_INSTANCE>();
-    auto      * UTILS_RESTRICT visibleArray    = lightData.data<FScene::VISIBILITY>();
+    // the cache doesn't hold the directional light
+    auto const* UTILS_RESTRICT sphereArray     = lightCache.data<FScene::POSITION_RADIUS>();
+    auto const* UTILS_RESTRICT directions      = lightCache.data<FScene::DIRECTION>();
+    auto const* UTILS_RESTRICT instanceArray   = lightCache.data<FScene::LIGHT_INSTANCE>();
+    auto      * UTILS_RESTRICT visibleArray    = lightCache.data<FScene::VISIBILITY>();
 
     Frustum const& frustum = mCullingFrustum;
-    Culler::intersects(visibleArray, frustum, sphereArray, lightData.size());
+    Culler::intersects(visibleArray, frustum, sphereArray, lightCache.size());
 
     const float4* const UTILS_RESTRICT planes = frustum.getNormalizedPlanes();
     // the directional light is considered visible
     size_t visibleLightCount = FScene::DIRECTIONAL_LIGHTS_COUNT;
-    // skip directional light
-    for (size_t i = FScene::DIRECTIONAL_LIGHTS_COUNT; i < lightData.size(); i++) {
+    for (size_t i = 0; i < lightCache.size(); i++) {
         FLightManager::Instance li = instanceArray[i];
         if (visibleArray[i]) {
             if (!lcm.isLightCaster(li)) {
@@ -699,25 +812,60 @@ void FView::prepareVisibleLights(FLightManager& lcm, utils::JobSystem&, FScene::
         }
     }
 
-    // Partition array such that all visible lights appear first
-    UTILS_UNUSED_IN_RELEASE auto last =
-            std::partition(lightData.begin() + FScene::DIRECTIONAL_LIGHTS_COUNT, lightData.end(),
-                    [](auto const& it) {
-                        return it.template get<FScene::VISIBILITY>() != 0;
-                    });
-    assert(visibleLightCount == size_t(last - lightData.begin()));
+    // Copy the visible lights after the directional light
+    assert(lightData.size() == FScene::DIRECTIONAL_LIGHTS_COUNT);
+    const size_t capacity = ((visibleLightCount + 0xF) & ~0xF) + 1;
+    if (lightData.capacity() < capacity) {
+        lightData.setCapacity(capacity);
+    }
+    for (size_t i = 0; i < lightCache.size(); i++) {
+        if (visibleArray[i]) {
+            lightData.push_back(sphereArray[i], directions[i], instanceArray[i], visibleArray[i]);
+        }
+    }
+    assert(visibleLightCount == lightData.size());
 
-    lightData.resize(visibleLightCount);
     mHasDynamicLighting = visibleLightCount > FScene::DIRECTIONAL_LIGHTS_COUNT;
 }
 
-void FView::updatePrimitivesLod(FEngine& engine, const CameraInfo&,
+void FView::updatePrimitivesLod(FEngine& engine, const CameraInfo& camera,
         FScene::RenderableSoa& renderableData, Range visibles) noexcept {
     FRenderableManager const& rcm = engine.getRenderableManager();
+    auto const* const UTILS_RESTRICT instances = renderableData.data<FScene::RENDERABLE_INSTANCE>();
+    auto const* const UTILS_RESTRICT centers = renderableData.data<FScene::WORLD_AABB_CENTER>();
+    auto const* const UTILS_RESTRICT extents = renderableData.data<FScene::WORLD_AABB_EXTENT>();
+    auto* const UTILS_RESTRICT primitives = renderableData.data<FScene::PRIMITIVES>();
+
+    // the levels picked last frame, and the ones picked this frame (this is called by the
+    // shadow and color passes, with the same camera)
+    auto const& previousLevels = mLodLevels;
+    auto& levels = mNextLodLevels;
+
+    // a bounding sphere of radius r at distance d covers r * projection[1][1] / d of the
+    // viewport's height, the distance doesn't matter with an orthographic projection
+    const float3 position = camera.getPosition();
+    const float scale = camera.projection[1][1];
+    const bool perspective = camera.projection[3][3] == 0;
+
     for (uint32_t index : visibles) {
-        uint8_t level = 0; // TODO: pick the proper level of detail
-        auto ri = renderableData.elementAt<FScene::RENDERABLE_INSTANCE>(index);
-        renderableData.elementAt<FScene::PRIMITIVES>(index) = rcm.getRenderPrimitives(ri, level);
+        auto ri = instances[index];
+        uint8_t level = 0;
+        FRenderableManager::LevelsOfDetail const* const lods = rcm.getLevelsOfDetail(ri);
+        if (UTILS_UNLIKELY(lods)) {
+            const float radius = length(extents[index]);
+            const float distance = length(centers[index] - position);
+            float screenSize = radius * scale;
+            if (perspective) {
+                screenSize = distance > radius ? screenSize / distance
+                                               : std::numeric_limits<float>::infinity();
+            }
+            const Entity e = rcm.getEntity(ri);
+            auto pos = previousLevels.find(e);
+            const uint8_t previous = pos != previousLevels.end() ? pos->second : uint8_t(0);
+            level = FRenderableManager::selectLevelOfDetail(*lods, screenSize, previous);
+            levels[e] = level;
+        }
+        primitives[index] = rcm.getRenderPrimitives(ri, level);
     }
 }
 
@@ -800,6 +948,22 @@ void View::setShadowsEnabled(bool enabled) noexcept {
     upcast(this)->setShadowsEnabled(enabled);
 }
 
+void View::setOcclusionCullingEnabled(bool enabled) noexcept {
+    upcast(this)->setOcclusionCullingEnabled(enabled);
+}
+
+bool View::isOcclusionCullingEnabled() const noexcept {
+    return upcast(this)->isOcclusionCullingEnabled();
+}
+
+void View::setCommandCachingEnabled(bool enabled) noexcept {
+    upcast(this)->setCommandCachingEnabled(enabled);
+}
+
+bool View::isCommandCachingEnabled() const noexcept {
+    return upcast(this)->isCommandCachingEnabled();
+}
+
 void View::setRenderTarget(TargetBufferFlags discard) noexcept {
     upcast(this)->setRenderTarget(discard);
 }
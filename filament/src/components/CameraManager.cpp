@@ -53,7 +53,14 @@ void FCameraManager::terminate() noexcept {
 
 void FCameraManager::gc(utils::EntityManager& em) noexcept {
     auto& manager = mManager;
-    manager.gc(em, 4, [this](Entity e) {
+    manager.sweep(em, [this](Entity e) {
+        destroy(e);
+    });
+}
+
+void FCameraManager::gc(Entity const* entities, size_t count) noexcept {
+    auto& manager = mManager;
+    manager.gc(entities, count, [this](Entity e) {
         destroy(e);
     });
 }
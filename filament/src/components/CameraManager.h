@@ -48,8 +48,12 @@ public:
     // free-up all resources
     void terminate() noexcept;
 
+    // removes the components of all dead entities
     void gc(utils::EntityManager& em) noexcept;
 
+    // removes the components of the given destroyed entities
+    void gc(utils::Entity const* entities, size_t count) noexcept;
+
     /*
     * Component Manager APIs
     */
@@ -76,6 +80,7 @@ private:
 
     struct CameraManagerImpl : public Base {
         using Base::gc;
+        using Base::sweep;
         using Base::swap;
         using Base::hasComponent;
     } mManager;
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TNT_FILAMENT_DETAILS_CHANGELOG_H
+#define TNT_FILAMENT_DETAILS_CHANGELOG_H
+
+#include <utils/compiler.h>
+#include <utils/Entity.h>
+#include <utils/Slice.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace filament {
+namespace details {
+
+/*
+ * ChangeLog records the entities whose component data changed in a component manager, so that
+ * consumers (i.e. FScene) can patch their own copy of that data instead of re-gathering it
+ * entirely every frame.
+ *
+ * Consumers keep a Cursor, which is the position in the log they've processed up to. Positions
+ * are absolute, so trimming entries that everybody consumed doesn't invalidate cursors.
+ * A cursor becomes invalid when the entries it still needed were trimmed, or when the whole
+ * log was invalidated (e.g. after a change that can't be expressed per-entity); in that case
+ * the consumer must re-gather everything.
+ *
+ * The same entity can appear several times in the log.
+ */
+class ChangeLog {
+public:
+    // number of entries we keep for a consumer that is behind, regardless of its size
+    static constexpr size_t MAX_ENTRIES = 65536;
+
+    struct Cursor {
+        uint32_t generation = 0;    // 0 is never a valid generation
+        size_t position = 0;
+    };
+
+    // records that the data associated to entity e changed
+    // the log is trimmed once per frame by FEngine::prepare(), so it holds about one frame
+    // worth of changes.
+    void push(utils::Entity e) {
+        mEntities.push_back(e);
+    }
+
+    // all consumers must re-gather everything
+    void invalidate() noexcept {
+        mGeneration++;
+        trim(end().position);
+    }
+
+    // drop all entries before position
+    void trim(size_t position) noexcept {
+        position = std::min(std::max(position, mBase), mBase + mEntities.size());
+        mEntities.erase(mEntities.begin(), mEntities.begin() + (position - mBase));
+        mBase = position;
+    }
+
+    // whether all the changes since cursor are still available
+    bool isValid(Cursor const& cursor) const noexcept {
+        return cursor.generation == mGeneration && cursor.position >= mBase;
+    }
+
+    // the entities that changed since cursor, which must be valid
+    utils::Slice<const utils::Entity> since(Cursor const& cursor) const noexcept {
+        assert(isValid(cursor));
+        return { mEntities.data() + (cursor.position - mBase), mEntities.data() + mEntities.size() };
+    }
+
+    // a cursor past the last change
+    Cursor end() const noexcept {
+        return { mGeneration, mBase + mEntities.size() };
+    }
+
+private:
+    std::vector<utils::Entity> mEntities;
+    size_t mBase = 0;
+    uint32_t mGeneration = 1;
+};
+
+} // namespace details
+} // namespace filament
+
+#endif // TNT_FILAMENT_DETAILS_CHANGELOG_H
@@ -195,7 +195,12 @@ void FLightManager::destroy(utils::Entity e) noexcept {
     Instance i = getInstance(e);
     if (i) {
         auto& manager = mManager;
-        manager.removeComponent(e);
+        Instance moved = manager.removeComponent(e);
+        mChangeLog.push(e);
+        if (moved != i) {
+            // the last component was moved into our slot, its Instance changed
+            mChangeLog.push(manager.getEntity(i));
+        }
     }
 }
 
@@ -217,12 +222,14 @@ void FLightManager::setLocalPosition(Instance i, const math::float3& position) n
     assert(i);
     auto& manager = mManager;
     manager[i].position = position;
+    mChangeLog.push(manager.getEntity(i));
 }
 
 void FLightManager::setLocalDirection(Instance i, float3 direction) noexcept {
     assert(i);
     auto& manager = mManager;
     manager[i].direction = direction;
+    mChangeLog.push(manager.getEntity(i));
 }
 
 void FLightManager::setColor(Instance i, const LinearColor& color) noexcept {
@@ -266,6 +273,7 @@ void FLightManager::setIntensity(Instance i, float intensity) noexcept {
                 break;
         }
         manager[i].intensity = luminousIntensity;
+        mChangeLog.push(manager.getEntity(i));
     }
 }
 
@@ -276,6 +284,7 @@ void FLightManager::setFalloff(Instance i, float falloff) noexcept {
         SpotParams& spotParams = manager[i].spotParams;
         manager[i].squaredFallOffInv = sqFalloff ? (1 / sqFalloff) : 0;
         spotParams.radius = falloff;
+        mChangeLog.push(manager.getEntity(i));
     }
 }
 
@@ -19,6 +19,8 @@
 
 #include "upcast.h"
 
+#include "components/ChangeLog.h"
+
 #include "driver/DriverApiForward.h"
 
 #include <filament/LightManager.h>
@@ -59,10 +61,25 @@ public:
 
     void prepare(driver::DriverApi& driver) const noexcept;
 
+    // removes the components of all dead entities
     void gc(utils::EntityManager& em) noexcept {
-        mManager.gc(em);
+        mManager.sweep(em, [this](utils::Entity e) {
+            destroy(e);
+        });
+    }
+
+    // removes the components of the given destroyed entities
+    void gc(utils::Entity const* entities, size_t count) noexcept {
+        mManager.gc(entities, count, [this](utils::Entity e) {
+            destroy(e);
+        });
     }
 
+    // entities whose scene-visible state (type, position, direction, radius, intensity)
+    // changed, or which gained or lost their component
+    ChangeLog const& getChangeLog() const noexcept { return mChangeLog; }
+    ChangeLog& getChangeLog() noexcept { return mChangeLog; }
+
     struct LightType {
         Type type : 3;
         uint8_t shadowMapBits : 4;
@@ -235,6 +252,7 @@ private:
 
     struct Sim : public Base {
         using Base::gc;
+        using Base::sweep;
         using Base::swap;
 
         struct Proxy {
@@ -268,6 +286,7 @@ private:
     };
 
     Sim mManager;
+    ChangeLog mChangeLog;
     FEngine& mEngine;
 };
 
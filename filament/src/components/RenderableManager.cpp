@@ -24,9 +24,13 @@
 #include "details/Material.h"
 #include "details/RenderPrimitive.h"
 
+#include <private/filament/UibGenerator.h>
+
 #include <utils/Log.h>
 #include <utils/Panic.h>
 
+#include <limits>
+
 using namespace math;
 using namespace utils;
 
@@ -47,6 +51,16 @@ struct RenderableManager::BuilderDetails {
     uint8_t mSkinningBoneCount = 0;
     Bone const* mBones = nullptr;
     math::mat4f const* mBoneMatrices = nullptr;
+    uint8_t mInstanceCount = 0;
+    math::mat4f const* mInstanceTransforms = nullptr;
+    math::float3 const* mOccluderVertices = nullptr;
+    size_t mOccluderVertexCount = 0;
+    uint16_t const* mOccluderIndices = nullptr;
+    size_t mOccluderIndexCount = 0;
+    size_t mLodFirst[MAX_LOD_COUNT] = {};
+    float mLodScreenSize[MAX_LOD_COUNT] = {};
+    float mLodHysteresis = 0;
+    uint8_t mLodCount = 1;
 
     explicit BuilderDetails(size_t count)
             : mEntriesCount(count), mCulling(true), mCastShadows(false), mReceiveShadows(true) {
@@ -152,6 +166,28 @@ RenderableManager::Builder& RenderableManager::Builder::skinning(
     return *this;
 }
 
+RenderableManager::Builder& RenderableManager::Builder::instances(size_t instanceCount) noexcept {
+    mImpl->mInstanceCount = (uint8_t)std::min(CONFIG_MAX_INSTANCE_COUNT, instanceCount);
+    return *this;
+}
+
+RenderableManager::Builder& RenderableManager::Builder::instances(
+        size_t instanceCount, math::mat4f const* transforms) noexcept {
+    mImpl->mInstanceCount = (uint8_t)std::min(CONFIG_MAX_INSTANCE_COUNT, instanceCount);
+    mImpl->mInstanceTransforms = transforms;
+    return *this;
+}
+
+RenderableManager::Builder& RenderableManager::Builder::occluder(
+        math::float3 const* vertices, size_t vertexCount,
+        uint16_t const* indices, size_t indexCount) noexcept {
+    mImpl->mOccluderVertices = vertices;
+    mImpl->mOccluderVertexCount = vertexCount;
+    mImpl->mOccluderIndices = indices;
+    mImpl->mOccluderIndexCount = indexCount;
+    return *this;
+}
+
 RenderableManager::Builder& RenderableManager::Builder::blendOrder(size_t index, uint16_t blendOrder) noexcept {
     if (index < mImpl->mEntriesCount) {
         mImpl->mEntries[index].blendOrder = blendOrder;
@@ -159,7 +195,50 @@ RenderableManager::Builder& RenderableManager::Builder::blendOrder(size_t index,
     return *this;
 }
 
+RenderableManager::Builder& RenderableManager::Builder::levelOfDetail(
+        uint8_t level, size_t first, float screenSize) noexcept {
+    if (level > 0 && level < MAX_LOD_COUNT) {
+        mImpl->mLodFirst[level] = first;
+        mImpl->mLodScreenSize[level] = screenSize;
+        mImpl->mLodCount = std::max(mImpl->mLodCount, uint8_t(level + 1));
+    }
+    return *this;
+}
+
+RenderableManager::Builder& RenderableManager::Builder::levelOfDetailHysteresis(
+        float hysteresis) noexcept {
+    mImpl->mLodHysteresis = std::max(0.0f, hysteresis);
+    return *this;
+}
+
 RenderableManager::Builder::Result RenderableManager::Builder::build(Engine& engine, Entity entity) {
+    // levels of detail must be in order and not empty
+    for (size_t l = 1, c = mImpl->mLodCount; l < c; l++) {
+        if (!ASSERT_PRECONDITION_NON_FATAL(
+                mImpl->mLodFirst[l] > mImpl->mLodFirst[l - 1] &&
+                mImpl->mLodFirst[l] < mImpl->mEntriesCount,
+                "[entity=%u] level of detail %u must start after the previous one and "
+                        "before the last primitive", entity.getId(), l)) {
+            return Error;
+        }
+        if (!ASSERT_PRECONDITION_NON_FATAL(mImpl->mLodScreenSize[l] > 0 &&
+                (l == 1 || mImpl->mLodScreenSize[l] < mImpl->mLodScreenSize[l - 1]),
+                "[entity=%u] level of detail %u must have a smaller screen size than the "
+                        "previous one", entity.getId(), l)) {
+            return Error;
+        }
+    }
+
+    // the occluder is rasterized on a job thread, its indices must all be valid
+    for (size_t i = 0, c = mImpl->mOccluderIndexCount; i < c; i++) {
+        if (!ASSERT_PRECONDITION_NON_FATAL(
+                mImpl->mOccluderIndices[i] < mImpl->mOccluderVertexCount,
+                "[entity=%u] occluder index @ %u (%u) >= vertexCount (%u)", entity.getId(),
+                unsigned(i), mImpl->mOccluderIndices[i], unsigned(mImpl->mOccluderVertexCount))) {
+            return Error;
+        }
+    }
+
     bool isEmpty = true;
     for (size_t i = 0, c = mImpl->mEntriesCount; i < c; i++) {
         auto& entry = mImpl->mEntries[i];
@@ -259,6 +338,11 @@ void FRenderableManager::create(
         if (bones && !builder->mSkinningBoneCount) {
             driver.destroyUniformBuffer(bones->handle);
         }
+        std::unique_ptr<InstanceTransforms>& instances = manager[ci].instances;
+        if (instances && !builder->mInstanceCount) {
+            driver.destroyUniformBuffer(instances->handle);
+            instances.reset();
+        }
     }
 
     ci = manager.addComponent(entity);
@@ -274,6 +358,21 @@ void FRenderableManager::create(
         }
         setPrimitives(ci, { rp, size_type(builder->mEntriesCount) });
 
+        std::unique_ptr<LevelsOfDetail>& lods = manager[ci].lods;
+        lods.reset();
+        if (builder->mLodCount > 1) {
+            lods.reset(new LevelsOfDetail);
+            lods->count = builder->mLodCount;
+            lods->hysteresis = builder->mLodHysteresis;
+            for (size_t l = 0, c = builder->mLodCount; l < c; l++) {
+                const size_t first = builder->mLodFirst[l];
+                const size_t last = l + 1 < c ? builder->mLodFirst[l + 1] : builder->mEntriesCount;
+                lods->levels[l] = { rp + first, size_type(last - first) };
+                lods->screenSizes[l] = l ? builder->mLodScreenSize[l]
+                                         : std::numeric_limits<float>::infinity();
+            }
+        }
+
         setAxisAlignedBoundingBox(ci, builder->mAABB);
         setLayerMask(ci, builder->mLayerMask);
         setPriority(ci, builder->mPriority);
@@ -282,6 +381,17 @@ void FRenderableManager::create(
         setCulling(ci, builder->mCulling);
         static_cast<Visibility&>(manager[ci].visibility).skinning = builder->mSkinningBoneCount > 0;
 
+        std::unique_ptr<Occluder>& occluder = manager[ci].occluder;
+        occluder.reset();
+        if (builder->mOccluderIndexCount >= 3) {
+            occluder.reset(new Occluder);
+            occluder->vertices.assign(builder->mOccluderVertices,
+                    builder->mOccluderVertices + builder->mOccluderVertexCount);
+            occluder->indices.assign(builder->mOccluderIndices,
+                    builder->mOccluderIndices + builder->mOccluderIndexCount - builder->mOccluderIndexCount % 3);
+        }
+        static_cast<Visibility&>(manager[ci].visibility).occluder = bool(occluder);
+
         if (!canReuse) {
             getUniformBuffer(ci) = UniformBuffer(engine.getPerRenderableUib());
             setUniformHandle(ci, driver.createUniformBuffer(getUniformBuffer(ci).getSize()));
@@ -308,6 +418,24 @@ void FRenderableManager::create(
                 std::fill_n(out, bones->count, Bone{});
             }
         }
+        if (builder->mInstanceCount) {
+            std::unique_ptr<InstanceTransforms>& instances = manager[ci].instances;
+            if (!instances) {
+                instances.reset(new InstanceTransforms);
+                instances->transforms = UniformBuffer(UibGenerator::getPerRenderableInstancesUib());
+                instances->handle = driver.createUniformBuffer(instances->transforms.getSize());
+            }
+            instances->count = builder->mInstanceCount;
+            if (builder->mInstanceTransforms) {
+                setInstances(ci, builder->mInstanceTransforms, builder->mInstanceCount);
+            } else {
+                // initialize the instances to identity
+                for (size_t i = 0, c = instances->count; i < c; i++) {
+                    const mat4f identity;
+                    setInstances(ci, &identity, 1, i);
+                }
+            }
+        }
     }
 }
 
@@ -316,7 +444,18 @@ void FRenderableManager::destroy(utils::Entity e) noexcept {
     Instance ci = getInstance(e);
     if (ci) {
         destroyComponent(ci);
-        mManager.removeComponent(e);
+        removeComponent(e);
+    }
+}
+
+void FRenderableManager::removeComponent(utils::Entity e) noexcept {
+    auto& manager = mManager;
+    Instance ci = manager.getInstance(e);
+    Instance moved = manager.removeComponent(e);
+    mChangeLog.push(e);
+    if (moved != ci) {
+        // the last component was moved into our slot, its Instance changed
+        changed(ci);
     }
 }
 
@@ -352,6 +491,12 @@ void FRenderableManager::destroyComponent(Instance ci) noexcept {
     if (bones) {
         driver.destroyUniformBuffer(bones->handle);
     }
+
+    // and the instances transforms
+    std::unique_ptr<InstanceTransforms> const& instances = manager[ci].instances;
+    if (instances) {
+        driver.destroyUniformBuffer(instances->handle);
+    }
 }
 
 void FRenderableManager::destroyComponentPrimitives(
@@ -371,6 +516,8 @@ void FRenderableManager::prepare(
     UniformBuffer           const * const UTILS_RESTRICT uniforms = manager.raw_array<UNIFORMS>();
     Handle<HwUniformBuffer> const * const UTILS_RESTRICT ubhs     = manager.raw_array<UNIFORMS_HANDLE>();
     std::unique_ptr<Bones>  const * const UTILS_RESTRICT bones    = manager.raw_array<BONES>();
+    std::unique_ptr<InstanceTransforms> const * const UTILS_RESTRICT transforms =
+            manager.raw_array<INSTANCES>();
     for (uint32_t index : list) {
         size_t i = instances[index].asValue();
         assert(i);  // we should never get the null instance here
@@ -385,6 +532,13 @@ void FRenderableManager::prepare(
                 bones[i]->bones.clean();
             }
         }
+        if (UTILS_UNLIKELY(transforms[i])) {
+            if (transforms[i]->transforms.isDirty()) {
+                driver.updateUniformBuffer(transforms[i]->handle,
+                        UniformBuffer(transforms[i]->transforms));
+                transforms[i]->transforms.clean();
+            }
+        }
     }
 }
 
@@ -407,7 +561,7 @@ void FRenderableManager::updateLocalUBO(Instance instance, const math::mat4f& mo
 
 void FRenderableManager::setMaterialInstanceAt(Instance instance, uint8_t level,
         size_t primitiveIndex, FMaterialInstance const* mi) noexcept {
-    if (instance) {
+    if (instance && level < getLevelCount(instance)) {
         Slice<FRenderPrimitive>& primitives = getRenderPrimitives(instance, level);
         if (primitiveIndex < primitives.size()) {
             primitives[primitiveIndex].setMaterialInstance(upcast(mi));
@@ -426,7 +580,7 @@ void FRenderableManager::setMaterialInstanceAt(Instance instance, uint8_t level,
 
 MaterialInstance* FRenderableManager::getMaterialInstanceAt(
         Instance instance, uint8_t level, size_t primitiveIndex) const noexcept {
-    if (instance) {
+    if (instance && level < getLevelCount(instance)) {
         const Slice<FRenderPrimitive>& primitives = getRenderPrimitives(instance, level);
         if (primitiveIndex < primitives.size()) {
             // We store the material instance as const because we don't want to change it internally
@@ -439,7 +593,7 @@ MaterialInstance* FRenderableManager::getMaterialInstanceAt(
 
 void FRenderableManager::setBlendOrderAt(Instance instance, uint8_t level,
         size_t primitiveIndex, uint16_t order) noexcept {
-    if (instance) {
+    if (instance && level < getLevelCount(instance)) {
         Slice<FRenderPrimitive>& primitives = getRenderPrimitives(instance, level);
         if (primitiveIndex < primitives.size()) {
             primitives[primitiveIndex].setBlendOrder(order);
@@ -449,7 +603,7 @@ void FRenderableManager::setBlendOrderAt(Instance instance, uint8_t level,
 
 AttributeBitset FRenderableManager::getEnabledAttributesAt(
         Instance instance, uint8_t level, size_t primitiveIndex) const noexcept {
-    if (instance) {
+    if (instance && level < getLevelCount(instance)) {
         Slice<FRenderPrimitive> const& primitives = getRenderPrimitives(instance, level);
         if (primitiveIndex < primitives.size()) {
             return primitives[primitiveIndex].getEnabledAttributes();
@@ -461,7 +615,7 @@ AttributeBitset FRenderableManager::getEnabledAttributesAt(
 void FRenderableManager::setGeometryAt(Instance instance, uint8_t level, size_t primitiveIndex,
         PrimitiveType type, FVertexBuffer* vertices, FIndexBuffer* indices,
         size_t offset, size_t count) noexcept {
-    if (instance) {
+    if (instance && level < getLevelCount(instance)) {
         Slice<FRenderPrimitive>& primitives = getRenderPrimitives(instance, level);
         if (primitiveIndex < primitives.size()) {
             primitives[primitiveIndex].set(mEngine, type, vertices, indices, offset,
@@ -472,7 +626,7 @@ void FRenderableManager::setGeometryAt(Instance instance, uint8_t level, size_t
 
 void FRenderableManager::setGeometryAt(Instance instance, uint8_t level, size_t primitiveIndex,
         PrimitiveType type, size_t offset, size_t count) noexcept {
-    if (instance) {
+    if (instance && level < getLevelCount(instance)) {
         Slice<FRenderPrimitive>& primitives = getRenderPrimitives(instance, level);
         if (primitiveIndex < primitives.size()) {
             primitives[primitiveIndex].set(mEngine, type, offset, 0, 0, count);
@@ -480,6 +634,22 @@ void FRenderableManager::setGeometryAt(Instance instance, uint8_t level, size_t
     }
 }
 
+uint8_t FRenderableManager::selectLevelOfDetail(LevelsOfDetail const& lods,
+        float screenSize, uint8_t previous) noexcept {
+    // level i is used while screenSize is in [screenSizes[i + 1], screenSizes[i]), the
+    // thresholds are moved away from the previous level by the hysteresis
+    const float lower = 1.0f - lods.hysteresis;
+    const float upper = 1.0f + lods.hysteresis;
+    uint8_t level = std::min(previous, uint8_t(lods.count - 1));
+    while (level + 1 < lods.count && screenSize < lods.screenSizes[level + 1] * lower) {
+        level++;
+    }
+    while (level > 0 && screenSize >= lods.screenSizes[level] * upper) {
+        level--;
+    }
+    return level;
+}
+
 void FRenderableManager::setBones(Instance ci,
         Bone const* UTILS_RESTRICT transforms, size_t boneCount, size_t offset) noexcept {
     if (ci) {
@@ -514,6 +684,27 @@ void FRenderableManager::setBones(Instance ci,
     }
 }
 
+void FRenderableManager::setInstances(Instance ci,
+        math::mat4f const* UTILS_RESTRICT transforms, size_t instanceCount, size_t offset) noexcept {
+    if (ci) {
+        std::unique_ptr<InstanceTransforms> const& instances = mManager[ci].instances;
+        if (instances && offset < instances->count) {
+            assert(offset + instanceCount <= instances->count);
+            instanceCount = std::min(instanceCount, instances->count - offset);
+            // see UibGenerator::getPerRenderableInstancesUib(), mat3 are stored as 3 float4
+            constexpr size_t normalsOffset = CONFIG_MAX_INSTANCE_COUNT * sizeof(mat4f);
+            UniformBuffer& ub = instances->transforms;
+            for (size_t i = 0; i < instanceCount; ++i) {
+                mat4f const& m = transforms[i];
+                ub.setUniform((offset + i) * sizeof(mat4f), m);
+                // see updateLocalUBO()
+                ub.setUniform(normalsOffset + (offset + i) * 3 * sizeof(float4),
+                        transpose(inverse(m.upperLeft())));
+            }
+        }
+    }
+}
+
 } // namespace details
 
 
@@ -568,20 +759,42 @@ const Box& RenderableManager::getAxisAlignedBoundingBox(Instance instance) const
     return upcast(this)->getAxisAlignedBoundingBox(instance);
 }
 
+size_t RenderableManager::getInstanceCount(Instance instance) const noexcept {
+    return upcast(this)->getInstanceCount(instance);
+}
+
+size_t RenderableManager::getLevelCount(Instance instance) const noexcept {
+    return upcast(this)->getLevelCount(instance);
+}
+
 size_t RenderableManager::getPrimitiveCount(Instance instance) const noexcept {
     return upcast(this)->getPrimitiveCount(instance, 0);
 }
 
+size_t RenderableManager::getPrimitiveCount(Instance instance, uint8_t level) const noexcept {
+    return level < getLevelCount(instance) ? upcast(this)->getPrimitiveCount(instance, level) : 0;
+}
+
 void RenderableManager::setMaterialInstanceAt(Instance instance,
         size_t primitiveIndex, MaterialInstance const* materialInstance) noexcept {
     upcast(this)->setMaterialInstanceAt(instance, 0, primitiveIndex, upcast(materialInstance));
 }
 
+void RenderableManager::setMaterialInstanceAt(Instance instance, uint8_t level,
+        size_t primitiveIndex, MaterialInstance const* materialInstance) noexcept {
+    upcast(this)->setMaterialInstanceAt(instance, level, primitiveIndex, upcast(materialInstance));
+}
+
 MaterialInstance* RenderableManager::getMaterialInstanceAt(
         Instance instance, size_t primitiveIndex) const noexcept {
     return upcast(this)->getMaterialInstanceAt(instance, 0, primitiveIndex);
 }
 
+MaterialInstance* RenderableManager::getMaterialInstanceAt(
+        Instance instance, uint8_t level, size_t primitiveIndex) const noexcept {
+    return upcast(this)->getMaterialInstanceAt(instance, level, primitiveIndex);
+}
+
 void RenderableManager::setBlendOrderAt(Instance instance, size_t primitiveIndex, uint16_t order) noexcept {
     upcast(this)->setBlendOrderAt(instance, 0, primitiveIndex, order);
 }
@@ -612,4 +825,9 @@ void RenderableManager::setBones(Instance instance,
     upcast(this)->setBones(instance, transforms, boneCount, offset);
 }
 
+void RenderableManager::setInstances(Instance instance,
+        mat4f const* transforms, size_t instanceCount, size_t offset) noexcept {
+    upcast(this)->setInstances(instance, transforms, instanceCount, offset);
+}
+
 } // namespace filament
@@ -19,6 +19,8 @@
 
 #include "upcast.h"
 
+#include "components/ChangeLog.h"
+
 #include "driver/DriverApiForward.h"
 #include "driver/UniformBuffer.h"
 #include "driver/Handle.h"
@@ -31,6 +33,9 @@
 #include <utils/Slice.h>
 #include <utils/Range.h>
 
+#include <memory>
+#include <vector>
+
 namespace filament {
 namespace details {
 
@@ -47,8 +52,28 @@ public:
         bool receiveShadows : 1;
         bool culling        : 1;
         bool skinning       : 1;
+        bool occluder       : 1;
+    };
+
+    // simplified geometry used for occlusion culling, see Builder::occluder()
+    struct Occluder {
+        std::vector<math::float3> vertices;
+        std::vector<uint16_t> indices;
     };
 
+    // levels of detail, see Builder::levelOfDetail()
+    struct LevelsOfDetail {
+        utils::Slice<FRenderPrimitive> levels[MAX_LOD_COUNT];
+        float screenSizes[MAX_LOD_COUNT];   // level i is used below screenSizes[i]
+        float hysteresis;
+        uint8_t count;
+    };
+
+    // returns the level of detail to use for a renderable covering 'screenSize' of the viewport,
+    // given the level used last time
+    static uint8_t selectLevelOfDetail(LevelsOfDetail const& lods,
+            float screenSize, uint8_t previous) noexcept;
+
     FRenderableManager(FEngine& engine) noexcept;
     ~FRenderableManager();
 
@@ -59,6 +84,10 @@ public:
      * Component Manager APIs
      */
 
+    size_t getComponentCount() const noexcept {
+        return mManager.getComponentCount();
+    }
+
     bool hasComponent(utils::Entity e) const noexcept {
         return mManager.hasComponent(e);
     }
@@ -67,6 +96,10 @@ public:
         return mManager.getInstance(e);
     }
 
+    utils::Entity getEntity(Instance instance) const noexcept {
+        return mManager.getEntity(instance);
+    }
+
     void create(const RenderableManager::Builder& builder, utils::Entity entity);
 
     void destroy(utils::Entity e) noexcept;
@@ -77,10 +110,25 @@ public:
             RenderableManager::Instance const* instances,
             utils::Range<uint32_t> list) const noexcept;
 
+    // removes the components of all dead entities
     void gc(utils::EntityManager& em) noexcept {
-        mManager.gc(em);
+        mManager.sweep(em, [this](utils::Entity e) {
+            removeComponent(e);
+        });
     }
 
+    // removes the components of the given destroyed entities
+    void gc(utils::Entity const* entities, size_t count) noexcept {
+        mManager.gc(entities, count, [this](utils::Entity e) {
+            removeComponent(e);
+        });
+    }
+
+    // entities whose scene-visible state (aabb, layers, visibility, uniform handles) changed,
+    // or which gained or lost their component
+    ChangeLog const& getChangeLog() const noexcept { return mChangeLog; }
+    ChangeLog& getChangeLog() noexcept { return mChangeLog; }
+
     utils::Slice<const UniformBuffer> getUniformBuffers() const noexcept {
         return mManager.slice<UNIFORMS>();
     }
@@ -106,11 +154,14 @@ public:
     inline void setPrimitives(Instance instance, utils::Slice<FRenderPrimitive> const& primitives) noexcept;
     inline void setBones(Instance instance, Bone const* transforms, size_t boneCount, size_t offset = 0) noexcept;
     inline void setBones(Instance instance, math::mat4f const* transforms, size_t boneCount, size_t offset = 0) noexcept;
+    void setInstances(Instance instance, math::mat4f const* transforms, size_t instanceCount, size_t offset = 0) noexcept;
 
 
     inline bool isShadowCaster(Instance instance) const noexcept;
     inline bool isShadowReceiver(Instance instance) const noexcept;
     inline bool isCullingEnabled(Instance instance) const noexcept;
+    inline Occluder const* getOccluder(Instance instance) const noexcept;
+    inline LevelsOfDetail const* getLevelsOfDetail(Instance instance) const noexcept;
 
     inline Box const& getAABB(Instance instance) const noexcept;
     inline Box const& getAxisAlignedBoundingBox(Instance instance) const noexcept { return getAABB(instance); }
@@ -123,9 +174,11 @@ public:
 
     inline Handle<HwUniformBuffer> getUbh(Instance instance) const noexcept;
     inline Handle<HwUniformBuffer> getBonesUbh(Instance instance) const noexcept;
+    inline Handle<HwUniformBuffer> getInstancesUbh(Instance instance) const noexcept;
+    inline size_t getInstanceCount(Instance instance) const noexcept;
 
 
-    inline size_t getLevelCount(Instance instance) const noexcept { return 1; }
+    inline size_t getLevelCount(Instance instance) const noexcept;
     inline size_t getPrimitiveCount(Instance instance, uint8_t level) const noexcept;
     void setMaterialInstanceAt(Instance instance, uint8_t level,
             size_t primitiveIndex, FMaterialInstance const* materialInstance) noexcept;
@@ -143,6 +196,8 @@ public:
 
 private:
     void destroyComponent(Instance ci) noexcept;
+    void removeComponent(utils::Entity e) noexcept;
+    inline void changed(Instance ci) noexcept;
     static void destroyComponentPrimitives(FEngine& engine,
             utils::Slice<FRenderPrimitive>& primitives) noexcept;
 
@@ -152,6 +207,13 @@ private:
         uint8_t count;
     };
 
+    // per-instance transforms, see Builder::instances()
+    struct InstanceTransforms {
+        filament::Handle<HwUniformBuffer> handle;
+        UniformBuffer transforms;
+        uint8_t count;
+    };
+
     enum {
         AABB,               // user data
         LAYERS,             // user data
@@ -160,6 +222,9 @@ private:
         UNIFORMS,           // filament data, UBO data where world-transform is stored
         UNIFORMS_HANDLE,    // filament data, handle to the driver's UBO
         BONES,              // filament data, UBO storing a pointer to the bones information
+        OCCLUDER,           // user data
+        LODS,               // user data
+        INSTANCES,          // filament data, UBO storing the instances transforms
     };
 
     using Base = utils::SingleInstanceComponentManager<
@@ -169,11 +234,15 @@ private:
             utils::Slice<FRenderPrimitive>,
             UniformBuffer,
             filament::Handle<HwUniformBuffer>,
-            std::unique_ptr<Bones>
+            std::unique_ptr<Bones>,
+            std::unique_ptr<Occluder>,
+            std::unique_ptr<LevelsOfDetail>,
+            std::unique_ptr<InstanceTransforms>
     >;
 
     struct Sim : public Base {
         using Base::gc;
+        using Base::sweep;
         using Base::swap;
 
         struct Proxy {
@@ -191,6 +260,9 @@ private:
                 Field<UNIFORMS>         uniforms;
                 Field<UNIFORMS_HANDLE>  uniformsHandle;
                 Field<BONES>            bones;
+                Field<OCCLUDER>         occluder;
+                Field<LODS>             lods;
+                Field<INSTANCES>        instances;
             };
         };
 
@@ -203,14 +275,20 @@ private:
     };
 
     Sim mManager;
+    ChangeLog mChangeLog;
     FEngine& mEngine;
 };
 
 FILAMENT_UPCAST(RenderableManager)
 
+void FRenderableManager::changed(Instance instance) noexcept {
+    mChangeLog.push(mManager.getEntity(instance));
+}
+
 void FRenderableManager::setAxisAlignedBoundingBox(Instance instance, const Box& aabb) noexcept {
     if (instance) {
         mManager[instance].aabb = aabb;
+        changed(instance);
     }
 }
 
@@ -219,12 +297,14 @@ void FRenderableManager::setLayerMask(Instance instance,
     if (instance) {
         uint8_t& layers = mManager[instance].layers;
         layers = (layers & ~select) | (values & select);
+        changed(instance);
     }
 }
 
 void FRenderableManager::setLayerMask(Instance instance, uint8_t layerMask) noexcept {
     if (instance) {
         mManager[instance].layers = layerMask;
+        changed(instance);
     }
 }
 
@@ -232,6 +312,7 @@ void FRenderableManager::setPriority(Instance instance, uint8_t priority) noexce
     if (instance) {
         Visibility& visibility = mManager[instance].visibility;
         visibility.priority = priority;
+        changed(instance);
     }
 }
 
@@ -239,6 +320,7 @@ void FRenderableManager::setCastShadows(Instance instance, bool enable) noexcept
     if (instance) {
         Visibility& visibility = mManager[instance].visibility;
         visibility.castShadows = enable;
+        changed(instance);
     }
 }
 
@@ -246,6 +328,7 @@ void FRenderableManager::setReceiveShadows(Instance instance, bool enable) noexc
     if (instance) {
         Visibility& visibility = mManager[instance].visibility;
         visibility.receiveShadows = enable;
+        changed(instance);
     }
 }
 
@@ -253,6 +336,7 @@ void FRenderableManager::setCulling(Instance instance, bool enable) noexcept {
     if (instance) {
         Visibility& visibility = mManager[instance].visibility;
         visibility.culling = enable;
+        changed(instance);
     }
 }
 
@@ -260,6 +344,7 @@ void FRenderableManager::setUniformHandle(Instance instance,
         Handle<HwUniformBuffer> const& handle) noexcept {
     if (instance) {
         mManager[instance].uniformsHandle = handle;
+        changed(instance);
     }
 }
 
@@ -287,6 +372,18 @@ bool FRenderableManager::isCullingEnabled(Instance instance) const noexcept {
     return getVisibility(instance).culling;
 }
 
+FRenderableManager::Occluder const*
+FRenderableManager::getOccluder(Instance instance) const noexcept {
+    std::unique_ptr<Occluder> const& occluder = mManager[instance].occluder;
+    return occluder.get();
+}
+
+FRenderableManager::LevelsOfDetail const*
+FRenderableManager::getLevelsOfDetail(Instance instance) const noexcept {
+    std::unique_ptr<LevelsOfDetail> const& lods = mManager[instance].lods;
+    return lods.get();
+}
+
 uint8_t FRenderableManager::getLayerMask(Instance instance) const noexcept {
     return mManager[instance].layers;
 }
@@ -316,14 +413,33 @@ Handle<HwUniformBuffer> FRenderableManager::getBonesUbh(Instance instance) const
     return bones ? bones->handle : Handle<HwUniformBuffer>{};
 }
 
+Handle<HwUniformBuffer> FRenderableManager::getInstancesUbh(Instance instance) const noexcept {
+    std::unique_ptr<InstanceTransforms> const& instances = mManager[instance].instances;
+    return instances ? instances->handle : Handle<HwUniformBuffer>{};
+}
+
+size_t FRenderableManager::getInstanceCount(Instance instance) const noexcept {
+    std::unique_ptr<InstanceTransforms> const& instances = mManager[instance].instances;
+    return instances ? instances->count : 0;
+}
+
+size_t FRenderableManager::getLevelCount(Instance instance) const noexcept {
+    std::unique_ptr<LevelsOfDetail> const& lods = mManager[instance].lods;
+    return lods ? lods->count : 1;
+}
+
 utils::Slice<FRenderPrimitive> const& FRenderableManager::getRenderPrimitives(
         Instance instance, uint8_t level) const noexcept {
-    return mManager[instance].primitives;
+    std::unique_ptr<LevelsOfDetail> const& lods = mManager[instance].lods;
+    assert(level < (lods ? lods->count : 1));
+    return lods ? lods->levels[level] : mManager[instance].primitives;
 }
 
 utils::Slice<FRenderPrimitive>& FRenderableManager::getRenderPrimitives(
         Instance instance, uint8_t level) noexcept {
-    return mManager[instance].primitives;
+    std::unique_ptr<LevelsOfDetail> const& lods = mManager[instance].lods;
+    assert(level < (lods ? lods->count : 1));
+    return lods ? lods->levels[level] : mManager[instance].primitives;
 }
 
 size_t FRenderableManager::getPrimitiveCount(Instance instance, uint8_t level) const noexcept {
@@ -16,13 +16,69 @@
 
 #include "components/TransformManager.h"
 
+#include <utils/JobSystem.h>
+
+#include <math/mat3.h>
+
+#include <algorithm>
+#include <functional>
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#   define TRANSFORM_HAS_NEON 1
+#   include <arm_neon.h>
+#elif defined(__SSE__) || defined(__x86_64__)
+#   define TRANSFORM_HAS_SSE 1
+#   include <xmmintrin.h>
+#endif
+
 using namespace utils;
 using namespace math;
 
 namespace filament {
 namespace details {
 
-FTransformManager::FTransformManager() noexcept = default;
+// out = lhs * rhs, one column at a time.
+// This computes exactly what mat4f::operator*() does, with the same operations in the same order.
+static inline void multiply(mat4f& UTILS_RESTRICT out,
+        mat4f const& lhs, mat4f const& rhs) noexcept {
+    float const* const l = &lhs[0][0];
+    float const* const r = &rhs[0][0];
+    float* const o = &out[0][0];
+#if defined(TRANSFORM_HAS_NEON)
+    const float32x4_t l0 = vld1q_f32(l + 0);
+    const float32x4_t l1 = vld1q_f32(l + 4);
+    const float32x4_t l2 = vld1q_f32(l + 8);
+    const float32x4_t l3 = vld1q_f32(l + 12);
+    for (size_t j = 0; j < 16; j += 4) {
+        // we don't use vmlaq_f32() which could be fused
+        float32x4_t c = vmulq_n_f32(l0, r[j]);
+        c = vaddq_f32(c, vmulq_n_f32(l1, r[j + 1]));
+        c = vaddq_f32(c, vmulq_n_f32(l2, r[j + 2]));
+        c = vaddq_f32(c, vmulq_n_f32(l3, r[j + 3]));
+        vst1q_f32(o + j, c);
+    }
+#elif defined(TRANSFORM_HAS_SSE)
+    const __m128 l0 = _mm_loadu_ps(l + 0);
+    const __m128 l1 = _mm_loadu_ps(l + 4);
+    const __m128 l2 = _mm_loadu_ps(l + 8);
+    const __m128 l3 = _mm_loadu_ps(l + 12);
+    for (size_t j = 0; j < 16; j += 4) {
+        __m128 c = _mm_mul_ps(l0, _mm_set1_ps(r[j]));
+        c = _mm_add_ps(c, _mm_mul_ps(l1, _mm_set1_ps(r[j + 1])));
+        c = _mm_add_ps(c, _mm_mul_ps(l2, _mm_set1_ps(r[j + 2])));
+        c = _mm_add_ps(c, _mm_mul_ps(l3, _mm_set1_ps(r[j + 3])));
+        _mm_storeu_ps(o + j, c);
+    }
+#else
+    (void)l;
+    (void)r;
+    (void)o;
+    out = lhs * rhs;
+#endif
+}
+
+FTransformManager::FTransformManager(JobSystem* js) noexcept : mJobSystem(js) {
+}
 
 FTransformManager::~FTransformManager() noexcept = default;
 
@@ -50,6 +106,7 @@ void FTransformManager::create(Entity entity, Instance parent, const mat4f& loca
         manager[i].next = 0;
         manager[i].prev = 0;
         manager[i].firstChild = 0;
+        manager[i].dirty = false;
         insertNode(i, parent);
         setTransform(i, localTransform);
     }
@@ -87,10 +144,13 @@ void FTransformManager::destroy(Entity e) noexcept {
 
         // 2) remove the component
         Instance moved = manager.removeComponent(e);
+        mChangeLog.push(e);
+        mLevelOrderValid = false;
 
         // 3) update the references to the entry now with Instance i
         if (moved != i) {
             updateNode(i);
+            mChangeLog.push(manager.getEntity(i));
         }
     }
 }
@@ -105,21 +165,88 @@ void FTransformManager::setTransform(Instance ci, const mat4f& model) noexcept {
     }
 }
 
+void FTransformManager::setTransforms(Instance const* instances,
+        const mat4f* localTransforms, size_t count) noexcept {
+    auto& manager = mManager;
+    mat4f* const UTILS_RESTRICT local = manager.raw_array<LOCAL>();
+    for (size_t k = 0; k < count; k++) {
+        const Instance i = instances[k];
+        validateNode(i);
+        if (i) {
+            local[i] = localTransforms[k];
+        }
+    }
+    updateNodeTransforms(instances, count);
+}
+
+void FTransformManager::setTransforms(Instance const* instances,
+        const float3* translations, const quatf* rotations, const float3* scales,
+        size_t count) noexcept {
+    auto& manager = mManager;
+    mat4f* const UTILS_RESTRICT local = manager.raw_array<LOCAL>();
+    for (size_t k = 0; k < count; k++) {
+        const Instance i = instances[k];
+        validateNode(i);
+        if (i) {
+            // translate(t) * rotate(r) * scale(s)
+            const mat3f r(rotations[k]);
+            const float3 s = scales ? scales[k] : float3{ 1 };
+            local[i] = mat4f{
+                    float4{ r[0] * s.x, 0 },
+                    float4{ r[1] * s.y, 0 },
+                    float4{ r[2] * s.z, 0 },
+                    float4{ translations[k], 1 }};
+        }
+    }
+    updateNodeTransforms(instances, count);
+}
+
+// updates the world transforms after the local transforms of several nodes were set
+void FTransformManager::updateNodeTransforms(Instance const* instances, size_t count) noexcept {
+    if (UTILS_UNLIKELY(!mLocalTransformTransactionOpen && !mLevelOrderValid)) {
+        // we can't update the hierarchy level by level without sorting it, which would
+        // invalidate the instances, only commitLocalTransformTransaction() is allowed to do that.
+        for (size_t k = 0; k < count; k++) {
+            if (instances[k]) {
+                updateNodeTransform(instances[k]);
+            }
+        }
+        return;
+    }
+
+    for (size_t k = 0; k < count; k++) {
+        const Instance i = instances[k];
+        if (i) {
+            markDirty(i);
+        }
+    }
+    if (!mLocalTransformTransactionOpen) {
+        transformLevels();
+    }
+}
+
+// flags a node for transformLevels(), which only walks the part of the levels holding dirty nodes
+void FTransformManager::markDirty(Instance i) noexcept {
+    mManager[i].dirty = true;
+    if (mLevelOrderValid) {
+        // otherwise, all the levels are walked after they're sorted
+        auto pos = std::upper_bound(mLevels.begin(), mLevels.end(), i);
+        assert(pos != mLevels.begin() && pos != mLevels.end());
+        Range<uint32_t>& range = mDirtyRanges[pos - mLevels.begin() - 1];
+        range.first = range.empty() ? uint32_t(i) : std::min(range.first, uint32_t(i));
+        range.last = std::max(range.last, uint32_t(i) + 1);
+    }
+}
+
 void FTransformManager::updateNodeTransform(Instance i) noexcept {
     validateNode(i);
     auto& manager = mManager;
     assert(i);
 
     if (UTILS_UNLIKELY(mLocalTransformTransactionOpen)) {
-        // don't update the world transform until commitLocalTransformTransaction() is called
-        Instance ci = manager[i].firstChild;
-        while (ci) {
-            Instance child = manager[ci].firstChild;
-            ci = manager[ci].next;
-            if (child) {
-                updateNodeTransform(child);
-            }
-        }
+        // don't update the world transform until commitLocalTransformTransaction() is called,
+        // which will also update our whole subtree.
+        markDirty(i);
         return;
     }
 
@@ -129,12 +256,13 @@ void FTransformManager::updateNodeTransform(Instance i) noexcept {
     mat4f const& pt = manager.raw_array<WORLD>()[parent];
 
     // compute our world transform
-    manager[i].world = pt * static_cast<mat4f const&>(manager[i].local);
+    multiply(manager.raw_array<WORLD>()[i], pt, manager[i].local);
+    mChangeLog.push(manager.getEntity(i));
 
     // update our children's world transforms
     Instance child = manager[i].firstChild;
     if (UTILS_UNLIKELY(child)) { // assume we don't have a hierarchy in the common case
-        transformChildren(manager, child);
+        transformChildren(manager, mChangeLog, child);
     }
 }
 
@@ -145,21 +273,160 @@ void FTransformManager::openLocalTransformTransaction() noexcept {
 void FTransformManager::commitLocalTransformTransaction() noexcept {
     if (mLocalTransformTransactionOpen) {
         mLocalTransformTransactionOpen = false;
-        auto& manager = mManager;
+        if (UTILS_UNLIKELY(!mLevelOrderValid)) {
+            sortLevels();
+        }
+        transformLevels();
+    }
+}
+
+// Sorts the instances breadth-first, so that each level of the hierarchy is contiguous and
+// stored after its parent level.
+void FTransformManager::sortLevels() noexcept {
+    auto& manager = mManager;
+    const size_t begin = manager.begin();
+    const size_t end = manager.end();
+
+    // find the breadth-first order of the nodes
+    std::vector<Instance> order;
+    order.reserve(end - begin);
+    for (Instance i = manager.begin(), e = manager.end(); i != e; ++i) {
+        if (!Instance(manager[i].parent)) {
+            order.push_back(i);
+        }
+    }
+    mLevels.clear();
+    for (size_t first = 0; first < order.size();) {
+        const size_t last = order.size();
+        mLevels.push_back(Instance(begin + first));
+        for (size_t k = first; k < last; k++) {
+            for (Instance child = manager[order[k]].firstChild; child;
+                    child = manager[child].next) {
+                order.push_back(child);
+            }
+        }
+        first = last;
+    }
+    mLevels.push_back(Instance(end));
 
-        // swapNode() below needs some temporary storage which we provide here
-        auto& soa = manager.getSoA();
-        soa.ensureCapacity(soa.size() + 1);
+    // the dirty nodes are moved below, so we walk all the levels this time
+    mDirtyRanges.resize(getLevelCount());
+    for (size_t k = 0, c = getLevelCount(); k < c; k++) {
+        mDirtyRanges[k] = { uint32_t(mLevels[k]), uint32_t(mLevels[k + 1]) };
+    }
+
+    // this fails if the hierarchy has a cycle
+    assert(order.size() == end - begin);
+
+    // swapNode() below needs some temporary storage which we provide here
+    auto& soa = manager.getSoA();
+    soa.ensureCapacity(soa.size() + 1);
 
-        mat4f const* const UTILS_RESTRICT world = manager.raw_array<WORLD>();
-        for (Instance i = manager.begin(), e = manager.end(); i != e; ++i) {
-            // Ensure that children are always sorted after their parent.
-            if (UTILS_UNLIKELY(Instance(manager[i].parent) > i)) {
-                swapNode(i, manager[i].parent);
+    // move each node to its position, we need to keep track of where the nodes are as we go.
+    // Nodes are identified by their original instance.
+    std::vector<uint32_t> nodeAt(end);     // node at a given instance
+    std::vector<uint32_t> instanceOf(end); // instance of a given node
+    for (size_t i = begin; i < end; i++) {
+        nodeAt[i] = uint32_t(i);
+        instanceOf[i] = uint32_t(i);
+    }
+    for (size_t k = 0, c = order.size(); k < c; k++) {
+        const Instance i = Instance(begin + k);
+        const Instance j = Instance(instanceOf[order[k]]);
+        if (i != j) {
+            swapNode(i, j);
+            std::swap(nodeAt[i], nodeAt[j]);
+            instanceOf[nodeAt[i]] = i;
+            instanceOf[nodeAt[j]] = j;
+        }
+    }
+
+    mLevelOrderValid = true;
+}
+
+// Updates the world transform of all the dirty subtrees, one level at a time. The nodes of
+// a level only depend on the previous level, so each level can be processed in parallel.
+// Only the span of each level that holds dirty nodes, or children of dirty nodes, is walked.
+void FTransformManager::transformLevels() noexcept {
+    auto& manager = mManager;
+    JobSystem* const js = mJobSystem;
+    Instance const* const UTILS_RESTRICT firstChild = manager.raw_array<FIRST_CHILD>();
+    Instance const* const UTILS_RESTRICT next = manager.raw_array<NEXT>();
+    bool* const UTILS_RESTRICT dirty = manager.raw_array<DIRTY>();
+
+    // the children of the dirty nodes of the previous level
+    Range<uint32_t> children{};
+    for (size_t k = 0, c = getLevelCount(); k < c; k++) {
+        Range<uint32_t>& range = mDirtyRanges[k];
+        if (!children.empty()) {
+            range.first = range.empty() ? children.first : std::min(range.first, children.first);
+            range.last = std::max(range.last, children.last);
+        }
+        children = {};
+        if (range.empty()) {
+            continue;
+        }
+
+        const size_t first = range.first;
+        const size_t last = range.last;
+        if (!js || last - first < MIN_PARALLEL_COUNT) {
+            transformRange(manager, first, last);
+        } else {
+            // transform job (this runs on multiple threads)
+            auto functor = [&manager, first](uint32_t index, uint32_t count) {
+                transformRange(manager, first + index, first + index + count);
+            };
+            auto job = jobs::parallel_for(*js, nullptr, 0, uint32_t(last - first),
+                    std::ref(functor), jobs::CountSplitter<MIN_PARALLEL_COUNT / 2, 8>());
+            js->runAndWait(job);
+        }
+
+        // Levels are sorted breadth-first, so the children of a span of a level are contiguous
+        // in the next level, from the first child of the first node to the last child of the
+        // last one.
+        size_t i = first;
+        while (i < last && !(dirty[i] && firstChild[i])) {
+            i++;
+        }
+        if (i < last) {
+            size_t j = last - 1;
+            while (!(dirty[j] && firstChild[j])) {
+                j--;
+            }
+            Instance lastChild = firstChild[j];
+            while (next[lastChild]) {
+                lastChild = next[lastChild];
+            }
+            children = { uint32_t(firstChild[i]), uint32_t(lastChild) + 1 };
+        }
+    }
+
+    // report the nodes that changed, even when most of them did: the scenes patch only those,
+    // which is never more work than re-gathering everything.
+    for (Range<uint32_t>& range : mDirtyRanges) {
+        for (uint32_t i : range) {
+            if (dirty[i]) {
+                dirty[i] = false;
+                mChangeLog.push(manager.getEntity(i));
             }
-            Instance parent = manager[i].parent;
-            assert(parent < i);
-            manager[i].world = world[parent] * static_cast<mat4f const&>(manager[i].local);
+        }
+        range = {};
+    }
+}
+
+// Updates the world transform of the nodes in [first, last) that are dirty or whose parent is,
+// all their parents must be up-to-date.
+void FTransformManager::transformRange(Sim& manager, size_t first, size_t last) noexcept {
+    mat4f* const world = manager.raw_array<WORLD>();
+    mat4f const* const UTILS_RESTRICT local = manager.raw_array<LOCAL>();
+    Instance const* const UTILS_RESTRICT parents = manager.raw_array<PARENT>();
+    bool* const dirty = manager.raw_array<DIRTY>();
+    for (size_t i = first; i < last; i++) {
+        // note: the instance 0 is never dirty, and is the parent of the roots
+        const Instance parent = parents[i];
+        if (dirty[i] || dirty[parent]) {
+            dirty[i] = true;
+            multiply(world[i], world[parent], local[i]);
         }
     }
 }
@@ -172,6 +439,7 @@ void FTransformManager::insertNode(Instance i, Instance parent) noexcept {
 
     manager[i].parent = parent;
     manager[i].prev = 0;
+    mLevelOrderValid = false;
     if (parent) {
         // we insert ourself first in the parent's list
         Instance next = manager[parent].firstChild;
@@ -197,6 +465,7 @@ void FTransformManager::swapNode(Instance i, Instance j) noexcept {
     // swap the content of the nodes directly
     std::swap(manager.elementAt<LOCAL>(i), manager.elementAt<LOCAL>(j));
     std::swap(manager.elementAt<WORLD>(i), manager.elementAt<WORLD>(j));
+    std::swap(manager.elementAt<DIRTY>(i), manager.elementAt<DIRTY>(j));
     manager.swap(i, j); // this swaps the data relative to SingleInstanceComponentManager
 
     // now swap the linked-list references, to do that correctly we must use a temporary
@@ -283,18 +552,19 @@ void FTransformManager::updateNode(Instance i) noexcept {
     validateNode(next);
 }
 
-void FTransformManager::transformChildren(Sim& manager, Instance ci) noexcept {
+void FTransformManager::transformChildren(Sim& manager, ChangeLog& changes, Instance ci) noexcept {
     while (ci) {
         // update child's world transform
         Instance parent = manager[ci].parent;
         mat4f const& pt = manager[parent].world;
         mat4f const& local = manager[ci].local;
-        manager[ci].world = pt * local;
+        multiply(manager.raw_array<WORLD>()[ci], pt, local);
+        changes.push(manager.getEntity(ci));
 
         // assume we don't have a deep hierarchy
         Instance child = manager[ci].firstChild;
         if (UTILS_UNLIKELY(child)) {
-            transformChildren(manager, child);
+            transformChildren(manager, changes, child);
         }
 
         // process our next child
@@ -346,7 +616,14 @@ void FTransformManager::validateNode(Instance i) noexcept {
 
 void FTransformManager::gc(utils::EntityManager& em) noexcept {
     auto& manager = mManager;
-    manager.gc(em, 4, [this](Entity e) {
+    manager.sweep(em, [this](Entity e) {
+                destroy(e);
+            });
+}
+
+void FTransformManager::gc(Entity const* entities, size_t count) noexcept {
+    auto& manager = mManager;
+    manager.gc(entities, count, [this](Entity e) {
                 destroy(e);
             });
 }
@@ -380,6 +657,17 @@ void TransformManager::setTransform(Instance ci, const mat4f& model) noexcept {
     upcast(this)->setTransform(ci, model);
 }
 
+void TransformManager::setTransforms(Instance const* instances,
+        const mat4f* localTransforms, size_t count) noexcept {
+    upcast(this)->setTransforms(instances, localTransforms, count);
+}
+
+void TransformManager::setTransforms(Instance const* instances,
+        const float3* translations, const quatf* rotations, const float3* scales,
+        size_t count) noexcept {
+    upcast(this)->setTransforms(instances, translations, rotations, scales, count);
+}
+
 const mat4f& TransformManager::getTransform(Instance ci) const noexcept {
     return upcast(this)->getTransform(ci);
 }
@@ -19,14 +19,25 @@
 
 #include "upcast.h"
 
+#include "components/ChangeLog.h"
+
 #include <filament/TransformManager.h>
 
 #include <utils/compiler.h>
 #include <utils/SingleInstanceComponentManager.h>
 #include <utils/Entity.h>
 #include <utils/Slice.h>
+#include <utils/Range.h>
 
 #include <math/mat4.h>
+#include <math/quat.h>
+#include <math/vec3.h>
+
+#include <vector>
+
+namespace utils {
+class JobSystem;
+} // namespace utils
 
 namespace filament {
 namespace details {
@@ -35,7 +46,8 @@ class UTILS_PRIVATE FTransformManager : public TransformManager {
 public:
     using Instance = TransformManager::Instance;
 
-    FTransformManager() noexcept;
+    // world transforms are updated on the JobSystem when it's provided
+    explicit FTransformManager(utils::JobSystem* js = nullptr) noexcept;
     ~FTransformManager() noexcept;
 
     // free-up all resources
@@ -66,14 +78,25 @@ public:
 
     void commitLocalTransformTransaction() noexcept;
 
+    // removes the components of all dead entities
     void gc(utils::EntityManager& em) noexcept;
 
+    // removes the components of the given destroyed entities
+    void gc(utils::Entity const* entities, size_t count) noexcept;
+
     utils::Slice<const math::mat4f> getWorldTransforms() const noexcept {
         return mManager.slice<WORLD>();
     }
 
     void setTransform(Instance ci, const math::mat4f& model) noexcept;
 
+    void setTransforms(Instance const* instances,
+            const math::mat4f* localTransforms, size_t count) noexcept;
+
+    void setTransforms(Instance const* instances,
+            const math::float3* translations, const math::quatf* rotations,
+            const math::float3* scales, size_t count) noexcept;
+
     const math::mat4f& getTransform(Instance ci) const noexcept {
         return mManager[ci].local;
     }
@@ -82,16 +105,33 @@ public:
         return mManager[ci].world;
     }
 
+    // entities whose world transform changed, or which gained or lost their component
+    ChangeLog const& getChangeLog() const noexcept { return mChangeLog; }
+    ChangeLog& getChangeLog() noexcept { return mChangeLog; }
+
+    // number of levels of the hierarchy, as of the last commitLocalTransformTransaction()
+    size_t getLevelCount() const noexcept {
+        return mLevels.empty() ? 0 : mLevels.size() - 1;
+    }
+
 private:
     struct Sim;
 
+    // levels with fewer nodes than this are updated on the calling thread
+    static constexpr size_t MIN_PARALLEL_COUNT = 1024;
+
     void validateNode(Instance i) noexcept;
     void removeNode(Instance i) noexcept;
     void updateNode(Instance i) noexcept;
     void updateNodeTransform(Instance i) noexcept;
+    void updateNodeTransforms(Instance const* instances, size_t count) noexcept;
+    void markDirty(Instance i) noexcept;
     void insertNode(Instance i, Instance p) noexcept;
     void swapNode(Instance i, Instance j) noexcept;
-    static void transformChildren(Sim& manager, Instance firstChild) noexcept;
+    void sortLevels() noexcept;
+    void transformLevels() noexcept;
+    static void transformChildren(Sim& manager, ChangeLog& changes, Instance firstChild) noexcept;
+    static void transformRange(Sim& manager, size_t first, size_t last) noexcept;
 
 
     enum {
@@ -101,6 +141,7 @@ private:
         FIRST_CHILD,    // instance to our first child
         NEXT,           // instance to our next sibling
         PREV,           // instance to our previous sibling
+        DIRTY,          // world transform must be updated by commitLocalTransformTransaction()
     };
 
     using Base = utils::SingleInstanceComponentManager<
@@ -109,15 +150,24 @@ private:
             Instance,
             Instance,
             Instance,
-            Instance
+            Instance,
+            bool
     >;
 
     struct Sim : public Base {
         using Base::gc;
+        using Base::sweep;
         using Base::swap;
 
         typename Base::SoA& getSoA() { return mData; }
 
+        // writable version of raw_array()
+        using Base::raw_array;
+        template<size_t E>
+        typename Base::SoA::template TypeAt<E>* raw_array() noexcept {
+            return Base::template data<E>();
+        }
+
         struct Proxy {
             // all of this gets inlined
             UTILS_ALWAYS_INLINE
@@ -132,6 +182,7 @@ private:
                 Field<FIRST_CHILD>  firstChild;
                 Field<NEXT>         next;
                 Field<PREV>         prev;
+                Field<DIRTY>        dirty;
             };
         };
 
@@ -144,6 +195,16 @@ private:
     };
 
     Sim mManager;
+    ChangeLog mChangeLog;
+    utils::JobSystem* mJobSystem = nullptr;
+
+    // Instances are sorted breadth-first (i.e. all roots, then all their children, etc...) by
+    // commitLocalTransformTransaction(), mLevels[k] is the first instance of level k, and the
+    // last entry is the end of the array. Any change to the hierarchy invalidates this order.
+    std::vector<Instance> mLevels;
+    // span of each level holding the dirty nodes, valid only as long as the order is
+    std::vector<utils::Range<uint32_t>> mDirtyRanges;
+    bool mLevelOrderValid = false;
     bool mLocalTransformTransactionOpen = false;
 };
 
@@ -18,15 +18,28 @@
 #define TNT_FILAMENT_DETAILS_ALLOCATORS_H
 
 #include <utils/Allocator.h>
+#include <utils/JobSystem.h>
+
+#include <memory>
+#include <vector>
+
+#include <assert.h>
 
 namespace filament {
 namespace details {
 
 // per render pass allocations
-// Froxelization needs about 1 MiB. Command buffer needs about 1 MiB.
-static constexpr size_t CONFIG_PER_RENDER_PASS_ARENA_SIZE    = 2 * 1024 * 1024;
+// Command buffer needs about 1 MiB. Sorting the command buffer needs about 1 MiB (temporary).
+// This is the size of the first block, more blocks are chained if a frame needs them, and
+// freed after CONFIG_PER_RENDER_PASS_ARENA_UNUSED_FRAMES frames without being used.
+static constexpr size_t CONFIG_PER_RENDER_PASS_ARENA_SIZE    = 3 * 1024 * 1024;
+static constexpr uint32_t CONFIG_PER_RENDER_PASS_ARENA_UNUSED_FRAMES = 60;
 
-// size of the high-level draw commands buffer (comes from the per-render pass allocator)
+// per JobSystem thread allocations, rewound at the end of each frame
+// Recording driver commands in parallel uses this for its per-slice command buffers.
+static constexpr size_t CONFIG_PER_THREAD_ARENA_SIZE = 512 * 1024;
+
+// initial size of the high-level draw commands buffer (comes from the per-render pass allocator)
 static constexpr size_t CONFIG_PER_FRAME_COMMANDS_SIZE = 1 * 1024 * 1024;
 
 // size of a command-stream buffer (comes from mmap -- not the per-engine arena)
@@ -56,7 +69,52 @@ using LinearAllocatorArena = utils::Arena<
 
 #endif
 
-using ArenaScope = utils::ArenaScope<LinearAllocatorArena>;
+// the per-render pass allocator grows as needed, and keeps track of its peak usage
+using PerRenderPassArena = utils::Arena<
+        utils::GrowingLinearAllocator,
+        utils::LockingPolicy::NoLock>;
+
+using ArenaScope = utils::ArenaScope<PerRenderPassArena>;
+
+/*
+ * One linear arena for each thread of a JobSystem, so that jobs can allocate scratch memory
+ * without locks. Allocations last until reset() is called, typically at the end of the frame,
+ * which allows a job to return memory to the thread that waited for it.
+ */
+class PerThreadArenas {
+public:
+    PerThreadArenas(const char* name, utils::JobSystem const& js, size_t size)
+            : mJobSystem(js) {
+        mArenas.resize(js.getThreadSlotCount());
+        for (auto& arena : mArenas) {
+            arena = std::make_unique<LinearAllocatorArena>(name, size);
+        }
+    }
+
+    PerThreadArenas(PerThreadArenas const& rhs) = delete;
+    PerThreadArenas& operator=(PerThreadArenas const& rhs) = delete;
+
+    // arena of the calling thread, which must be part of our JobSystem
+    LinearAllocatorArena& get() noexcept {
+        assert(utils::JobSystem::getJobSystem() == &mJobSystem);
+        return *mArenas[utils::JobSystem::getThreadIndex()];
+    }
+
+    // arena of any thread, the caller must make sure that thread isn't using it
+    size_t getArenaCount() const noexcept { return mArenas.size(); }
+    LinearAllocatorArena& get(size_t index) noexcept { return *mArenas[index]; }
+
+    // rewinds all the arenas, no job can be using them
+    void reset() noexcept {
+        for (auto& arena : mArenas) {
+            arena->reset();
+        }
+    }
+
+private:
+    utils::JobSystem const& mJobSystem;
+    std::vector<std::unique_ptr<LinearAllocatorArena>> mArenas;
+};
 
 } // namespace details
 } // namespace filament
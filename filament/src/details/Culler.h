@@ -48,6 +48,21 @@ public:
 
     using result_type = uint8_t;
 
+    // Instruction sets the culling kernels are specialized for. The best one supported by the
+    // CPU is selected at runtime.
+    enum class Isa : uint8_t {
+        GENERIC,
+        NEON,
+        AVX2,
+        AVX512
+    };
+
+    // returns the instruction set used by the culling kernels
+    static Isa getIsa() noexcept;
+
+    // returns whether the kernels for this instruction set can run on this CPU
+    static bool isSupported(Isa isa) noexcept;
+
     /*
      * returns whether each AABB in an array intersects with the furstum
      */
@@ -66,6 +81,25 @@ public:
             math::float4 const* b,
             size_t count) noexcept;
 
+    /*
+     * returns whether each AABB in an array intersects with the furstum, the centers and
+     * half-extents are given as separate x, y and z arrays
+     */
+    static void intersects(result_type* results,
+            Frustum const& frustum,
+            float const* cx, float const* cy, float const* cz,
+            float const* ex, float const* ey, float const* ez,
+            size_t count, size_t bit) noexcept;
+
+    /*
+     * returns whether each sphere in an array intersects with the furstum, the centers and
+     * radii are given as separate x, y, z and r arrays
+     */
+    static void intersects(result_type* results,
+            Frustum const& frustum,
+            float const* x, float const* y, float const* z, float const* r,
+            size_t count) noexcept;
+
     /*
      * returns whether an AABB intersects with the frustum
      */
@@ -92,6 +126,21 @@ public:
                 Frustum const& frustum,
                 math::float4 const* b,
                 size_t count) noexcept;
+
+        // same as Culler::isSupported()
+        static bool isSupported(Isa isa) noexcept;
+
+        // these use the kernels for the given instruction set, which must be supported
+        static void intersects(Isa isa, result_type* results,
+                Frustum const& frustum,
+                float const* cx, float const* cy, float const* cz,
+                float const* ex, float const* ey, float const* ez,
+                size_t count) noexcept;
+
+        static void intersects(Isa isa, result_type* results,
+                Frustum const& frustum,
+                float const* x, float const* y, float const* z, float const* r,
+                size_t count) noexcept;
     };
 };
 
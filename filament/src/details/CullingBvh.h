@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TNT_FILAMENT_DETAILS_CULLINGBVH_H
+#define TNT_FILAMENT_DETAILS_CULLINGBVH_H
+
+#include "details/Culler.h"
+
+#include <filament/Box.h>
+#include <filament/Frustum.h>
+
+#include <utils/compiler.h>
+#include <utils/StructureOfArrays.h>
+
+#include <math/vec3.h>
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace utils {
+class JobSystem;
+} // namespace utils;
+
+namespace filament {
+namespace details {
+
+/*
+ * A bounding volume hierarchy over an array of axis aligned boxes, used to cull whole groups of
+ * boxes against a frustum. The flat Culler is used to test the boxes of the leaves.
+ *
+ * The hierarchy is built with a median split along the longest axis. When boxes move, but
+ * none are added or removed, the hierarchy can be refit instead of rebuilt. Refitting doesn't
+ * change the topology, so its quality degrades over time and it needs to be rebuilt once in
+ * a while.
+ */
+class CullingBvh {
+public:
+    // maximum number of boxes in a leaf, must be a multiple of Culler::MODULO
+    static constexpr size_t LEAF_SIZE = 32;
+
+    // rebuilds the hierarchy over 'count' boxes
+    void build(math::float3 const* center, math::float3 const* extent, size_t count);
+
+    // updates the hierarchy after the boxes at indices 'changed' moved
+    void refit(math::float3 const* center, math::float3 const* extent,
+            uint32_t const* changed, size_t count) noexcept;
+
+    void clear() noexcept;
+
+    // number of boxes in the hierarchy
+    size_t size() const noexcept { return mIndices.size(); }
+
+    // number of refits since the last build
+    size_t getRefitCount() const noexcept { return mRefitCount; }
+
+    /*
+     * Sets 'bit' in results[i] for each box i (as indexed in build()) intersecting the frustum.
+     * This runs on multiple threads.
+     */
+    void cull(utils::JobSystem& js, Culler::result_type* results,
+            Frustum const& frustum, size_t bit) const noexcept;
+
+private:
+    struct Node {
+        Box bounds;
+        uint32_t first;     // first box of this subtree in mIndices
+        uint32_t count;     // number of boxes in this subtree
+        uint32_t right;     // index of the right child, 0 for leaves (left child is next)
+        uint32_t parent;
+    };
+
+    enum class Classification : uint8_t { OUTSIDE, INTERSECTS, INSIDE };
+
+    // boxes are stored as separate x, y, z arrays for the Culler's kernels
+    enum {
+        CENTER_X,
+        CENTER_Y,
+        CENTER_Z,
+        EXTENT_X,
+        EXTENT_Y,
+        EXTENT_Z
+    };
+
+    using BoxSoa = utils::StructureOfArrays<float, float, float, float, float, float>;
+
+    void setBox(size_t position, math::float3 const& center, math::float3 const& extent) noexcept;
+    uint32_t buildNode(math::float3 const* center, uint32_t first, uint32_t count, uint32_t parent);
+    void updateBounds(uint32_t node) noexcept;
+    void cullSubtree(Culler::result_type* results, Frustum const& frustum,
+            math::float4 const* planes, size_t bit, uint32_t node, bool inside) const noexcept;
+
+    static Classification classify(math::float4 const* planes, Box const& box) noexcept;
+    static Box merge(Box const& lhs, Box const& rhs) noexcept;
+
+    std::vector<Node> mNodes;
+    std::vector<uint32_t> mIndices;     // box index for each position in the hierarchy
+    std::vector<uint32_t> mPositions;   // position in the hierarchy of each box
+    std::vector<uint32_t> mLeaves;      // leaf node of each position in the hierarchy
+    BoxSoa mBoxes;                      // copy of the boxes in hierarchy order, with padding
+    std::vector<uint8_t> mDirty;
+    size_t mRefitCount = 0;
+};
+
+} // namespace details
+} // namespace filament
+
+#endif // TNT_FILAMENT_DETAILS_CULLINGBVH_H
@@ -51,6 +51,7 @@
 #include <utils/Allocator.h>
 #include <utils/JobSystem.h>
 #include <utils/CountDownLatch.h>
+#include <utils/DestroyedEntityQueue.h>
 
 #include <math/mat4.h>
 #include <math/quat.h>
@@ -58,6 +59,7 @@
 #include <chrono>
 #include <memory>
 #include <unordered_map>
+#include <vector>
 
 namespace filament {
 
@@ -108,6 +110,9 @@ public:
     static constexpr size_t CONFIG_MIN_COMMAND_BUFFERS_SIZE     = details::CONFIG_MIN_COMMAND_BUFFERS_SIZE;
     static constexpr size_t CONFIG_COMMAND_BUFFERS_SIZE         = details::CONFIG_COMMAND_BUFFERS_SIZE;
 
+    // number of destroyed entities whose components are removed at once by gc()
+    static constexpr size_t GC_BATCH_SIZE = 256;
+
     struct PerViewUib {
         static UniformInterfaceBlock getUib() noexcept;
         // these fields are only used to call offsetof() and make it easy to visualize the UBO
@@ -167,9 +172,10 @@ public:
         static constexpr size_t SHADOW_MAP     = 0;
         static constexpr size_t RECORDS        = 1;
         static constexpr size_t FROXELS        = 2;
-        static constexpr size_t IBL_DFG_LUT    = 3;
-        static constexpr size_t IBL_SPECULAR   = 4;
-        static constexpr size_t IBL_IRRADIANCE = 5;
+        static constexpr size_t LIGHTS         = 3;
+        static constexpr size_t IBL_DFG_LUT    = 4;
+        static constexpr size_t IBL_SPECULAR   = 5;
+        static constexpr size_t IBL_IRRADIANCE = 6;
     };
 
     struct PostProcessSib {
@@ -201,7 +207,10 @@ public:
     // the per-frame Area is used by all Renderer, so they must run in sequence and
     // have freed all allocated memory when done. If this needs to change in the future,
     // we'll simply have to use separate Areas (for instance).
-    LinearAllocatorArena& getPerRenderPassAllocator() noexcept { return mPerRenderPassAllocator; }
+    PerRenderPassArena& getPerRenderPassAllocator() noexcept { return mPerRenderPassAllocator; }
+
+    // scratch memory for jobs, one arena per JobSystem thread, rewound by FRenderer::endFrame()
+    PerThreadArenas& getPerThreadAllocators() noexcept { return mPerThreadAllocators; }
 
     // Material IDs...
     uint32_t getMaterialId() const noexcept { return mMaterialId++; }
@@ -331,6 +340,10 @@ public:
     void prepare();
     void gc();
 
+    // Removes the entities destroyed since the last call from all the scenes, and queues their
+    // components for gc(). This is called by prepare() and FScene::prepare().
+    void drainDestroyedEntities();
+
     filaflat::ShaderBuilder& getVertexShaderBuilder() noexcept {
         return mVertexShaderBuilder;
     }
@@ -339,6 +352,15 @@ public:
         return mFragmentShaderBuilder;
     }
 
+    void setGarbageCollectionTimeBudget(duration budget) noexcept {
+        mGarbageCollectionTimeBudget = budget;
+    }
+
+    CommandBufferStats getCommandBufferStats() const noexcept {
+        return { mCommandBufferQueue.getSize(), mCommandBufferQueue.getHighWatermark(),
+                 mCommandBufferQueue.getGrowCount() };
+    }
+
     FDebugRegistry& getDebugRegistry() noexcept {
         return mDebugRegistry;
     }
@@ -373,6 +395,12 @@ private:
     RenderTargetPool mRenderTargetPool;
 
     utils::EntityManager& mEntityManager;
+    utils::DestroyedEntityQueue mDestroyedEntities;
+
+    // destroyed entities whose components haven't been removed yet
+    std::vector<utils::Entity> mGarbage;
+    bool mSweepComponents = false;  // set when all entities were destroyed at once
+    duration mGarbageCollectionTimeBudget = std::chrono::microseconds(500);
     FRenderableManager mRenderableManager;
     FTransformManager mTransformManager;
     FLightManager mLightManager;
@@ -415,10 +443,11 @@ private:
     CommandBufferQueue mCommandBufferQueue;
     DriverApi mCommandStream;
 
-    LinearAllocatorArena mPerRenderPassAllocator;
+    PerRenderPassArena mPerRenderPassAllocator;
     HeapAllocatorArena mHeapAllocator;
 
     utils::JobSystem mJobSystem;
+    PerThreadArenas mPerThreadAllocators;
 
     Epoch mEpoch;
 
@@ -447,6 +476,9 @@ public:
             float dzn = -1.0f;
             float dzf =  1.0f;
         } shadowmap;
+        struct {
+            bool culling_bvh = true;
+        } scene;
     } debug;
 };
 
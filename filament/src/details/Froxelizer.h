@@ -18,6 +18,7 @@
 #define TNT_FILAMENT_DETAILS_FROXEL_H
 
 #include "details/Allocators.h"
+#include "details/Culler.h"
 #include "details/Scene.h"
 #include "details/Engine.h"
 
@@ -28,7 +29,6 @@
 #include <filament/Viewport.h>
 
 #include <utils/compiler.h>
-#include <utils/bitset.h>
 #include <utils/Slice.h>
 
 #include <math/mat4.h>
@@ -52,8 +52,8 @@ public:
 };
 
 //
-// Light UBO           Froxel Record Buffer     per-froxel light list texture
-// {4 x float4}         R_U8  {index into        RG_U16 {offset, point-count, spot-sount}
+// Light texture       Froxel Record Buffer     per-froxel light list texture
+// {4 x float4}         R_U16 {index into        RG_U32 {offset, point-count | spot-count}
 // (spot/point            light texture}
 //
 //  +----+                     +-+                     +----+
@@ -66,11 +66,11 @@ public:
 //  :    :                     | |                     |    |
 //  :    :                     | |                     |    |
 //  :    :                     +-+                     |    |
-//  :    :                  65536 max                  +----+
+//  :    :              64K to 256K                    +----+
 //  |....|                                          h = num froxels
 //  |....|
 //  +----+
-// 256 lights max
+// 4096 lights max
 //
 
 // Max number of froxels limited by:
@@ -78,9 +78,13 @@ public:
 // - chosen texture width [64]
 // - size of CPU-side indices [16 bits]
 // Also, increasing the number of froxels adds more pressure on the "record buffer" which stores
-// the light indices per froxel. The record buffer is limited to 65536 entries, so with
-// 8192 froxels, we can store 8 lights per froxels assuming they're all used. In practice, some
-// froxels are not used, so we can store more.
+// the light indices per froxel. The record buffer starts with 65536 entries and grows up to
+// 262144 entries when it runs out of space, so with 8192 froxels, we can store 32 lights per
+// froxels assuming they're all used. In practice, some froxels are not used, so we can store more.
+// The number of froxels is the resolution of the light grid, it doesn't limit the number of
+// lights (CONFIG_MAX_LIGHT_COUNT): each froxel entry can reference any number of lights in the
+// record buffer. Each light group and light record word costs one bit per froxel, so doubling
+// the froxels would double the time and memory (4 MiB w/ 4096 lights) spent froxelizing.
 static constexpr size_t FROXEL_BUFFER_ENTRY_COUNT_MAX = 8192;
 
 class Froxelizer {
@@ -90,7 +94,7 @@ public:
 
     void terminate(driver::DriverApi& driverApi) noexcept;
 
-    // gpu buffer containing records. valid after construction.
+    // gpu buffer containing records. valid after construction, can be re-allocated by prepare().
     GPUBuffer const& getRecordBuffer() const noexcept { return mRecordsBuffer; }
 
     // gpu buffer containing froxels. valid after construction.
@@ -101,17 +105,18 @@ public:
     /*
      * Allocate per-frame data structures for froxelization.
      *
-     * driverApi         used to allocate memory in the stream
-     * arena             use to allocate per-frame memory
+     * driverApi         used to re-allocate the record buffer
      * viewport          viewport used to calculate froxel dimensions
      * projection        camera projection matrix
      * projectionNear    near plane
      * projectionFar     far plane
+     * lightCount        number of point and spot lights that will be froxelized
      *
      * return true if updateUniforms() needs to be called
      */
-    bool prepare(driver::DriverApi& driverApi, ArenaScope& arena, Viewport const& viewport,
-            const math::mat4f& projection, float projectionNear, float projectionFar) noexcept;
+    bool prepare(driver::DriverApi& driverApi, Viewport const& viewport,
+            const math::mat4f& projection, float projectionNear, float projectionFar,
+            size_t lightCount) noexcept;
 
     Froxel getFroxelAt(size_t x, size_t y, size_t z) const noexcept;
     size_t getFroxelCountX() const noexcept { return mFroxelCountX; }
@@ -120,9 +125,27 @@ public:
     size_t getFroxelCount() const noexcept { return mFroxelCount; }
 
     // update Records and Froxels texture with lights data. this is thread-safe.
+    // Only the lights that changed since the last call are froxelized again, and nothing is
+    // updated if neither the lights nor the camera changed.
     void froxelizeLights(FEngine& engine, math::mat4f const& viewMatrix,
             const FScene::LightSoa& lightData) noexcept;
 
+    struct Stats {
+        size_t lightCount = 0;              // point and spot lights given to froxelizeLights()
+        size_t froxelizedLightCount = 0;    // lights that were added, moved or removed
+        bool recordsUpdated = false;        // false if the froxel and record buffers were reused
+        FEngine::duration duration = {};    // time spent in froxelizeLights()
+    };
+
+    // statistics about the last froxelizeLights() call
+    Stats const& getStats() const noexcept { return mStats; }
+
+    // Instruction set used by the light vs. froxel intersection kernels, Culler::getIsa() by
+    // default. It must be supported by this CPU (see Culler::isSupported()).
+    // Changing it causes all lights to be froxelized again.
+    void setIsa(Culler::Isa isa) noexcept;
+    Culler::Isa getIsa() const noexcept { return mIsa; }
+
     void updateUniforms(UniformBuffer& u) {
         u.setUniform(offsetof(FEngine::PerViewUib, zParams), mParamsZ);
         u.setUniform(offsetof(FEngine::PerViewUib, fParams), mParamsF.yz);
@@ -131,7 +154,7 @@ public:
         u.setUniform(offsetof(FEngine::PerViewUib, oneOverFroxelDimensionY), mOneOverDimension.y);
     }
 
-    // send froxel data to GPU
+    // send froxel data to GPU, if it changed
     void commit(driver::DriverApi& driverApi);
 
 
@@ -141,35 +164,39 @@ public:
 
     struct FroxelEntry {
         union {
-            uint32_t u32;
+            uint64_t u64;
             struct {
-                uint16_t offset = 0;
+                uint32_t offset = 0;
                 union {
-                    uint8_t count[2] = { 0, 0 };
+                    uint16_t count[2] = { 0, 0 };
                     struct {
-                        uint8_t pointLightCount;
-                        uint8_t spotLightCount;
+                        uint16_t pointLightCount;
+                        uint16_t spotLightCount;
                     };
                 };
             };
         };
     };
-    // This depends on the maximum number of lights (currently 255),and can't be more than 16 bits.
+    // This depends on the maximum number of lights (currently 4095),and can't be more than 16 bits.
     static_assert(CONFIG_MAX_LIGHT_INDEX <= std::numeric_limits<uint16_t>::max(), "can't have more than 65536 lights");
     using RecordBufferType = std::conditional_t<CONFIG_MAX_LIGHT_INDEX <= std::numeric_limits<uint8_t>::max(), uint8_t, uint16_t>;
-    const utils::Slice<FroxelEntry>& getFroxelBufferUser() const { return mFroxelBufferUser; }
-    const utils::Slice<RecordBufferType>& getRecordBufferUser() const { return mRecordBufferUser; }
+    utils::Slice<const FroxelEntry> getFroxelBufferUser() const {
+        return { mFroxelBufferUser.data(), mFroxelBufferUser.data() + mFroxelBufferUser.size() };
+    }
+    utils::Slice<const RecordBufferType> getRecordBufferUser() const {
+        return { mRecordBufferUser.data(), mRecordBufferUser.data() + mRecordBufferUser.size() };
+    }
 
-    // this is chosen so froxelizePointAndSpotLight() vectorizes 4 froxel tests / spotlight
+    // this is chosen so froxelizePointAndSpotLight() tests 4 to 16 froxels at once / spotlight
+    // (one 32-bits lane per froxel)
     // with 256 lights this implies 8 jobs (256 / 32) for froxelization.
     using LightGroupType = uint32_t;
 
-private:
-    struct LightRecord {
-        using bitset = utils::bitset<uint64_t, (CONFIG_MAX_LIGHT_COUNT + 63) / 64>;
-        bitset lights;
-    };
+    // the set of lights of a froxel is a bitmask made of one or more of these, depending on the
+    // number of lights being froxelized.
+    using LightRecordWord = uint64_t;
 
+private:
     struct LightParams {
         math::float3 position;
         float cosSqr;
@@ -187,7 +214,8 @@ private:
     void setProjection(const math::mat4f& projection, float near, float far) noexcept;
     bool update() noexcept;
 
-    void froxelizeLoop(FEngine& engine,
+    // returns the number of lights that were added, moved or removed
+    size_t froxelizeLoop(FEngine& engine,
             const math::mat4f& viewMatrix, const FScene::LightSoa& lightData) noexcept;
 
     void froxelizeAssignRecordsCompress() noexcept;
@@ -214,14 +242,34 @@ private:
     float* mDistancesZ = nullptr;                   // max 2.1 MiB (actual: resolution dependant)
     math::float4* mPlanesX = nullptr;
     math::float4* mPlanesY = nullptr;
-    math::float4* mBoundingSpheres = nullptr;
-
-    utils::Slice<FroxelThreadData> mFroxelShardedData;  // 256 KiB w/  256 lights
-    utils::Slice<FroxelEntry> mFroxelBufferUser;        //  32 KiB w/ 8192 froxels
 
-    // max 32 KiB  (actual: resolution dependant)
-    utils::Slice<RecordBufferType> mRecordBufferUser;   //  64 KiB
-    utils::Slice<LightRecord> mLightRecords;            // 256 KiB w/ 256 lights
+    // the same data in structures of arrays, for the vectorized intersection kernels
+    float* mPlanesXx = nullptr;                     // mPlanesX are {x,0,z,0}
+    float* mPlanesXz = nullptr;
+    float* mBoundingSpheresX = nullptr;             // bounding sphere of each froxel
+    float* mBoundingSpheresY = nullptr;
+    float* mBoundingSpheresZ = nullptr;
+    float* mBoundingSpheresR = nullptr;
+    Culler::Isa mIsa = Culler::getIsa();
+
+    // froxelized lights are kept from one frame to the next, so we only need to update the
+    // lights that changed.
+    std::vector<FroxelThreadData> mFroxelThreadData;    // 256 KiB w/  256 lights, 4 MiB w/ 4096
+    std::vector<LightParams> mLightParams;              // lights in mFroxelThreadData
+    math::mat4f mViewMatrix;                            // view matrix used for mLightParams
+    bool mFroxelThreadDataInvalid = true;               // mFroxelThreadData must be rebuilt
+    Stats mStats;
+
+    // CPU copy of the froxel and record buffers, and the temporary light records they're built
+    // from. They're only touched when the records are rebuilt.
+    std::vector<FroxelEntry> mFroxelBufferUser;         //  64 KiB w/ 8192 froxels
+    std::vector<RecordBufferType> mRecordBufferUser;    // 128 KiB to 512 KiB
+    std::vector<LightRecordWord> mLightRecords;         // 256 KiB w/ 256 lights, 4 MiB w/ 4096
+    size_t mUsedRecordCount = 0;                        // records uploaded by commit()
+
+    // number of light groups (i.e. jobs) and of light record words per froxel, for this frame
+    size_t mGroupCount = 0;
+    size_t mLightRecordWordCount = 0;
 
     uint16_t mFroxelCountX = 0;
     uint16_t mFroxelCountY = 0;
@@ -237,6 +285,8 @@ private:
     math::float2 mOneOverDimension = {};
     GPUBuffer mRecordsBuffer;
     GPUBuffer mFroxelBuffer;
+    uint16_t mRecordBufferHeight = 0;
+    bool mRecordBufferFull = false;     // set when froxels were dropped for lack of records
 
     // needed for update()
     Viewport mViewport;
@@ -17,8 +17,10 @@
 #ifndef TNT_FILAMENT_DETAILS_LIGHTDATA_H
 #define TNT_FILAMENT_DETAILS_LIGHTDATA_H
 
-#include <driver/Handle.h>
-#include <driver/UniformBuffer.h>
+#include "driver/DriverApiForward.h"
+#include "driver/GPUBuffer.h"
+
+#include <utils/Slice.h>
 
 #include <math/vec4.h>
 
@@ -27,6 +29,10 @@ namespace details {
 
 class FEngine;
 
+/*
+ * Parameters of the point and spot lights, stored in a texture so the number of lights isn't
+ * limited by the maximum UBO size. Each light takes 4 RGBA32F texels.
+ */
 class GpuLightBuffer {
 public:
     using LightIndex = uint16_t;
@@ -38,9 +44,17 @@ public:
         math::float4 spotScaleOffset;   // { scale, offset, unused, unused }
     };
 
+    // Make sure this matches the same constants in light_punctual.fs
+    static constexpr size_t LIGHTS_PER_ROW_SHIFT = 4u;
+    static constexpr size_t LIGHTS_PER_ROW = 1u << LIGHTS_PER_ROW_SHIFT;
+    static constexpr size_t LIGHTS_PER_ROW_MASK = LIGHTS_PER_ROW - 1u;
+
     explicit GpuLightBuffer(FEngine& engine) noexcept;
 
-    void commit(FEngine& engine) noexcept;
+    // allocates the parameters of 'count' lights in the command stream, valid until commit()
+    void prepare(driver::DriverApi& driverApi, size_t count) noexcept;
+
+    void commit(driver::DriverApi& driverApi) noexcept;
 
     void terminate(FEngine& engine);
 
@@ -51,20 +65,21 @@ public:
     ~GpuLightBuffer() noexcept;
 
     LightParameters& getLightParameters(LightIndex h) noexcept {
-        // This assumes the layout of the LightsUniforms uniform buffer
-        // it is defined in UibGenerator.cpp
-        LightParameters* lights = (LightParameters *)mLightsUb.getBuffer();
-        return lights[h];
+        assert(h < mLights.size());
+        return mLights[h];
     }
 
     void invalidate(LightIndex h, size_t count) noexcept {
-        mLightsUb.invalidateUniforms(h * sizeof(LightParameters), count * sizeof(LightParameters));
+        mLightsBuffer.invalidate(h >> LIGHTS_PER_ROW_SHIFT,
+                ((h + count + LIGHTS_PER_ROW_MASK) >> LIGHTS_PER_ROW_SHIFT) - (h >> LIGHTS_PER_ROW_SHIFT));
     }
 
+    // gpu buffer containing the lights parameters. valid after construction.
+    GPUBuffer const& getLightsBuffer() const noexcept { return mLightsBuffer; }
+
 private:
-    void commitSlow(FEngine& engine) noexcept;
-    Handle<HwUniformBuffer> mLightUbh;
-    mutable UniformBuffer mLightsUb;
+    GPUBuffer mLightsBuffer;
+    utils::Slice<LightParameters> mLights;
 };
 
 } // namespace details
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TNT_FILAMENT_DETAILS_OCCLUSIONCULLER_H
+#define TNT_FILAMENT_DETAILS_OCCLUSIONCULLER_H
+
+#include "details/Culler.h"
+
+#include <filament/Box.h>
+
+#include <utils/compiler.h>
+
+#include <math/mat4.h>
+#include <math/vec3.h>
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace utils {
+class JobSystem;
+} // namespace utils;
+
+namespace filament {
+namespace details {
+
+/*
+ * A software occlusion culler.
+ *
+ * A small set of occluder meshes is rasterized on the CPU into a low resolution depth buffer,
+ * then bounding boxes are tested against it. Occluder meshes must be entirely contained in the
+ * objects they represent, so that they never hide something that's actually visible.
+ *
+ * To stay conservative:
+ * - each occluder triangle is written at the depth of its farthest vertex,
+ * - triangles crossing the near plane are dropped,
+ * - boxes crossing the near plane are always visible,
+ * - boxes are tested against one more pixel on each side of their screen-space bounds, since
+ *   occluders write the pixels whose center they cover, not only the ones they fully cover.
+ *
+ * Depths are NDC z values, smaller is closer.
+ */
+class OcclusionCuller {
+public:
+    // size of the depth buffer, the width must be a multiple of 8
+    static constexpr size_t WIDTH = 256;
+    static constexpr size_t HEIGHT = 128;
+
+    // the depth buffer is rasterized in horizontal bands of this many rows, in parallel
+    static constexpr size_t BAND_HEIGHT = 16;
+
+    struct Mesh {
+        math::mat4f transform;          // object to world
+        math::float3 const* vertices;
+        uint16_t const* indices;        // triangle list
+        size_t indexCount;
+    };
+
+    OcclusionCuller();
+
+    /*
+     * Clears the depth buffer and rasterizes the occluders into it, with the given world to
+     * clip-space transform. This runs on multiple threads.
+     */
+    void rasterize(utils::JobSystem& js, math::mat4f const& viewProjection,
+            Mesh const* meshes, size_t count) noexcept;
+
+    /*
+     * Clears 'bit' in results[i] for each box i that is entirely hidden by the occluders.
+     * Boxes that don't have 'bit' set aren't tested. This runs on multiple threads.
+     */
+    void cull(utils::JobSystem& js, Culler::result_type* results,
+            math::float3 const* center, math::float3 const* extent,
+            size_t count, size_t bit) const noexcept;
+
+    // returns whether a box is entirely hidden by the occluders
+    bool isOccluded(Box const& box) const noexcept;
+
+    // number of triangles written in the depth buffer by the last rasterize()
+    size_t getTriangleCount() const noexcept { return mTriangleCount; }
+
+    // depth at the given pixel, (0, 0) is the bottom-left corner. Only valid after rasterize().
+    float getDepth(size_t x, size_t y) const noexcept { return mDepth[y * WIDTH + x]; }
+
+private:
+    struct Triangle {
+        math::float2 v[3];      // screen-space, counter-clockwise
+        float depth;            // farthest depth
+        int16_t minX, minY, maxX, maxY;
+    };
+
+    static bool setup(Triangle& triangle, math::float4 const* clip) noexcept;
+    void rasterizeBand(size_t firstRow, size_t lastRow) noexcept;
+
+    math::mat4f mViewProjection;
+    std::vector<float> mDepth;          // WIDTH x HEIGHT, allocated by the first rasterize()
+    std::vector<Triangle> mTriangles;
+    std::vector<size_t> mMeshOffsets;
+    size_t mTriangleCount = 0;
+};
+
+} // namespace details
+} // namespace filament
+
+#endif // TNT_FILAMENT_DETAILS_OCCLUSIONCULLER_H
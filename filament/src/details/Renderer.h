@@ -87,7 +87,7 @@ private:
     public:
         ColorPass(const char* name, utils::JobSystem& js, utils::JobSystem::Job* jobFroxelize,
                 FView* view, Handle<HwRenderTarget> rth);
-        static void renderColorPass(FEngine& engine, utils::JobSystem& js,
+        static void renderColorPass(FEngine& engine, utils::JobSystem& js, ArenaScope& arena,
                 Handle<HwRenderTarget> rth,
                 FView* view, Viewport const& scaledViewport,
                 utils::GrowingSlice<Command>& commands) noexcept;
@@ -101,7 +101,7 @@ private:
         void endRenderPass(DriverApi& driver, Viewport const& viewport) noexcept override;
     public:
         ShadowPass(const char* name, ShadowMap const& shadowMap) noexcept;
-        static void renderShadowMap(FEngine& engine, utils::JobSystem& js,
+        static void renderShadowMap(FEngine& engine, utils::JobSystem& js, ArenaScope& arena,
                 FView* view, utils::GrowingSlice<Command>& commands) noexcept;
     };
 
@@ -135,13 +135,14 @@ private:
     Handle<HwRenderTarget> mRenderTarget;
     FSwapChain* mSwapChain = nullptr;
     size_t mCommandsHighWatermark = 0;
+    size_t mPerRenderPassArenaHighWatermark = 0;
     uint32_t mFrameId = 0;
     FrameInfoManager mFrameInfoManager;
     bool mIsRGB16FSupported : 1;
     bool mIsRGB8Supported : 1;
 
     // per-frame arena for this Renderer
-    LinearAllocatorArena& mPerRenderPassArena;
+    PerRenderPassArena& mPerRenderPassArena;
 
 #if EXTRA_TIMING_INFO
     Series<float> mRendering;
@@ -23,6 +23,7 @@
 #include "components/TransformManager.h"
 
 #include "details/Culler.h"
+#include "details/CullingBvh.h"
 #include "details/GpuLightBuffer.h"
 
 #include "Allocators.h"
@@ -37,8 +38,15 @@
 #include <utils/Range.h>
 
 #include <cstddef>
+#include <vector>
+
+#include <tsl/robin_map.h>
 #include <tsl/robin_set.h>
 
+namespace utils {
+class JobSystem;
+} // namespace utils;
+
 namespace filament {
 namespace details {
 
@@ -69,6 +77,8 @@ public:
     size_t getRenderableCount() const noexcept;
     size_t getLightCount() const noexcept;
 
+    size_t getEntityCount() const noexcept { return mEntities.size(); }
+
 public:
     /*
      * Filaments-scope Public API
@@ -83,11 +93,16 @@ public:
     void terminate(FEngine& engine);
 
     void prepare(const math::mat4f& worldOriginTansform);
+
+    // Called by FEngine with the entities destroyed since the last call, only the ones in this
+    // scene are looked at. invalidate() makes the next prepare() re-gather everything.
+    void removeDestroyedEntities(utils::Entity const* entities, size_t count) noexcept;
+    void invalidate() noexcept { mGatherAll = true; }
     void prepareLights(const CameraInfo& camera, ArenaScope& arena) noexcept;
     void computeBounds(Aabb& castersBox, Aabb& receiversBox, uint32_t visibleLayers) const noexcept;
 
     /*
-     * Storage for per-frame renderable data
+     * Storage for renderable data
      */
 
     enum {
@@ -96,6 +111,8 @@ public:
         VISIBILITY_STATE,       //  1 visibility data of the component
         UBH,                    //  4 uniform buffer handle
         BONES_UBH,              //  4 bones uniform buffer handle
+        INSTANCES_UBH,          //  4 instances transforms uniform buffer handle
+        INSTANCE_COUNT,         //  1 number of instances, 0 if not instanced
         WORLD_AABB_CENTER,      // 12 world-space bounding box center of the renderable
         VISIBLE_MASK,           //  1 each bit represents a visibility in a pass
 
@@ -114,6 +131,8 @@ public:
             FRenderableManager::Visibility,
             Handle<HwUniformBuffer>,
             Handle<HwUniformBuffer>,
+            Handle<HwUniformBuffer>,
+            uint8_t,
             math::float3,
             Culler::result_type,
             uint8_t,
@@ -122,6 +141,12 @@ public:
             uint32_t
     >;
 
+    // All the renderables of the scene, up-to-date after prepare(). FView culls these in place
+    // (i.e. only VISIBLE_MASK is written), their order only changes in prepare().
+    RenderableSoa const& getRenderableCache() const noexcept { return mRenderableCache; }
+    RenderableSoa& getRenderableCache() noexcept { return mRenderableCache; }
+
+    // The visible renderables of the current frame, filled by FView after culling.
     RenderableSoa const& getRenderableData() const noexcept { return mRenderableData; }
     RenderableSoa& getRenderableData() noexcept { return mRenderableData; }
 
@@ -138,7 +163,7 @@ public:
     }
 
     /*
-     * Storage for per-frame light data
+     * Storage for light data
      */
 
     enum {
@@ -155,12 +180,67 @@ public:
             Culler::result_type
     >;
 
+    // All the point and spot lights of the scene, up-to-date after prepare(). FView culls these
+    // in place (i.e. only VISIBILITY is written).
+    LightSoa const& getLightCache() const noexcept { return mLightCache; }
+    LightSoa& getLightCache() noexcept { return mLightCache; }
+
+    // The directional light followed by the visible lights of the current frame, the latter
+    // are filled by FView after culling.
     LightSoa const& getLightData() const noexcept { return mLightData; }
     LightSoa& getLightData() noexcept { return mLightData; }
 
+    // parameters of the point and spot lights, valid after prepareLights()
+    GpuLightBuffer const& getGpuLightBuffer() const noexcept { return mGpuLightData; }
+
     void updateUBOs(utils::Range<uint32_t> visibleRenderables) const noexcept;
 
+    // position of the component managers' change logs this scene has caught-up to
+    enum {
+        TRANSFORM_CHANGES,
+        RENDERABLE_CHANGES,
+        LIGHT_CHANGES,
+        CHANGE_LOG_COUNT
+    };
+
+    ChangeLog::Cursor getChangeCursor(size_t log) const noexcept { return mChangeCursors[log]; }
+
+    // Hierarchy over the world AABBs of the renderables, or null if culling should use the
+    // flat arrays. Its indices match the rows of getRenderableCache().
+    CullingBvh const* getCullingBvh() const noexcept {
+        return mCullingBvh.size() ? &mCullingBvh : nullptr;
+    }
+
+    struct Test {
+        static constexpr uint8_t RENDERABLE = 0x1;     // what gatherEntity() found
+        static constexpr uint8_t LIGHT = 0x2;
+
+        // gathers a single entity in row 'index' of 'renderables' and 'lights'
+        static uint8_t gatherEntity(FScene const& scene, utils::Entity e,
+                RenderableSoa& renderables, LightSoa& lights, size_t index) noexcept;
+
+        // gathers 'list' in the scene's cached arrays, on multiple threads if it's long enough
+        static void gatherEntities(FScene& scene, utils::JobSystem& js,
+                std::vector<utils::Entity> const& list);
+
+    };
+
 private:
+    enum : uint8_t {
+        GATHERED_NOTHING            = 0x0,
+        GATHERED_RENDERABLE         = 0x1,
+        GATHERED_LIGHT              = 0x2,
+        GATHERED_DIRECTIONAL_LIGHT  = 0x4,
+    };
+
+    uint8_t gatherEntity(utils::Entity e, RenderableSoa& renderables, LightSoa& lights,
+            size_t index) const noexcept;
+    void gatherEntities(utils::JobSystem& js, std::vector<utils::Entity> const& list);
+    void removeRenderable(utils::Entity e) noexcept;
+    void removeLight(utils::Entity e) noexcept;
+    void updateCullingBvh();
+    static void ensurePadding(RenderableSoa& renderables, LightSoa& lights);
+
     FEngine& mEngine;
     FSkybox const* mSkybox = nullptr;
     FIndirectLight const* mIndirectLight = nullptr;
@@ -172,6 +252,32 @@ private:
     tsl::robin_set<utils::Entity> mEntities;
     RenderableSoa mRenderableData;
     LightSoa mLightData;
+
+    // Persistent copy of the gathered data, patched in place using the component managers'
+    // change logs and the destroyed entities, so prepare() only touches the rows that changed.
+    RenderableSoa mRenderableCache;
+    std::vector<utils::Entity> mRenderableEntities;
+    tsl::robin_map<utils::Entity, uint32_t> mRenderableRows;
+    LightSoa mLightCache;   // directional lights are not stored here
+    std::vector<utils::Entity> mLightEntities;
+    tsl::robin_map<utils::Entity, uint32_t> mLightRows;
+    std::vector<utils::Entity> mDirectionalLights;
+
+    std::vector<utils::Entity> mAddedEntities;
+    bool mGatherAll = true;
+
+    CullingBvh mCullingBvh;
+    std::vector<uint32_t> mUpdatedRenderableRows;
+    bool mRenderableRowsChanged = true;
+
+    // temporary storage used while gathering
+    std::vector<utils::Entity> mGatherList;
+    std::vector<uint8_t> mGathered;
+    RenderableSoa mGatheredRenderables;
+    LightSoa mGatheredLights;
+
+    ChangeLog::Cursor mChangeCursors[CHANGE_LOG_COUNT];
+    math::mat4f mWorldOriginTransform;
 };
 
 FILAMENT_UPCAST(Scene)
@@ -20,10 +20,12 @@
 #include <filament/View.h>
 
 #include "upcast.h"
+#include "RenderPass.h"
 
 #include "details/Allocators.h"
 #include "details/Camera.h"
 #include "details/Froxelizer.h"
+#include "details/OcclusionCuller.h"
 #include "details/ShadowMap.h"
 #include "details/Scene.h"
 
@@ -33,11 +35,15 @@
 
 #include <utils/compiler.h>
 #include <utils/Allocator.h>
+#include <utils/Entity.h>
 #include <utils/StructureOfArrays.h>
 #include <utils/Slice.h>
 #include <utils/Range.h>
 
 #include <deque>
+#include <vector>
+
+#include <tsl/robin_map.h>
 
 namespace utils {
 class JobSystem;
@@ -131,15 +137,38 @@ public:
     void prepareVisibleShadowCasters(utils::JobSystem& js, FScene::RenderableSoa& renderableData,
                                      Frustum const& lightFrustum) const noexcept;
 
+    void prepareOcclusion(utils::JobSystem& js, FRenderableManager const& rcm,
+            FScene::RenderableSoa& renderableData, math::mat4f const& viewProjection) noexcept;
+
+    // picks the level of detail of each renderable, from its size as seen by 'camera'
     void updatePrimitivesLod(
             FEngine& engine, const CameraInfo& camera,
             FScene::RenderableSoa& renderableData, Range visibles) noexcept;
 
     static void cullRenderables(utils::JobSystem& js, FScene::RenderableSoa& renderableData,
-                                Frustum const& frustum, size_t bit) noexcept;
+                                CullingBvh const* bvh, Frustum const& frustum, size_t bit,
+                                utils::jobs::AdaptiveSplitter& splitter) noexcept;
 
     void setShadowsEnabled(bool enabled) noexcept { mShadowingEnabled = enabled; }
 
+    void setOcclusionCullingEnabled(bool enabled) noexcept { mOcclusionCulling = enabled; }
+    bool isOcclusionCullingEnabled() const noexcept { return mOcclusionCulling; }
+
+    void setCommandCachingEnabled(bool enabled) noexcept;
+    bool isCommandCachingEnabled() const noexcept { return mCommandCaching; }
+
+    // the commands caches of the color and shadow passes, or nullptr if caching is disabled
+    RenderPass::CommandCache* getColorCommandCache() noexcept {
+        return mCommandCaching ? &mColorCommandCache : nullptr;
+    }
+    RenderPass::CommandCache* getShadowCommandCache() noexcept {
+        return mCommandCaching ? &mShadowCommandCache : nullptr;
+    }
+
+    // the splitters of the jobs generating the commands of the color and shadow passes
+    utils::jobs::AdaptiveSplitter& getColorPassSplitter() noexcept { return mColorPassSplitter; }
+    utils::jobs::AdaptiveSplitter& getShadowPassSplitter() noexcept { return mShadowPassSplitter; }
+
     ShadowMap const& getShadowMap() const { return mDirectionalShadowMap; }
 
     FCamera const* getDirectionalLightCamera() const noexcept {
@@ -206,8 +235,8 @@ public:
     void setCameraUser(FCamera* camera) noexcept { setCullingCamera(camera); }
 
 private:
-    void prepareVisibleLights(
-            FLightManager& lcm, utils::JobSystem& js, FScene::LightSoa& lightData) const;
+    void prepareVisibleLights(FLightManager& lcm, utils::JobSystem& js,
+            FScene::LightSoa& lightCache, FScene::LightSoa& lightData) const;
 
     void computeVisibilityMasks(
             uint8_t visibleLayers, uint8_t const* layers,
@@ -221,8 +250,9 @@ private:
 
     // we don't inline this one, because the function is quite large and there is not much to
     // gain from inlining.
-    static FScene::RenderableSoa::iterator partition(
-            FScene::RenderableSoa::iterator begin, FScene::RenderableSoa::iterator end, uint8_t mask) noexcept;
+    static void copyVisibleRenderables(
+            FScene::RenderableSoa const& renderableCache, FScene::RenderableSoa& renderableData,
+            Range& visibleRenderables, Range& visibleShadowCasters) noexcept;
 
 
     // these are accessed in the render loop, keep together
@@ -244,6 +274,23 @@ private:
 
     mutable Froxelizer mFroxelizer;
 
+    OcclusionCuller mOcclusionCuller;
+    std::vector<OcclusionCuller::Mesh> mOccluderMeshes;
+
+    // Level of detail picked last frame for each visible renderable, for the hysteresis. It's
+    // keyed by entity because instances are reused and move when components are removed.
+    // Only last frame's entries are kept (see prepare()), so destroyed entities are dropped.
+    tsl::robin_map<utils::Entity, uint8_t> mLodLevels;
+    tsl::robin_map<utils::Entity, uint8_t> mNextLodLevels;
+    RenderPass::CommandCache mColorCommandCache;
+    RenderPass::CommandCache mShadowCommandCache;
+
+    // each loop measures its own item cost, so each has its own splitter
+    mutable utils::jobs::AdaptiveSplitter mCullingSplitter;
+    mutable utils::jobs::AdaptiveSplitter mShadowCullingSplitter;
+    utils::jobs::AdaptiveSplitter mColorPassSplitter;
+    utils::jobs::AdaptiveSplitter mShadowPassSplitter;
+
     Viewport mViewport;
     LinearColorA mClearColor;
     bool mCulling = true;
@@ -256,6 +303,8 @@ private:
     AntiAliasing mAntiAliasing = AntiAliasing::FXAA;
     bool mShadowingEnabled = true;
     bool mHasPostProcessPass = true;
+    bool mOcclusionCulling = false;
+    bool mCommandCaching = false;
     DepthPrepass mDepthPrepass = DepthPrepass::DEFAULT;
 
     using duration = std::chrono::duration<float, std::milli>;
@@ -49,7 +49,14 @@ CircularBuffer::CircularBuffer(size_t size) {
     mHead = mData;
 }
 
+CircularBuffer::CircularBuffer(void* data, size_t size) noexcept
+        : mData(data), mOwnsData(false), mSize(size), mTail(data), mHead(data) {
+}
+
 CircularBuffer::~CircularBuffer() noexcept {
+    if (!mOwnsData) {
+        return;
+    }
 #if HAS_MMAP
     if (mData) {
         munmap(mData, mSize * 2 + BLOCK_SIZE);
@@ -137,6 +144,7 @@ void* CircularBuffer::alloc(size_t size) noexcept {
 }
 
 void CircularBuffer::circularize() noexcept {
+    assert(mOwnsData);
     if (mUsesAshmem > 0) {
         intptr_t overflow = intptr_t(mHead) - (intptr_t(mData) + ssize_t(mSize));
         if (overflow >= 0) {
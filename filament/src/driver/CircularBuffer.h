@@ -37,6 +37,11 @@ public:
     //      to set it to 3*requiredSize to avoid blocking the render thread (usually the UI thread).
     explicit CircularBuffer(size_t bufferSize);
 
+    // Wraps 'size' bytes of memory owned by the caller, which must outlive this object.
+    // Such a buffer is not circular and circularize() must not be called on it, it's used to
+    // record commands on another thread, see CommandStream::append().
+    CircularBuffer(void* data, size_t size) noexcept;
+
     // can't be moved or copy-constructed
     CircularBuffer(CircularBuffer const& rhs) = delete;
     CircularBuffer(CircularBuffer&& rhs) noexcept = delete;
@@ -59,6 +64,9 @@ public:
     // returns true if the buffer is empty (e.g. after calling flush)
     bool empty() const noexcept { return mTail == mHead; }
 
+    // number of bytes allocated since the last circularize()
+    size_t getUsed() const noexcept { return size_t(intptr_t(mHead) - intptr_t(mTail)); }
+
     void* getHead() const noexcept { return mHead; }
 
     void* getTail() const noexcept { return mTail; }
@@ -72,6 +80,7 @@ private:
     // pointer to the beginning of the circular buffer (constant)
     void* mData = nullptr;
     int mUsesAshmem = -1;
+    bool mOwnsData = true;
 
     // size of the circular buffer (constant)
     size_t mSize = 0;
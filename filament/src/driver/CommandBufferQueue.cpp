@@ -18,6 +18,9 @@
 
 #include <assert.h>
 
+#include <algorithm>
+#include <mutex>
+
 #include <utils/Log.h>
 #include <utils/Systrace.h>
 
@@ -27,27 +30,61 @@ using namespace utils;
 
 namespace filament {
 
+static_assert(!(CommandBufferQueue::MAX_SLICES & (CommandBufferQueue::MAX_SLICES - 1)),
+        "MAX_SLICES must be a power of two");
+
 CommandBufferQueue::CommandBufferQueue(size_t requiredSize, size_t bufferSize)
         : mRequiredSize((requiredSize + CircularBuffer::BLOCK_MASK) & ~CircularBuffer::BLOCK_MASK),
-          mCircularBuffer(bufferSize),
-          mFreeSpace(mCircularBuffer.size()) {
-    assert(mCircularBuffer.size() > requiredSize);
+          mBufferSize(bufferSize) {
+    mBuffers[0].reset(new CircularBuffer(bufferSize));
+    for (size_t i = 0; i < MAX_BUFFERS; i++) {
+        mFreeSpace[i].store(i ? 0 : mBuffers[0]->size(), std::memory_order_relaxed);
+    }
+    assert(mBuffers[0]->size() > requiredSize);
 }
 
 CommandBufferQueue::~CommandBufferQueue() {
-    assert(!mCommandBuffersToExecute.size());
+    assert(mWriteIndex.load() == mReadIndex.load());
+}
+
+template<typename P>
+void CommandBufferQueue::wait(std::atomic<bool>& waiting, Condition& condition,
+        std::atomic<int64_t>& blockedTime, P predicate) noexcept {
+    // Let the other side know it must signal the condition. This store and the load in
+    // wake() are sequentially consistent: either the other side sees that we're waiting,
+    // or we see its update when checking the predicate.
+    waiting.store(true);
+    if (!predicate()) {
+        const auto start = std::chrono::steady_clock::now();
+        std::unique_lock<Mutex> lock(mLock);
+        condition.wait(lock, predicate);
+        lock.unlock();
+        const auto duration = std::chrono::steady_clock::now() - start;
+        blockedTime.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(),
+                std::memory_order_relaxed);
+    }
+    waiting.store(false, std::memory_order_relaxed);
+}
+
+void CommandBufferQueue::wake(std::atomic<bool>& waiting, Condition& condition) noexcept {
+    if (UTILS_UNLIKELY(waiting.load())) {
+        // taking the lock guarantees the other side is not between checking its predicate
+        // and waiting on the condition
+        std::lock_guard<Mutex> lock(mLock);
+        condition.notify_one();
+    }
 }
 
 void CommandBufferQueue::requestExit() {
-    std::unique_lock<utils::Mutex> lock(mLock);
-    mExitRequested = true;
-    mCondition.notify_one();
+    mExitRequested.store(true);
+    wake(mConsumerWaiting, mConsumerCondition);
 }
 
 void CommandBufferQueue::flush() noexcept {
     SYSTRACE_CALL();
 
-    CircularBuffer& circularBuffer = mCircularBuffer;
+    const uint32_t current = mCurrent;
+    CircularBuffer& circularBuffer = *mBuffers[current];
     if (circularBuffer.empty()) {
         return;
     }
@@ -67,53 +104,131 @@ void CommandBufferQueue::flush() noexcept {
 
     circularBuffer.circularize();
 
-    std::unique_lock<utils::Mutex> lock(mLock);
-    mCommandBuffersToExecute.push_back({ tail, head });
-
     // circular buffer is too small, we corrupted the stream
-    assert(used <= mFreeSpace);
+    assert(used <= mFreeSpace[current].load());
+
+    // we need a free slot in the ring, this only waits if the consumer is far behind
+    const uint32_t writeIndex = mWriteIndex.load(std::memory_order_relaxed);
+    if (UTILS_UNLIKELY(writeIndex - mReadIndex.load() >= MAX_SLICES)) {
+        SYSTRACE_NAME("waiting: CommandBufferQueue::flush()");
+        wait(mProducerWaiting, mProducerCondition, mProducerBlockedTime, [this, writeIndex]() {
+            return writeIndex - mReadIndex.load() < MAX_SLICES;
+        });
+    }
 
-    // wait until there is enough space in the buffer
-    mFreeSpace -= used;
-    const size_t requiredSize = mRequiredSize;
+    // publish this slice
+    mSlices[writeIndex % MAX_SLICES] = { tail, head, current };
+    mFreeSpace[current].fetch_sub(used);
+    mWriteIndex.store(writeIndex + 1);
+    wake(mConsumerWaiting, mConsumerCondition);
 
-#ifndef NDEBUG
-    size_t totalUsed = circularBuffer.size() - mFreeSpace;
+    mLastUsed[current] = ++mFlushCount;
+
+    size_t totalUsed = 0;
+    for (size_t i = 0; i < MAX_BUFFERS; i++) {
+        if (mBuffers[i]) {
+            totalUsed += mBuffers[i]->size() - mFreeSpace[i].load(std::memory_order_relaxed);
+        }
+    }
     mHighWatermark = std::max(mHighWatermark, totalUsed);
-    if (UTILS_UNLIKELY(totalUsed > requiredSize)) {
-        slog.d << "CommandStream used too much space: " << totalUsed
-            << ", out of " << requiredSize << " (will block)" << io::endl;
+
+    selectBuffer();
+}
+
+void CommandBufferQueue::selectBuffer() noexcept {
+    const size_t requiredSize = mRequiredSize;
+
+    // use the first buffer whenever possible, so the others can be freed
+    uint32_t next = MAX_BUFFERS;
+    if (mFreeSpace[0].load() >= requiredSize) {
+        next = 0;
+    } else if (mFreeSpace[mCurrent].load() >= requiredSize) {
+        next = mCurrent;
+    } else {
+        for (uint32_t i = 1; i < MAX_BUFFERS; i++) {
+            if (mBuffers[i] && mFreeSpace[i].load() >= requiredSize) {
+                next = i;
+                break;
+            }
+        }
     }
+
+    if (UTILS_UNLIKELY(next == MAX_BUFFERS)) {
+        // grow rather than waiting for the driver thread to catch up
+        for (uint32_t i = 1; i < MAX_BUFFERS; i++) {
+            if (!mBuffers[i]) {
+                SYSTRACE_NAME("CommandBufferQueue::grow");
+                mBuffers[i].reset(new CircularBuffer(mBufferSize));
+                mFreeSpace[i].store(mBuffers[i]->size());
+                mGrowCount++;
+                next = i;
+#ifndef NDEBUG
+                slog.d << "CommandBufferQueue: grown to " << getSize() / 1024 << " KiB"
+                       << io::endl;
 #endif
+                break;
+            }
+        }
+    }
 
-    if (UTILS_LIKELY(mFreeSpace >= requiredSize)) {
-        // ideally (and usually) we don't have to wait, this is the common case, so special case
-        // the unlock-before-notify, optimization.
-        lock.unlock();
-        mCondition.notify_one();
-    } else {
-        // unfortunately, there is not enough space left, we'll have to wait.
-        mCondition.notify_one(); // too bad there isn't a notify-and-wait
+    if (UTILS_UNLIKELY(next == MAX_BUFFERS)) {
+        // we can't grow anymore, wait until there is enough space in the current buffer.
+        next = mCurrent;
         SYSTRACE_NAME("waiting: CircularBuffer::flush()");
-        mCondition.wait(lock, [this, requiredSize]() -> bool {
-            return mFreeSpace >= requiredSize;
+        wait(mProducerWaiting, mProducerCondition, mProducerBlockedTime, [this, next, requiredSize]() {
+            return mFreeSpace[next].load() >= requiredSize;
         });
     }
+
+    mCurrent = next;
+    mLastUsed[next] = mFlushCount;
+
+    // free the extra buffers that have been idle for a while. A buffer whose space is
+    // entirely free has no commands left to execute, the driver thread is done with it.
+    for (uint32_t i = 1; i < MAX_BUFFERS; i++) {
+        if (mBuffers[i] && i != next &&
+                mFlushCount - mLastUsed[i] > QUIET_FLUSH_COUNT &&
+                mFreeSpace[i].load() == mBuffers[i]->size()) {
+            mBuffers[i].reset();
+        }
+    }
 }
 
-std::vector<CommandBufferQueue::Slice> CommandBufferQueue::waitForCommands() const {
-    std::unique_lock<utils::Mutex> lock(mLock);
-    while (mCommandBuffersToExecute.empty() && !mExitRequested) {
-        mCondition.wait(lock);
+size_t CommandBufferQueue::getSize() const noexcept {
+    size_t size = 0;
+    for (size_t i = 0; i < MAX_BUFFERS; i++) {
+        if (mBuffers[i]) {
+            size += mBuffers[i]->size();
+        }
     }
-    return std::move(mCommandBuffersToExecute);
+    return size;
+}
+
+CommandBufferQueue::Slice CommandBufferQueue::waitForCommands() noexcept {
+    const uint32_t readIndex = mReadIndex.load(std::memory_order_relaxed);
+    auto ready = [this, readIndex]() {
+        return mWriteIndex.load() != readIndex || mExitRequested.load();
+    };
+    if (!ready()) {
+        wait(mConsumerWaiting, mConsumerCondition, mConsumerBlockedTime, ready);
+    }
+
+    if (mWriteIndex.load() == readIndex) {
+        // exit was requested and there is nothing left to execute
+        return { nullptr, nullptr, 0 };
+    }
+
+    const Slice slice = mSlices[readIndex % MAX_SLICES];
+    mReadIndex.store(readIndex + 1);
+    // the producer could be waiting for a free slot
+    wake(mProducerWaiting, mProducerCondition);
+    return slice;
 }
 
-void CommandBufferQueue::releaseBuffer(CommandBufferQueue::Slice const& buffer) {
-    std::unique_lock<utils::Mutex> lock(mLock);
-    mFreeSpace += uintptr_t(buffer.end) - uintptr_t(buffer.begin);
-    lock.unlock();
-    mCondition.notify_one();
+void CommandBufferQueue::releaseBuffer(CommandBufferQueue::Slice const& buffer) noexcept {
+    mFreeSpace[buffer.buffer].fetch_add(uintptr_t(buffer.end) - uintptr_t(buffer.begin));
+    // the producer could be waiting for some space
+    wake(mProducerWaiting, mProducerCondition);
 }
 
 } // namespace filament
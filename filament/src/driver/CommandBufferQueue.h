@@ -23,55 +23,119 @@
 #include <utils/Condition.h>
 #include <utils/Mutex.h>
 
-#include <vector>
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+#include <stdint.h>
 
 namespace filament {
 
 /*
- * A produdcer-consumer command queue that uses a CircularBuffer as main storage
+ * A single-producer, single-consumer command queue that uses a CircularBuffer as main storage.
+ *
+ * Command buffers are handed from the producer (flush()) to the consumer (waitForCommands())
+ * through a lock-free ring. The mutex and conditions are only used when one side must block:
+ * the consumer when there is nothing to execute, the producer when it's out of space.
+ *
+ * When the CircularBuffer doesn't have enough space left, the queue grows by switching to an
+ * extra CircularBuffer (up to MAX_BUFFERS) rather than blocking. Extra buffers are freed
+ * after they haven't been used for a while.
  */
 class CommandBufferQueue {
+public:
     struct Slice {
         void* begin;
         void* end;
+        uint32_t buffer;    // index of the CircularBuffer this slice belongs to
     };
 
-    const size_t mRequiredSize;
-
-    CircularBuffer mCircularBuffer;
+    // maximum number of command buffers waiting to be executed, must be a power of two
+    static constexpr size_t MAX_SLICES = 64;
 
-    // space available in the circular buffer
+    // maximum number of CircularBuffers, i.e. how much the queue can grow
+    static constexpr size_t MAX_BUFFERS = 4;
 
-    mutable utils::Mutex mLock;
-    mutable utils::Condition mCondition;
-    mutable std::vector<Slice> mCommandBuffersToExecute;
-    size_t mFreeSpace = 0;
-    size_t mHighWatermark = 0;
-    bool mExitRequested = false;
+    // extra CircularBuffers are freed after this many flush() without being used
+    static constexpr uint32_t QUIET_FLUSH_COUNT = 256;
 
-public:
     // requiredSize: guaranteed available space after flush()
     CommandBufferQueue(size_t requiredSize, size_t bufferSize);
     ~CommandBufferQueue();
 
-    CircularBuffer& getCircularBuffer() { return mCircularBuffer; }
+    // the CircularBuffer commands must be written to, this can change after each flush()
+    CircularBuffer& getCircularBuffer() { return *mBuffers[mCurrent]; }
 
-    size_t getHigWatermark() noexcept { return mHighWatermark; }
+    // largest amount of memory used at once by the command buffers, in bytes
+    size_t getHighWatermark() const noexcept { return mHighWatermark; }
 
-    // wait for commands to be available and returns an array containing these commands
-    std::vector<Slice> waitForCommands() const;
+    // current size of all the CircularBuffers, in bytes
+    size_t getSize() const noexcept;
+
+    // number of times the queue had to grow
+    size_t getGrowCount() const noexcept { return mGrowCount; }
+
+    // total time the producer / consumer spent blocked, waiting for the other side
+    std::chrono::nanoseconds getProducerBlockedTime() const noexcept {
+        return std::chrono::nanoseconds(mProducerBlockedTime.load(std::memory_order_relaxed));
+    }
+    std::chrono::nanoseconds getConsumerBlockedTime() const noexcept {
+        return std::chrono::nanoseconds(mConsumerBlockedTime.load(std::memory_order_relaxed));
+    }
+
+    // wait for a command buffer to be available and returns it. Returns an empty Slice
+    // (begin is nullptr) when there is nothing left to execute and exit was requested.
+    Slice waitForCommands() noexcept;
 
     // return the memory used by this command buffer to the circular buffer
     // WARNING: releaseBuffer() must be called in sequence of the Slices returned by
     // waitForCommands()
-    void releaseBuffer(Slice const& buffer);
+    void releaseBuffer(Slice const& buffer) noexcept;
 
-    // all commands buffers (Slices) written to this point are returned by waitForCommand(). This
-    // call blocks until the CircularBuffer has at least mRequiredSize bytes available.
+    // all commands buffers (Slices) written to this point are returned by waitForCommand().
+    // After this call, getCircularBuffer() has at least mRequiredSize bytes available. This
+    // only blocks if all MAX_BUFFERS are in use.
     void flush() noexcept;
 
     // returns from waitForcommands() immediately.
     void requestExit();
+
+private:
+    template<typename P>
+    void wait(std::atomic<bool>& waiting, utils::Condition& condition,
+            std::atomic<int64_t>& blockedTime, P predicate) noexcept;
+    void wake(std::atomic<bool>& waiting, utils::Condition& condition) noexcept;
+    void selectBuffer() noexcept;
+
+    const size_t mRequiredSize;
+    const size_t mBufferSize;
+
+    // the first buffer always exists, the others are allocated when needed.
+    // mFreeSpace[i] is the space available in mBuffers[i]
+    std::unique_ptr<CircularBuffer> mBuffers[MAX_BUFFERS];
+    std::atomic<size_t> mFreeSpace[MAX_BUFFERS];
+    uint32_t mLastUsed[MAX_BUFFERS] = {};   // last flush() that used each buffer
+    uint32_t mCurrent = 0;                  // buffer being written to
+    uint32_t mFlushCount = 0;
+
+    // command buffers written by flush() and not yet returned by waitForCommands()
+    Slice mSlices[MAX_SLICES];
+    std::atomic<uint32_t> mWriteIndex = { 0 };
+    std::atomic<uint32_t> mReadIndex = { 0 };
+
+    std::atomic<bool> mExitRequested = { false };
+
+    // only used to block
+    utils::Mutex mLock;
+    utils::Condition mProducerCondition;
+    utils::Condition mConsumerCondition;
+    std::atomic<bool> mProducerWaiting = { false };
+    std::atomic<bool> mConsumerWaiting = { false };
+
+    std::atomic<int64_t> mProducerBlockedTime = { 0 };
+    std::atomic<int64_t> mConsumerBlockedTime = { 0 };
+    size_t mHighWatermark = 0;
+    size_t mGrowCount = 0;
 };
 
 } // namespace filament
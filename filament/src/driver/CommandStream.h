@@ -30,6 +30,7 @@
 #include <assert.h>
 #include <cstddef>
 #include <stdint.h>
+#include <string.h>
 
 // Set to true to print every commands out on log.d. This requires RTTI and DEBUG
 #define DEBUG_COMMAND_STREAM false
@@ -272,6 +273,30 @@ public:
 
     void execute(void* buffer);
 
+    // changes the CircularBuffer commands are written to, this must happen right after a flush
+    void setCircularBuffer(CircularBuffer& buffer) noexcept { mCurrentBuffer = &buffer; }
+
+    // the driver commands are recorded for
+    Driver& getDriver() const noexcept { return *mDriver; }
+
+    /*
+     * Appends the commands recorded by another CommandStream into 'buffer', which is typically
+     * a CircularBuffer wrapping some scratch memory. This allows to record commands on several
+     * threads concurrently and then to stitch them in order.
+     * The commands are copied with memcpy(), so only those that only hold handles and values
+     * can be recorded this way (e.g. not allocate(), queueCommand() or BufferDescriptors).
+     */
+    inline void append(CircularBuffer const& buffer) noexcept {
+        const size_t size = buffer.getUsed();
+        memcpy(allocateCommand(size), buffer.getTail(), size);
+    }
+
+    // returns the size taken in the stream by a call to Driver::METHOD
+    template<typename T, T METHOD>
+    static constexpr size_t getCommandSize() noexcept {
+        return CommandBase::align(sizeof(typename CommandType<T>::template Command<METHOD>));
+    }
+
     /*
      * queueCommand() allows to queue a lambda function as a command.
      * This is much less efficient than using the Driver* API.
@@ -2620,6 +2620,28 @@ void OpenGLDriver::draw(
     CHECK_GL_ERROR(utils::slog.e)
 }
 
+void OpenGLDriver::drawInstanced(
+        Driver::ProgramHandle ph,
+        Driver::RasterState rs,
+        Driver::RenderPrimitiveHandle rph,
+        uint32_t instanceCount) {
+    DEBUG_MARKER()
+
+    OpenGLProgram* p = handle_cast<OpenGLProgram*>(ph);
+    useProgram(p);
+
+    const GLRenderPrimitive* rp = handle_cast<const GLRenderPrimitive *>(rph);
+    bindVertexArray(rp);
+
+    setRasterState(rs);
+
+    // there is no instanced version of glDrawRangeElements
+    glDrawElementsInstanced(GLenum(rp->type), rp->count, rp->gl.indicesType,
+            reinterpret_cast<const void*>(rp->offset), GLsizei(instanceCount));
+
+    CHECK_GL_ERROR(utils::slog.e)
+}
+
 // explicit instantiation of the Dispatcher
 template class ConcreteDispatcher<OpenGLDriver>;
 
@@ -794,6 +794,11 @@ void VulkanDriver::blit(TargetBufferFlags buffers,
 
 void VulkanDriver::draw(Driver::ProgramHandle ph, Driver::RasterState rasterState,
         Driver::RenderPrimitiveHandle rph) {
+    drawInstanced(ph, rasterState, rph, 1);
+}
+
+void VulkanDriver::drawInstanced(Driver::ProgramHandle ph, Driver::RasterState rasterState,
+        Driver::RenderPrimitiveHandle rph, uint32_t instanceCount) {
     VkCommandBuffer cmdbuffer = mContext.cmdbuffer;
     ASSERT_POSTCONDITION(cmdbuffer, "Draw calls can occur only within a beginFrame / endFrame.");
     const VulkanRenderPrimitive& prim = *handle_cast<VulkanRenderPrimitive>(mHandleMap, rph);
@@ -899,11 +904,11 @@ void VulkanDriver::draw(Driver::ProgramHandle ph, Driver::RasterState rasterStat
             prim.indexBuffer->indexType);
 
     // Finally, make the actual draw call. TODO: support subranges
+    // The first instance must be 0, since shaders index the instances with gl_InstanceIndex.
     const uint32_t indexCount = prim.count;
-    const uint32_t instanceCount = 1;
     const uint32_t firstIndex = prim.offset / prim.indexBuffer->elementSize;
     const int32_t vertexOffset = 0;
-    const uint32_t firstInstId = 1;
+    const uint32_t firstInstId = 0;
     vkCmdDrawIndexed(cmdbuffer, indexCount, instanceCount, firstIndex, vertexOffset, firstInstId);
 }
 
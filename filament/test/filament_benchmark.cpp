@@ -16,16 +16,29 @@
 
 #include <filament/Box.h>
 #include <filament/Frustum.h>
+#include <filament/LightManager.h>
+#include <filament/Viewport.h>
 #include "details/Culler.h"
+#include "details/Engine.h"
+#include "details/Froxelizer.h"
 
+#include <utils/EntityManager.h>
+#include <utils/JobSystem.h>
 #include <utils/Profiler.h>
+#include <utils/RadixSort.h>
 #include <utils/compiler.h>
 #include <math/fast.h>
 #include <math/scalar.h>
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <vector>
 #include <random>
+#include <string>
+#include <thread>
+#include <utility>
 
 using namespace filament;
 using namespace filament::details;
@@ -62,6 +75,20 @@ void benchmark(Profiler& p, const char* const name, T f) {
     printResults(name, REPEAT, c);
 }
 
+// runs f() REPEAT times and prints how many objects per nanosecond it processed
+template <typename T, size_t REPEAT = 1000>
+void throughput(const char* const name, size_t count, T f) {
+    f(); // warm-up
+    auto start = std::chrono::steady_clock::now();
+#pragma nounroll
+    for (size_t i = 0; i < REPEAT; i++) {
+        f();
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::nano> ns = end - start;
+    std::cout << name << ": " << (count * REPEAT) / ns.count() << " objects/ns" << std::endl;
+}
+
 // ------------------------------------------------------------------------------------------------
 
 int main(void) {
@@ -125,6 +152,45 @@ int main(void) {
     std::cout << "visible spheres: " << vs << std::endl;
     std::cout << std::endl;
 
+    // culling kernels for each instruction set supported by this CPU, with SoA inputs
+    std::vector<float> cx(batch), cy(batch), cz(batch), ex(batch), ey(batch), ez(batch), r(batch);
+    for (size_t i = 0; i < batch; i++) {
+        cx[i] = boxesCenter[i].x;
+        cy[i] = boxesCenter[i].y;
+        cz[i] = boxesCenter[i].z;
+        ex[i] = boxesExtent[i].x;
+        ey[i] = boxesExtent[i].y;
+        ez[i] = boxesExtent[i].z;
+        r[i] = spheres[i].w;
+    }
+
+    const std::pair<Culler::Isa, const char*> isas[] = {
+            { Culler::Isa::GENERIC, "Generic" },
+            { Culler::Isa::NEON,    "NEON"    },
+            { Culler::Isa::AVX2,    "AVX2"    },
+            { Culler::Isa::AVX512,  "AVX-512" },
+    };
+    for (auto const& isa : isas) {
+        if (!Culler::Test::isSupported(isa.first)) {
+            continue;
+        }
+        std::string boxesName = std::string("Box Culling SoA ") + isa.second;
+        std::string spheresName = std::string("Sphere Culling SoA ") + isa.second;
+        auto cullBoxes = [&]() {
+            Culler::Test::intersects(isa.first, visibles, frustum,
+                    cx.data(), cy.data(), cz.data(), ex.data(), ey.data(), ez.data(), batch);
+        };
+        auto cullSpheres = [&]() {
+            Culler::Test::intersects(isa.first, visibles, frustum,
+                    cx.data(), cy.data(), cz.data(), r.data(), batch);
+        };
+        benchmark(p, boxesName.c_str(), cullBoxes);
+        benchmark(p, spheresName.c_str(), cullSpheres);
+        throughput(boxesName.c_str(), batch, cullBoxes);
+        throughput(spheresName.c_str(), batch, cullSpheres);
+        std::cout << std::endl;
+    }
+
     free(visibles);
 
 
@@ -169,6 +235,140 @@ int main(void) {
         }
     });
 
+    // sorting render commands: 32 bytes commands with a 64-bit key
+    struct Command {
+        uint64_t key;
+        uint64_t payload[3];
+    };
+    const size_t commandCount = 200000;
+    std::uniform_int_distribution<uint64_t> randomKey;
+    std::vector<Command> unsortedCommands(commandCount);
+    for (size_t i = 0; i < commandCount; i++) {
+        unsortedCommands[i] = { randomKey(gen), { i, i, i } };
+    }
+    std::vector<Command> commands(commandCount);
+    std::vector<Command> sortedCommands(commandCount);
+    std::vector<RadixSort::Item> items(commandCount * 2);
+
+    JobSystem js;
+    js.adopt();
+
+    auto stdSort = [&]() {
+        commands = unsortedCommands;
+        std::sort(commands.begin(), commands.end(), [](Command const& lhs, Command const& rhs) {
+            return lhs.key < rhs.key;
+        });
+    };
+
+    auto radixSort = [&]() {
+        commands = unsortedCommands;
+        for (size_t i = 0; i < commandCount; i++) {
+            items[i] = { commands[i].key, uint32_t(i) };
+        }
+        RadixSort::Item const* sorted =
+                RadixSort::sort(js, items.data(), items.data() + commandCount, commandCount);
+        for (size_t i = 0; i < commandCount; i++) {
+            sortedCommands[i] = commands[sorted[i].value];
+        }
+    };
+
+    benchmark(p, "std::sort commands", stdSort);
+    benchmark(p, "RadixSort commands", radixSort);
+    throughput<decltype(stdSort), 20>("std::sort commands", commandCount, stdSort);
+    throughput<decltype(radixSort), 20>("RadixSort commands", commandCount, radixSort);
+
+    js.emancipate();
+
+    // creating and destroying entities, from one thread and from several threads at once
+    {
+        EntityManager& em = EntityManager::get();
+        const size_t entityCount = 1024;
+        const size_t threadCount = 4;
+        std::vector<Entity> entities[threadCount];
+        for (auto& list : entities) {
+            list.resize(entityCount);
+        }
+        auto createDestroy = [&](size_t t) {
+            for (Entity& e : entities[t]) {
+                e = em.create();
+            }
+            for (Entity e : entities[t]) {
+                em.destroy(e);
+            }
+        };
+        throughput("EntityManager create/destroy 1 thread", entityCount, [&]() {
+            createDestroy(0);
+        });
+        throughput<std::function<void()>, 100>("EntityManager create/destroy 4 threads",
+                entityCount * threadCount, [&]() {
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < threadCount; t++) {
+                threads.emplace_back(createDestroy, t);
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+        });
+        std::cout << std::endl;
+    }
+
+    // froxelizing lights at 1080p and 4K, half of them are spot lights
+    FEngine* engine = FEngine::create();
+
+    Entity pointEntity = engine->getEntityManager().create();
+    Entity spotEntity = engine->getEntityManager().create();
+    LightManager::Builder(LightManager::Type::POINT).build(*engine, pointEntity);
+    LightManager::Builder(LightManager::Type::SPOT).spotLightCone(0.3f, 0.8f).build(*engine, spotEntity);
+    const FLightManager::Instance point = engine->getLightManager().getInstance(pointEntity);
+    const FLightManager::Instance spot = engine->getLightManager().getInstance(spotEntity);
+
+    const Viewport viewports[] = { { 0, 0, 1920, 1080 }, { 0, 0, 3840, 2160 } };
+    const size_t lightCounts[] = { 256, 1024, 4096 };
+    for (Viewport const& vp : viewports) {
+        const float aspect = float(vp.width) / vp.height;
+        const mat4f projection = mat4f::perspective(60.0f, aspect, 0.1f, 100.0f);
+        for (size_t lightCount : lightCounts) {
+            Froxelizer froxelizer(*engine);
+            froxelizer.prepare(engine->getDriverApi(), vp, projection, 0.1f, 100.0f,
+                    lightCount);
+
+            // lights are spread in the view frustum
+            FScene::LightSoa lights;
+            lights.push_back({}, {}, {}, {});   // first one is always skipped
+            for (size_t i = 0; i < lightCount; i++) {
+                const float z = -1.0f - 49.0f * std::abs(rand(gen)) / 100.0f;
+                const float4 sphere{
+                        rand(gen) * -z * aspect * 0.005f, rand(gen) * -z * 0.005f, z,
+                        rand(gen, std::uniform_real_distribution<float>::param_type{ 0.5f, 5.0f }) };
+                const float3 direction = normalize(float3{ rand(gen), rand(gen), rand(gen) });
+                lights.push_back(sphere, direction, (i & 1) ? spot : point, 1);
+            }
+
+            // a different view matrix each time, so all the lights are froxelized every time
+            size_t frame = 0;
+            auto froxelize = [&]() {
+                const mat4f view = mat4f::translate(float4{ 0, 0, (frame++ & 1) ? 0.01f : 0.0f, 1 });
+                froxelizer.froxelizeLights(*engine, view, lights);
+            };
+
+            for (auto const& isa : isas) {
+                if (!Culler::Test::isSupported(isa.first)) {
+                    continue;
+                }
+                froxelizer.setIsa(isa.first);
+                std::string name = std::string("Froxelize ") + std::to_string(lightCount) +
+                        " lights " + std::to_string(vp.width) + "x" + std::to_string(vp.height) +
+                        " " + isa.second;
+                throughput<decltype(froxelize), 20>(name.c_str(), lightCount, froxelize);
+            }
+            froxelizer.terminate(engine->getDriverApi());
+            std::cout << std::endl;
+        }
+    }
+
+    engine->shutdown();
+    delete engine;
+
     return 0;
 }
 
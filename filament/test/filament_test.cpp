@@ -28,17 +28,36 @@
 #include <filament/Material.h>
 #include <filament/Engine.h>
 
+#include "driver/CircularBuffer.h"
+#include "driver/CommandBufferQueue.h"
+#include "driver/CommandStream.h"
+#include "driver/DriverBase.h"
 #include "driver/UniformBuffer.h"
 #include <filament/UniformInterfaceBlock.h>
 
+#include <private/filament/UibGenerator.h>
+#include <private/filament/Variant.h>
+
 #include "details/Allocators.h"
 #include "details/Material.h"
 #include "details/Camera.h"
+#include "details/Culler.h"
+#include "details/CullingBvh.h"
 #include "details/Froxelizer.h"
+#include "details/OcclusionCuller.h"
+#include "details/RenderPrimitive.h"
 #include "details/Engine.h"
+#include "components/ChangeLog.h"
+#include "RenderPass.h"
+#include "components/RenderableManager.h"
 #include "components/TransformManager.h"
 #include "utils/RangeSet.h"
 
+#include <utils/JobSystem.h>
+
+#include <random>
+#include <thread>
+
 using namespace filament;
 using namespace math;
 using namespace utils;
@@ -144,6 +163,219 @@ TEST(FilamentTest, TransformManager) {
     EXPECT_EQ(tcm.getWorldTransform(child), mat4f{ float4{ 8 }});
 }
 
+TEST(FilamentTest, TransformManagerLevels) {
+    JobSystem js;
+    js.adopt();
+
+    filament::details::FTransformManager tcm(&js);
+    EntityManager& em = EntityManager::get();
+
+    // a wide and deep hierarchy, with a level large enough to be updated in parallel
+    const size_t count = 3000;
+    std::vector<Entity> entities(count);
+    em.create(count, entities.data());
+    std::default_random_engine gen;
+    std::vector<size_t> parents(count, count);
+    for (size_t k = 10; k < count; k++) {
+        parents[k] = (k < 2000) ? gen() % 10 : 10 + gen() % (k - 10);
+    }
+    std::vector<mat4f> locals(count);
+    for (size_t k = 0; k < count; k++) {
+        const float scale = 1.0f + k % 2;
+        locals[k] = mat4f::translate(float4{ k % 7, k % 5, k % 3, 1 }) *
+                    mat4f::scale(float4{ scale, scale, scale, 1 });
+    }
+
+    // children are created before their parent, so they end-up out of order
+    for (size_t k = 0; k < count; k++) {
+        tcm.create(entities[k]);
+    }
+    tcm.openLocalTransformTransaction();
+    for (size_t k = count; k-- > 0;) {
+        if (parents[k] < count) {
+            tcm.setParent(tcm.getInstance(entities[k]), tcm.getInstance(entities[parents[k]]));
+        }
+        tcm.setTransform(tcm.getInstance(entities[k]), locals[k]);
+    }
+    tcm.commitLocalTransformTransaction();
+
+    auto check = [&]() {
+        // parents always have a lower index than their children
+        std::vector<mat4f> expected(count);
+        for (size_t k = 0; k < count; k++) {
+            expected[k] = (parents[k] < count) ? expected[parents[k]] * locals[k] : locals[k];
+            auto i = tcm.getInstance(entities[k]);
+            EXPECT_EQ(expected[k], tcm.getWorldTransform(i));
+            if (parents[k] < count) {
+                EXPECT_LT(tcm.getInstance(entities[parents[k]]), i);
+            }
+        }
+    };
+    check();
+    EXPECT_GT(tcm.getLevelCount(), 2);
+
+    // only the updated subtree is reported as changed
+    auto& changeLog = tcm.getChangeLog();
+    auto cursor = changeLog.end();
+    const size_t root = 5;
+    std::vector<bool> inSubtree(count, false);
+    size_t subtreeSize = 0;
+    for (size_t k = 0; k < count; k++) {
+        inSubtree[k] = (k == root) || (parents[k] < count && inSubtree[parents[k]]);
+        subtreeSize += inSubtree[k] ? 1 : 0;
+    }
+    locals[root] = mat4f::translate(float4{ 1, 2, 3, 1 });
+    tcm.openLocalTransformTransaction();
+    tcm.setTransform(tcm.getInstance(entities[root]), locals[root]);
+    tcm.commitLocalTransformTransaction();
+    check();
+    ASSERT_TRUE(changeLog.isValid(cursor));
+    auto changes = changeLog.since(cursor);
+    EXPECT_EQ(subtreeSize, changes.size());
+    for (Entity e : changes) {
+        auto pos = std::find(entities.begin(), entities.end(), e);
+        ASSERT_NE(entities.end(), pos);
+        EXPECT_TRUE(inSubtree[pos - entities.begin()]);
+    }
+
+    // same outside of a transaction, with dirty nodes in several levels
+    cursor = changeLog.end();
+    const std::array<size_t, 2> roots = { 7, 2500 };
+    subtreeSize = 0;
+    for (size_t k = 0; k < count; k++) {
+        inSubtree[k] = (k == roots[0]) || (k == roots[1]) ||
+                (parents[k] < count && inSubtree[parents[k]]);
+        subtreeSize += inSubtree[k] ? 1 : 0;
+    }
+    std::array<TransformManager::Instance, 2> instances;
+    std::array<mat4f, 2> transforms;
+    for (size_t k = 0; k < roots.size(); k++) {
+        locals[roots[k]] = mat4f::translate(float4{ 3, 2, 1, 1 });
+        instances[k] = tcm.getInstance(entities[roots[k]]);
+        transforms[k] = locals[roots[k]];
+    }
+    tcm.setTransforms(instances.data(), transforms.data(), instances.size());
+    check();
+    ASSERT_TRUE(changeLog.isValid(cursor));
+    changes = changeLog.since(cursor);
+    EXPECT_EQ(subtreeSize, changes.size());
+    for (Entity e : changes) {
+        auto pos = std::find(entities.begin(), entities.end(), e);
+        ASSERT_NE(entities.end(), pos);
+        EXPECT_TRUE(inSubtree[pos - entities.begin()]);
+    }
+
+    em.destroy(count, entities.data());
+    js.emancipate();
+}
+
+TEST(FilamentTest, TransformManagerBatch) {
+    filament::details::FTransformManager tcm;
+    EntityManager& em = EntityManager::get();
+    std::array<Entity, 4> entities;
+    em.create(entities.size(), entities.data());
+
+    // a root with a child and a grandchild, and another root
+    tcm.create(entities[0]);
+    tcm.create(entities[1], tcm.getInstance(entities[0]), {});
+    tcm.create(entities[2], tcm.getInstance(entities[1]), {});
+    tcm.create(entities[3]);
+
+    auto instances = [&]() {
+        std::array<TransformManager::Instance, 4> result;
+        for (size_t k = 0; k < entities.size(); k++) {
+            result[k] = tcm.getInstance(entities[k]);
+        }
+        return result;
+    };
+
+    // the hierarchy was never sorted, world transforms are still updated immediately
+    std::array<mat4f, 4> locals = {
+            mat4f{ float4{ 2 }}, mat4f{ float4{ 3 }}, mat4f{ float4{ 5 }}, mat4f{ float4{ 7 }}};
+    auto i = instances();
+    tcm.setTransforms(i.data(), locals.data(), 2);
+    EXPECT_EQ(locals[0], tcm.getTransform(i[0]));
+    EXPECT_EQ(locals[1], tcm.getTransform(i[1]));
+    EXPECT_EQ(mat4f{ float4{ 2 }}, tcm.getWorldTransform(i[0]));
+    EXPECT_EQ(mat4f{ float4{ 6 }}, tcm.getWorldTransform(i[1]));
+    EXPECT_EQ(mat4f{ float4{ 6 }}, tcm.getWorldTransform(i[2]));
+
+    // inside a transaction, world transforms are updated by the commit
+    tcm.openLocalTransformTransaction();
+    tcm.setTransforms(i.data() + 1, locals.data() + 1, 3);
+    EXPECT_EQ(mat4f{ float4{ 6 }}, tcm.getWorldTransform(i[2]));
+    EXPECT_EQ(mat4f{ float4{ 1 }}, tcm.getWorldTransform(i[3]));
+    tcm.commitLocalTransformTransaction();
+    i = instances();
+    EXPECT_EQ(mat4f{ float4{ 30 }}, tcm.getWorldTransform(i[2]));
+    EXPECT_EQ(mat4f{ float4{ 7 }}, tcm.getWorldTransform(i[3]));
+
+    // translation, rotation and scale, with the hierarchy sorted
+    const float3 translations[2] = {{ 1, 2, 3 }, { -4, 5, 0 }};
+    const quatf rotations[2] = {
+            quatf::fromAxisAngle(float3{ 0, 1, 0 }, 0.5f),
+            quatf::fromAxisAngle(float3{ 1, 0, 0 }, -1.0f) };
+    const float3 scales[2] = {{ 2, 2, 2 }, { 1, 3, 0.5f }};
+    tcm.setTransforms(i.data(), translations, rotations, scales, 2);
+    for (size_t k = 0; k < 2; k++) {
+        const mat4f expected = mat4f::translate(float4{ translations[k], 1 }) *
+                mat4f(rotations[k]) * mat4f::scale(float4{ scales[k], 1 });
+        for (size_t c = 0; c < 4; c++) {
+            EXPECT_TRUE(vec3eq(expected[c].xyz, tcm.getTransform(i[k])[c].xyz));
+            EXPECT_EQ(expected[c].w, tcm.getTransform(i[k])[c].w);
+        }
+    }
+    EXPECT_EQ(tcm.getTransform(i[0]), tcm.getWorldTransform(i[0]));
+    EXPECT_EQ(tcm.getTransform(i[0]) * tcm.getTransform(i[1]), tcm.getWorldTransform(i[1]));
+    EXPECT_EQ(tcm.getWorldTransform(i[1]) * locals[2], tcm.getWorldTransform(i[2]));
+
+    // scales are optional
+    tcm.setTransforms(i.data() + 3, translations, rotations, nullptr, 1);
+    EXPECT_TRUE(vec3eq(mat4f(rotations[0])[0].xyz, tcm.getWorldTransform(i[3])[0].xyz));
+    EXPECT_EQ(float4(translations[0], 1), tcm.getWorldTransform(i[3])[3]);
+
+    em.destroy(entities.size(), entities.data());
+}
+
+TEST(FilamentTest, ChangeLog) {
+    filament::details::ChangeLog log;
+    EntityManager& em = EntityManager::get();
+    std::array<Entity, 3> entities;
+    em.create(entities.size(), entities.data());
+
+    // a default cursor is never valid
+    filament::details::ChangeLog::Cursor cursor;
+    EXPECT_FALSE(log.isValid(cursor));
+
+    cursor = log.end();
+    EXPECT_TRUE(log.isValid(cursor));
+    EXPECT_EQ(0, log.since(cursor).size());
+
+    log.push(entities[0]);
+    log.push(entities[1]);
+    EXPECT_TRUE(log.isValid(cursor));
+    ASSERT_EQ(2, log.since(cursor).size());
+    EXPECT_EQ(entities[0], log.since(cursor)[0]);
+    EXPECT_EQ(entities[1], log.since(cursor)[1]);
+
+    // trimming entries a cursor has consumed keeps it valid
+    auto consumed = log.end();
+    log.push(entities[2]);
+    log.trim(consumed.position);
+    EXPECT_FALSE(log.isValid(cursor));
+    EXPECT_TRUE(log.isValid(consumed));
+    ASSERT_EQ(1, log.since(consumed).size());
+    EXPECT_EQ(entities[2], log.since(consumed)[0]);
+
+    // invalidating the log invalidates all cursors
+    consumed = log.end();
+    log.invalidate();
+    EXPECT_FALSE(log.isValid(consumed));
+    EXPECT_TRUE(log.isValid(log.end()));
+
+    em.destroy(entities.size(), entities.data());
+}
+
 TEST(FilamentTest, UniformInterfaceBlock) {
 
     UniformInterfaceBlock::Builder b;
@@ -408,6 +640,287 @@ TEST(FilamentTest, SphereCulling) {
     EXPECT_TRUE(frustum.intersects({ 0, 200 }));
 }
 
+TEST(FilamentTest, CullingBvh) {
+    using namespace filament::details;
+
+    JobSystem js;
+    js.adopt();
+
+    Frustum frustum(mat4f::frustum(-1, 1, -1, 1, 1, 100));
+
+    // random boxes, some of them visible, with padding for the Culler
+    const size_t count = 5000;
+    std::default_random_engine gen;
+    std::uniform_real_distribution<float> position(-150.0f, 150.0f);
+    std::uniform_real_distribution<float> size(0.1f, 4.0f);
+    std::vector<float3> centers(count + Culler::MODULO);
+    std::vector<float3> extents(count + Culler::MODULO);
+    for (size_t i = 0; i < count; i++) {
+        centers[i] = { position(gen), position(gen), position(gen) };
+        extents[i] = { size(gen), size(gen), size(gen) };
+    }
+
+    auto check = [&](CullingBvh const& bvh) {
+        std::vector<Culler::result_type> expected(count + Culler::MODULO, 0);
+        std::vector<Culler::result_type> results(count + Culler::MODULO, 0);
+        Culler::intersects(expected.data(), frustum, centers.data(), extents.data(), count, 1);
+        bvh.cull(js, results.data(), frustum, 1);
+        size_t visibles = 0;
+        for (size_t i = 0; i < count; i++) {
+            EXPECT_EQ(expected[i], results[i]);
+            visibles += expected[i] ? 1 : 0;
+        }
+        EXPECT_GT(visibles, 0);
+        EXPECT_LT(visibles, count);
+    };
+
+    CullingBvh bvh;
+    bvh.build(centers.data(), extents.data(), count);
+    EXPECT_EQ(count, bvh.size());
+    check(bvh);
+
+    // move some boxes in front of the camera and refit
+    std::vector<uint32_t> changed;
+    for (uint32_t i = 0; i < count; i += 7) {
+        centers[i] = { 0, 0, -10 - position(gen) * 0.25f };
+        changed.push_back(i);
+    }
+    bvh.refit(centers.data(), extents.data(), changed.data(), changed.size());
+    EXPECT_EQ(1, bvh.getRefitCount());
+    check(bvh);
+
+    js.emancipate();
+}
+
+TEST(FilamentTest, CullerKernels) {
+    using namespace filament::details;
+
+    Frustum frustum(mat4f::frustum(-1, 1, -1, 1, 1, 100));
+
+    // random boxes and spheres (AVX-512 kernels process 16 at a time, leave a tail of 8)
+    const size_t count = 1000;
+    std::default_random_engine gen;
+    std::uniform_real_distribution<float> position(-150.0f, 150.0f);
+    std::uniform_real_distribution<float> size(0.1f, 4.0f);
+    std::vector<float> soa[6];
+    for (auto& array : soa) {
+        array.resize(count);
+    }
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < 3; j++) {
+            soa[j][i] = position(gen);
+            soa[j + 3][i] = size(gen);
+        }
+    }
+
+    std::vector<Culler::result_type> expectedBoxes(count, 0);
+    std::vector<Culler::result_type> expectedSpheres(count, 0);
+    Culler::Test::intersects(Culler::Isa::GENERIC, expectedBoxes.data(), frustum,
+            soa[0].data(), soa[1].data(), soa[2].data(),
+            soa[3].data(), soa[4].data(), soa[5].data(), count);
+    Culler::Test::intersects(Culler::Isa::GENERIC, expectedSpheres.data(), frustum,
+            soa[0].data(), soa[1].data(), soa[2].data(), soa[3].data(), count);
+
+    size_t visibles = 0;
+    for (size_t i = 0; i < count; i++) {
+        visibles += expectedBoxes[i] ? 1 : 0;
+    }
+    EXPECT_GT(visibles, 0);
+    EXPECT_LT(visibles, count);
+
+    // all the kernels supported by this CPU must agree with the generic one
+    for (Culler::Isa isa : { Culler::Isa::NEON, Culler::Isa::AVX2, Culler::Isa::AVX512 }) {
+        if (!Culler::Test::isSupported(isa)) {
+            continue;
+        }
+        std::vector<Culler::result_type> boxes(count, 0);
+        std::vector<Culler::result_type> spheres(count, 0xFF);
+        Culler::Test::intersects(isa, boxes.data(), frustum,
+                soa[0].data(), soa[1].data(), soa[2].data(),
+                soa[3].data(), soa[4].data(), soa[5].data(), count);
+        Culler::Test::intersects(isa, spheres.data(), frustum,
+                soa[0].data(), soa[1].data(), soa[2].data(), soa[3].data(), count);
+        for (size_t i = 0; i < count; i++) {
+            EXPECT_EQ(expectedBoxes[i], boxes[i]);
+            EXPECT_EQ(expectedSpheres[i], spheres[i]);
+        }
+    }
+}
+
+TEST(FilamentTest, OcclusionCuller) {
+    using namespace filament::details;
+
+    JobSystem js;
+    js.adopt();
+
+    // camera at the origin looking down -z, a quad occluder facing it at z = -10
+    const mat4f viewProjection = mat4f::perspective(90.0f, 1.0f, 1.0f, 100.0f);
+    const float3 vertices[] = { { -5, -5, -10 }, { 5, -5, -10 }, { 5, 5, -10 }, { -5, 5, -10 } };
+    const uint16_t indices[] = { 0, 1, 2, 0, 2, 3 };
+    OcclusionCuller::Mesh mesh = { mat4f{}, vertices, indices, 6 };
+
+    OcclusionCuller culler;
+    culler.rasterize(js, viewProjection, &mesh, 1);
+    EXPECT_EQ(2, culler.getTriangleCount());
+
+    // the center of the depth buffer is covered, not its corners
+    const size_t w = OcclusionCuller::WIDTH;
+    const size_t h = OcclusionCuller::HEIGHT;
+    EXPECT_LT(culler.getDepth(w / 2, h / 2), 1.0f);
+    EXPECT_GT(culler.getDepth(0, 0), 1.0f);
+
+    // behind the occluder
+    EXPECT_TRUE(culler.isOccluded({ { 0, 0, -50 }, { 1, 1, 1 } }));
+    // in front of the occluder
+    EXPECT_FALSE(culler.isOccluded({ { 0, 0, -5 }, { 1, 1, 1 } }));
+    // intersecting the occluder
+    EXPECT_FALSE(culler.isOccluded({ { 0, 0, -10 }, { 1, 1, 1 } }));
+    // behind, but not entirely hidden
+    EXPECT_FALSE(culler.isOccluded({ { 40, 0, -50 }, { 1, 1, 1 } }));
+    EXPECT_FALSE(culler.isOccluded({ { 12, 0, -20 }, { 2, 1, 1 } }));
+    // crossing the near plane
+    EXPECT_FALSE(culler.isOccluded({ { 0, 0, -1 }, { 1, 1, 1 } }));
+
+    // the occluder's right edge covers 70% of a column of pixels, which are written. A box
+    // reaching 90% of that column sticks out of the occluder, so it's visible.
+    const float3 partial[] = {
+            { -5, -5, -10 }, { 4.9765625f, -5, -10 }, { 4.9765625f, 5, -10 }, { -5, 5, -10 } };
+    mesh = { mat4f{}, partial, indices, 6 };
+    culler.rasterize(js, viewProjection, &mesh, 1);
+    EXPECT_LT(culler.getDepth(191, h / 2), 1.0f);
+    EXPECT_FALSE(culler.isOccluded({ { 23.9609375f, 0, -50 }, { 1, 1, 0 } }));
+    EXPECT_TRUE(culler.isOccluded({ { 22.9609375f, 0, -50 }, { 1, 1, 0 } }));
+    mesh = { mat4f{}, vertices, indices, 6 };
+    culler.rasterize(js, viewProjection, &mesh, 1);
+
+    // only the given bit of the boxes that have it are updated
+    const float3 centers[] = { { 0, 0, -50 }, { 0, 0, -5 }, { 0, 0, -60 }, { 40, 0, -50 } };
+    const float3 extents[] = { { 1, 1, 1 }, { 1, 1, 1 }, { 1, 1, 1 }, { 1, 1, 1 } };
+    Culler::result_type results[] = { 0x3, 0x3, 0x2, 0x3 };
+    culler.cull(js, results, centers, extents, 4, 0);
+    EXPECT_EQ(0x2, results[0]);
+    EXPECT_EQ(0x3, results[1]);
+    EXPECT_EQ(0x2, results[2]);
+    EXPECT_EQ(0x3, results[3]);
+
+    // triangles crossing the near plane are dropped
+    const float3 near[] = { { -5, -5, 0 }, { 5, -5, -10 }, { 5, 5, -10 } };
+    mesh = { mat4f{}, near, indices, 3 };
+    culler.rasterize(js, viewProjection, &mesh, 1);
+    EXPECT_EQ(0, culler.getTriangleCount());
+    EXPECT_FALSE(culler.isOccluded({ { 0, 0, -50 }, { 1, 1, 1 } }));
+
+    js.emancipate();
+}
+
+TEST(FilamentTest, LevelOfDetailSelection) {
+    using namespace filament::details;
+
+    // level 1 below 50% of the viewport, level 2 below 10%
+    FRenderableManager::LevelsOfDetail lods{};
+    lods.count = 3;
+    lods.screenSizes[0] = std::numeric_limits<float>::infinity();
+    lods.screenSizes[1] = 0.5f;
+    lods.screenSizes[2] = 0.1f;
+    lods.hysteresis = 0;
+
+    EXPECT_EQ(0, FRenderableManager::selectLevelOfDetail(lods, 2.0f, 0));
+    EXPECT_EQ(0, FRenderableManager::selectLevelOfDetail(lods, 0.5f, 2));
+    EXPECT_EQ(1, FRenderableManager::selectLevelOfDetail(lods, 0.49f, 0));
+    EXPECT_EQ(1, FRenderableManager::selectLevelOfDetail(lods, 0.1f, 2));
+    EXPECT_EQ(2, FRenderableManager::selectLevelOfDetail(lods, 0.01f, 0));
+
+    // with some hysteresis, the previous level is kept close to the thresholds
+    lods.hysteresis = 0.2f;
+    EXPECT_EQ(0, FRenderableManager::selectLevelOfDetail(lods, 0.45f, 0));
+    EXPECT_EQ(1, FRenderableManager::selectLevelOfDetail(lods, 0.45f, 1));
+    EXPECT_EQ(1, FRenderableManager::selectLevelOfDetail(lods, 0.55f, 1));
+    EXPECT_EQ(1, FRenderableManager::selectLevelOfDetail(lods, 0.35f, 0));
+    EXPECT_EQ(0, FRenderableManager::selectLevelOfDetail(lods, 0.65f, 1));
+    EXPECT_EQ(2, FRenderableManager::selectLevelOfDetail(lods, 0.01f, 0));
+}
+
+TEST(FilamentTest, Instancing) {
+    // FRenderableManager::setInstances() relies on this layout
+    UniformInterfaceBlock const& uib = UibGenerator::getPerRenderableInstancesUib();
+    EXPECT_EQ(0, uib.getUniformOffset("modelFromInstanceMatrix", 0));
+    EXPECT_EQ(ssize_t(CONFIG_MAX_INSTANCE_COUNT * sizeof(math::mat4f)),
+            uib.getUniformOffset("modelFromInstanceNormalMatrix", 0));
+    EXPECT_EQ(ssize_t(CONFIG_MAX_INSTANCE_COUNT * sizeof(math::mat4f) + 3 * sizeof(math::float4)),
+            uib.getUniformOffset("modelFromInstanceNormalMatrix", 1));
+    // ES 3.0 only guarantees 16 KiB
+    EXPECT_LE(uib.getSize(), 16384u);
+
+    // the instancing variant is a vertex variant that survives unlit and depth filtering
+    const uint8_t instancing = Variant::INSTANCING;
+    EXPECT_EQ(instancing, Variant::filterVariantVertex(instancing));
+    EXPECT_EQ(0, Variant::filterVariantFragment(instancing));
+    EXPECT_EQ(instancing, Variant::filterVariant(
+            Variant::INSTANCING | Variant::DIRECTIONAL_LIGHTING, false));
+    EXPECT_TRUE(Variant(Variant::DEPTH_VARIANT | Variant::INSTANCING).isDepthPass());
+}
+
+TEST(FilamentTest, CommandBufferQueue) {
+    // a small buffer, so that both sides have to wait for each other
+    CommandBufferQueue queue(CircularBuffer::BLOCK_SIZE, CircularBuffer::BLOCK_SIZE * 4);
+    const uint32_t count = 10000;
+
+    uint32_t received = 0;
+    bool ordered = true;
+    std::thread consumer([&queue, &received, &ordered]() {
+        for (;;) {
+            CommandBufferQueue::Slice slice = queue.waitForCommands();
+            if (!slice.begin) {
+                break;
+            }
+            ordered = ordered && *static_cast<uint32_t*>(slice.begin) == received;
+            received++;
+            queue.releaseBuffer(slice);
+        }
+    });
+
+    for (uint32_t i = 0; i < count; i++) {
+        // buffers of various sizes, some of them larger than a block
+        const size_t size = 64 + (i % 7) * 1024;
+        *static_cast<uint32_t*>(queue.getCircularBuffer().allocate(size)) = i;
+        queue.flush();
+    }
+    queue.requestExit();
+    consumer.join();
+
+    EXPECT_EQ(count, received);
+    EXPECT_TRUE(ordered);
+}
+
+TEST(FilamentTest, CommandBufferQueueGrowth) {
+    const size_t bufferSize = CircularBuffer::BLOCK_SIZE * 4;
+    CommandBufferQueue queue(CircularBuffer::BLOCK_SIZE, bufferSize);
+    const size_t size = queue.getSize();
+
+    // nothing is executed, so each of these needs a new buffer
+    const size_t count = CommandBufferQueue::MAX_BUFFERS - 1;
+    for (size_t i = 0; i < count; i++) {
+        queue.getCircularBuffer().allocate(CircularBuffer::BLOCK_SIZE * 3);
+        queue.flush();
+    }
+    EXPECT_EQ(count, queue.getGrowCount());
+    EXPECT_EQ(size * CommandBufferQueue::MAX_BUFFERS, queue.getSize());
+    EXPECT_GE(queue.getHighWatermark(), count * CircularBuffer::BLOCK_SIZE * 3);
+
+    for (size_t i = 0; i < count; i++) {
+        queue.releaseBuffer(queue.waitForCommands());
+    }
+
+    // after a while, the extra buffers are freed
+    for (size_t i = 0; i < CommandBufferQueue::QUIET_FLUSH_COUNT + 2; i++) {
+        queue.getCircularBuffer().allocate(64);
+        queue.flush();
+        queue.releaseBuffer(queue.waitForCommands());
+    }
+    EXPECT_EQ(count, queue.getGrowCount());
+    EXPECT_EQ(size, queue.getSize());
+}
+
 TEST(FilamentTest, ColorConversion) {
     // Linear to Gamma
     // 0.0 stays 0.0
@@ -457,10 +970,6 @@ TEST(FilamentTest, FroxelData) {
 
     FEngine* engine = FEngine::create();
 
-    LinearAllocatorArena arena("FRenderer: per-frame allocator", FEngine::CONFIG_PER_RENDER_PASS_ARENA_SIZE);
-    utils::ArenaScope<LinearAllocatorArena> scope(arena);
-
-
     // view-port size is chosen so that we fit exactly a integer # of froxels horizontally
     // (unfortunately there is no way to guarantee it as it depends on the max # of froxel
     // used by the engine). We do this to infer the value of the left and right most planes
@@ -470,7 +979,7 @@ TEST(FilamentTest, FroxelData) {
 
     Froxelizer froxelData(*engine);
     froxelData.setOptions(5, 100);
-    froxelData.prepare(engine->getDriverApi(), scope, vp, p, 0.1, 100);
+    froxelData.prepare(engine->getDriverApi(), vp, p, 0.1, 100, 1);
 
     Froxel f = froxelData.getFroxelAt(0,0,0);
 
@@ -553,11 +1062,571 @@ TEST(FilamentTest, FroxelData) {
         EXPECT_GT(pointCount, 0);
     }
 
+    {
+        // more lights than a single light UBO could hold, all at the same place
+        const size_t count = 300;
+        froxelData.prepare(engine->getDriverApi(), vp, p, 0.1, 100, count);
+
+        FScene::LightSoa manyLights;
+        manyLights.push_back({}, {}, {}, {});   // first one is always skipped
+        for (size_t i = 0; i < count; i++) {
+            manyLights.push_back(float4{ 0, 0, -3, 1 }, {}, instance, 1);
+        }
+
+        froxelData.froxelizeLights(*engine, {}, manyLights);
+        auto const& froxelBuffer = froxelData.getFroxelBufferUser();
+        auto const& recordBuffer = froxelData.getRecordBufferUser();
+        size_t litFroxelCount = 0;
+        for (const auto& entry : froxelBuffer) {
+            EXPECT_TRUE(entry.pointLightCount == 0 || entry.pointLightCount == count);
+            EXPECT_EQ(entry.spotLightCount, 0);
+            if (entry.pointLightCount) {
+                // each light must be referenced exactly once
+                std::vector<bool> seen(count);
+                for (size_t i = 0; i < count; i++) {
+                    size_t index = recordBuffer[entry.offset + i];
+                    ASSERT_LT(index, count);
+                    EXPECT_FALSE(seen[index]);
+                    seen[index] = true;
+                }
+                litFroxelCount++;
+            }
+        }
+        EXPECT_GT(litFroxelCount, 0);
+        EXPECT_EQ(count, froxelData.getStats().froxelizedLightCount);
+        EXPECT_TRUE(froxelData.getStats().recordsUpdated);
+
+        // nothing changed, nothing needs to be froxelized
+        froxelData.froxelizeLights(*engine, {}, manyLights);
+        EXPECT_EQ(0, froxelData.getStats().froxelizedLightCount);
+        EXPECT_FALSE(froxelData.getStats().recordsUpdated);
+
+        // only the light that moved is froxelized again
+        manyLights.elementAt<FScene::POSITION_RADIUS>(8) = float4{ 0, 0, -20, 1 };
+        froxelData.froxelizeLights(*engine, {}, manyLights);
+        EXPECT_EQ(1, froxelData.getStats().froxelizedLightCount);
+        EXPECT_TRUE(froxelData.getStats().recordsUpdated);
+
+        // and it's been removed from the froxels it left
+        size_t movedFroxelCount = 0;
+        size_t leftFroxelCount = 0;
+        for (const auto& entry : froxelBuffer) {
+            movedFroxelCount += entry.pointLightCount == 1 ? 1 : 0;
+            leftFroxelCount += entry.pointLightCount == count - 1 ? 1 : 0;
+            EXPECT_NE(entry.pointLightCount, count);
+        }
+        EXPECT_GT(movedFroxelCount, 0);
+        EXPECT_GT(leftFroxelCount, 0);
+    }
+
+    {
+        // all the intersection kernels must froxelize point and spot lights the same way
+        Entity s = engine->getEntityManager().create();
+        LightManager::Builder(LightManager::Type::SPOT)
+                .spotLightCone(0.2f, 0.6f)
+                .build(*engine, s);
+        LightManager::Instance spot = engine->getLightManager().getInstance(s);
+
+        const size_t count = 256;
+        froxelData.prepare(engine->getDriverApi(), vp, p, 0.1, 100, count);
+
+        std::mt19937 gen;
+        std::uniform_real_distribution<float> rand(-1.0f, 1.0f);
+        FScene::LightSoa randomLights;
+        randomLights.push_back({}, {}, {}, {});   // first one is always skipped
+        for (size_t i = 0; i < count; i++) {
+            const float z = -2.0f - 40.0f * std::abs(rand(gen));
+            const float4 sphere{ rand(gen) * z, rand(gen) * z, z, 1.0f + 4.0f * std::abs(rand(gen)) };
+            const float3 direction = normalize(float3{ rand(gen), rand(gen), rand(gen) });
+            randomLights.push_back(sphere, direction, (i & 1) ? spot : instance, 1);
+        }
+
+        froxelData.setIsa(Culler::Isa::GENERIC);
+        froxelData.froxelizeLights(*engine, {}, randomLights);
+        auto const& froxelBuffer = froxelData.getFroxelBufferUser();
+        auto const& recordBuffer = froxelData.getRecordBufferUser();
+        const std::vector<Froxelizer::FroxelEntry> froxels(froxelBuffer.begin(), froxelBuffer.end());
+        const std::vector<Froxelizer::RecordBufferType> records(recordBuffer.begin(), recordBuffer.end());
+
+        size_t spotCount = 0;
+        for (const auto& entry : froxels) {
+            spotCount += entry.spotLightCount;
+        }
+        EXPECT_GT(spotCount, 0);
+
+        const Culler::Isa isas[] = { Culler::Isa::NEON, Culler::Isa::AVX2, Culler::Isa::AVX512 };
+        for (Culler::Isa isa : isas) {
+            if (!Culler::Test::isSupported(isa)) {
+                continue;
+            }
+            froxelData.setIsa(isa);
+            froxelData.froxelizeLights(*engine, {}, randomLights);
+            EXPECT_EQ(count, froxelData.getStats().froxelizedLightCount);
+            for (size_t i = 0; i < froxels.size(); i++) {
+                const auto& entry = froxelBuffer[i];
+                ASSERT_EQ(froxels[i].u64, entry.u64);
+                for (size_t j = 0; j < entry.pointLightCount + entry.spotLightCount; j++) {
+                    EXPECT_EQ(records[entry.offset + j], recordBuffer[entry.offset + j]);
+                }
+            }
+        }
+        froxelData.setIsa(Culler::getIsa());
+    }
+
     froxelData.terminate(engine->getDriverApi());
     engine->shutdown();
     delete engine;
 }
 
+TEST(FilamentTest, SceneGatherEntities) {
+    using namespace filament::details;
+
+    FEngine* engine = FEngine::create();
+    EntityManager& em = engine->getEntityManager();
+    FTransformManager& tcm = engine->getTransformManager();
+    FScene* scene = engine->createScene();
+
+    // long enough to be gathered on several threads, with dead and component-less entities
+    // interleaved across the chunks
+    const size_t count = 1000;
+    std::vector<Entity> entities(count);
+    em.create(count, entities.data());
+    for (size_t i = 0; i < count; i++) {
+        const Entity e = entities[i];
+        const float3 position = { float(i), float(i % 13), -float(i % 7) };
+        switch (i % 7) {
+            case 0: // renderable
+            case 3: // renderable of an entity destroyed below
+            case 4: // renderable and light
+                RenderableManager::Builder(0)
+                        .boundingBox({ position, { 1, 2, 3 } })
+                        .priority(uint8_t(i % 8))
+                        .layerMask(0xFF, uint8_t(i))
+                        .build(*engine, e);
+                tcm.setTransform(tcm.getInstance(e), mat4f::translate(float4{ position, 1 }));
+                if (i % 7 == 4) {
+                    LightManager::Builder(LightManager::Type::POINT)
+                            .position(position)
+                            .build(*engine, e);
+                }
+                break;
+            case 1: // point light
+                LightManager::Builder(LightManager::Type::POINT)
+                        .position(position)
+                        .build(*engine, e);
+                break;
+            case 5: // spot light
+                LightManager::Builder(LightManager::Type::SPOT)
+                        .position(position)
+                        .direction({ 0, -1, 0 })
+                        .build(*engine, e);
+                break;
+            default: // no components
+                break;
+        }
+    }
+    for (size_t i = 3; i < count; i += 7) {
+        em.destroy(entities[i]);
+    }
+
+    FScene::Test::gatherEntities(*scene, engine->getJobSystem(), entities);
+    FScene::RenderableSoa const& renderableCache = scene->getRenderableCache();
+    FScene::LightSoa const& lightCache = scene->getLightCache();
+
+    // gather the same entities one by one, the cached arrays keep their order
+    FScene::RenderableSoa renderables;
+    FScene::LightSoa lights;
+    renderables.resize(1);
+    lights.resize(1);
+    size_t r = 0;
+    size_t l = 0;
+    for (Entity e : entities) {
+        const uint8_t kind = FScene::Test::gatherEntity(*scene, e, renderables, lights, 0);
+        if (kind & FScene::Test::RENDERABLE) {
+            ASSERT_LT(r, renderableCache.size());
+            EXPECT_EQ(renderables.elementAt<FScene::RENDERABLE_INSTANCE>(0),
+                    renderableCache.elementAt<FScene::RENDERABLE_INSTANCE>(r));
+            EXPECT_EQ(renderables.elementAt<FScene::WORLD_TRANSFORM>(0),
+                    renderableCache.elementAt<FScene::WORLD_TRANSFORM>(r));
+            EXPECT_EQ(0, memcmp(&renderables.elementAt<FScene::VISIBILITY_STATE>(0),
+                    &renderableCache.elementAt<FScene::VISIBILITY_STATE>(r),
+                    sizeof(FRenderableManager::Visibility)));
+            EXPECT_EQ(renderables.elementAt<FScene::UBH>(0).getId(),
+                    renderableCache.elementAt<FScene::UBH>(r).getId());
+            EXPECT_EQ(renderables.elementAt<FScene::BONES_UBH>(0).getId(),
+                    renderableCache.elementAt<FScene::BONES_UBH>(r).getId());
+            EXPECT_EQ(renderables.elementAt<FScene::INSTANCES_UBH>(0).getId(),
+                    renderableCache.elementAt<FScene::INSTANCES_UBH>(r).getId());
+            EXPECT_EQ(renderables.elementAt<FScene::INSTANCE_COUNT>(0),
+                    renderableCache.elementAt<FScene::INSTANCE_COUNT>(r));
+            EXPECT_EQ(renderables.elementAt<FScene::WORLD_AABB_CENTER>(0),
+                    renderableCache.elementAt<FScene::WORLD_AABB_CENTER>(r));
+            EXPECT_EQ(renderables.elementAt<FScene::LAYERS>(0),
+                    renderableCache.elementAt<FScene::LAYERS>(r));
+            EXPECT_EQ(renderables.elementAt<FScene::WORLD_AABB_EXTENT>(0),
+                    renderableCache.elementAt<FScene::WORLD_AABB_EXTENT>(r));
+            r++;
+        }
+        if (kind & FScene::Test::LIGHT) {
+            ASSERT_LT(l, lightCache.size());
+            EXPECT_EQ(lights.elementAt<FScene::POSITION_RADIUS>(0),
+                    lightCache.elementAt<FScene::POSITION_RADIUS>(l));
+            EXPECT_EQ(lights.elementAt<FScene::DIRECTION>(0),
+                    lightCache.elementAt<FScene::DIRECTION>(l));
+            EXPECT_EQ(lights.elementAt<FScene::LIGHT_INSTANCE>(0),
+                    lightCache.elementAt<FScene::LIGHT_INSTANCE>(l));
+            l++;
+        }
+    }
+    size_t renderableCount = 0;
+    size_t lightCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        renderableCount += (i % 7 == 0 || i % 7 == 4) ? 1 : 0;
+        lightCount += (i % 7 == 1 || i % 7 == 4 || i % 7 == 5) ? 1 : 0;
+    }
+    EXPECT_EQ(renderableCount, r);
+    EXPECT_EQ(lightCount, l);
+    EXPECT_EQ(r, renderableCache.size());
+    EXPECT_EQ(l, lightCache.size());
+
+    engine->destroy(scene);
+    engine->shutdown();
+    delete engine;
+}
+
+TEST(FilamentTest, ScenePrepareDestroyedEntities) {
+    using namespace filament::details;
+
+    FEngine* engine = FEngine::create();
+    EntityManager& em = engine->getEntityManager();
+    FRenderableManager& rcm = engine->getRenderableManager();
+    FScene* scene = engine->createScene();
+    FScene* other = engine->createScene();
+
+    const size_t count = 100;
+    std::vector<Entity> entities(count);
+    em.create(count, entities.data());
+    for (Entity e : entities) {
+        RenderableManager::Builder(0).boundingBox({ { 0, 0, 0 }, { 1, 1, 1 } }).build(*engine, e);
+        scene->addEntity(e);
+    }
+    // the other scene only has the first half of the entities
+    for (size_t i = 0; i < count / 2; i++) {
+        other->addEntity(entities[i]);
+    }
+    scene->prepare(mat4f{});
+    other->prepare(mat4f{});
+    FScene::RenderableSoa const& renderableCache = scene->getRenderableCache();
+    EXPECT_EQ(count, renderableCache.size());
+
+    // nothing changed, nothing is removed
+    scene->prepare(mat4f{});
+    EXPECT_EQ(count, renderableCache.size());
+
+    // the components of destroyed entities outlive them until they're garbage collected
+    std::vector<FRenderableManager::Instance> destroyed;
+    for (size_t i = 0; i < count; i += 3) {
+        destroyed.push_back(rcm.getInstance(entities[i]));
+        em.destroy(entities[i]);
+    }
+    scene->prepare(mat4f{});
+    EXPECT_EQ(count - destroyed.size(), renderableCache.size());
+    for (size_t i = 0; i < renderableCache.size(); i++) {
+        auto ri = renderableCache.elementAt<FScene::RENDERABLE_INSTANCE>(i);
+        EXPECT_EQ(destroyed.end(), std::find(destroyed.begin(), destroyed.end(), ri));
+    }
+
+    // the other scene dropped its destroyed entities too, even though it wasn't prepared
+    FScene::RenderableSoa const& otherCache = other->getRenderableCache();
+    EXPECT_EQ(count / 2 - (count / 2 + 2) / 3, otherCache.size());
+    for (size_t i = 0; i < otherCache.size(); i++) {
+        auto ri = otherCache.elementAt<FScene::RENDERABLE_INSTANCE>(i);
+        EXPECT_EQ(destroyed.end(), std::find(destroyed.begin(), destroyed.end(), ri));
+    }
+    other->prepare(mat4f{});
+    EXPECT_EQ(count / 2 - (count / 2 + 2) / 3, otherCache.size());
+
+    engine->destroy(other);
+    engine->destroy(scene);
+    engine->shutdown();
+    delete engine;
+}
+
+TEST(FilamentTest, CommandCache) {
+    using namespace filament::details;
+    using Command = RenderPass::Command;
+
+    FEngine* engine = FEngine::create();
+    JobSystem& js = engine->getJobSystem();
+    FMaterial const* const material = engine->getDefaultMaterial();
+    FMaterialInstance const* const instances[] = {
+            material->getDefaultInstance(), material->createInstance() };
+
+    // the camera looks down -z from the origin
+    const float3 cameraPosition = { 0, 0, 0 };
+    const float3 cameraForward = { 0, 0, -1 };
+    const uint32_t flags = RenderPass::CommandTypeFlags::COLOR;
+
+    struct Object {
+        float3 center;
+        bool visible;
+        std::vector<FRenderPrimitive> primitives;
+    };
+    const size_t count = 1000;
+    std::vector<Object> objects(count);
+    for (size_t i = 0; i < count; i++) {
+        objects[i].center = { 0, 0, -(1.0f + i * 0.37f) };
+        objects[i].visible = true;
+        objects[i].primitives.resize(1 + i % 2);
+        for (size_t p = 0; p < objects[i].primitives.size(); p++) {
+            objects[i].primitives[p].setMaterialInstance(instances[(i / 3 + p) & 1]);
+        }
+    }
+
+    // the SoA only holds the visible objects, like after culling
+    FScene::RenderableSoa soa;
+    soa.setCapacity(count + 1);
+    auto gather = [&soa, &objects]() {
+        soa.clear();
+        for (size_t i = 0; i < objects.size(); i++) {
+            Object& object = objects[i];
+            if (!object.visible) {
+                continue;
+            }
+            const size_t k = soa.size();
+            soa.resize(k + 1);
+            FRenderableManager::Visibility visibility = {};
+            visibility.priority = 4;
+            soa.elementAt<FScene::RENDERABLE_INSTANCE>(k) =
+                    utils::EntityInstance<RenderableManager>(uint32_t(i + 1));
+            soa.elementAt<FScene::VISIBILITY_STATE>(k) = visibility;
+            soa.elementAt<FScene::UBH>(k) = Handle<HwUniformBuffer>(HandleBase::HandleId(i));
+            soa.elementAt<FScene::BONES_UBH>(k) = {};
+            soa.elementAt<FScene::INSTANCES_UBH>(k) = {};
+            soa.elementAt<FScene::INSTANCE_COUNT>(k) = 0;
+            soa.elementAt<FScene::WORLD_AABB_CENTER>(k) = object.center;
+            soa.elementAt<FScene::PRIMITIVES>(k) = { object.primitives.data(),
+                    object.primitives.data() + object.primitives.size() };
+        }
+        return Range<uint32_t>{ 0, uint32_t(soa.size()) };
+    };
+
+    // commands with the same key can be in any order, so they're compared by their renderable
+    auto sorted = [](GrowingSlice<Command> const& commands) {
+        std::vector<Command> result;
+        for (Command const& command : commands) {
+            if (command.key != uint64_t(RenderPass::Pass::SENTINEL)) {
+                result.push_back(command);
+            }
+        }
+        std::sort(result.begin(), result.end(), [](Command const& lhs, Command const& rhs) {
+            return std::make_tuple(lhs.key, lhs.primitive.perRenderableUniforms.getId(),
+                    uintptr_t(lhs.primitive.mi)) <
+                   std::make_tuple(rhs.key, rhs.primitive.perRenderableUniforms.getId(),
+                    uintptr_t(rhs.primitive.mi));
+        });
+        return result;
+    };
+
+    RenderPass::CommandCache cache;
+    std::vector<Command> cachedStorage(count * 4 + 1);
+    std::vector<Command> rebuiltStorage(count * 4 + 1);
+    auto check = [&]() {
+        const Range<uint32_t> vr = gather();
+        filament::details::ArenaScope arena(engine->getPerRenderPassAllocator());
+
+        GrowingSlice<Command> cached(cachedStorage.data(), uint32_t(cachedStorage.size()));
+        ASSERT_TRUE(RenderPass::Test::generateCachedCommands(js, arena, cache, flags,
+                soa, vr, 0, cameraPosition, cameraForward, cached));
+        GrowingSlice<Command> rebuilt(rebuiltStorage.data(), uint32_t(rebuiltStorage.size()));
+        RenderPass::Test::generateCommands(js, arena, flags,
+                soa, vr, 0, cameraPosition, cameraForward, rebuilt);
+
+        // the cached commands are sorted
+        for (size_t i = 1; i < cached.size(); i++) {
+            ASSERT_LE(cached[i - 1].key, cached[i].key);
+        }
+
+        std::vector<Command> a = sorted(cached);
+        std::vector<Command> b = sorted(rebuilt);
+        ASSERT_EQ(b.size(), a.size());
+        for (size_t i = 0; i < a.size(); i++) {
+            EXPECT_EQ(b[i].key, a[i].key);
+            EXPECT_EQ(b[i].primitive.mi, a[i].primitive.mi);
+            EXPECT_EQ(b[i].primitive.primitiveHandle.getId(), a[i].primitive.primitiveHandle.getId());
+            EXPECT_EQ(b[i].primitive.perRenderableUniforms.getId(),
+                    a[i].primitive.perRenderableUniforms.getId());
+            EXPECT_EQ(b[i].primitive.rasterState.u, a[i].primitive.rasterState.u);
+            EXPECT_EQ(b[i].primitive.materialVariant.key, a[i].primitive.materialVariant.key);
+            EXPECT_EQ(b[i].primitive.instanceCount, a[i].primitive.instanceCount);
+        }
+    };
+
+    // the first frame generates everything, the second one only reuses the cached commands
+    check();
+    EXPECT_EQ(1, cache.getRebuildCount());
+    check();
+    EXPECT_EQ(1, cache.getRebuildCount());
+    EXPECT_EQ(1, cache.getPatchCount());
+
+    // a few renderables change, below REBUILD_RATIO
+    const size_t few = size_t(count * RenderPass::CommandCache::REBUILD_RATIO / 4);
+    for (size_t i = 0; i < few; i++) {
+        // switch material instance
+        FRenderPrimitive& primitive = objects[i * 4].primitives[0];
+        primitive.setMaterialInstance(
+                primitive.getMaterialInstance() == instances[0] ? instances[1] : instances[0]);
+        // cross a depth bucket
+        objects[i * 4 + 1].center.z *= 4.0f;
+        // become invisible
+        objects[i * 4 + 2].visible = false;
+    }
+    check();
+    EXPECT_EQ(1, cache.getRebuildCount());
+    EXPECT_EQ(2, cache.getPatchCount());
+
+    // the invisible renderables become visible again
+    for (size_t i = 0; i < few; i++) {
+        objects[i * 4 + 2].visible = true;
+    }
+    check();
+    EXPECT_EQ(1, cache.getRebuildCount());
+    EXPECT_EQ(3, cache.getPatchCount());
+
+    // most renderables cross a depth bucket, above REBUILD_RATIO
+    for (size_t i = 0; i < count; i += 2) {
+        objects[i].center.z *= 4.0f;
+    }
+    check();
+    EXPECT_EQ(2, cache.getRebuildCount());
+    EXPECT_EQ(3, cache.getPatchCount());
+
+    // and the next frame patches the rebuilt commands again
+    objects[1].primitives[0].setMaterialInstance(instances[0]);
+    objects[7].visible = false;
+    check();
+    EXPECT_EQ(2, cache.getRebuildCount());
+    EXPECT_EQ(4, cache.getPatchCount());
+
+    engine->destroy(instances[1]);
+    engine->shutdown();
+    delete engine;
+}
+
+// A driver that only records the calls it receives, along with their handles and scalar arguments
+class RecordingDriver final : public DriverBase {
+public:
+    RecordingDriver() noexcept : DriverBase(new ConcreteDispatcher<RecordingDriver>(this)) { }
+
+    // terminates the commands recorded in 'buffer' and executes them
+    void execute(CircularBuffer& buffer) {
+        new(buffer.allocate(CommandBase::align(sizeof(NoopCommand)))) NoopCommand(nullptr);
+        CommandStream(*this, buffer).execute(buffer.getTail());
+    }
+
+    std::vector<uint64_t> calls;
+
+private:
+    ShaderModel getShaderModel() const noexcept override { return ShaderModel::UNKNOWN; }
+
+    static uint64_t value(HandleBase const& h) noexcept { return h.getId(); }
+    static uint64_t value(Driver::RasterState rs) noexcept { return rs.u; }
+    template<typename T, typename = typename std::enable_if<
+            std::is_arithmetic<T>::value || std::is_enum<T>::value>::type>
+    static uint64_t value(T v) noexcept { return uint64_t(v); }
+    template<typename T, typename = typename std::enable_if<
+            !std::is_arithmetic<T>::value && !std::is_enum<T>::value &&
+            !std::is_base_of<HandleBase, T>::value>::type, typename = void>
+    static uint64_t value(T const&) noexcept { return 0; }
+
+    void record() noexcept { }
+
+    template<typename FIRST, typename... REMAINING>
+    void record(FIRST const& first, REMAINING const& ... rest) noexcept {
+        calls.push_back(value(first));
+        record(rest...);
+    }
+
+    friend class filament::ConcreteDispatcher<RecordingDriver>;
+
+#define DECL_DRIVER_API(methodName, paramsDecl, params) \
+    UTILS_ALWAYS_INLINE void methodName(paramsDecl) { \
+        /* string literals have the same address each time a given method is called */ \
+        calls.push_back(uint64_t(uintptr_t(#methodName))); \
+        record(params); }
+
+#define DECL_DRIVER_API_SYNCHRONOUS(RetType, methodName, paramsDecl, params) \
+    RetType methodName(paramsDecl) override { return RetType(); }
+
+#define DECL_DRIVER_API_RETURN(RetType, methodName, paramsDecl, params) \
+    RetType methodName##Synchronous() noexcept override { \
+        return RetType((RetType::HandleId)0xDEAD0000); } \
+    UTILS_ALWAYS_INLINE void methodName(RetType, paramsDecl) { }
+
+#include "driver/DriverAPI.inc"
+};
+
+template class filament::ConcreteDispatcher<RecordingDriver>;
+
+TEST(FilamentTest, ParallelCommandRecording) {
+    using namespace filament::details;
+
+    FEngine* engine = FEngine::create();
+    JobSystem& js = engine->getJobSystem();
+    FMaterial const* const material = engine->getDefaultMaterial();
+    FMaterialInstance const* const instances[] = {
+            material->getDefaultInstance(), material->createInstance() };
+
+    // enough commands for several rounds of slices on all threads
+    const size_t threads = size_t(1) << js.getParallelSplitCount();
+    const size_t count = 3 * threads * 1024 + 17;
+
+    std::default_random_engine gen;
+    std::uniform_int_distribution<uint32_t> rand(0, 7);
+    std::vector<RenderPass::Command> commands(count + 1);
+    for (size_t i = 0; i < count; i++) {
+        RenderPass::Command& command = commands[i];
+        RenderPass::PrimitiveInfo& info = command.primitive;
+        const uint32_t r = rand(gen);
+        command.key = i;
+        // material instance changes are frequent, and some happen at the slice boundaries
+        info.mi = instances[(i / (r + 1)) & 1];
+        info.primitiveHandle = Handle<HwRenderPrimitive>(HandleBase::HandleId(i));
+        info.perRenderableUniforms = Handle<HwUniformBuffer>(HandleBase::HandleId(2 * i));
+        if (r == 1) {
+            info.perRenderableBones = Handle<HwUniformBuffer>(HandleBase::HandleId(2 * i + 1));
+        }
+        if (r == 2) {
+            info.perRenderableInstances = Handle<HwUniformBuffer>(HandleBase::HandleId(3 * i));
+            info.instanceCount = 4;
+        }
+    }
+    commands[count].key = uint64_t(-1);
+    Slice<RenderPass::Command> slice(commands.data(), commands.data() + commands.size());
+
+    RecordingDriver serialDriver;
+    std::vector<uint8_t> serialData((count + 1) * 256);
+    CircularBuffer serialBuffer(serialData.data(), serialData.size());
+    CommandStream serialStream(serialDriver, serialBuffer);
+    RenderPass::Test::recordDriverCommands(serialStream, slice);
+    serialDriver.execute(serialBuffer);
+
+    RecordingDriver parallelDriver;
+    std::vector<uint8_t> parallelData((count + 1) * 256);
+    CircularBuffer parallelBuffer(parallelData.data(), parallelData.size());
+    CommandStream parallelStream(parallelDriver, parallelBuffer);
+    filament::details::ArenaScope arena(engine->getPerRenderPassAllocator());
+    RenderPass::Test::recordDriverCommands(*engine, js, arena, parallelStream, slice);
+    parallelDriver.execute(parallelBuffer);
+
+    EXPECT_FALSE(serialDriver.calls.empty());
+    EXPECT_EQ(serialDriver.calls, parallelDriver.calls);
+
+    engine->destroy(instances[1]);
+    engine->shutdown();
+    delete engine;
+}
+
 TEST(FilamentTest, RangeSet) {
 
     utils::RangeSet<4> rs;
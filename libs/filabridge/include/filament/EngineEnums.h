@@ -37,13 +37,13 @@ enum VertexAttribute : uint8_t {
 // Effectively, these are just names.
 // These are limited by Program::NUM_UNIFORM_BINDINGS (currently 8)
 namespace BindingPoints {
-    constexpr uint8_t PER_VIEW                = 0;    // uniforms/samplers updated per view
-    constexpr uint8_t PER_RENDERABLE          = 1;    // uniforms/samplers updated per renderable
-    constexpr uint8_t PER_RENDERABLE_BONES    = 2;    // bones data, per renderable
-    constexpr uint8_t LIGHTS                  = 3;    // lights data array
-    constexpr uint8_t POST_PROCESS            = 4;    // samplers for the post process pass
-    constexpr uint8_t PER_MATERIAL_INSTANCE   = 5;    // uniforms/samplers updates per material
-    constexpr uint8_t COUNT                   = 6;
+    constexpr uint8_t PER_VIEW                 = 0;    // uniforms/samplers updated per view
+    constexpr uint8_t PER_RENDERABLE           = 1;    // uniforms/samplers updated per renderable
+    constexpr uint8_t PER_RENDERABLE_BONES     = 2;    // bones data, per renderable
+    constexpr uint8_t POST_PROCESS             = 3;    // samplers for the post process pass
+    constexpr uint8_t PER_RENDERABLE_INSTANCES = 4;    // instances transforms, per renderable
+    constexpr uint8_t PER_MATERIAL_INSTANCE    = 5;    // uniforms/samplers updates per material
+    constexpr uint8_t COUNT                    = 6;
 }
 
 static_assert(BindingPoints::PER_MATERIAL_INSTANCE == BindingPoints::COUNT - 1,
@@ -51,15 +51,19 @@ static_assert(BindingPoints::PER_MATERIAL_INSTANCE == BindingPoints::COUNT - 1,
 
 constexpr size_t MAX_ATTRIBUTE_BUFFERS_COUNT = 8;   // FIXME: should match Driver::MAX_ATTRIBUTE_BUFFER_COUNT
 
-// This value is limited by UBO size, ES3.0 only guarantees 16 KiB.
-// Values <= 256, use less CPU and GPU resources.
-constexpr size_t CONFIG_MAX_LIGHT_COUNT = 256;
+// Lights are stored in a texture (see GpuLightBuffer), so this isn't limited by UBO size.
+// Light indices are stored on 16 bits, and froxelization memory grows with the number of lights
+// actually visible, not with this value.
+constexpr size_t CONFIG_MAX_LIGHT_COUNT = 4096;
 constexpr size_t CONFIG_MAX_LIGHT_INDEX = CONFIG_MAX_LIGHT_COUNT - 1;
 
-// This value is also limited by UBO size, ES3.0 only guarantees 16 KiB.
+// This value is limited by UBO size, ES3.0 only guarantees 16 KiB.
 // 256 is enough, but we could use 512 if needed
 constexpr size_t CONFIG_MAX_BONE_COUNT = 256;
 
+// This value is also limited by UBO size, each instance takes 112 bytes (a mat4 and a mat3)
+constexpr size_t CONFIG_MAX_INSTANCE_COUNT = 128;
+
 // can't really use std::underlying_type<AttributeIndex>::type because the driver takes a uint32_t
 using AttributeBitset = utils::bitset32;
 
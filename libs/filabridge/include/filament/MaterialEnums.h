@@ -21,6 +21,11 @@
 #include <stdint.h>
 
 namespace filament {
+    // Version of the material packages. It must be incremented whenever the engine and the
+    // materials must agree on something new (e.g. binding points or sampler bindings), the
+    // engine refuses materials built for another version.
+    static constexpr uint32_t MATERIAL_VERSION = 3;
+
     enum class Shading : uint8_t {
         UNLIT,                  // no lighting applied, emissive possible
         LIT,                    // default, standard lighting
@@ -25,9 +25,9 @@ class UibGenerator {
 public:
     static UniformInterfaceBlock& getPerViewUib() noexcept;
     static UniformInterfaceBlock& getPerRenderableUib() noexcept;
-    static UniformInterfaceBlock& getLightsUib() noexcept;
     static UniformInterfaceBlock& getPostProcessingUib() noexcept;
     static UniformInterfaceBlock& getPerRenderableBonesUib() noexcept;
+    static UniformInterfaceBlock& getPerRenderableInstancesUib() noexcept;
 };
 
 }
@@ -28,7 +28,8 @@ SamplerInterfaceBlock& SibGenerator::getPerViewSib() noexcept {
             .name("Light")
             .add("shadowMap",     Type::SAMPLER_2D,      Format::SHADOW,Precision::LOW)
             .add("records",       Type::SAMPLER_2D,      Format::UINT,  Precision::MEDIUM)
-            .add("froxels",       Type::SAMPLER_2D,      Format::UINT,  Precision::MEDIUM)
+            .add("froxels",       Type::SAMPLER_2D,      Format::UINT,  Precision::HIGH)
+            .add("lights",        Type::SAMPLER_2D,      Format::FLOAT, Precision::HIGH)
             .add("iblDFG",        Type::SAMPLER_2D,      Format::FLOAT, Precision::MEDIUM)
             .add("iblSpecular",   Type::SAMPLER_CUBEMAP, Format::FLOAT, Precision::MEDIUM)
             .build();
@@ -52,8 +53,6 @@ SamplerInterfaceBlock* SibGenerator::getSib(uint8_t bindingPoint) noexcept {
             return &getPerViewSib();
         case BindingPoints::PER_RENDERABLE:
             return nullptr;
-        case BindingPoints::LIGHTS:
-            return nullptr;
         case BindingPoints::POST_PROCESS:
             return &getPostProcessSib();
         default:
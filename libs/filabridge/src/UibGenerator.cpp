@@ -73,14 +73,6 @@ UniformInterfaceBlock& UibGenerator::getPerRenderableUib() noexcept {
     return uib;
 }
 
-UniformInterfaceBlock& UibGenerator::getLightsUib() noexcept {
-    static UniformInterfaceBlock uib = UniformInterfaceBlock::Builder()
-            .name("LightsUniforms")
-            .add("lights", CONFIG_MAX_LIGHT_COUNT, UniformInterfaceBlock::Type::MAT4, Precision::HIGH)
-            .build();
-    return uib;
-}
-
 UniformInterfaceBlock& UibGenerator::getPostProcessingUib() noexcept {
     static UniformInterfaceBlock uib =  UniformInterfaceBlock::Builder()
             .name("PostProcessUniforms")
@@ -99,4 +91,13 @@ UniformInterfaceBlock& UibGenerator::getPerRenderableBonesUib() noexcept {
     return uib;
 }
 
+UniformInterfaceBlock& UibGenerator::getPerRenderableInstancesUib() noexcept {
+    static UniformInterfaceBlock uib = UniformInterfaceBlock::Builder()
+            .name("InstancesUniforms")
+            .add("modelFromInstanceMatrix",       CONFIG_MAX_INSTANCE_COUNT, UniformInterfaceBlock::Type::MAT4, Precision::HIGH)
+            .add("modelFromInstanceNormalMatrix", CONFIG_MAX_INSTANCE_COUNT, UniformInterfaceBlock::Type::MAT3, Precision::HIGH)
+            .build();
+    return uib;
+}
+
 } // namespace filament
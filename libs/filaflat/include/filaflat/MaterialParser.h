@@ -53,6 +53,7 @@ public:
     bool isPostProcessMaterial() const noexcept;
 
     // Accessors
+    bool getMaterialVersion(uint32_t* value) const noexcept;
     bool getName(utils::CString*) const noexcept;
     bool getUIB(filament::UniformInterfaceBlock* uib) const noexcept;
     bool getSIB(filament::SamplerInterfaceBlock* sib) const noexcept;
@@ -160,6 +160,7 @@ const std::string ShaderGenerator::createVertexProgram(filament::driver::ShaderM
     cg.generateDefine(vs, "HAS_DIRECTIONAL_LIGHTING", litVariants && variant.hasDirectionalLighting());
     cg.generateDefine(vs, "HAS_SHADOWING", litVariants && variant.hasShadowReceiver());
     cg.generateDefine(vs, "HAS_SKINNING", variant.hasSkinning());
+    cg.generateDefine(vs, "HAS_INSTANCING", variant.hasInstancing());
     cg.generateDefine(vs, getShadingDefine(material.shading), true);
     generateMaterialDefines(vs, cg, mProperties);
 
@@ -189,6 +190,11 @@ const std::string ShaderGenerator::createVertexProgram(filament::driver::ShaderM
                 BindingPoints::PER_RENDERABLE_BONES,
                 UibGenerator::getPerRenderableBonesUib());
     }
+    if (variant.hasInstancing()) {
+        cg.generateUniforms(vs, ShaderType::VERTEX,
+                BindingPoints::PER_RENDERABLE_INSTANCES,
+                UibGenerator::getPerRenderableInstancesUib());
+    }
     cg.generateUniforms(vs, ShaderType::VERTEX,
             BindingPoints::PER_MATERIAL_INSTANCE, material.uib);
     cg.generateSeparator(vs);
@@ -287,8 +293,6 @@ const std::string ShaderGenerator::createFragmentProgram(filament::driver::Shade
     // uniforms and samplers
     cg.generateUniforms(fs, ShaderType::FRAGMENT,
             BindingPoints::PER_VIEW, UibGenerator::getPerViewUib());
-    cg.generateUniforms(fs, ShaderType::FRAGMENT,
-            BindingPoints::LIGHTS, UibGenerator::getLightsUib());
     cg.generateUniforms(fs, ShaderType::FRAGMENT,
             BindingPoints::PER_MATERIAL_INSTANCE, material.uib);
     cg.generateSeparator(fs);
@@ -22,6 +22,7 @@
 #include <stddef.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <atomic>
 #include <mutex>
 
@@ -130,6 +131,101 @@ private:
     void* mCurrent = nullptr;
 };
 
+/* ------------------------------------------------------------------------------------------------
+ * GrowingLinearAllocator
+ *
+ * + Allocates blocks linearly
+ * + Chains blocks from the heap when the area is full, those are kept for reuse until trim()
+ * + Can free top of memory back up to a specified point, in any block
+ * + Keeps track of the peak memory usage
+ * + Doesn't call destructors
+ * ------------------------------------------------------------------------------------------------
+ */
+
+class GrowingLinearAllocator {
+public:
+    // use memory area provided, then blocks of (at least) the same size from the heap
+    GrowingLinearAllocator(void* begin, void* end) noexcept;
+
+    template <typename AREA>
+    explicit GrowingLinearAllocator(const AREA& area)
+            : GrowingLinearAllocator(area.begin(), area.end()) { }
+
+    // Allocators can't be copied
+    GrowingLinearAllocator(const GrowingLinearAllocator& rhs) = delete;
+    GrowingLinearAllocator& operator=(const GrowingLinearAllocator& rhs) = delete;
+
+    ~GrowingLinearAllocator() noexcept;
+
+    // our allocator concept
+    void* alloc(size_t size, size_t alignment = alignof(std::max_align_t), size_t extra = 0) UTILS_RESTRICT {
+        void* const p = pointermath::align(mCurrent, alignment, extra);
+        void* const c = pointermath::add(p, size);
+        if (UTILS_LIKELY(c <= mEnd)) {
+            mCurrent = c;
+            return p;
+        }
+        return grow(size, alignment, extra);
+    }
+
+    // API specific to this allocator
+
+    void *getCurrent() UTILS_RESTRICT noexcept {
+        return mCurrent;
+    }
+
+    // free memory back to the specified point, blocks chained after it are kept for reuse
+    void rewind(void* p) noexcept;
+
+    // frees all allocated blocks
+    void reset() noexcept {
+        rewind(mAreaBegin);
+    }
+
+    // bytes currently allocated, in all blocks
+    size_t allocated() const UTILS_RESTRICT noexcept {
+        return mAllocatedBefore + (uintptr_t(mCurrent) - uintptr_t(mBegin));
+    }
+
+    // most bytes allocated at once since construction or the last resetPeak()
+    size_t getPeak() const noexcept {
+        return std::max(mPeak, allocated());
+    }
+
+    void resetPeak() noexcept {
+        mPeak = allocated();
+    }
+
+    // number of blocks allocated from the heap, in use or not
+    size_t getBlockCount() const noexcept;
+
+    // Frees the blocks that stayed unused for more than 'count' calls to trim(), e.g. this is
+    // called once per frame, after the last rewind(), to free the blocks of a spike.
+    void trim(uint32_t count) noexcept;
+
+    // GrowingLinearAllocator shouldn't have a free() method
+    // it's only needed to be compatible with STLAllocator<> below
+    void free(void*) UTILS_RESTRICT noexcept { }
+
+private:
+    struct Block;
+    void* grow(size_t size, size_t alignment, size_t extra) noexcept;
+
+    // the block we're allocating from
+    void* mBegin = nullptr;
+    void* mEnd = nullptr;
+    void* mCurrent = nullptr;
+
+    // the area given at construction, which is always the first block
+    void* mAreaBegin = nullptr;
+    void* mAreaEnd = nullptr;
+
+    size_t mAllocatedBefore = 0;    // bytes allocated in the blocks before the current one
+    size_t mPeak = 0;
+    Block* mBlock = nullptr;        // current heap block, nullptr while in the area
+    Block* mSpare = nullptr;        // heap blocks not in use
+};
+
 /* ------------------------------------------------------------------------------------------------
  * HeapAllocator
  *
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TNT_UTILS_DESTROYEDENTITYQUEUE_H
+#define TNT_UTILS_DESTROYEDENTITYQUEUE_H
+
+#include <utils/compiler.h>
+#include <utils/Entity.h>
+#include <utils/EntityManager.h>
+#include <utils/Mutex.h>
+
+#include <vector>
+
+namespace utils {
+
+/*
+ * Collects the entities destroyed by an EntityManager, so that component managers can remove
+ * the components of exactly those entities, instead of probing for dead ones.
+ *
+ * Entities can be destroyed on any thread.
+ */
+class UTILS_PUBLIC DestroyedEntityQueue : private EntityManager::Listener {
+public:
+    explicit DestroyedEntityQueue(EntityManager& em) noexcept;
+    ~DestroyedEntityQueue() noexcept;
+
+    DestroyedEntityQueue(DestroyedEntityQueue const& rhs) = delete;
+    DestroyedEntityQueue& operator=(DestroyedEntityQueue const& rhs) = delete;
+
+    /*
+     * Appends the entities destroyed since the last call to 'entities'.
+     * Returns false if all entities were destroyed meanwhile (i.e. EntityManager::clear()),
+     * in which case nothing is appended.
+     */
+    bool drain(std::vector<Entity>& entities);
+
+private:
+    void onEntitiesDestroyed(size_t n, Entity const* entities) noexcept override;
+    void onAllEntitiesDestroyed() noexcept override;
+
+    EntityManager& mEntityManager;
+    Mutex mLock;
+    std::vector<Entity> mEntities;
+    bool mAllDestroyed = false;
+};
+
+} // namespace utils
+
+#endif // TNT_UTILS_DESTROYEDENTITYQUEUE_H
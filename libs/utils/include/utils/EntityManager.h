@@ -47,10 +47,10 @@ public:
         return RAW_INDEX_COUNT - 1;
     }
 
-    // create n entities. Thread safe.
+    // create n entities. Thread safe and lock-free, creating entities in batches is cheaper.
     void create(size_t n, Entity* entities);
 
-    // destroys n entities. Thread safe.
+    // destroys n entities. Thread safe and lock-free, destroying entities in batches is cheaper.
     void destroy(size_t n, Entity* entities) noexcept;
 
     // create a new Entity. Thread safe.
@@ -80,7 +80,8 @@ public:
     // unregisters a listener.
     void unregisterListener(Listener* l) noexcept;
 
-    // destroys all entities and return to the initial state. Thread Safe.
+    // destroys all entities and return to the initial state.
+    // This must not be called concurrently with create() or destroy().
     // Use this carefully -- this is mostly for testing
     void clear() noexcept;
 
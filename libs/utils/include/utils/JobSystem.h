@@ -20,7 +20,10 @@
 #include <assert.h>
 
 #include <atomic>
+#include <chrono>
 #include <functional>
+#include <iosfwd>
+#include <memory>
 #include <thread>
 #include <vector>
 
@@ -45,7 +48,11 @@
 namespace utils {
 
 class JobSystem {
-    static constexpr size_t MAX_JOB_COUNT = 4096;
+    // The job pool is sized with the number of threads, between MIN_JOB_COUNT and MAX_JOB_COUNT
+    // jobs. Jobs are referenced by 16-bits indices, and any queue must be able to hold all of them.
+    static constexpr size_t MIN_JOB_COUNT = 4096;
+    static constexpr size_t MAX_JOB_COUNT = 16384;
+    static constexpr size_t JOB_COUNT_PER_THREAD = 256;
     static_assert(MAX_JOB_COUNT <= 0x7FFE, "MAX_JOB_COUNT must be <= 0x7FFE");
     using WorkQueue = WorkStealingDequeue<uint16_t, MAX_JOB_COUNT>;
 
@@ -93,6 +100,11 @@ public:
     // part of a Jobsystem.
     static JobSystem* getJobSystem() noexcept;
 
+    // return the index of this thread in its JobSystem, in [0, getThreadSlotCount()).
+    // Worker threads come first, then adoptable threads. This thread must be part of
+    // a JobSystem.
+    static size_t getThreadIndex() noexcept;
+
     // If a parent is not specified when creating a job, that job will automatically take the
     // master job as a parent.
     // The master job is reset when calling reset()
@@ -220,11 +232,18 @@ public:
 
     // Add job to this thread's execution queue.
     // Current thread must be owned by JobSystem's thread pool. See adopt().
-    enum runFlags { DONT_SIGNAL = 0x1 };
+    //
+    // Jobs run with LOW_PRIORITY go to a separate queue, and are only executed when no other job
+    // can be found. This is meant for background work (e.g. asset decoding) that mustn't delay
+    // the frame's jobs. The priority isn't inherited by the jobs a low priority job runs.
+    // See also jobs::createBackgroundTask().
+    enum runFlags { DONT_SIGNAL = 0x1, LOW_PRIORITY = 0x2 };
     void run(Job* job, uint32_t flags = 0) noexcept;
 
     // Wait on a job.
     // Current thread must be owned by JobSystem's thread pool. See adopt().
+    // While waiting, the thread runs other jobs, but never LOW_PRIORITY ones: those are only run
+    // by the worker threads.
     void wait(Job const* job) noexcept;
 
     void runAndWait(Job* job) noexcept {
@@ -258,6 +277,57 @@ public:
         return mParallelSplitCount;
     }
 
+    // number of worker threads in the pool (i.e. not counting adopted threads)
+    size_t getThreadCount() const noexcept {
+        return mThreadCount;
+    }
+
+    // number of threads that can be part of this JobSystem (workers + adoptable threads)
+    size_t getThreadSlotCount() const noexcept {
+        return mThreadStates.size();
+    }
+
+    // number of jobs that can exist at the same time
+    size_t getJobCount() const noexcept {
+        return mJobCount;
+    }
+
+    // number of NUMA nodes the worker threads are distributed on, 1 on non-NUMA systems
+    size_t getNodeCount() const noexcept {
+        return mNodeCount;
+    }
+
+    // number of jobs waiting in the queues, this is only a hint
+    size_t getActiveJobCount() const noexcept {
+        return mActiveJobs.load(std::memory_order_relaxed);
+    }
+
+
+    // Profiling
+    //
+    // When profiling is started, each thread records the start and end time of the jobs it
+    // executes in a ring buffer, along with steal attempts and the time spent sleeping.
+    // The methods below must be called from the same thread, while no job is running.
+
+    struct ThreadStats {
+        uint64_t jobCount = 0;          // number of jobs executed
+        uint64_t stealCount = 0;        // number of jobs stolen from other threads
+        uint64_t failedStealCount = 0;  // number of attempts to steal a job that failed
+        uint64_t idleTime = 0;          // time spent sleeping, in nanoseconds
+    };
+
+    // starts recording, keeping the last 'eventCount' jobs executed by each thread
+    void startProfiling(size_t eventCount = 4096) noexcept;
+
+    // stops recording, the data recorded so far is kept until profiling is started again
+    void stopProfiling() noexcept;
+
+    // statistics of each thread, worker threads first, then adoptable threads
+    std::vector<ThreadStats> getThreadStats() const;
+
+    // writes the recorded jobs as a Chrome trace (JSON), see chrome://tracing
+    void exportChromeTrace(std::ostream& out) const;
+
 private:
     // this is just to avoid using std::default_random_engine, since we're in a public header.
     class default_random_engine {
@@ -276,45 +346,76 @@ private:
         // make sure storage is cache-line aligned
         WorkQueue workQueue;
 
+        // jobs run with LOW_PRIORITY
+        alignas(CACHELINE_SIZE)
+        WorkQueue lowPriorityWorkQueue;
+
         // these are not accessed by the worker threads
         alignas(CACHELINE_SIZE)     // this causes 56-bytes padding
         JobSystem* js;
         std::thread thread;
         default_random_engine rndGen;
-        uint32_t mask;
+        uint16_t index;     // index of this thread in mThreadStates
+        uint16_t node;      // NUMA node of this thread, mNodeCount if unknown (adopted threads)
     };
 
     static_assert(sizeof(ThreadState) % CACHELINE_SIZE == 0,
             "ThreadState doesn't align to a cache line");
 
     static ThreadState& getState() noexcept;
+    static size_t computeJobCount(size_t threadCount) noexcept;
 
     Job* create(Job* parent, JobFunc func) noexcept;
     Job* allocateJob() noexcept;
     JobSystem::ThreadState& getStateToStealFrom(JobSystem::ThreadState& state) noexcept;
+    JobSystem::ThreadState& getNodeStateToStealFrom(JobSystem::ThreadState& state) noexcept;
     bool hasJobCompleted(Job const* job) noexcept;
 
     void requestExit() noexcept;
     bool exitRequested() const noexcept;
 
     void loop(ThreadState* threadState) noexcept;
-    bool execute(JobSystem::ThreadState& state) noexcept;
+    bool execute(JobSystem::ThreadState& state, bool allowLowPriority) noexcept;
+    Job* steal(JobSystem::ThreadState& state, bool lowPriority) noexcept;
+
+    struct ProfilingEvent {
+        uint64_t begin;         // in nanoseconds since profiling started
+        uint64_t end;
+        uint16_t job;           // index of the job in the pool
+        uint16_t parent;        // index of the parent in the pool, 0x7FFF if none
+        bool stolen;
+        bool lowPriority;
+    };
+
+    // only written by the thread it belongs to
+    struct Profile {
+        std::unique_ptr<ProfilingEvent[]> events;
+        size_t eventCount = 0;  // total number of events recorded, the ring buffer has
+                                // mProfilingEventCount entries
+        std::atomic<uint64_t> jobCount = { 0 };
+        std::atomic<uint64_t> stealCount = { 0 };
+        std::atomic<uint64_t> failedStealCount = { 0 };
+        std::atomic<uint64_t> idleTime = { 0 };
+    };
+
+    bool isProfiling() const noexcept;
+    uint64_t getProfilingTime() const noexcept;
 
     void put(WorkQueue& workQueue, Job* job) noexcept {
         size_t index = job - mJobStorageBase;
-        assert(index >= 0 && index < MAX_JOB_COUNT);
+        assert(index >= 0 && index < mJobCount);
         workQueue.push(uint16_t(index + 1));
     }
 
     Job* pop(WorkQueue& workQueue) noexcept {
         size_t index = workQueue.pop();
-        assert(index <= MAX_JOB_COUNT);
+        assert(index <= mJobCount);
         return !index ? nullptr : (mJobStorageBase - 1) + index;
     }
 
     Job* steal(WorkQueue& workQueue) noexcept {
         size_t index = workQueue.steal();
-        assert(index <= MAX_JOB_COUNT);
+        assert(index <= mJobCount);
         return !index ? nullptr : (mJobStorageBase - 1) + index;
     }
 
@@ -322,6 +423,7 @@ private:
     utils::Mutex mLock;
     utils::Condition mCondition;
     std::atomic<uint32_t> mActiveJobs = { 0 };
+    const uint16_t mJobCount;                           // size of the job pool, in jobs
     utils::Arena<utils::ThreadSafeObjectPoolAllocator<Job>, LockingPolicy::NoLock> mJobPool;
 
     template <typename T>
@@ -336,12 +438,19 @@ private:
     alignas(16) // at least we align to half (or quarter) cache-line
     aligned_vector<ThreadState> mThreadStates;          // actual data is stored offline
     std::atomic<bool> mExitRequested = { 0 };           // this one is almost never written
+    std::atomic<bool> mProfiling = { false };           // this one is almost never written
     std::atomic<uint16_t> mAdoptedThreads = { 0 };      // this one is almost never written
     Job* const mJobStorageBase;                         // Base for conversion to indices
     uint16_t mThreadCount = 0;                          // total # of threads in the pool
+    uint16_t mNodeCount = 1;                            // # of NUMA nodes used by the pool
     uint8_t mParallelSplitCount = 0;                    // # of split allowable in parallel_for
     Job* mMasterJob = nullptr;
 
+    // one per thread state, only allocated when profiling is used
+    std::unique_ptr<Profile[]> mProfiles;
+    size_t mProfilingEventCount = 0;
+    std::chrono::steady_clock::time_point mProfilingStart;
+
     static UTILS_DECLARE_TLS(ThreadState *) sThreadState;
 };
 
@@ -488,6 +597,40 @@ struct ParallelForJobData {
     SplitterType splitter;      // 1
 };
 
+template<typename F>
+struct BackgroundTaskData {
+    using Functor = F;
+    using JobData = BackgroundTaskData;
+
+    BackgroundTaskData(Functor functor, JobSystem::Job* task) noexcept
+            : functor(std::move(functor)), task(task) {
+    }
+
+    void step(JobSystem& js, JobSystem::Job* job) noexcept {
+        // the first chunk runs in the task's job, the next ones in its children
+        JobSystem::Job* const parent = task ? task : job;
+        if (!functor()) {
+            return;
+        }
+
+        // run the next chunk in a new low priority job, so that other jobs can run in-between
+        JobSystem::Job* next = js.createJob<JobData, &JobData::step>(parent, JobData(functor, parent));
+        if (UTILS_LIKELY(next)) {
+            js.run(next, JobSystem::LOW_PRIORITY);
+        } else {
+            // oops, no more job available, finish the task right now
+            while (functor()) { }
+        }
+    }
+
+    // Runs one chunk per call, on whichever thread picks up the chunk's job, and returns false
+    // when the task is done. It's copied into each chunk's job after the previous chunk ran, so
+    // state captured by value carries over; anything captured by reference is owned by the
+    // caller and must outlive the task.
+    Functor functor;
+    JobSystem::Job* task;       // 8
+};
+
 } // namespace details
 
 
@@ -558,6 +701,16 @@ JobSystem::Job* parallel_for(JobSystem& js, JobSystem::Job* parent,
     return parallel_for(js, parent, slice.data(), slice.size(), functor, splitter, finish);
 }
 
+// Creates a long-running background task executed in chunks: functor() is called repeatedly,
+// each time in a new low priority job, until it returns false. This lets other jobs run
+// in-between chunks.
+// The returned job must be run with JobSystem::LOW_PRIORITY, it completes after the last chunk.
+template<typename F>
+JobSystem::Job* createBackgroundTask(JobSystem& js, JobSystem::Job* parent, F functor) noexcept {
+    using JobData = details::BackgroundTaskData<F>;
+    return js.createJob<JobData, &JobData::step>(parent, JobData(std::move(functor), nullptr));
+}
+
 
 template <size_t COUNT, size_t MAX_SPLITS = 12>
 class CountSplitter {
@@ -567,6 +720,83 @@ public:
     }
 };
 
+/*
+ * A splitter that sizes the jobs of a parallel_for from the number of threads and the measured
+ * cost of an item, instead of a compile-time count. It must be kept between calls, and each
+ * loop should have its own since the cost of an item depends on the loop, e.g.:
+ *
+ *   jobs::AdaptiveSplitter mSplitter;  // member of the object owning the loop
+ *   auto job = jobs::parallel_for(js, parent, start, count, std::ref(functor), mSplitter);
+ *
+ * The work is always split in at least one job per thread. Until the item cost is known, each
+ * thread gets about 4 jobs. After that, jobs are split further, down to TARGET_JOB_DURATION, but
+ * only while some threads don't have work (lazy binary splitting).
+ *
+ * An AdaptiveSplitter can be used by several parallel_for at the same time.
+ */
+class AdaptiveSplitter {
+public:
+    // duration of a job we aim for, in nanoseconds
+    static constexpr uint32_t TARGET_JOB_DURATION = 50000;
+    static constexpr size_t MAX_SPLITS = 12;
+
+    // this is what's stored in the jobs
+    class Policy {
+    public:
+        bool split(size_t splits, size_t count) const noexcept {
+            if (splits >= MAX_SPLITS || count < size_t(mMinCount) * 2) {
+                return false;
+            }
+            if (splits < mEagerSplits) {
+                return true;
+            }
+            JobSystem const* const js = JobSystem::getJobSystem();
+            return js && js->getActiveJobCount() < js->getThreadCount();
+        }
+    private:
+        friend class AdaptiveSplitter;
+        uint32_t mMinCount = 1;
+        uint8_t mEagerSplits = 0;
+    };
+
+    AdaptiveSplitter() noexcept = default;
+    AdaptiveSplitter(AdaptiveSplitter const&) = delete;
+    AdaptiveSplitter& operator=(AdaptiveSplitter const&) = delete;
+
+    // average cost of an item in nanoseconds, 0 until measured
+    uint32_t getItemCost() const noexcept {
+        return mItemCost.load(std::memory_order_relaxed);
+    }
+
+    // updates the item cost with the measurements recorded so far, and returns the policy
+    // to use for splitting 'count' items
+    Policy getPolicy(JobSystem const& js, size_t count) noexcept;
+
+    // records that processing 'count' items took 'duration' nanoseconds
+    void record(size_t count, uint64_t duration) noexcept {
+        mMeasuredCount.fetch_add(count, std::memory_order_relaxed);
+        mMeasuredTime.fetch_add(duration, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint32_t> mItemCost = { 0 };
+    std::atomic<uint64_t> mMeasuredCount = { 0 };
+    std::atomic<uint64_t> mMeasuredTime = { 0 };
+};
+
+// parallel jobs with start/count indices, sized by an AdaptiveSplitter
+template<typename F>
+JobSystem::Job* parallel_for(JobSystem& js, JobSystem::Job* parent,
+        uint32_t start, uint32_t count, F functor, AdaptiveSplitter& splitter) noexcept {
+    auto timed = [f = std::move(functor), &splitter](uint32_t s, uint32_t c) {
+        const auto begin = std::chrono::steady_clock::now();
+        f(s, c);
+        splitter.record(c, uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - begin).count()));
+    };
+    return parallel_for(js, parent, start, count, std::move(timed), splitter.getPolicy(js, count));
+}
+
 } // namespace jobs
 } // namespace utils
 
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UTILS_RADIXSORT_H
+#define UTILS_RADIXSORT_H
+
+#include <utils/compiler.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace utils {
+
+class JobSystem;
+
+/**
+ * Stable LSD radix sort of 64-bit keys associated to a 32-bit value (typically an index into
+ * an array of larger items, which is cheaper to sort than the items themselves).
+ *
+ * Keys are sorted 8 bits at a time, digits that are the same for all keys are skipped.
+ * Large arrays are split in chunks processed in parallel on the JobSystem.
+ */
+class UTILS_PUBLIC RadixSort {
+public:
+    struct Item {
+        uint64_t key;
+        uint32_t value;
+    };
+
+    // arrays smaller than this are sorted on the calling thread only
+    static constexpr size_t MIN_PARALLEL_COUNT = 8192;
+
+    // maximum number of chunks processed in parallel
+    static constexpr size_t MAX_CHUNKS = 16;
+
+    /**
+     * Sorts 'count' items by key.
+     *
+     * @param js        JobSystem used to run the parallel passes
+     * @param items     items to sort
+     * @param scratch   temporary storage for at least 'count' items
+     * @param count     number of items
+     * @return either items or scratch, whichever holds the sorted items
+     */
+    static Item* sort(JobSystem& js, Item* items, Item* scratch, size_t count) noexcept;
+};
+
+} // namespace utils
+
+#endif // UTILS_RADIXSORT_H
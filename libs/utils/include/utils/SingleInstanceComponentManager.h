@@ -133,6 +133,21 @@ public:
                 });
     }
 
+    // Removes the components of the given destroyed entities, if they have one. Unlike gc()
+    // above, this always frees everything it can, in time proportional to 'count'.
+    void gc(Entity const* entities, size_t count) noexcept {
+        gc(entities, count, [this](Entity e) {
+                    removeComponent(e);
+                });
+    }
+
+    // Removes the components of all dead entities. This visits all components.
+    void sweep(const EntityManager& em) noexcept {
+        sweep(em, [this](Entity e) {
+                    removeComponent(e);
+                });
+    }
+
     // return the first instance
     Instance begin() const noexcept { return 1u; }
 
@@ -252,6 +267,27 @@ protected:
         }
     }
 
+    template<typename REMOVE>
+    void gc(Entity const* entities, size_t count, REMOVE removeComponent) noexcept {
+        for (size_t i = 0; i < count; i++) {
+            if (hasComponent(entities[i])) {
+                removeComponent(entities[i]);
+            }
+        }
+    }
+
+    template<typename REMOVE>
+    void sweep(const EntityManager& em, REMOVE removeComponent) noexcept {
+        Entity const* entities = getEntities();
+        // removing a component moves the last one in its place, going backward guarantees
+        // the one moved was already visited.
+        for (size_t i = getComponentCount(); i-- > 0;) {
+            if (!em.isAlive(entities[i])) {
+                removeComponent(entities[i]);
+            }
+        }
+    }
+
 protected:
     SoA mData;
 
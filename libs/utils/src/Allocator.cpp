@@ -20,6 +20,7 @@
 #include <assert.h>
 
 #include <algorithm>
+#include <initializer_list>
 
 #include <utils/Log.h>
 
@@ -51,6 +52,114 @@ void LinearAllocator::swap(LinearAllocator& rhs) noexcept {
     std::swap(mCurrent, rhs.mCurrent);
 }
 
+// ------------------------------------------------------------------------------------------------
+// GrowingLinearAllocator
+// ------------------------------------------------------------------------------------------------
+
+// header of the blocks allocated from the heap, followed by the block's memory (which keeps
+// malloc()'s alignment)
+struct alignas(std::max_align_t) GrowingLinearAllocator::Block {
+    Block* previous;                // block we came from (or next spare block)
+    void* end;
+    void* previousCurrent;          // where we were in the previous block
+    size_t previousAllocatedBefore;
+    uint32_t unusedCount;           // calls to trim() since this block became spare
+};
+
+GrowingLinearAllocator::GrowingLinearAllocator(void* begin, void* end) noexcept
+    : mBegin(begin), mEnd(end), mCurrent(begin), mAreaBegin(begin), mAreaEnd(end) {
+}
+
+GrowingLinearAllocator::~GrowingLinearAllocator() noexcept {
+    for (Block* list : { mBlock, mSpare }) {
+        while (list) {
+            Block* const previous = list->previous;
+            ::free(list);
+            list = previous;
+        }
+    }
+}
+
+void* GrowingLinearAllocator::grow(size_t size, size_t alignment, size_t extra) noexcept {
+    // the new block must be able to hold this allocation with the worst alignment
+    const size_t needed = sizeof(Block) + alignment + extra + size;
+
+    // reuse a spare block if there is one large enough
+    Block** link = &mSpare;
+    while (*link && size_t(uintptr_t((*link)->end) - uintptr_t(*link)) < needed) {
+        link = &(*link)->previous;
+    }
+    Block* block = *link;
+    if (block) {
+        *link = block->previous;
+    } else {
+        const size_t capacity = std::max(needed,
+                size_t(uintptr_t(mEnd) - uintptr_t(mBegin)) + sizeof(Block));
+        block = static_cast<Block*>(::malloc(capacity));
+        if (UTILS_UNLIKELY(!block)) {
+            return nullptr;
+        }
+        block->end = pointermath::add(block, capacity);
+    }
+
+    mPeak = getPeak();
+    block->previous = mBlock;
+    block->previousCurrent = mCurrent;
+    block->previousAllocatedBefore = mAllocatedBefore;
+    mAllocatedBefore = allocated();
+    mBlock = block;
+    mBegin = mCurrent = pointermath::add(block, sizeof(Block));
+    mEnd = block->end;
+
+    // this can't fail
+    void* const p = pointermath::align(mCurrent, alignment, extra);
+    mCurrent = pointermath::add(p, size);
+    assert(mCurrent <= mEnd);
+    return p;
+}
+
+void GrowingLinearAllocator::rewind(void* p) noexcept {
+    mPeak = getPeak();
+
+    // go back to the block p belongs to, the blocks after it become spare
+    while (mBlock && !(p >= mBegin && p <= mEnd)) {
+        Block* const block = mBlock;
+        mBlock = block->previous;
+        mAllocatedBefore = block->previousAllocatedBefore;
+        mBegin = mBlock ? pointermath::add(mBlock, sizeof(Block)) : mAreaBegin;
+        mEnd = mBlock ? mBlock->end : mAreaEnd;
+        block->previous = mSpare;
+        block->unusedCount = 0;
+        mSpare = block;
+    }
+
+    assert(p >= mBegin && p <= mEnd);
+    mCurrent = p;
+}
+
+void GrowingLinearAllocator::trim(uint32_t count) noexcept {
+    Block** link = &mSpare;
+    while (*link) {
+        Block* const block = *link;
+        if (++block->unusedCount > count) {
+            *link = block->previous;
+            ::free(block);
+        } else {
+            link = &block->previous;
+        }
+    }
+}
+
+size_t GrowingLinearAllocator::getBlockCount() const noexcept {
+    size_t count = 0;
+    for (Block const* list : { mBlock, mSpare }) {
+        for (; list; list = list->previous) {
+            count++;
+        }
+    }
+    return count;
+}
+
 // ------------------------------------------------------------------------------------------------
 // FreeList
 // ------------------------------------------------------------------------------------------------
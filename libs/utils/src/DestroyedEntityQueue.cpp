@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <utils/DestroyedEntityQueue.h>
+
+#include <mutex>
+
+namespace utils {
+
+DestroyedEntityQueue::DestroyedEntityQueue(EntityManager& em) noexcept
+        : mEntityManager(em) {
+    em.registerListener(this);
+}
+
+DestroyedEntityQueue::~DestroyedEntityQueue() noexcept {
+    mEntityManager.unregisterListener(this);
+}
+
+bool DestroyedEntityQueue::drain(std::vector<Entity>& entities) {
+    std::lock_guard<Mutex> lock(mLock);
+    if (UTILS_UNLIKELY(mAllDestroyed)) {
+        mAllDestroyed = false;
+        mEntities.clear();
+        return false;
+    }
+    if (entities.empty()) {
+        // this is the common case, no copy needed
+        std::swap(entities, mEntities);
+    } else {
+        entities.insert(entities.end(), mEntities.begin(), mEntities.end());
+        mEntities.clear();
+    }
+    return true;
+}
+
+void DestroyedEntityQueue::onEntitiesDestroyed(size_t n, Entity const* entities) noexcept {
+    std::lock_guard<Mutex> lock(mLock);
+    if (!mAllDestroyed) {
+        // null entities are allowed by EntityManager::destroy()
+        for (size_t i = 0; i < n; i++) {
+            if (entities[i]) {
+                mEntities.push_back(entities[i]);
+            }
+        }
+    }
+}
+
+void DestroyedEntityQueue::onAllEntitiesDestroyed() noexcept {
+    std::lock_guard<Mutex> lock(mLock);
+    mAllDestroyed = true;
+    mEntities.clear();
+}
+
+} // namespace utils
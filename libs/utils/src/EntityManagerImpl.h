@@ -19,20 +19,36 @@
 
 #include <utils/EntityManager.h>
 
-#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <mutex>
-#include <set>
+#include <thread>
+#include <vector>
 
 #include <utils/compiler.h>
 #include <utils/Entity.h>
 #include <utils/Mutex.h>
 
-#include <tsl/robin_set.h>
-
 namespace utils {
 
 static constexpr const size_t MIN_FREE_INDICES = 1024;
 
+/*
+ * create() and destroy() are lock-free.
+ *
+ * Fresh indices are handed out by bumping mCurrentIndex. Freed indices go into a ring buffer
+ * large enough to hold all indices, so it can never be full: destroy() reserves a range of
+ * slots with a single atomic add, and create() reserves a range of indices to recycle with a
+ * single compare-and-swap. Each slot has a sequence number telling whether it's ready to be
+ * written or read at a given position, so that create() can wait for a concurrent destroy()
+ * that reserved the slot but didn't write it yet, and destroy() can wait for a concurrent
+ * create() that didn't read the slot's previous index yet.
+ *
+ * The listeners are a copy-on-write list: (un)registering publishes a new copy, and frees the
+ * previous one once no destroy() or clear() is iterating it anymore. For that reason, listeners
+ * must not (un)register themselves from their callbacks.
+ */
 class UTILS_PRIVATE EntityManagerImpl : public EntityManager {
 public:
 
@@ -42,126 +58,239 @@ public:
     using EntityManager::create;
     using EntityManager::destroy;
 
-    void create(size_t n, Entity* entities) {
-        Entity::Type index;
-        auto& freeList = mFreeList;
-        uint8_t* const gens = mGens;
+    EntityManagerImpl() : mFreeIndices(new Slot[RAW_INDEX_COUNT]) {
+        resetFreeIndices();
+    }
+
+    ~EntityManagerImpl() noexcept {
+        delete mListeners.load(std::memory_order_relaxed);
+    }
 
-        // this must be thread-safe, acquire the free-list mutex
-        std::lock_guard<Mutex> lock(mFreeListLock);
-        Entity::Type currentIndex = mCurrentIndex;
-        for (size_t i = 0; i < n; i++) {
-            // If we have more than a certain number of freed indices, get one from the list.
-            // this is a trade-off between how often we recycle indices and how large the free list
-            // can grow.
-            if (UTILS_UNLIKELY(currentIndex >= RAW_INDEX_COUNT || freeList.size() >= MIN_FREE_INDICES)) {
-
-                // this could only happen if we had gone through all the indices at least once
-                if (UTILS_UNLIKELY(freeList.empty())) {
+    void create(size_t n, Entity* entities) {
+        size_t i = 0;
+        while (i < n) {
+            // If we have more than a certain number of freed indices, get them from the free list.
+            // This is a trade-off between how often we recycle indices and how large the free
+            // list can grow. Once all indices have been used once, we always use the free list.
+            // The idea is that we have enough indices that it doesn't happen in practice.
+            const bool exhausted =
+                    mCurrentIndex.load(std::memory_order_relaxed) >= RAW_INDEX_COUNT;
+            i += recycleIndices(n - i, entities + i, exhausted ? 0 : MIN_FREE_INDICES - 1);
+            if (i < n) {
+                if (UTILS_UNLIKELY(exhausted)) {
                     // return the null entity
-                    entities[i] = {};
-                    continue;
+                    std::fill(entities + i, entities + n, Entity{});
+                    break;
                 }
-
-                index = freeList.front();
-                freeList.pop_front();
-            } else {
-                // In the common case, we just grab the next index.
-                // This works only until all indices have been used once, at which point
-                // we're always in the slower case above. The idea is that we have enough indices
-                // that it doesn't happen in practice.
-                index = currentIndex++;
+                // In the common case, we just grab the next indices.
+                i += newIndices(n - i, entities + i);
             }
-            entities[i] = Entity{ makeIdentity(gens[index], index) };
         }
-        mCurrentIndex = currentIndex;
     }
 
     void destroy(size_t n, Entity* entities) noexcept {
-        auto& freeList = mFreeList;
         uint8_t* const gens = mGens;
 
-        std::unique_lock<Mutex> lock(mFreeListLock);
-        for (size_t i = 0; i < n; i++) {
-            if (!entities[i]) {
-                // behave like free(), ok to free null Entity.
-                continue;
-            }
+        Entity::Type indices[DESTROY_BATCH_SIZE];
+        for (size_t i = 0; i < n;) {
+            size_t count = 0;
+            for (; i < n && count < DESTROY_BATCH_SIZE; i++) {
+                if (!entities[i]) {
+                    // behave like free(), ok to free null Entity.
+                    continue;
+                }
 
-            // it's an error to delete an Entity twice...
-            assert(isAlive(entities[i]));
-
-            // ... deleting a dead Entity will corrupt the internal state, so we protect ourselves
-            // against it. We don't guarantee anything about external state -- e.g. the listeners
-            // will be called.
-            if (isAlive(entities[i])) {
-                Entity::Type index = getIndex(entities[i]);
-                freeList.push_back(index);
-
-                // The generation update doesn't require the lock because it's only used for isAlive()
-                // and entities work as weak references -- it just means that isAlive() could return
-                // true a little longer than expected in some other threads.
-                // We do need a memory fence though, it is provided by the mFreeListLock.unlock() below.
-                gens[index]++;
+                // it's an error to delete an Entity twice...
+                assert(isAlive(entities[i]));
+
+                // ... deleting a dead Entity will corrupt the internal state, so we protect
+                // ourselves against it. We don't guarantee anything about external state -- e.g.
+                // the listeners will be called.
+                if (isAlive(entities[i])) {
+                    Entity::Type index = getIndex(entities[i]);
+                    indices[count++] = index;
+
+                    // The generation update doesn't need to be atomic because it's only used for
+                    // isAlive() and entities work as weak references -- it just means that
+                    // isAlive() could return true a little longer than expected in some other
+                    // threads. create() sees it thanks to the release in freeIndices().
+                    gens[index]++;
+                }
             }
+            freeIndices(count, indices);
         }
-        lock.unlock();
 
         // notify our listeners that some entities are being destroyed
-        std::set<Listener*> listeners = getListeners();
-        for (auto const& l : listeners) {
+        forEachListener([n, entities](Listener* l) {
             l->onEntitiesDestroyed(n, entities);
-        }
+        });
     }
 
-
+    // this must not be called concurrently with create() or destroy()
     void clear() noexcept {
         uint8_t* const gens = mGens;
 
-        std::unique_lock<Mutex> lock(mFreeListLock);
-
         // make all indices that were ever used invalid
-        for (size_t i = 0, c = mCurrentIndex; i < c; i++) {
+        for (size_t i = 0, c = mCurrentIndex.load(); i < c && i < RAW_INDEX_COUNT; i++) {
             gens[i]++;
         }
 
         // clear the free-list entirely.
-        mCurrentIndex = 1;
-        mFreeList.clear();
-        mFreeList.shrink_to_fit();
-        lock.unlock();
+        mCurrentIndex.store(1);
+        resetFreeIndices();
 
         // notify our listeners that all entities are being destroyed
-        std::set<Listener*> listeners = getListeners();
-        for (auto const& l : listeners) {
+        forEachListener([](Listener* l) {
             l->onAllEntitiesDestroyed();
-        }
+        });
     }
 
     void registerListener(EntityManager::Listener* l) noexcept {
         std::lock_guard<Mutex> lock(mListenerLock);
-        mListeners.insert(l);
+        Listeners const* const listeners = mListeners.load(std::memory_order_relaxed);
+        if (std::find(listeners->begin(), listeners->end(), l) == listeners->end()) {
+            Listeners* const copy = new Listeners(*listeners);
+            copy->push_back(l);
+            publishListeners(copy);
+        }
     }
 
     void unregisterListener(EntityManager::Listener* l) noexcept {
         std::lock_guard<Mutex> lock(mListenerLock);
-        mListeners.erase(l);
+        Listeners const* const listeners = mListeners.load(std::memory_order_relaxed);
+        if (std::find(listeners->begin(), listeners->end(), l) != listeners->end()) {
+            Listeners* const copy = new Listeners(*listeners);
+            copy->erase(std::remove(copy->begin(), copy->end(), l), copy->end());
+            publishListeners(copy);
+        }
     }
 
-    std::set<EntityManager::Listener*> getListeners() noexcept {
-        std::unique_lock<Mutex> lock(mListenerLock);
-        return mListeners;
+    // number of freed indices waiting to be recycled
+    size_t getFreeIndexCount() const noexcept {
+        return uint32_t(mTail.load(std::memory_order_relaxed) -
+                        mHead.load(std::memory_order_relaxed));
     }
 
 private:
-    uint32_t mCurrentIndex = 1;
+    using Listeners = std::vector<Listener*>;
+
+    // number of entities destroy() processes at once
+    static constexpr const size_t DESTROY_BATCH_SIZE = 64;
+
+    template<typename F>
+    void forEachListener(F f) noexcept {
+        // this pairs with publishListeners(): either it sees us iterating, or we see its list
+        mListenerReaders.fetch_add(1, std::memory_order_seq_cst);
+        Listeners const* const listeners = mListeners.load(std::memory_order_seq_cst);
+        for (Listener* l : *listeners) {
+            f(l);
+        }
+        mListenerReaders.fetch_sub(1, std::memory_order_release);
+    }
+
+    // must be called with mListenerLock held
+    void publishListeners(Listeners* listeners) noexcept {
+        Listeners* const previous = mListeners.exchange(listeners, std::memory_order_seq_cst);
+        // wait for the callers of forEachListener() that may still be using the previous list,
+        // the new ones use the new list.
+        while (mListenerReaders.load(std::memory_order_seq_cst)) {
+            std::this_thread::yield();
+        }
+        delete previous;
+    }
+
+    static constexpr const uint32_t FREE_INDICES_MASK = RAW_INDEX_COUNT - 1;
+
+    struct Slot {
+        // position + 1 once written at 'position', position + RAW_INDEX_COUNT once read
+        std::atomic<uint32_t> sequence;
+        Entity::Type index;
+    };
+
+    void resetFreeIndices() noexcept {
+        // each slot is ready to be written at its first position
+        for (size_t i = 0; i < RAW_INDEX_COUNT; i++) {
+            mFreeIndices[i].sequence.store(uint32_t(i), std::memory_order_relaxed);
+        }
+        mHead.store(0, std::memory_order_relaxed);
+        mTail.store(0, std::memory_order_relaxed);
+    }
+
+    // allocates up to n never used indices, returns how many were allocated
+    size_t newIndices(size_t n, Entity* entities) noexcept {
+        uint8_t const* const gens = mGens;
+        uint32_t first = mCurrentIndex.load(std::memory_order_relaxed);
+        size_t count;
+        do {
+            if (first >= RAW_INDEX_COUNT) {
+                return 0;
+            }
+            count = std::min(n, RAW_INDEX_COUNT - first);
+        } while (!mCurrentIndex.compare_exchange_weak(first, uint32_t(first + count),
+                std::memory_order_relaxed, std::memory_order_relaxed));
+
+        for (size_t i = 0; i < count; i++) {
+            const Entity::Type index = Entity::Type(first + i);
+            entities[i] = Entity{ makeIdentity(gens[index], index) };
+        }
+        return count;
+    }
+
+    // recycles up to n freed indices, leaving at least 'keep' of them in the free list.
+    // Returns how many were recycled.
+    size_t recycleIndices(size_t n, Entity* entities, size_t keep) noexcept {
+        uint8_t const* const gens = mGens;
+        uint32_t head = mHead.load(std::memory_order_relaxed);
+        size_t count;
+        do {
+            const uint32_t available = mTail.load(std::memory_order_relaxed) - head;
+            if (available <= keep) {
+                return 0;
+            }
+            count = std::min(n, available - keep);
+        } while (!mHead.compare_exchange_weak(head, uint32_t(head + count),
+                std::memory_order_relaxed, std::memory_order_relaxed));
+
+        for (size_t i = 0; i < count; i++) {
+            const uint32_t position = uint32_t(head + i);
+            Slot& slot = mFreeIndices[position & FREE_INDICES_MASK];
+            // the slot may have been reserved by destroy() but not written yet
+            while (UTILS_UNLIKELY(
+                    slot.sequence.load(std::memory_order_acquire) != uint32_t(position + 1))) {
+                std::this_thread::yield();
+            }
+            const Entity::Type index = slot.index;
+            slot.sequence.store(uint32_t(position + RAW_INDEX_COUNT), std::memory_order_release);
+            entities[i] = Entity{ makeIdentity(gens[index], index) };
+        }
+        return count;
+    }
+
+    void freeIndices(size_t count, Entity::Type const* indices) noexcept {
+        // The ring buffer can hold all indices, so it can't overflow. However, a create()
+        // that reserved a slot one lap earlier may not have read it yet.
+        const uint32_t tail = mTail.fetch_add(uint32_t(count), std::memory_order_relaxed);
+        for (size_t i = 0; i < count; i++) {
+            const uint32_t position = uint32_t(tail + i);
+            Slot& slot = mFreeIndices[position & FREE_INDICES_MASK];
+            while (UTILS_UNLIKELY(slot.sequence.load(std::memory_order_acquire) != position)) {
+                std::this_thread::yield();
+            }
+            slot.index = indices[i];
+            slot.sequence.store(uint32_t(position + 1), std::memory_order_release);
+        }
+    }
+
+    std::atomic<uint32_t> mCurrentIndex = { 1 };
 
-    // stores indices that got freed
-    mutable Mutex mFreeListLock;
-    std::deque<Entity::Type> mFreeList;
+    // freed indices, between mHead and mTail
+    std::unique_ptr<Slot[]> mFreeIndices;
+    std::atomic<uint32_t> mHead = { 0 };
+    std::atomic<uint32_t> mTail = { 0 };
 
-    mutable Mutex mListenerLock;
-    std::set<Listener*> mListeners;
+    Mutex mListenerLock;
+    std::atomic<Listeners*> mListeners = { new Listeners };
+    std::atomic<uint32_t> mListenerReaders = { 0 };
 };
 
 } // namespace utils
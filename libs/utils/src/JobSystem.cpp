@@ -21,11 +21,19 @@
 // when SYSTRACE_TAG_JOBSYSTEM is used, enables even heavier systraces
 #define HEAVY_SYSTRACE  0
 
+// set to 0 to compile-out the profiling code entirely, see JobSystem::startProfiling()
+#define JOBSYSTEM_PROFILING 1
+
 
 #include <utils/JobSystem.h>
 
+#include <algorithm>
 #include <cmath>
+#include <iomanip>
+#include <limits>
+#include <ostream>
 #include <random>
+#include <vector>
 
 #include <utils/compiler.h>
 #include <utils/memalign.h>
@@ -55,6 +63,12 @@
 #    define gettid() syscall(SYS_gettid)
 #endif
 
+#if defined(__linux__)
+#    include <sched.h>
+#    include <stdio.h>
+#    include <stdlib.h>
+#endif
+
 namespace utils {
 
 UTILS_DEFINE_TLS(JobSystem::ThreadState *) JobSystem::sThreadState(nullptr);
@@ -103,24 +117,80 @@ void JobSystem::setThreadAffinity(uint32_t mask) noexcept {
 #endif
 }
 
-JobSystem::JobSystem(size_t threadCount, size_t adoptableThreadsCount) noexcept
-    : mJobPool("JobSystem Job pool", MAX_JOB_COUNT * sizeof(Job)),
-      mJobStorageBase(static_cast<Job *>(mJobPool.getAllocator().getCurrent()))
-{
-    SYSTRACE_ENABLE();
+#if defined(__linux__)
+
+// Returns the CPUs of each NUMA node that has CPUs, or nothing if this can't be determined.
+static std::vector<cpu_set_t> getNumaNodes() noexcept {
+    std::vector<cpu_set_t> nodes;
+    char path[64];
+    char list[1024];
+    for (unsigned int node = 0; ; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+        FILE* file = fopen(path, "r");
+        if (!file) {
+            break;
+        }
+        char const* p = fgets(list, sizeof(list), file);
+        fclose(file);
+        if (!p) {
+            break;
+        }
 
+        // the format is a list of ranges, e.g.: "0-15,32-47"
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        while (*p >= '0' && *p <= '9') {
+            char* end;
+            unsigned long first = strtoul(p, &end, 10);
+            unsigned long last = first;
+            if (*end == '-') {
+                last = strtoul(end + 1, &end, 10);
+            }
+            for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+                CPU_SET(cpu, &set);
+            }
+            p = (*end == ',') ? end + 1 : end;
+        }
+
+        // memory-only nodes don't run threads
+        if (CPU_COUNT(&set)) {
+            nodes.push_back(set);
+        }
+    }
+    return nodes;
+}
+
+#endif
+
+static size_t getWorkerThreadCount(size_t threadCount) noexcept {
     if (threadCount == 0) {
         // default value, system dependant
         size_t hwThreads = std::thread::hardware_concurrency();
         if (UTILS_HAS_HYPER_THREADING) {
             // For now we avoid using HT, this simplifies profiling.
             // TODO: figure-out what to do with Hyper-threading
-            threadCount = hwThreads / 2 - 1;
-        } else {
-            threadCount = hwThreads - 1;
+            hwThreads /= 2;
         }
+        // keep at least one worker thread (hardware_concurrency() can return 0)
+        threadCount = std::max(size_t(2), hwThreads) - 1;
     }
-    threadCount = std::min(size_t(32), threadCount);
+    // thread indices are stored in 16-bits
+    return std::min(size_t(0x7FFF), threadCount);
+}
+
+size_t JobSystem::computeJobCount(size_t threadCount) noexcept {
+    return std::max(size_t(MIN_JOB_COUNT),
+            std::min(size_t(MAX_JOB_COUNT), threadCount * JOB_COUNT_PER_THREAD));
+}
+
+JobSystem::JobSystem(size_t threadCount, size_t adoptableThreadsCount) noexcept
+    : mJobCount(uint16_t(computeJobCount(getWorkerThreadCount(threadCount) + adoptableThreadsCount))),
+      mJobPool("JobSystem Job pool", mJobCount * sizeof(Job)),
+      mJobStorageBase(static_cast<Job *>(mJobPool.getAllocator().getCurrent()))
+{
+    SYSTRACE_ENABLE();
+
+    threadCount = getWorkerThreadCount(threadCount);
 
     mThreadStates = aligned_vector<ThreadState>(threadCount + adoptableThreadsCount);
     mThreadCount = uint16_t(threadCount);
@@ -130,6 +200,15 @@ JobSystem::JobSystem(size_t threadCount, size_t adoptableThreadsCount) noexcept
     assert(mExitRequested.is_lock_free());
     assert(Job().runningJobCount.is_lock_free());
 
+#if defined(__linux__)
+    // On NUMA systems, worker threads are distributed round-robin on the nodes and can only run
+    // on their node's CPUs, so that they can steal from their neighbours first.
+    std::vector<cpu_set_t> nodes(getNumaNodes());
+    if (nodes.size() > 1) {
+        mNodeCount = uint16_t(std::min(nodes.size(), threadCount));
+    }
+#endif
+
     std::random_device rd;
     const size_t hardwareThreadCount = mThreadCount;
     auto& states = mThreadStates;
@@ -138,11 +217,19 @@ JobSystem::JobSystem(size_t threadCount, size_t adoptableThreadsCount) noexcept
     for (size_t i = 0, n = states.size(); i < n; i++) {
         auto& state = states[i];
         state.rndGen = default_random_engine(rd());
-        state.mask = uint32_t(1UL << i);
+        state.index = uint16_t(i);
+        // adopted threads can run anywhere
+        state.node = uint16_t(i < hardwareThreadCount ? i % mNodeCount : mNodeCount);
         state.js = this;
         if (i < hardwareThreadCount) {
             // don't start a thread of adoptable thread slots
             state.thread = std::thread(&JobSystem::loop, this, &state);
+#if defined(__linux__)
+            if (mNodeCount > 1) {
+                pthread_setaffinity_np(state.thread.native_handle(),
+                        sizeof(cpu_set_t), &nodes[state.node]);
+            }
+#endif
         }
     }
 }
@@ -164,6 +251,10 @@ JobSystem* JobSystem::getJobSystem() noexcept {
     return state ? state->js : nullptr;
 }
 
+size_t JobSystem::getThreadIndex() noexcept {
+    return getState().index;
+}
+
 void JobSystem::requestExit() noexcept {
     mLock.lock();
     mExitRequested.store(true, std::memory_order_relaxed);
@@ -180,6 +271,21 @@ inline bool JobSystem::exitRequested() const noexcept {
     return mExitRequested.load(std::memory_order_relaxed);
 }
 
+inline bool JobSystem::isProfiling() const noexcept {
+    // acquire is needed to synchronize with startProfiling()
+    return JOBSYSTEM_PROFILING && mProfiling.load(std::memory_order_acquire);
+}
+
+inline uint64_t JobSystem::getProfilingTime() const noexcept {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - mProfilingStart).count());
+}
+
+// profiling counters are only written by the thread they belong to
+static inline void increment(std::atomic<uint64_t>& counter, uint64_t value) noexcept {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
 inline bool JobSystem::hasJobCompleted(JobSystem::Job const* job) noexcept {
     return job->runningJobCount.load(std::memory_order_relaxed) <= 0;
 }
@@ -202,19 +308,69 @@ inline JobSystem::ThreadState& JobSystem::getStateToStealFrom(JobSystem::ThreadS
     return mThreadStates[index];
 }
 
-bool JobSystem::execute(JobSystem::ThreadState& state) noexcept {
+inline JobSystem::ThreadState& JobSystem::getNodeStateToStealFrom(JobSystem::ThreadState& state) noexcept {
+    // worker threads of node N are at indices N, N + mNodeCount, N + 2 * mNodeCount, etc...
+    const uint16_t node = state.node;
+    const uint16_t count = uint16_t((mThreadCount - node + mNodeCount - 1) / mNodeCount);
+    uint16_t index = uint16_t(node + (state.rndGen() % count) * mNodeCount);
+    assert(index < mThreadCount);
+    return mThreadStates[index];
+}
 
-    Job* job = pop(state.workQueue);
+JobSystem::Job* JobSystem::steal(JobSystem::ThreadState& state, bool lowPriority) noexcept {
+    Job* job = nullptr;
+    UTILS_UNUSED size_t attempts = 0;
+    if (state.node < mNodeCount) {
+        // try to steal a job from a thread on our NUMA node first
+        ThreadState& stateToStealFrom = getNodeStateToStealFrom(state);
+        if (&stateToStealFrom != &state) {
+            attempts++;
+            job = steal(lowPriority ?
+                    stateToStealFrom.lowPriorityWorkQueue : stateToStealFrom.workQueue);
+        }
+    }
     if (job == nullptr) {
-        // our queue is empty, try to steal a job
         ThreadState& stateToStealFrom = getStateToStealFrom(state);
         if (&stateToStealFrom != &state) {
             // don't steal from our own queue
-            job = steal(stateToStealFrom.workQueue);
+            attempts++;
+            job = steal(lowPriority ?
+                    stateToStealFrom.lowPriorityWorkQueue : stateToStealFrom.workQueue);
             // nullptr -> nothing to steal in that queue either
         }
     }
 
+#if JOBSYSTEM_PROFILING
+    if (UTILS_UNLIKELY(isProfiling()) && attempts) {
+        Profile& profile = mProfiles[state.index];
+        increment(profile.failedStealCount, job ? attempts - 1 : attempts);
+        increment(profile.stealCount, job ? 1 : 0);
+    }
+#endif
+
+    return job;
+}
+
+bool JobSystem::execute(JobSystem::ThreadState& state, bool allowLowPriority) noexcept {
+
+    UTILS_UNUSED bool stolen = false;
+    UTILS_UNUSED bool lowPriority = false;
+    Job* job = pop(state.workQueue);
+    if (job == nullptr) {
+        // our queue is empty, try to steal a job
+        job = steal(state, false);
+        stolen = job != nullptr;
+    }
+    if (job == nullptr && allowLowPriority) {
+        // no job found, fall back to low priority jobs, ours first
+        lowPriority = true;
+        job = pop(state.lowPriorityWorkQueue);
+        if (job == nullptr) {
+            job = steal(state, true);
+            stolen = job != nullptr;
+        }
+    }
+
     if (job) {
         SYSTRACE_CALL();
 
@@ -223,10 +379,33 @@ bool JobSystem::execute(JobSystem::ThreadState& state) noexcept {
         
         SYSTRACE_VALUE32("JobSystem::activeJobs", activeJobs - 1);
 
+#if JOBSYSTEM_PROFILING
+        const bool profiling = isProfiling();
+        ProfilingEvent event;
+        if (UTILS_UNLIKELY(profiling)) {
+            event.job = uint16_t(job - mJobStorageBase);
+            event.parent = job->parent;
+            event.stolen = stolen;
+            event.lowPriority = lowPriority;
+            event.begin = getProfilingTime();
+        }
+#endif
+
         if (UTILS_LIKELY(job->function)) {
             SYSTRACE_NAME("job->function");
             job->function(job->padding, *this, job);
         }
+
+#if JOBSYSTEM_PROFILING
+        if (UTILS_UNLIKELY(profiling)) {
+            event.end = getProfilingTime();
+            Profile& profile = mProfiles[state.index];
+            profile.events[profile.eventCount % mProfilingEventCount] = event;
+            profile.eventCount++;
+            increment(profile.jobCount, 1);
+        }
+#endif
+
         finish(job);
     }
     return job != nullptr;
@@ -241,11 +420,22 @@ void JobSystem::loop(ThreadState* threadState) noexcept {
 
     // run our main loop...
     do {
-        if (!execute(*threadState)) {
-            std::unique_lock<Mutex> lock(mLock);
-            while (!exitRequested() && !(mActiveJobs.load(std::memory_order_relaxed))) {
-                mCondition.wait(lock);
+        if (!execute(*threadState, true)) {
+#if JOBSYSTEM_PROFILING
+            const bool profiling = isProfiling();
+            const uint64_t idleBegin = profiling ? getProfilingTime() : 0;
+#endif
+            {
+                std::unique_lock<Mutex> lock(mLock);
+                while (!exitRequested() && !(mActiveJobs.load(std::memory_order_relaxed))) {
+                    mCondition.wait(lock);
+                }
             }
+#if JOBSYSTEM_PROFILING
+            if (UTILS_UNLIKELY(profiling) && isProfiling()) {
+                increment(mProfiles[threadState->index].idleTime, getProfilingTime() - idleBegin);
+            }
+#endif
         }
     } while (!exitRequested());
 }
@@ -265,7 +455,7 @@ JobSystem::Job* JobSystem::create(JobSystem::Job* parent, JobFunc func) noexcept
 
             parent->runningJobCount.fetch_add(1, std::memory_order_relaxed);
             index = parent - mJobStorageBase;
-            assert(index < MAX_JOB_COUNT);
+            assert(index < mJobCount);
         }
         job->function = func;
         job->parent = uint16_t(index);
@@ -315,7 +505,7 @@ void JobSystem::run(JobSystem::Job* job, uint32_t flags) noexcept {
     // an assert() in execute(). Either way, it's not "wrong", but the assert() is useful.
     uint32_t activeJobs = mActiveJobs.fetch_add(1, std::memory_order_relaxed);
 
-    put(state.workQueue, job);
+    put((flags & LOW_PRIORITY) ? state.lowPriorityWorkQueue : state.workQueue, job);
 
     SYSTRACE_CONTEXT();
     SYSTRACE_VALUE32("JobSystem::activeJobs", activeJobs + 1);
@@ -337,7 +527,8 @@ void JobSystem::wait(JobSystem::Job const* job) noexcept {
     assert(job);
     ThreadState& state(getState());
     do {
-        if (!execute(state)) {
+        // a waiter doesn't run low priority jobs, they could delay the job it's waiting for
+        if (!execute(state, false)) {
             // we're a waiter so we spin!!!
             UTILS_WAIT_FOR_EVENT();
         }
@@ -381,9 +572,118 @@ void JobSystem::emancipate() {
     sThreadState = nullptr;
 }
 
+// -----------------------------------------------------------------------------------------------
+// profiling...
+
+void JobSystem::startProfiling(size_t eventCount) noexcept {
+#if JOBSYSTEM_PROFILING
+    const size_t count = mThreadStates.size();
+    mProfilingEventCount = std::max(size_t(1), eventCount);
+    mProfiles.reset(new Profile[count]);
+    for (size_t i = 0; i < count; i++) {
+        mProfiles[i].events.reset(new ProfilingEvent[mProfilingEventCount]);
+    }
+    mProfilingStart = std::chrono::steady_clock::now();
+    mProfiling.store(true, std::memory_order_release);
+#endif
+}
+
+void JobSystem::stopProfiling() noexcept {
+    mProfiling.store(false, std::memory_order_relaxed);
+}
+
+std::vector<JobSystem::ThreadStats> JobSystem::getThreadStats() const {
+    std::vector<ThreadStats> stats(mThreadStates.size());
+    if (mProfiles) {
+        for (size_t i = 0, n = stats.size(); i < n; i++) {
+            Profile const& profile = mProfiles[i];
+            stats[i].jobCount = profile.jobCount.load(std::memory_order_relaxed);
+            stats[i].stealCount = profile.stealCount.load(std::memory_order_relaxed);
+            stats[i].failedStealCount = profile.failedStealCount.load(std::memory_order_relaxed);
+            stats[i].idleTime = profile.idleTime.load(std::memory_order_relaxed);
+        }
+    }
+    return stats;
+}
+
+void JobSystem::exportChromeTrace(std::ostream& out) const {
+    // timestamps are in microseconds
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(3);
+
+    // one track per thread, with the thread's statistics
+    const std::vector<ThreadStats> stats(getThreadStats());
+    out << "{\"traceEvents\":[";
+    for (size_t i = 0, n = stats.size(); i < n; i++) {
+        out << (i ? ",\n" : "\n")
+            << R"({"name":"thread_name","ph":"M","pid":0,"tid":)" << i
+            << R"(,"args":{"name":"JobSystem )" << (i < mThreadCount ? "worker " : "adopted ") << i
+            << R"(","jobs":)" << stats[i].jobCount
+            << R"(,"steals":)" << stats[i].stealCount
+            << R"(,"failedSteals":)" << stats[i].failedStealCount
+            << R"(,"idleTimeUs":)" << stats[i].idleTime / 1000.0 << "}}";
+    }
+
+    if (mProfiles) {
+        for (size_t i = 0, n = mThreadStates.size(); i < n; i++) {
+            Profile const& profile = mProfiles[i];
+            const size_t count = std::min(profile.eventCount, mProfilingEventCount);
+            for (size_t k = profile.eventCount - count; k < profile.eventCount; k++) {
+                ProfilingEvent const& event = profile.events[k % mProfilingEventCount];
+                out << ",\n"
+                    << R"({"name":"job","cat":")" << (event.lowPriority ? "low priority" : "job")
+                    << R"(","ph":"X","pid":0,"tid":)" << i
+                    << R"(,"ts":)" << event.begin / 1000.0
+                    << R"(,"dur":)" << (event.end - event.begin) / 1000.0
+                    << R"(,"args":{"job":)" << event.job;
+                if (event.parent != 0x7FFF) {
+                    out << R"(,"parent":)" << event.parent;
+                }
+                out << R"(,"stolen":)" << (event.stolen ? "true" : "false") << "}}";
+            }
+        }
+    }
+
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+
+    out.flags(flags);
+    out.precision(precision);
+}
+
+// -----------------------------------------------------------------------------------------------
+
+jobs::AdaptiveSplitter::Policy jobs::AdaptiveSplitter::getPolicy(
+        JobSystem const& js, size_t count) noexcept {
+    uint64_t cost = mItemCost.load(std::memory_order_relaxed);
+    const uint64_t measuredCount = mMeasuredCount.exchange(0, std::memory_order_relaxed);
+    const uint64_t measuredTime = mMeasuredTime.exchange(0, std::memory_order_relaxed);
+    if (measuredCount) {
+        // use a moving average, so that a single slow run doesn't change the splitting much
+        const uint64_t measured = std::max(uint64_t(1), measuredTime / measuredCount);
+        cost = cost ? (cost * 3 + measured) / 4 : measured;
+        mItemCost.store(uint32_t(std::min(cost, uint64_t(std::numeric_limits<uint32_t>::max()))), std::memory_order_relaxed);
+    }
+
+    Policy policy;
+    policy.mEagerSplits = uint8_t(js.getParallelSplitCount());
+    const size_t threadCount = js.getThreadCount() + 1;
+    if (cost) {
+        // cheap items would ask for more items per job than there are, but we always want
+        // at least one job per thread
+        const uint64_t minCount = std::min(uint64_t(TARGET_JOB_DURATION / cost),
+                uint64_t(count / threadCount));
+        policy.mMinCount = uint32_t(std::max(uint64_t(1), minCount));
+    } else {
+        policy.mMinCount = uint32_t(std::max(size_t(1), count / (threadCount * 4)));
+    }
+    return policy;
+}
+
 io::ostream& operator<<(io::ostream& out, JobSystem const& js) {
     for (auto const& item : js.mThreadStates) {
-        out << size_t(std::log2f(item.mask)) << ": " << item.workQueue.getCount() << io::endl;
+        out << item.index << ": " << item.workQueue.getCount()
+            << " (low priority: " << item.lowPriorityWorkQueue.getCount() << ")" << io::endl;
     }
     return out;
 }
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <utils/RadixSort.h>
+
+#include <utils/JobSystem.h>
+
+#include <algorithm>
+#include <functional>
+
+namespace utils {
+
+static constexpr size_t RADIX_BITS = 8;
+static constexpr size_t RADIX = 1u << RADIX_BITS;
+
+// minimum number of items processed by a parallel job
+static constexpr size_t MIN_CHUNK_SIZE = 2048;
+
+RadixSort::Item* RadixSort::sort(JobSystem& js,
+        Item* UTILS_RESTRICT items, Item* UTILS_RESTRICT scratch, size_t count) noexcept {
+    if (count < 2) {
+        return items;
+    }
+
+    // find the digits that are not the same for all keys, we don't need to sort the others
+    uint64_t differ = 0;
+    const uint64_t first = items[0].key;
+    for (size_t i = 1; i < count; i++) {
+        differ |= items[i].key ^ first;
+    }
+
+    // one chunk per thread at most, more would only add overhead
+    const size_t threads = size_t(1) << js.getParallelSplitCount();
+    const size_t chunks = (count < MIN_PARALLEL_COUNT) ? 1 :
+            std::min({ MAX_CHUNKS, threads, count / MIN_CHUNK_SIZE });
+
+    auto run = [&js, chunks](auto& functor) {
+        if (chunks == 1) {
+            functor(0, 1);
+        } else {
+            auto job = jobs::parallel_for(js, nullptr, 0, uint32_t(chunks),
+                    std::ref(functor), jobs::CountSplitter<1, 8>());
+            js.runAndWait(job);
+        }
+    };
+
+    // per-chunk histograms, then per-chunk output position of each digit
+    uint32_t histograms[MAX_CHUNKS][RADIX];
+
+    Item* src = items;
+    Item* dst = scratch;
+    for (size_t shift = 0; shift < 64; shift += RADIX_BITS) {
+        if (!((differ >> shift) & (RADIX - 1))) {
+            continue;
+        }
+
+        auto histogram = [src, count, chunks, shift, &histograms](uint32_t index, uint32_t c) {
+            for (size_t chunk = index, e = index + c; chunk < e; chunk++) {
+                uint32_t* const UTILS_RESTRICT h = histograms[chunk];
+                std::fill_n(h, RADIX, 0);
+                for (size_t i = chunk * count / chunks, n = (chunk + 1) * count / chunks; i < n; i++) {
+                    h[(src[i].key >> shift) & (RADIX - 1)]++;
+                }
+            }
+        };
+        run(histogram);
+
+        // items with the same digit are stored in chunk order, which keeps the sort stable
+        uint32_t offset = 0;
+        for (size_t d = 0; d < RADIX; d++) {
+            for (size_t chunk = 0; chunk < chunks; chunk++) {
+                const uint32_t n = histograms[chunk][d];
+                histograms[chunk][d] = offset;
+                offset += n;
+            }
+        }
+
+        auto scatter = [src, dst, count, chunks, shift, &histograms](uint32_t index, uint32_t c) {
+            for (size_t chunk = index, e = index + c; chunk < e; chunk++) {
+                uint32_t* const UTILS_RESTRICT positions = histograms[chunk];
+                for (size_t i = chunk * count / chunks, n = (chunk + 1) * count / chunks; i < n; i++) {
+                    Item const& item = src[i];
+                    dst[positions[(item.key >> shift) & (RADIX - 1)]++] = item;
+                }
+            }
+        };
+        run(scatter);
+
+        std::swap(src, dst);
+    }
+    return src;
+}
+
+} // namespace utils
@@ -85,6 +85,65 @@ TEST(AllocatorTest, LinearAllocator) {
 }
 
 
+TEST(AllocatorTest, GrowingLinearAllocator) {
+    char scratch[1024];
+    void* p = nullptr;
+
+    GrowingLinearAllocator la(scratch, scratch+sizeof(scratch));
+    EXPECT_EQ(0, la.getBlockCount());
+
+    // the area is used first
+    p = la.alloc(1000, 1, 0);
+    EXPECT_EQ(scratch, p);
+
+    // then a block is chained
+    void* const mark = la.getCurrent();
+    p = la.alloc(100, 16, 0);
+    EXPECT_NE(nullptr, p);
+    EXPECT_EQ(0, uintptr_t(p) & 15);
+    EXPECT_TRUE(p < scratch || p >= scratch + sizeof(scratch));
+    EXPECT_EQ(1, la.getBlockCount());
+    EXPECT_EQ(1100, la.allocated());
+
+    // allocations larger than the area get a large enough block
+    void* const large = la.alloc(4096, 1, 0);
+    EXPECT_NE(nullptr, large);
+    memset(large, 0, 4096);
+    EXPECT_EQ(2, la.getBlockCount());
+    EXPECT_EQ(5196, la.allocated());
+
+    // rewinding into the area keeps the blocks for reuse
+    la.rewind(mark);
+    EXPECT_EQ(1000, la.allocated());
+    EXPECT_EQ(5196, la.getPeak());
+    p = la.alloc(24, 1, 0);
+    EXPECT_EQ(mark, p);
+    EXPECT_EQ(large, la.alloc(4096, 1, 0));
+    EXPECT_EQ(2, la.getBlockCount());
+
+    // the peak can be restarted, e.g. every frame
+    la.reset();
+    EXPECT_EQ(0, la.allocated());
+    la.resetPeak();
+    la.alloc(512, 1, 0);
+    la.reset();
+    EXPECT_EQ(512, la.getPeak());
+
+    // blocks that stay unused are eventually freed, the others are kept
+    la.trim(2);
+    la.trim(2);
+    EXPECT_EQ(2, la.getBlockCount());
+    la.alloc(1000, 1, 0);
+    la.alloc(100, 1, 0);
+    la.reset();
+    la.trim(2);
+    EXPECT_EQ(1, la.getBlockCount());
+    la.trim(2);
+    la.trim(2);
+    EXPECT_EQ(0, la.getBlockCount());
+}
+
+
 TEST(AllocatorTest, PoolAllocator) {
     char scratch[1024 + 31];
     void* p = nullptr;
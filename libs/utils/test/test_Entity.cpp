@@ -19,7 +19,13 @@
 #include <memory>
 
 #include "../src/EntityManagerImpl.h"
+#include <utils/DestroyedEntityQueue.h>
 #include <utils/NameComponentManager.h>
+#include <utils/SingleInstanceComponentManager.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
 
 using namespace utils;
 
@@ -128,6 +134,74 @@ TEST(EntityTest, Lots) {
     // at this point, we should be getting indices from the free-list exclusively
 }
 
+TEST(EntityTest, MultiThreaded) {
+    EntityManagerImpl em;
+    const size_t threadCount = 4;
+    const size_t iterations = 500;
+    const size_t batchSize = 256;
+
+    // each thread records the indices of every batch, and keeps its last batch alive
+    std::vector<Entity> alive[threadCount];
+    std::vector<uint32_t> created[threadCount];
+
+    auto worker = [&](size_t t) {
+        std::vector<Entity> entities(batchSize);
+        for (size_t i = 0; i < iterations; i++) {
+            em.create(batchSize, entities.data());
+            for (Entity e : entities) {
+                ASSERT_TRUE(em.isAlive(e));
+                created[t].push_back(EntityManagerImpl::getIndex(e));
+            }
+            if (i + 1 == iterations) {
+                alive[t] = entities;
+                break;
+            }
+            // destroy half of them one by one, and the other half at once
+            for (size_t k = 0; k < batchSize / 2; k++) {
+                em.destroy(entities[k]);
+            }
+            em.destroy(batchSize / 2, entities.data() + batchSize / 2);
+            for (Entity e : entities) {
+                ASSERT_FALSE(em.isAlive(e));
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < threadCount; t++) {
+        threads.emplace_back(worker, t);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // no batch handed out the same index twice
+    for (auto const& indices : created) {
+        ASSERT_EQ(iterations * batchSize, indices.size());
+        for (size_t i = 0; i < indices.size(); i += batchSize) {
+            std::vector<uint32_t> batch(indices.begin() + i, indices.begin() + i + batchSize);
+            std::sort(batch.begin(), batch.end());
+            EXPECT_TRUE(std::adjacent_find(batch.begin(), batch.end()) == batch.end());
+        }
+    }
+
+    // all the entities still alive must use different indices
+    std::vector<uint32_t> indices;
+    for (auto const& entities : alive) {
+        for (Entity e : entities) {
+            EXPECT_TRUE(em.isAlive(e));
+            indices.push_back(EntityManagerImpl::getIndex(e));
+        }
+    }
+    ASSERT_EQ(threadCount * batchSize, indices.size());
+    std::sort(indices.begin(), indices.end());
+    EXPECT_TRUE(std::adjacent_find(indices.begin(), indices.end()) == indices.end());
+    EXPECT_GE(em.getFreeIndexCount(), MIN_FREE_INDICES - 1);
+
+    for (auto& entities : alive) {
+        em.destroy(entities.size(), entities.data());
+    }
+}
 
 TEST(EntityTest, NameComponent) {
 
@@ -176,3 +250,113 @@ TEST(EntityTest, NameComponent) {
 
     cm.gc(em);
 }
+
+TEST(EntityTest, DestroyedEntityQueue) {
+    EntityManagerImpl em;
+    DestroyedEntityQueue queue(em);
+
+    Entity entities[16];
+    em.create(16, entities);
+
+    std::vector<Entity> destroyed;
+    EXPECT_TRUE(queue.drain(destroyed));
+    EXPECT_TRUE(destroyed.empty());
+
+    // null entities are ignored
+    Entity some[3] = { entities[2], Entity{}, entities[5] };
+    em.destroy(3, some);
+    em.destroy(entities[7]);
+    EXPECT_TRUE(queue.drain(destroyed));
+    ASSERT_EQ(3, destroyed.size());
+    EXPECT_EQ(entities[2], destroyed[0]);
+    EXPECT_EQ(entities[5], destroyed[1]);
+    EXPECT_EQ(entities[7], destroyed[2]);
+
+    // entities are appended, and only reported once
+    em.destroy(entities[9]);
+    EXPECT_TRUE(queue.drain(destroyed));
+    ASSERT_EQ(4, destroyed.size());
+    EXPECT_EQ(entities[9], destroyed[3]);
+    destroyed.clear();
+    EXPECT_TRUE(queue.drain(destroyed));
+    EXPECT_TRUE(destroyed.empty());
+
+    // clearing the EntityManager destroys everything
+    em.destroy(entities[10]);
+    em.clear();
+    EXPECT_FALSE(queue.drain(destroyed));
+    EXPECT_TRUE(destroyed.empty());
+    EXPECT_TRUE(queue.drain(destroyed));
+}
+
+TEST(EntityTest, ManyListeners) {
+    EntityManagerImpl em;
+
+    // there is no limit to the number of listeners
+    const size_t count = 100;
+    std::vector<std::unique_ptr<DestroyedEntityQueue>> queues;
+    for (size_t i = 0; i < count; i++) {
+        queues.emplace_back(new DestroyedEntityQueue(em));
+    }
+
+    Entity entities[2];
+    em.create(2, entities);
+    em.destroy(entities[0]);
+
+    // unregistered listeners aren't called anymore, the others still are
+    queues.erase(queues.begin(), queues.begin() + count / 2);
+    em.destroy(entities[1]);
+
+    for (auto const& queue : queues) {
+        std::vector<Entity> destroyed;
+        EXPECT_TRUE(queue->drain(destroyed));
+        ASSERT_EQ(2, destroyed.size());
+        EXPECT_EQ(entities[0], destroyed[0]);
+        EXPECT_EQ(entities[1], destroyed[1]);
+    }
+}
+
+TEST(EntityTest, DeterministicGc) {
+    EntityManagerImpl em;
+    DestroyedEntityQueue queue(em);
+    SingleInstanceComponentManager<int> cm;
+
+    const size_t count = 1000;
+    std::vector<Entity> entities(count);
+    em.create(count, entities.data());
+    for (Entity e : entities) {
+        cm.addComponent(e);
+    }
+
+    // destroy every other entity, plus some that don't have a component
+    std::vector<Entity> dead;
+    for (size_t i = 0; i < count; i += 2) {
+        dead.push_back(entities[i]);
+    }
+    Entity others[4];
+    em.create(4, others);
+    em.destroy(4, others);
+    em.destroy(dead.size(), dead.data());
+
+    std::vector<Entity> destroyed;
+    EXPECT_TRUE(queue.drain(destroyed));
+    EXPECT_EQ(dead.size() + 4, destroyed.size());
+
+    // all the components of destroyed entities are removed in one go
+    cm.gc(destroyed.data(), destroyed.size());
+    EXPECT_EQ(count / 2, cm.getComponentCount());
+    for (size_t i = 0; i < count; i++) {
+        EXPECT_EQ(i % 2 == 1, cm.hasComponent(entities[i]));
+    }
+
+    // sweep() finds the dead entities by itself
+    em.destroy(entities[1]);
+    em.destroy(entities[count - 1]);
+    cm.sweep(em);
+    EXPECT_EQ(count / 2 - 2, cm.getComponentCount());
+    EXPECT_FALSE(cm.hasComponent(entities[1]));
+    EXPECT_FALSE(cm.hasComponent(entities[count - 1]));
+    for (size_t i = 0, c = cm.getComponentCount(); i < c; i++) {
+        EXPECT_TRUE(em.isAlive(cm.getEntities()[i]));
+    }
+}
@@ -23,6 +23,7 @@
 #include <math/mat3.h>
 
 #include <array>
+#include <sstream>
 #include <thread>
 #include <utils/Allocator.h>
 
@@ -219,6 +220,189 @@ TEST(JobSystem, JobSystemParallelChildren) {
 }
 
 
+TEST(JobSystem, JobSystemManyThreads) {
+    v = 0;
+
+    // more threads than the bits in a 32-bits mask
+    JobSystem js(48);
+    js.adopt();
+
+    EXPECT_EQ(48, js.getThreadCount());
+    EXPECT_GE(js.getJobCount(), 48 * 256);
+    EXPECT_GE(js.getNodeCount(), 1);
+
+    struct User {
+        std::atomic_int calls = {0};
+        void func(JobSystem&, JobSystem::Job*) {
+            v++;
+            calls++;
+        };
+    } j;
+
+    // more jobs than the pool used to hold, all alive at the same time
+    std::vector<JobSystem::Job*> jobs;
+    JobSystem::Job* root = js.createJob<User, &User::func>(nullptr, &j);
+    for (int i=0 ; i<8192 ; i++) {
+        JobSystem::Job* job = js.createJob<User, &User::func>(root, &j);
+        ASSERT_NE(nullptr, job);
+        jobs.push_back(job);
+    }
+    for (JobSystem::Job* job : jobs) {
+        js.run(job);
+    }
+    js.runAndWait(root);
+
+    EXPECT_EQ(8193, v.load());
+    EXPECT_EQ(8193, j.calls);
+
+    js.emancipate();
+}
+
+
+TEST(JobSystem, JobSystemPriorities) {
+    JobSystem js(1);
+    js.adopt();
+
+    // keep the only worker thread busy, so that all the jobs below run on this thread
+    std::atomic_bool started = { false };
+    std::atomic_bool done = { false };
+    JobSystem::Job* blocker = jobs::createJob(js, nullptr, [&started, &done]() {
+        started = true;
+        while (!done) {
+            std::this_thread::yield();
+        }
+    });
+    js.run(blocker);
+    while (!started) {
+        std::this_thread::yield();
+    }
+
+    // low priority jobs are queued first, but must run last. This thread runs the high
+    // priority ones while it waits, the last one lets the worker thread run the low priority ones.
+    std::atomic_int order = { 0 };
+    std::array<int, 64> low;
+    std::array<int, 64> high;
+    JobSystem::Job* root = js.createJob();
+    for (size_t i = 0; i < low.size(); i++) {
+        js.run(jobs::createJob(js, root, [&order, &low, i]() { low[i] = order++; }),
+                JobSystem::LOW_PRIORITY);
+    }
+    for (size_t i = 0; i < high.size(); i++) {
+        js.run(jobs::createJob(js, root, [&order, &high, &done, i]() {
+            high[i] = order++;
+            if (high[i] == int(high.size()) - 1) {
+                done = true;
+            }
+        }));
+    }
+    js.runAndWait(root);
+
+    for (size_t i = 0; i < high.size(); i++) {
+        EXPECT_LT(high[i], int(high.size()));
+    }
+    for (size_t i = 0; i < low.size(); i++) {
+        EXPECT_GE(low[i], int(high.size()));
+    }
+
+    js.wait(blocker);
+    js.emancipate();
+}
+
+TEST(JobSystem, JobSystemWaitSkipsLowPriority) {
+    JobSystem js(1);
+    js.adopt();
+
+    // a thread waiting on a job never runs low priority jobs, the worker thread runs them all
+    const std::thread::id waiter = std::this_thread::get_id();
+    std::atomic_int runOnWaiter = { 0 };
+    std::atomic_int runCount = { 0 };
+    JobSystem::Job* root = js.createJob();
+    for (size_t i = 0; i < 64; i++) {
+        js.run(jobs::createJob(js, root, [&runOnWaiter, &runCount, waiter]() {
+            runOnWaiter += std::this_thread::get_id() == waiter ? 1 : 0;
+            runCount++;
+        }), JobSystem::LOW_PRIORITY);
+    }
+    js.runAndWait(root);
+
+    EXPECT_EQ(64, runCount);
+    EXPECT_EQ(0, runOnWaiter);
+
+    js.emancipate();
+}
+
+TEST(JobSystem, JobSystemBackgroundTask) {
+    JobSystem js;
+    js.adopt();
+
+    // many more chunks than jobs available at once
+    size_t chunks = 0;
+    const size_t count = js.getJobCount() * 4;
+    JobSystem::Job* task = jobs::createBackgroundTask(js, nullptr, [&chunks, count]() {
+        return ++chunks < count;
+    });
+    ASSERT_NE(nullptr, task);
+    js.run(task, JobSystem::LOW_PRIORITY);
+    js.wait(task);
+
+    EXPECT_EQ(count, chunks);
+
+    js.emancipate();
+}
+
+
+TEST(JobSystem, JobSystemProfiling) {
+    JobSystem js;
+    js.adopt();
+
+    // only the last 16 jobs of each thread are kept
+    js.startProfiling(16);
+
+    std::atomic_int calls = { 0 };
+    JobSystem::Job* root = js.createJob();
+    for (int i = 0; i < 256; i++) {
+        js.run(jobs::createJob(js, root, [&calls]() { calls++; }));
+    }
+    js.runAndWait(root);
+    js.stopProfiling();
+
+    EXPECT_EQ(256, calls);
+
+    std::vector<JobSystem::ThreadStats> stats(js.getThreadStats());
+    ASSERT_EQ(js.getThreadCount() + 1, stats.size());
+    uint64_t jobCount = 0;
+    for (auto const& s : stats) {
+        jobCount += s.jobCount;
+    }
+    EXPECT_EQ(257, jobCount);
+
+    // recording is stopped
+    js.runAndWait(js.createJob());
+    jobCount = 0;
+    for (auto const& s : js.getThreadStats()) {
+        jobCount += s.jobCount;
+    }
+    EXPECT_EQ(257, jobCount);
+
+    std::ostringstream trace;
+    js.exportChromeTrace(trace);
+    const std::string json(trace.str());
+    EXPECT_EQ(0, json.find("{\"traceEvents\":["));
+    EXPECT_NE(std::string::npos, json.find(R"("name":"JobSystem adopted )"));
+    EXPECT_NE(std::string::npos, json.find(R"("ph":"X")"));
+
+    // each thread exports at most its last 16 jobs (plus its name)
+    const std::string adopted = R"("tid":)" + std::to_string(js.getThreadCount()) + ",";
+    size_t events = 0;
+    for (size_t p = json.find(adopted); p != std::string::npos; p = json.find(adopted, p + 1)) {
+        events++;
+    }
+    EXPECT_LE(events, 16 + 1);
+
+    js.emancipate();
+}
+
+
 TEST(JobSystem, JobSystemSequentialChildren) {
     JobSystem js;
     js.adopt();
@@ -283,6 +467,77 @@ TEST(JobSystem, JobSystemParallelFor) {
     js.emancipate();
 }
 
+TEST(JobSystem, JobSystemAdaptiveParallelFor) {
+    JobSystem js;
+    js.adopt();
+
+    AdaptiveSplitter splitter;
+    EXPECT_EQ(0, splitter.getItemCost());
+
+    std::vector<uint32_t> values(100000, 0);
+    auto functor = [&values](uint32_t s, uint32_t c) {
+        for (uint32_t i = s; i < s + c; i++) {
+            values[i]++;
+        }
+    };
+
+    for (size_t k = 0; k < 4; k++) {
+        JobSystem::Job* job = parallel_for(js, nullptr, 0, uint32_t(values.size()),
+                std::ref(functor), splitter);
+        js.runAndWait(job);
+    }
+
+    // each item is processed exactly once per parallel_for
+    for (uint32_t v : values) {
+        EXPECT_EQ(4, v);
+    }
+
+    // the cost is known after the first run
+    EXPECT_GT(splitter.getItemCost(), 0);
+
+    js.emancipate();
+}
+
+TEST(JobSystem, JobSystemAdaptiveSplitterCheapItems) {
+    JobSystem js(4);
+
+    // items so cheap that a job would need more items than there are to last long enough
+    AdaptiveSplitter splitter;
+    splitter.record(1000000, 1000000);
+    const size_t count = 10000;
+    AdaptiveSplitter::Policy policy = splitter.getPolicy(js, count);
+    EXPECT_EQ(1, splitter.getItemCost());
+
+    // the work is still split between the threads
+    EXPECT_TRUE(policy.split(0, count));
+}
+
+TEST(JobSystem, JobSystemThreadIndex) {
+    JobSystem js(4, 1);
+    js.adopt();
+
+    // the adopted thread comes after the worker threads
+    EXPECT_EQ(5, js.getThreadSlotCount());
+    EXPECT_EQ(4, JobSystem::getThreadIndex());
+
+    std::vector<size_t> indices(10000, 0);
+    auto functor = [&indices](uint32_t s, uint32_t c) {
+        const size_t index = JobSystem::getThreadIndex();
+        for (uint32_t i = s; i < s + c; i++) {
+            indices[i] = index;
+        }
+    };
+    JobSystem::Job* job = parallel_for(js, nullptr, 0, uint32_t(indices.size()),
+            std::ref(functor), CountSplitter<64>());
+    js.runAndWait(job);
+
+    for (size_t index : indices) {
+        EXPECT_LT(index, js.getThreadSlotCount());
+    }
+
+    js.emancipate();
+}
+
 TEST(JobSystem, JobSystemDelegates) {
     JobSystem js;
     js.adopt();
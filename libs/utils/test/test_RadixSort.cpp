@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <utils/JobSystem.h>
+#include <utils/RadixSort.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+using namespace utils;
+
+static void checkSorted(JobSystem& js, std::vector<RadixSort::Item> items) {
+    std::vector<RadixSort::Item> expected(items);
+    std::stable_sort(expected.begin(), expected.end(),
+            [](RadixSort::Item const& lhs, RadixSort::Item const& rhs) {
+                return lhs.key < rhs.key;
+            });
+
+    std::vector<RadixSort::Item> scratch(items.size());
+    RadixSort::Item const* sorted = RadixSort::sort(js, items.data(), scratch.data(), items.size());
+    for (size_t i = 0; i < items.size(); i++) {
+        // the sort is stable, so the values must match too
+        ASSERT_EQ(expected[i].key, sorted[i].key);
+        ASSERT_EQ(expected[i].value, sorted[i].value);
+    }
+}
+
+TEST(RadixSortTest, Sort) {
+    JobSystem js;
+    js.adopt();
+
+    std::default_random_engine gen;
+    std::uniform_int_distribution<uint64_t> random;
+
+    // serial and parallel paths, with full 64-bit keys
+    for (size_t count : { size_t(0), size_t(1), size_t(100), size_t(100000) }) {
+        std::vector<RadixSort::Item> items(count);
+        for (size_t i = 0; i < count; i++) {
+            items[i] = { random(gen), uint32_t(i) };
+        }
+        checkSorted(js, items);
+    }
+
+    // few distinct keys with only a couple of varying digits, this checks stability
+    // and that skipping digits works
+    std::vector<RadixSort::Item> items(50000);
+    for (size_t i = 0; i < items.size(); i++) {
+        items[i] = { (random(gen) & 0x0F000000000000F0llu) | 0x1234, uint32_t(i) };
+    }
+    checkSorted(js, items);
+
+    js.emancipate();
+}
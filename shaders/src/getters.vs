@@ -6,14 +6,35 @@ mat4 getLightFromWorldMatrix() {
     return frameUniforms.lightFromWorldMatrix;
 }
 
+#if defined(HAS_INSTANCING)
+int getInstanceIndex() {
+#if defined(CODEGEN_TARGET_VULKAN_ENVIRONMENT)
+    return gl_InstanceIndex;
+#else
+    return gl_InstanceID;
+#endif
+}
+#endif
+
 /** @public-api */
 mat4 getWorldFromModelMatrix() {
+#if defined(HAS_INSTANCING)
+    // instances are transformed in the renderable's model space
+    return objectUniforms.worldFromModelMatrix *
+            instancesUniforms.modelFromInstanceMatrix[getInstanceIndex()];
+#else
     return objectUniforms.worldFromModelMatrix;
+#endif
 }
 
 /** @public-api */
 mat3 getWorldFromModelNormalMatrix() {
+#if defined(HAS_INSTANCING)
+    return objectUniforms.worldFromModelNormalMatrix *
+            instancesUniforms.modelFromInstanceNormalMatrix[getInstanceIndex()];
+#else
     return objectUniforms.worldFromModelNormalMatrix;
+#endif
 }
 
 //------------------------------------------------------------------------------
@@ -7,14 +7,18 @@
 #define FROXEL_BUFFER_WIDTH         (1u << FROXEL_BUFFER_WIDTH_SHIFT)
 #define FROXEL_BUFFER_WIDTH_MASK    (FROXEL_BUFFER_WIDTH - 1u)
 
-#define RECORD_BUFFER_WIDTH_SHIFT   5u
+#define RECORD_BUFFER_WIDTH_SHIFT   8u
 #define RECORD_BUFFER_WIDTH         (1u << RECORD_BUFFER_WIDTH_SHIFT)
 #define RECORD_BUFFER_WIDTH_MASK    (RECORD_BUFFER_WIDTH - 1u)
 
+// Make sure this matches the same constants in GpuLightBuffer.h
+#define LIGHTS_PER_ROW_SHIFT        4u
+#define LIGHTS_PER_ROW_MASK         ((1u << LIGHTS_PER_ROW_SHIFT) - 1u)
+
 struct FroxelParams {
-    uint recordOffset; // offset at which the list of lights for this froxel starts
-    uint pointCount;   // number of point lights in this froxel
-    uint spotCount;    // number of spot lights in this froxel
+    HIGHP uint recordOffset; // offset at which the list of lights for this froxel starts
+    uint pointCount;         // number of point lights in this froxel
+    uint spotCount;          // number of spot lights in this froxel
 };
 
 /**
@@ -60,24 +64,32 @@ ivec2 getFroxelTexCoord(uint froxelIndex) {
  */
 FroxelParams getFroxelParams(uint froxelIndex) {
     ivec2 texCoord = getFroxelTexCoord(froxelIndex);
-    uvec2 entry = texelFetch(light_froxels, texCoord, 0).rg;
+    HIGHP uvec2 entry = texelFetch(light_froxels, texCoord, 0).rg;
 
     FroxelParams froxel;
     froxel.recordOffset = entry.r;
-    froxel.pointCount = entry.g & 0xFFu;
-    froxel.spotCount = entry.g >> 8u;
+    froxel.pointCount = entry.g & 0xFFFFu;
+    froxel.spotCount = entry.g >> 16u;
     return froxel;
 }
 
 /**
  * Returns the coordinates of the light record in the light_records texture
  * given the specified index. A light record is a single uint index into the
- * lights data buffer (lightsUniforms UBO).
+ * lights data texture (light_lights).
  */
-ivec2 getRecordTexCoord(uint index) {
+ivec2 getRecordTexCoord(const HIGHP uint index) {
     return ivec2(index & RECORD_BUFFER_WIDTH_MASK, index >> RECORD_BUFFER_WIDTH_SHIFT);
 }
 
+/**
+ * Returns the coordinates of the first texel of the specified light in the
+ * light_lights texture. Each light is stored as 4 consecutive texels.
+ */
+ivec2 getLightTexCoord(uint lightIndex) {
+    return ivec2((lightIndex & LIGHTS_PER_ROW_MASK) << 2u, lightIndex >> LIGHTS_PER_ROW_SHIFT);
+}
+
 float getSquareFalloffAttenuation(float distanceSquare, float falloff) {
     float factor = distanceSquare * falloff;
     float smoothFactor = saturate(1.0 - factor * factor);
@@ -118,17 +130,18 @@ void setupPunctualLight(inout Light light, const HIGHP vec4 positionFalloff) {
  * in the w component.
  *
  * The light parameters used to compute the Light structure are fetched from the
- * lightsUniforms uniform buffer.
+ * light_lights texture.
  */
-Light getSpotLight(uint index) {
+Light getSpotLight(const HIGHP uint index) {
     Light light;
     ivec2 texCoord = getRecordTexCoord(index);
     uint lightIndex = texelFetch(light_records, texCoord, 0).r;
+    ivec2 lightCoord = getLightTexCoord(lightIndex);
 
-    HIGHP vec4 positionFalloff = lightsUniforms.lights[lightIndex][0];
-    HIGHP vec4 colorIntensity  = lightsUniforms.lights[lightIndex][1];
-          vec4 directionIES    = lightsUniforms.lights[lightIndex][2];
-          vec2 scaleOffset     = lightsUniforms.lights[lightIndex][3].xy;
+    HIGHP vec4 positionFalloff = texelFetch(light_lights, lightCoord, 0);
+    HIGHP vec4 colorIntensity  = texelFetch(light_lights, lightCoord + ivec2(1, 0), 0);
+          vec4 directionIES    = texelFetch(light_lights, lightCoord + ivec2(2, 0), 0);
+          vec2 scaleOffset     = texelFetch(light_lights, lightCoord + ivec2(3, 0), 0).xy;
 
     light.colorIntensity.rgb = colorIntensity.rgb;
     light.colorIntensity.w = computePreExposedIntensity(colorIntensity.w, frameUniforms.exposure);
@@ -146,15 +159,16 @@ Light getSpotLight(uint index) {
  * in the w component.
  *
  * The light parameters used to compute the Light structure are fetched from the
- * lightsUniforms uniform buffer.
+ * light_lights texture.
  */
-Light getPointLight(uint index) {
+Light getPointLight(const HIGHP uint index) {
     Light light;
     ivec2 texCoord = getRecordTexCoord(index);
     uint lightIndex = texelFetch(light_records, texCoord, 0).r;
+    ivec2 lightCoord = getLightTexCoord(lightIndex);
 
-    HIGHP vec4 positionFalloff = lightsUniforms.lights[lightIndex][0];
-    HIGHP vec4 colorIntensity  = lightsUniforms.lights[lightIndex][1];
+    HIGHP vec4 positionFalloff = texelFetch(light_lights, lightCoord, 0);
+    HIGHP vec4 colorIntensity  = texelFetch(light_lights, lightCoord + ivec2(1, 0), 0);
 
     light.colorIntensity.rgb = colorIntensity.rgb;
     light.colorIntensity.w = computePreExposedIntensity(colorIntensity.w, frameUniforms.exposure);
@@ -178,10 +192,10 @@ void evaluatePunctualLights(const PixelParams pixel, inout vec3 color) {
     // the current fragment. A froxel also contains a record offset that
     // tells us where the indices of those lights are in the records
     // texture. The records texture contains the indices of the actual
-    // light data in the lightsUniforms uniform buffer
+    // light data in the lights texture
 
-    uint index = froxel.recordOffset;
-    uint end = index + froxel.pointCount;
+    HIGHP uint index = froxel.recordOffset;
+    HIGHP uint end = index + froxel.pointCount;
 
     // Iterate point lights
     for ( ; index < end; index++) {
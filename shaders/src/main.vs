@@ -10,8 +10,8 @@ void main() {
         // Extract the normal and tangent in world space from the input quaternion
         // We encode the orthonormal basis as a quaternion to save space in the attributes
         toTangentFrame(normalize(mesh_tangents), material.worldNormal, vertex_worldTangent);
-        vertex_worldTangent = objectUniforms.worldFromModelNormalMatrix * vertex_worldTangent;
-        material.worldNormal = objectUniforms.worldFromModelNormalMatrix * material.worldNormal;
+        vertex_worldTangent = getWorldFromModelNormalMatrix() * vertex_worldTangent;
+        material.worldNormal = getWorldFromModelNormalMatrix() * material.worldNormal;
         #if defined(HAS_SKINNING)
             skinNormal(material.worldNormal, mesh_bone_indices, mesh_bone_weights);
             skinNormal(vertex_worldTangent, mesh_bone_indices, mesh_bone_weights);
@@ -22,7 +22,7 @@ void main() {
     #else // MATERIAL_HAS_ANISOTROPY || MATERIAL_HAS_NORMAL
         // Without anisotropy or normal mapping we only need the normal vector
         toTangentFrame(normalize(mesh_tangents), material.worldNormal);
-        material.worldNormal = objectUniforms.worldFromModelNormalMatrix * material.worldNormal;
+        material.worldNormal = getWorldFromModelNormalMatrix() * material.worldNormal;
         #if defined(HAS_SKINNING)
             skinNormal(material.worldNormal, mesh_bone_indices, mesh_bone_weights);
         #endif